@@ -7,13 +7,16 @@
 #include "bank_server_concurrent.h"
 #include "../server/bank_log.h"
 #include "../server/bank_account.h"
+#include "../server/bank_report.h"
 #include "../server/bank_persistence.h"
+#include "../server/bank_journal.h"
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -91,16 +94,66 @@ void report_active_children(void) {
     }
 }
 
+/* Log a child that ended and stop tracking it */
+static void reaped(pid_t pid, int status)
+{
+    if (WIFEXITED(status))
+    {
+        log_message(LOG_INFO, "[PARENT %d] Child process %d terminated with status %d", 
+                    getpid(), pid, WEXITSTATUS(status));
+    }
+    else if (WIFSIGNALED(status))
+    {
+        log_message(LOG_WARNING, "[PARENT %d] Child process %d terminated by signal %d", 
+                    getpid(), pid, WTERMSIG(status));
+    }
+    
+    // Remove from tracking array
+    untrack_child_process(pid);
+    
+    child_count--;
+    log_message(LOG_INFO, "[PARENT %d] Child process %d reaped (zombie removed), remaining children: %d",
+               getpid(), pid, child_count);
+}
+
 /* Signal handler for graceful shutdown */
 void shutdown_server(int signal)
 {
     running = 0;
     log_message(LOG_INFO, "[PARENT %d] Received signal %d, shutting down server...", getpid(), signal);
 
+    // Children are reaped below, not by child_handler
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
     // Report any remaining children
     log_message(LOG_INFO, "[PARENT %d] Preparing to shut down with %d active child processes", 
                 getpid(), child_count);
     report_active_children();
+
+    // Ask every child to leave after the request in hand, and wait for all of
+    // them, so the checkpoint never sees a change half made
+    for (int i = 0; i < child_count; i++)
+    {
+        kill(child_pids[i], CHILD_STOP_SIGNAL);
+    }
+    while (child_count > 0)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_message(LOG_ERROR, "[PARENT %d] Waiting for children failed: %s", getpid(), strerror(errno));
+            break;
+        }
+        reaped(pid, status);
+    }
     
     // Free child tracking array
     if (child_pids != NULL) {
@@ -109,8 +162,10 @@ void shutdown_server(int signal)
         log_message(LOG_INFO, "[PARENT %d] Freed child PID tracking array", getpid());
     }
 
-    // Save data before exiting
+    // Save data before exiting; bank_lock() ends here instead if a child died holding it
+    bank_lock();
     save_data();
+    bank_unlock();
 
     // Close server socket
     if (server_socket > 0)
@@ -131,24 +186,88 @@ void child_handler(int sig)
     // Reap all zombie child processes
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
     {
-        if (WIFEXITED(status))
+        reaped(pid, status);
+    }
+}
+
+/* Set in a child once the parent asked it to leave */
+static volatile sig_atomic_t stopping = 0;
+
+/* CHILD_STOP_SIGNAL handler in a child */
+static void stop_child(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/* Wait until the client sends something; 0 when the parent asked the child
+   to leave first. CHILD_STOP_SIGNAL stays blocked in a child except here,
+   so it never cuts a request short. */
+static int wait_for_request(int sock)
+{
+    sigset_t waiting;
+    fd_set readable;
+
+    sigprocmask(SIG_BLOCK, NULL, &waiting);
+    sigdelset(&waiting, CHILD_STOP_SIGNAL);
+    while (!stopping)
+    {
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        if (pselect(sock + 1, &readable, NULL, NULL, NULL, &waiting) > 0)
         {
-            log_message(LOG_INFO, "[PARENT %d] Child process %d terminated with status %d", 
-                        getpid(), pid, WEXITSTATUS(status));
+            return 1;
         }
-        else if (WIFSIGNALED(status))
+        if (errno != EINTR)
         {
-            log_message(LOG_WARNING, "[PARENT %d] Child process %d terminated by signal %d", 
-                        getpid(), pid, WTERMSIG(status));
+            return 1; /* let recv report it */
         }
-        
-        // Remove from tracking array
-        untrack_child_process(pid);
-        
-        child_count--;
-        log_message(LOG_INFO, "[PARENT %d] Child process %d reaped (zombie removed), remaining children: %d",
-                   getpid(), pid, child_count);
     }
+    return 0;
+}
+
+/* Operations and statuses of the BATCH frame being served */
+static batch_op_t batch_ops[BATCH_MAX];
+static signed char batch_status[BATCH_MAX];
+
+/* Receive exactly len bytes; returns len, 0 on disconnect or -1 on error */
+static ssize_t recv_all(int sock, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n;
+        }
+        got += n;
+    }
+    return (ssize_t)got;
+}
+
+/* Send exactly len bytes; returns len or -1 on error */
+static ssize_t send_all(int sock, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sock, (const char *)buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return (ssize_t)sent;
 }
 
 /* Handle a client connection */
@@ -156,6 +275,7 @@ void handle_client(int client_socket)
 {
     request_t request;
     response_t response;
+    int batch_count;
     char client_ip[INET_ADDRSTRLEN];
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
@@ -184,14 +304,20 @@ void handle_client(int client_socket)
     {
         // Reset response structure
         memset(&response, 0, sizeof(response));
+        batch_count = 0;
 
         log_message(LOG_INFO, "[CHILD %d] Waiting to receive request from client %s", 
                    getpid(), client_ip);
         printf("[CHILD %d] Waiting to receive request from client %s...\n", 
               getpid(), client_ip);
 
-        // Receive client request
-        ssize_t bytes_received = recv(client_socket, &request, sizeof(request), 0);
+        // Receive client request, unless the server is shutting down
+        if (!wait_for_request(client_socket))
+        {
+            log_message(LOG_INFO, "[CHILD %d] Server shutting down; leaving client %s", getpid(), client_ip);
+            break;
+        }
+        ssize_t bytes_received = recv_all(client_socket, &request, sizeof(request));
         if (bytes_received <= 0)
         {
             if (bytes_received == 0)
@@ -217,7 +343,32 @@ void handle_client(int client_socket)
                getpid(), request.command, client_ip, bytes_received);
         sleep(SHORT_WAIT);
 
-        // Process request based on command
+        // A batch's operations follow its frame; read them before taking the lock
+        if (request.command == BATCH)
+        {
+            if (request.amount < 1 || request.amount > BATCH_MAX)
+            {
+                // The frame length cannot be trusted, so drop the connection
+                response.status = STATUS_INVALID;
+                snprintf(response.message, sizeof(response.message),
+                         "Batch rejected: Must carry 1 to %d operations", BATCH_MAX);
+                log_message(LOG_WARNING, "Batch rejected: %d operations from client %s",
+                            request.amount, client_ip);
+                send_all(client_socket, &response, sizeof(response));
+                close(client_socket);
+                return;
+            }
+
+            if (recv_all(client_socket, batch_ops, request.amount * sizeof(batch_op_t)) <= 0)
+            {
+                log_message(LOG_ERROR, "Client %s disconnected in the middle of a batch", client_ip);
+                close(client_socket);
+                return;
+            }
+        }
+
+        // Process request based on command; the other processes wait meanwhile
+        bank_lock();
         switch (request.command)
         {
         case OPEN:
@@ -398,17 +549,29 @@ void handle_client(int client_socket)
         case STATEMENT:
         {
             log_message(LOG_INFO, "Processing STATEMENT command for client %s", client_ip);
-            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d",
-                        request.account_number, request.pin);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d, Offset=%d, Limit=%d",
+                        request.account_number, request.pin, request.offset, request.limit);
 
-            int result = statement(request.account_number, request.pin, &response);
+            // A zero limit asks for the latest entries from the recent cache
+            int result = request.limit > 0
+                             ? statement_page(request.account_number, request.pin,
+                                              request.offset, request.limit, &response)
+                             : statement(request.account_number, request.pin, &response);
             response.status = result;
             if (result == STATUS_OK)
             {
-                strcpy(response.message, "Statement retrieved successfully");
+                snprintf(response.message, sizeof(response.message),
+                         "Statement retrieved successfully (%d of %d transactions)",
+                         response.transaction_count, response.transaction_total);
                 log_message(LOG_INFO, "Statement request successful: Account=%d, Transactions=%d",
                             request.account_number, response.transaction_count);
             }
+            else if (result == STATUS_INVALID)
+            {
+                strcpy(response.message, "Statement request rejected: Invalid offset or limit");
+                log_message(LOG_WARNING, "Statement request rejected: Offset=%d, Limit=%d",
+                            request.offset, request.limit);
+            }
             else
             {
                 strcpy(response.message, "Statement request failed: Account not found or wrong PIN");
@@ -418,14 +581,151 @@ void handle_client(int client_socket)
             break;
         }
 
+        case ACCOUNTS:
+        {
+            log_message(LOG_INFO, "Processing ACCOUNTS command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d",
+                        request.account_number, request.pin);
+
+            int result = list_accounts(request.account_number, request.pin, &response);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Customer holds %d account(s), total balance %lld",
+                         response.holding_count, response.total_holdings);
+                log_message(LOG_INFO, "Account listing successful: Account=%d, Accounts=%d, Total=%lld",
+                            request.account_number, response.holding_count, response.total_holdings);
+            }
+            else
+            {
+                strcpy(response.message, "Account listing failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Account listing failed: Account %d not found or wrong PIN",
+                            request.account_number);
+            }
+            break;
+        }
+
+        case TRANSFER:
+        {
+            log_message(LOG_INFO, "Processing TRANSFER command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d, To=%d, Amount=%d",
+                        request.account_number, request.pin, request.to_account, request.amount);
+
+            int result = transfer(request.account_number, request.pin,
+                                  request.to_account, request.amount);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                int bal;
+                balance(request.account_number, request.pin, &bal);
+                response.balance = bal;
+                snprintf(response.message, sizeof(response.message),
+                         "Transfer to %d successful. New balance: %d", request.to_account, bal);
+                log_message(LOG_INFO, "Transfer successful: Account=%d, To=%d, Amount=%d, New Balance=%d",
+                            request.account_number, request.to_account, request.amount, bal);
+            }
+            else if (result == STATUS_MIN_AMT)
+            {
+                strcpy(response.message, "Transfer rejected: Would break minimum balance");
+                log_message(LOG_WARNING, "Transfer rejected: Would break minimum balance for account %d",
+                            request.account_number);
+            }
+            else if (result == STATUS_INVALID)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Transfer rejected: Must be >= %d to a different account", MIN_DEPOSIT);
+                log_message(LOG_WARNING, "Transfer rejected: Amount %d to account %d not valid",
+                            request.amount, request.to_account);
+            }
+            else
+            {
+                strcpy(response.message, "Transfer failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Transfer failed: Account %d or %d not found, or wrong PIN",
+                            request.account_number, request.to_account);
+            }
+            break;
+        }
+
+        case REPORT:
+        {
+            log_message(LOG_INFO, "Processing REPORT command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, Margin=%d, Top=%d",
+                        request.account_number, request.amount, request.limit);
+
+            // Bank-wide figures are only for a signed-in account holder
+            int result = authenticate(request.account_number, request.pin);
+            if (result != STATUS_OK)
+            {
+                response.status = result;
+                strcpy(response.message, "Report failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Report refused: Account %d not found or wrong PIN",
+                            request.account_number);
+                break;
+            }
+
+            result = run_report(request.amount, request.limit, &response.report);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Report over %d accounts: total %lld, %d under %d (%d us, %s)",
+                         response.report.accounts, response.report.total,
+                         response.report.under, response.report.threshold,
+                         response.report.elapsed_us, response.report.engine);
+                log_message(LOG_INFO, "Report successful: Accounts=%d, Total=%lld",
+                            response.report.accounts, response.report.total);
+            }
+            else
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Report rejected: Top list holds 0 to %d accounts", REPORT_TOP);
+                log_message(LOG_WARNING, "Report rejected: Top=%d", request.limit);
+            }
+            break;
+        }
+
+        case BATCH:
+        {
+            log_message(LOG_INFO, "[CHILD %d] Processing BATCH command for client %s",
+                        getpid(), client_ip);
+            log_message(LOG_INFO, "Request details: Operations=%d", request.amount);
+
+            batch_count = request.amount;
+            int applied = apply_batch(batch_ops, batch_count, batch_status);
+            response.status = STATUS_OK;
+            response.transaction_total = batch_count;
+            response.transaction_count = applied;
+            snprintf(response.message, sizeof(response.message),
+                     "Batch applied: %d of %d operations succeeded", applied, batch_count);
+            log_message(LOG_INFO, "Batch from client %s: %d of %d applied",
+                        client_ip, applied, batch_count);
+            break;
+        }
+
+        case STATS:
+        {
+            log_message(LOG_INFO, "Processing STATS command for client %s", client_ip);
+
+            persistence_stats(&response.stats);
+            response.status = STATUS_OK;
+            snprintf(response.message, sizeof(response.message),
+                     "%lld syncs covering %lld records, %lld checkpoints (%lld in the background%s)",
+                     response.stats.commits, response.stats.records_synced,
+                     response.stats.checkpoints, response.stats.snapshots_forked,
+                     response.stats.snapshot_running ? ", one running" : "");
+            break;
+        }
+
         case QUIT:
         {
+            bank_unlock();
             log_message(LOG_INFO, "Client %s requested to quit", client_ip);
             // Send termination response
             response.status = STATUS_OK;
             strcpy(response.message, "Shutting Down...");
             log_message(LOG_INFO, "Sending termination message to client %s", client_ip);
-            send(client_socket, &response, sizeof(response), 0);
+            send_all(client_socket, &response, sizeof(response));
             log_message(LOG_INFO, "Closing connection with client %s", client_ip);
             close(client_socket);
             return;
@@ -441,13 +741,38 @@ void handle_client(int client_socket)
         }
         }
 
+        long long ticket = journal_lsn();
+        bank_unlock();
+
+        // Hold the reply until the changes it reports are on disk
+        if (journal_wait(ticket) < 0)
+        {
+            // The journal failed; a checkpoint makes them durable instead
+            bank_lock();
+            int saved = commit_data();
+            bank_unlock();
+            if (saved != 0)
+            {
+                response.status = STATUS_ERROR;
+                batch_count = 0;
+                strcpy(response.message, "Request failed: Changes could not be saved");
+                log_message(LOG_ERROR, "Changes for client %s are neither journaled nor checkpointed",
+                            client_ip);
+            }
+        }
+
         log_message(LOG_INFO, "Preparing to send response to client %s (status: %d)",
                     client_ip, response.status);
         printf("Preparing to send response to client %s...\n", client_ip);
         sleep(SHORT_WAIT);
 
         // Send response back to client
-        ssize_t bytes_sent = send(client_socket, &response, sizeof(response), 0);
+        ssize_t bytes_sent = send_all(client_socket, &response, sizeof(response));
+        if (bytes_sent >= 0 && batch_count > 0)
+        {
+            // A batch reply carries one status byte per operation
+            bytes_sent = send_all(client_socket, batch_status, batch_count);
+        }
         if (bytes_sent < 0)
         {
             log_message(LOG_ERROR, "Error sending response to client %s: %s",
@@ -578,6 +903,15 @@ void run_server(void)
         return;
     }
     
+    // CHILD_STOP_SIGNAL is only for children, which take it between requests
+    sigset_t forking, shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, CHILD_STOP_SIGNAL);
+    sigprocmask(SIG_BLOCK, &shutdown_signals, &forking);
+    sigaddset(&forking, CHILD_STOP_SIGNAL);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+
     log_message(LOG_INFO, "[PARENT %d] Concurrent server ready (using processes)", getpid());
     printf("[PARENT %d] Concurrent server ready (using processes)\n", getpid());
 
@@ -617,7 +951,18 @@ void run_server(void)
         log_message(LOG_INFO, "[PARENT %d] Attempting to create child process for client %s:%d",
                    getpid(), client_ip, client_port);
         
-        // Fork a new process to handle the client
+        // A child that died holding the bank lock left the bank unusable
+        if (bank_lock_lost())
+        {
+            log_message(LOG_ERROR, "[PARENT %d] Bank lock lost with a child; shutting down for a rebuild from disk",
+                        getpid());
+            close(client_socket);
+            shutdown_server(SIGTERM);
+        }
+
+        // Fork a new process to handle the client; shutdown waits until the
+        // child is tracked and has set up its own signals
+        sigprocmask(SIG_BLOCK, &shutdown_signals, NULL);
         pid_t pid = fork();
         
         if (pid < 0) {
@@ -625,6 +970,7 @@ void run_server(void)
             log_message(LOG_ERROR, "[PARENT %d] Fork failed: %s", getpid(), strerror(errno));
             perror("Fork failed");
             close(client_socket);
+            sigprocmask(SIG_SETMASK, &forking, NULL);
             continue;
         }
         else if (pid == 0) {
@@ -637,6 +983,17 @@ void run_server(void)
             }
             
             close(server_socket); // Child doesn't need the listening socket
+
+            // Only the parent saves on shutdown. A child ignores Ctrl-C and
+            // SIGTERM, and leaves between requests once the parent asks
+            signal(SIGINT, SIG_IGN);
+            signal(SIGTERM, SIG_IGN);
+            struct sigaction stop;
+            memset(&stop, 0, sizeof(stop));
+            stop.sa_handler = stop_child;
+            sigemptyset(&stop.sa_mask);
+            sigaction(CHILD_STOP_SIGNAL, &stop, NULL);
+            sigprocmask(SIG_SETMASK, &forking, NULL);
             
             log_message(LOG_INFO, "[CHILD %d] Process created by parent %d to handle client %s:%d", 
                         getpid(), getppid(), client_ip, client_port);
@@ -683,6 +1040,7 @@ void run_server(void)
             
             log_message(LOG_INFO, "[PARENT %d] Returning to accept loop for next client", getpid());
             printf("[PARENT %d] Returning to accept loop for next client\n", getpid());
+            sigprocmask(SIG_SETMASK, &forking, NULL);
         }
     }
 
@@ -8,6 +8,8 @@
 #include "../server/bank_common.h"
 #include <signal.h>  /* For struct sigaction */
 
+#define CHILD_STOP_SIGNAL SIGUSR1 /* parent to child: leave after the request in hand */
+
 /* Server function prototypes */
 void shutdown_server(int signal);
 void handle_client(int client_socket);
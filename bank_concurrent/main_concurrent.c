@@ -1,7 +1,7 @@
 /*
  * Banking System - Main program (Concurrent Server with processes)
  *
- * Compile: gcc -std=c99 -Wall -o bank_server_concurrent main_concurrent.c bank_server_concurrent.c bank_account.c bank_persistence.c bank_log.c
+ * Compile: gcc -std=c99 -Wall -pthread -o bank_server_concurrent main_concurrent.c bank_server_concurrent.c bank_account.c bank_report.c bank_index.c bank_store.c bank_history.c bank_arena.c bank_persistence.c bank_json.c bank_lz.c bank_crc.c bank_snapshot.c bank_records.c bank_journal.c bank_shm.c bank_uring.c bank_log.c
  * Run: ./bank_server_concurrent [port]
  */
 
@@ -9,6 +9,7 @@
 #include "../server/bank_log.h"
 #include "../server/bank_persistence.h"
 #include "../server/bank_account.h"
+#include "../server/bank_shm.h"
 #include "bank_server_concurrent.h"
 #include <signal.h>
 #include <stdlib.h>
@@ -39,11 +40,33 @@ int main(int argc, char *argv[])
     log_init();
     log_message(LOG_INFO, "Starting concurrent server (using processes)");
 
-    // Load existing data
+    // Children are forked per client, so the bank must live in shared memory
+    if (shm_init() != 0)
+    {
+        log_message(LOG_ERROR, "Failed to set up shared memory for the bank. Exiting.");
+        return EXIT_FAILURE;
+    }
+
+    // One process owns the data directory at a time
+    if (lock_data_dir() != 0)
+    {
+        log_message(LOG_ERROR, "Data directory is in use. Exiting.");
+        return EXIT_FAILURE;
+    }
+
+    // Load existing data; serving a partly loaded bank would hide damage, so stop instead
     if (load_data() != 0)
     {
-        log_message(LOG_WARNING, "Could not load existing data. Starting fresh.");
-        fprintf(stderr, "Warning: Could not load existing data. Starting fresh.\n");
+        log_message(LOG_ERROR, "Could not load existing data cleanly. Exiting.");
+        fprintf(stderr, "Could not load existing data cleanly; see %s. Exiting.\n", LOG_FILE);
+        return EXIT_FAILURE;
+    }
+
+    // Every child must see the others' updates
+    if (share_bank() != 0)
+    {
+        log_message(LOG_ERROR, "Failed to share the bank between processes. Exiting.");
+        return EXIT_FAILURE;
     }
 
     // Initialize and run the server
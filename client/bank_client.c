@@ -97,6 +97,31 @@ int main(int argc, char *argv[]) {
                 get_statement();
                 break;
                 
+            case CMD_ACCOUNTS:
+                log_message(LOG_INFO, "User requested account listing");
+                list_accounts();
+                break;
+                
+            case CMD_TRANSFER:
+                log_message(LOG_INFO, "User requested a transfer");
+                transfer();
+                break;
+                
+            case CMD_REPORT:
+                log_message(LOG_INFO, "User requested a bank report");
+                bank_report();
+                break;
+                
+            case CMD_STATS:
+                log_message(LOG_INFO, "User requested server stats");
+                server_stats();
+                break;
+                
+            case CMD_BATCH:
+                log_message(LOG_INFO, "User requested batch postings");
+                run_batch();
+                break;
+                
             case CMD_QUIT:
                 log_message(LOG_INFO, "User requested to quit the application");
                 disconnect_from_server();
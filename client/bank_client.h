@@ -25,6 +25,12 @@
 #define LOG_FILE       "client.log"    /* log file name                   */
 #define SHORT_WAIT     1               /* short wait in seconds           */
 #define MEDIUM_WAIT    2               /* medium wait in seconds          */
+#define STMT_PAGE      20              /* most transactions per statement */
+#define HOLDINGS_LISTED 10             /* most accounts in one listing    */
+#define BATCH_MAX      4096            /* most operations per BATCH frame */
+#define REPORT_BINS    16              /* buckets in the balance histogram */
+#define REPORT_TOP     10              /* most balances in a top-N report  */
+#define REPORT_BIN_BASE 1024           /* upper edge of the first bucket   */
 
 /* Log levels */
 typedef enum {
@@ -41,6 +47,11 @@ typedef enum {
     CMD_WITHDRAW = 4,     /* Withdraw money                */
     CMD_BALANCE = 5,      /* Check balance                 */
     CMD_STATEMENT = 6,    /* Get transaction statement     */
+    CMD_ACCOUNTS = 7,     /* List the customer's accounts  */
+    CMD_BATCH = 8,        /* Apply several postings at once */
+    CMD_TRANSFER = 9,     /* Move money between accounts   */
+    CMD_REPORT = 10,      /* Bank-wide balance report      */
+    CMD_STATS = 11,       /* Persistence counters          */
     CMD_QUIT = 0          /* Quit                          */
 } command_t;
 
@@ -58,21 +69,72 @@ typedef enum {
 } acct_type_t;
 
 typedef struct {
-    char type;                /* 'D' = deposit, 'W' = withdraw       */
+    char type;                /* 'D' deposit, 'W' withdraw, 'T'/'R' transfer out/in, 'I' interest, 'F' fee */
     int  amount;              /* amount of the transaction           */
     time_t when;              /* time of transaction                 */
     int  balance_after;       /* balance after posting               */
 } transaction_t;
 
+/* One account in a customer's listing */
+typedef struct {
+    int number;
+    acct_type_t type;
+    int balance;
+} holding_t;
+
+/* Bank-wide balance report; bucket k holds balances below REPORT_BIN_BASE << k */
+typedef struct {
+    long long total;          /* sum of all balances                 */
+    int accounts;             /* live accounts scanned               */
+    int threshold;            /* MIN_BALANCE + the requested margin  */
+    int under;                /* accounts below threshold            */
+    int hist[REPORT_BINS];    /* balance histogram                   */
+    int top_count;            /* entries used in top                 */
+    holding_t top[REPORT_TOP]; /* largest balances, descending       */
+    int elapsed_us;           /* time spent scanning                 */
+    char engine[8];           /* kernel that ran: avx2, sse2, scalar */
+} report_t;
+
+/* Group commit and checkpoint counters */
+typedef struct {
+    long long commits;        /* fdatasync calls made                */
+    long long records_synced; /* journal records they made durable   */
+    long long waits;          /* replies held for durability         */
+    long long wait_us_total;  /* time those replies were held        */
+    long long journal_bytes;  /* current journal size                */
+    long long checkpoints;    /* snapshots written since start       */
+    long long snapshots_forked; /* of those, written by a forked child */
+    int commit_window_us;     /* longest a write waits for its sync  */
+    int commit_bytes;         /* unsynced bytes that force a sync    */
+    int last_sync_us;         /* duration of the latest fdatasync    */
+    int max_group;            /* most records made durable by one sync */
+    int last_snapshot_ms;     /* duration of the latest background snapshot */
+    int snapshot_running;     /* a background snapshot is being written */
+    long long archived_bytes; /* journal bytes moved to the archive  */
+    long long archive_packed; /* what they took there, compressed    */
+    long long archive_us;     /* time spent packing them             */
+} stats_t;
+
+/* One posting inside a BATCH frame */
+typedef struct {
+    command_t command;        /* CMD_DEPOSIT or CMD_WITHDRAW */
+    int account_number;
+    int pin;
+    int amount;
+} batch_op_t;
+
 /* A structure for client request messages */
 typedef struct {
     command_t command;
     int account_number;
     int pin;
-    int amount;
+    int amount;               /* BATCH: records that follow; REPORT: margin over minimum */
     acct_type_t account_type;
     char name[40];
     char nat_id[20];
+    int offset;               /* STATEMENT: first entry of the page, 0 = oldest */
+    int limit;                /* STATEMENT: page size, 0 = latest 5; REPORT: top N */
+    int to_account;           /* TRANSFER: account credited                     */
 } request_t;
 
 /* A structure for server response messages */
@@ -83,7 +145,13 @@ typedef struct {
     int balance;
     char message[256];
     int transaction_count;
-    transaction_t transactions[5]; // TRANS_KEEP = 5
+    transaction_t transactions[STMT_PAGE];
+    int transaction_total;    /* entries in the account's full history */
+    int holding_count;        /* ACCOUNTS: accounts held by the customer */
+    holding_t holdings[HOLDINGS_LISTED];
+    long long total_holdings; /* ACCOUNTS: sum of their balances     */
+    report_t report;          /* REPORT: bank-wide figures           */
+    stats_t stats;            /* STATS: persistence counters         */
 } response_t;
 
 /* Global variables - extern declaration */
@@ -107,8 +175,13 @@ void open_account(void);
 void close_account(void);
 void deposit(void);
 void withdraw(void);
+void transfer(void);
 void check_balance(void);
 void get_statement(void);
+void list_accounts(void);
+void run_batch(void);
+void bank_report(void);
+void server_stats(void);
 void display_banner(void);
 
 #endif /* BANK_CLIENT_H */
\ No newline at end of file
@@ -108,6 +108,27 @@ void interpret_response(response_t *response, command_t command, int account_num
             }
             break;
             
+        case CMD_TRANSFER:
+            if (response->status == 0) {
+                printf("Transfer successful\n");
+                printf("New balance: %d\n", response->balance);
+                log_message(LOG_INFO, "Transfer successful - New balance: %d", response->balance);
+            } else {
+                printf("Transfer failed - likely reasons:\n");
+                if (response->status == -2) {
+                    printf("- Transfer would break minimum balance requirement (%d)\n", 1000); // MIN_BALANCE
+                    log_message(LOG_WARNING, "Transfer failed - Would break minimum balance");
+                } else if (response->status == -3) {
+                    printf("- Amount must be at least %d and go to a different account\n", 500); // MIN_DEPOSIT
+                    log_message(LOG_WARNING, "Transfer failed - Invalid amount or target");
+                } else if (response->status == -1) {
+                    printf("- Either account number does not exist\n");
+                    printf("- Incorrect PIN provided\n");
+                    log_message(LOG_WARNING, "Transfer failed - likely: non-existent account or wrong PIN");
+                }
+            }
+            break;
+            
         case CMD_BALANCE:
             if (response->status == 0) {
                 printf("Current balance: %d\n", response->balance);
@@ -150,6 +171,63 @@ void interpret_response(response_t *response, command_t command, int account_num
             }
             break;
             
+        case CMD_ACCOUNTS:
+            if (response->status == 0) {
+                printf("Customer holds %d account(s), total holdings %lld\n",
+                       response->holding_count, response->total_holdings);
+                log_message(LOG_INFO, "Account listing successful - %d accounts, total %lld",
+                           response->holding_count, response->total_holdings);
+            } else {
+                printf("Account listing failed - likely reasons:\n");
+                printf("- Account number does not exist\n");
+                printf("- Incorrect PIN provided\n");
+                log_message(LOG_WARNING, "Account listing failed - likely: non-existent account or wrong PIN");
+            }
+            break;
+            
+        case CMD_REPORT:
+            if (response->status == 0) {
+                printf("Accounts: %d, total deposits held: %lld\n",
+                       response->report.accounts, response->report.total);
+                printf("Accounts below %d: %d\n",
+                       response->report.threshold, response->report.under);
+                printf("Scanned in %d us using the %s engine\n",
+                       response->report.elapsed_us, response->report.engine);
+                log_message(LOG_INFO, "Report successful - %d accounts, total %lld",
+                           response->report.accounts, response->report.total);
+            } else if (response->status == STATUS_INVALID) {
+                printf("Report failed - likely reasons:\n");
+                printf("- Top list size must be between 0 and %d\n", REPORT_TOP);
+                log_message(LOG_WARNING, "Report failed - likely: bad top list size");
+            } else {
+                printf("Report failed - likely reasons:\n");
+                printf("- Account number does not exist\n");
+                printf("- Incorrect PIN provided\n");
+                log_message(LOG_WARNING, "Report failed - likely: non-existent account or wrong PIN");
+            }
+            break;
+            
+        case CMD_STATS:
+            if (response->status == 0) {
+                log_message(LOG_INFO, "Stats received - %lld syncs, %lld checkpoints",
+                           response->stats.commits, response->stats.checkpoints);
+            } else {
+                printf("Stats request failed\n");
+                log_message(LOG_WARNING, "Stats request failed");
+            }
+            break;
+            
+        case CMD_BATCH:
+            if (response->status == 0) {
+                log_message(LOG_INFO, "Batch applied - %d of %d operations",
+                           response->transaction_count, response->transaction_total);
+            } else {
+                printf("Batch rejected - likely reasons:\n");
+                printf("- Frame carried no operations or more than %d\n", BATCH_MAX);
+                log_message(LOG_WARNING, "Batch rejected - likely: bad operation count");
+            }
+            break;
+            
         case CMD_QUIT:
             printf("Server acknowledged disconnect request\n");
             log_message(LOG_INFO, "Server acknowledged client disconnect request");
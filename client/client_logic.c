@@ -9,7 +9,8 @@ void display_banner(void) {
     log_message(LOG_INFO, "Displaying main menu banner");
     printf("\n============== BANK CLIENT (Network Version) ==============\n");
     printf("1: Open  2: Close  3: Deposit  4: Withdraw  5: Balance\n");
-    printf("6: Statement  0: Quit\n");
+    printf("6: Statement  7: My Accounts  8: Batch Postings  9: Transfer\n");
+    printf("10: Bank Report  11: Server Stats  0: Quit\n");
     printf("----------------------------------------------------------\n");
 }
 
@@ -234,6 +235,62 @@ void withdraw(void) {
     interpret_response(&response, CMD_WITHDRAW, request.account_number);
 }
 
+/* Transfer money to another account */
+void transfer(void) {
+    request_t request;
+    response_t response;
+    
+    log_message(LOG_INFO, "Starting TRANSFER operation");
+    printf("Starting TRANSFER operation...\n");
+    
+    memset(&request, 0, sizeof(request));
+    request.command = CMD_TRANSFER;
+    
+    printf("From Account Number: ");
+    scanf("%d", &request.account_number);
+    
+    printf("PIN: ");
+    scanf("%d", &request.pin);
+    
+    printf("To Account Number: ");
+    scanf("%d", &request.to_account);
+    
+    printf("Amount: ");
+    scanf("%d", &request.amount);
+    
+    log_message(LOG_INFO, "TRANSFER details - Account: %d, PIN: %d, To: %d, Amount: %d", 
+               request.account_number, request.pin, request.to_account, request.amount);
+    
+    printf("Processing transfer, please wait...\n");
+    sleep(SHORT_WAIT);
+    
+    // Send request to server
+    log_message(LOG_INFO, "Sending TRANSFER request to server");
+    if (send(client_socket, &request, sizeof(request), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to send TRANSFER request: %s", strerror(errno));
+        perror("Send failed");
+        return;
+    }
+    log_message(LOG_INFO, "TRANSFER request sent successfully");
+    sleep(SHORT_WAIT);
+    
+    // Receive response from server
+    log_message(LOG_INFO, "Waiting for server response");
+    printf("Waiting for server response...\n");
+    if (recv(client_socket, &response, sizeof(response), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to receive server response: %s", strerror(errno));
+        perror("Receive failed");
+        return;
+    }
+    
+    // Display server response
+    log_message(LOG_INFO, "Received response from server - Status: %d, Message: %s", 
+               response.status, response.message);
+    
+    // Interpret the response in detail
+    interpret_response(&response, CMD_TRANSFER, request.account_number);
+}
+
 /* Check account balance */
 void check_balance(void) {
     request_t request;
@@ -301,8 +358,18 @@ void get_statement(void) {
     printf("PIN: ");
     scanf("%d", &request.pin);
     
-    log_message(LOG_INFO, "STATEMENT details - Account: %d, PIN: %d", 
-               request.account_number, request.pin);
+    printf("Start at entry (0 = oldest, -1 = latest 5): ");
+    scanf("%d", &request.offset);
+    if (request.offset < 0) {
+        request.offset = 0;
+        request.limit = 0;
+    } else {
+        printf("Entries per page (max %d): ", STMT_PAGE);
+        scanf("%d", &request.limit);
+    }
+    
+    log_message(LOG_INFO, "STATEMENT details - Account: %d, PIN: %d, Offset: %d, Limit: %d", 
+               request.account_number, request.pin, request.offset, request.limit);
     
     printf("Generating account statement, please wait...\n");
     sleep(SHORT_WAIT);
@@ -335,7 +402,8 @@ void get_statement(void) {
     
     // Display transaction details in a table format if successful
     if (response.status == 0 && response.transaction_count > 0) {
-        printf("\nTransaction Details:\n");
+        printf("\nTransaction Details (%d of %d):\n",
+               response.transaction_count, response.transaction_total);
         printf("Date/Time        Type Amount  Balance\n");
         printf("---------------- ---- ------- -------\n");
         
@@ -347,4 +415,293 @@ void get_statement(void) {
         }
         printf("\n");
     }
-}
\ No newline at end of file
+}
+
+/* List every account held by the owner of an account */
+void list_accounts(void) {
+    request_t request;
+    response_t response;
+    
+    log_message(LOG_INFO, "Starting ACCOUNTS operation");
+    printf("Starting ACCOUNTS operation...\n");
+    
+    memset(&request, 0, sizeof(request));
+    request.command = CMD_ACCOUNTS;
+    
+    printf("Account Number: ");
+    scanf("%d", &request.account_number);
+    
+    printf("PIN: ");
+    scanf("%d", &request.pin);
+    
+    log_message(LOG_INFO, "ACCOUNTS details - Account: %d, PIN: %d", 
+               request.account_number, request.pin);
+    
+    printf("Retrieving your accounts, please wait...\n");
+    sleep(SHORT_WAIT);
+    
+    // Send request to server
+    log_message(LOG_INFO, "Sending ACCOUNTS request to server");
+    if (send(client_socket, &request, sizeof(request), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to send ACCOUNTS request: %s", strerror(errno));
+        perror("Send failed");
+        return;
+    }
+    log_message(LOG_INFO, "ACCOUNTS request sent successfully");
+    sleep(SHORT_WAIT);
+    
+    // Receive response from server
+    log_message(LOG_INFO, "Waiting for server response");
+    printf("Waiting for server response...\n");
+    if (recv(client_socket, &response, sizeof(response), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to receive server response: %s", strerror(errno));
+        perror("Receive failed");
+        return;
+    }
+    
+    // Display server response
+    log_message(LOG_INFO, "Received response from server - Status: %d, Message: %s", 
+               response.status, response.message);
+    
+    // Interpret the response in detail
+    interpret_response(&response, CMD_ACCOUNTS, request.account_number);
+    
+    // Display the accounts in a table format if successful
+    if (response.status == 0 && response.holding_count > 0) {
+        printf("\nAccount  Type      Balance\n");
+        printf("-------- --------- -------\n");
+        
+        for (int i = 0; i < response.holding_count; i++) {
+            holding_t *h = &response.holdings[i];
+            printf("%-8d %-9s %-7d\n", h->number,
+                   h->type == SAVINGS ? "Savings" : "Checking", h->balance);
+        }
+        printf("Total holdings: %lld\n\n", response.total_holdings);
+    }
+}
+
+
+/* Send one BATCH frame and report the per-operation results */
+static int send_batch(const batch_op_t *ops, int count, int *applied) {
+    request_t request;
+    response_t response;
+    signed char status[BATCH_MAX];
+    
+    memset(&request, 0, sizeof(request));
+    request.command = CMD_BATCH;
+    request.amount = count;
+    
+    log_message(LOG_INFO, "Sending BATCH frame with %d operations", count);
+    if (send(client_socket, &request, sizeof(request), 0) < 0 ||
+        send(client_socket, ops, count * sizeof(batch_op_t), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to send BATCH request: %s", strerror(errno));
+        perror("Send failed");
+        return -1;
+    }
+    
+    // The reply is a response followed by one status byte per operation
+    if (recv(client_socket, &response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+        log_message(LOG_ERROR, "Failed to receive server response: %s", strerror(errno));
+        perror("Receive failed");
+        return -1;
+    }
+    if (response.status != 0) {
+        interpret_response(&response, CMD_BATCH, 0);
+        return -1;
+    }
+    if (recv(client_socket, status, count, MSG_WAITALL) != count) {
+        log_message(LOG_ERROR, "Failed to receive batch statuses: %s", strerror(errno));
+        perror("Receive failed");
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (status[i] != 0) {
+            printf("  %c %d %d -> status %d\n",
+                   ops[i].command == CMD_DEPOSIT ? 'D' : 'W',
+                   ops[i].account_number, ops[i].amount, status[i]);
+            log_message(LOG_WARNING, "Batch operation on account %d failed with status %d",
+                       ops[i].account_number, status[i]);
+        }
+    }
+    *applied += response.transaction_count;
+    return 0;
+}
+
+/* Apply postings from a file ("D|W account pin amount" per line) in batches */
+void run_batch(void) {
+    static batch_op_t ops[BATCH_MAX];
+    char path[256], line[128];
+    char kind;
+    int count = 0, total = 0, applied = 0, skipped = 0;
+    
+    log_message(LOG_INFO, "Starting BATCH operation");
+    printf("Starting BATCH operation...\n");
+    
+    printf("Postings file: ");
+    scanf("%255s", path);
+    
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        log_message(LOG_ERROR, "Cannot open postings file %s: %s", path, strerror(errno));
+        perror("Cannot open postings file");
+        return;
+    }
+    
+    while (fgets(line, sizeof(line), f)) {
+        batch_op_t *op = &ops[count];
+        if (sscanf(line, " %c %d %d %d", &kind, &op->account_number, &op->pin, &op->amount) != 4 ||
+            (kind != 'D' && kind != 'W')) {
+            skipped++;
+            continue;
+        }
+        op->command = kind == 'D' ? CMD_DEPOSIT : CMD_WITHDRAW;
+        
+        if (++count == BATCH_MAX) {
+            if (send_batch(ops, count, &applied) < 0) {
+                fclose(f);
+                return;
+            }
+            total += count;
+            count = 0;
+        }
+    }
+    fclose(f);
+    
+    if (count > 0) {
+        if (send_batch(ops, count, &applied) < 0) {
+            return;
+        }
+        total += count;
+    }
+    
+    printf("Batch complete: %d of %d postings applied, %d unreadable lines skipped\n",
+           applied, total, skipped);
+    log_message(LOG_INFO, "BATCH complete - %d of %d applied, %d lines skipped",
+               applied, total, skipped);
+}
+
+/* Request a bank-wide balance report */
+void bank_report(void) {
+    request_t request;
+    response_t response;
+    
+    log_message(LOG_INFO, "Starting REPORT operation");
+    printf("Starting REPORT operation...\n");
+    
+    memset(&request, 0, sizeof(request));
+    request.command = CMD_REPORT;
+    
+    printf("Account Number: ");
+    scanf("%d", &request.account_number);
+    
+    printf("PIN: ");
+    scanf("%d", &request.pin);
+    
+    printf("Margin over minimum balance: ");
+    scanf("%d", &request.amount);
+    
+    printf("Top balances to list (0-%d): ", REPORT_TOP);
+    scanf("%d", &request.limit);
+    
+    log_message(LOG_INFO, "REPORT details - Account: %d, PIN: %d, Margin: %d, Top: %d", 
+               request.account_number, request.pin, request.amount, request.limit);
+    
+    // Send request to server
+    log_message(LOG_INFO, "Sending REPORT request to server");
+    if (send(client_socket, &request, sizeof(request), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to send REPORT request: %s", strerror(errno));
+        perror("Send failed");
+        return;
+    }
+    
+    // Receive response from server
+    log_message(LOG_INFO, "Waiting for server response");
+    printf("Waiting for server response...\n");
+    if (recv(client_socket, &response, sizeof(response), MSG_WAITALL) < 0) {
+        log_message(LOG_ERROR, "Failed to receive server response: %s", strerror(errno));
+        perror("Receive failed");
+        return;
+    }
+    
+    // Interpret the response in detail
+    interpret_response(&response, CMD_REPORT, 0);
+    
+    if (response.status == 0) {
+        report_t *r = &response.report;
+        printf("\nBalance range            Accounts\n");
+        printf("------------------------ --------\n");
+        for (int k = 0; k < REPORT_BINS; k++) {
+            long lo = k == 0 ? 0 : (long)REPORT_BIN_BASE << (k - 1);
+            if (k < REPORT_BINS - 1) {
+                printf("%10ld - %-11ld %8d\n", lo, ((long)REPORT_BIN_BASE << k) - 1, r->hist[k]);
+            } else {
+                printf("%10ld and above  %8d\n", lo, r->hist[k]);
+            }
+        }
+        
+        if (r->top_count > 0) {
+            printf("\nTop balances:\n");
+            printf("Account  Type      Balance\n");
+            printf("-------- --------- -------\n");
+            for (int i = 0; i < r->top_count; i++) {
+                holding_t *h = &r->top[i];
+                printf("%-8d %-9s %-7d\n", h->number,
+                       h->type == SAVINGS ? "Savings" : "Checking", h->balance);
+            }
+        }
+        printf("\n");
+    }
+}
+
+/* Request the server's persistence counters */
+void server_stats(void) {
+    request_t request;
+    response_t response;
+    
+    log_message(LOG_INFO, "Starting STATS operation");
+    
+    memset(&request, 0, sizeof(request));
+    request.command = CMD_STATS;
+    
+    // Send request to server
+    log_message(LOG_INFO, "Sending STATS request to server");
+    if (send(client_socket, &request, sizeof(request), 0) < 0) {
+        log_message(LOG_ERROR, "Failed to send STATS request: %s", strerror(errno));
+        perror("Send failed");
+        return;
+    }
+    
+    // Receive response from server
+    log_message(LOG_INFO, "Waiting for server response");
+    printf("Waiting for server response...\n");
+    if (recv(client_socket, &response, sizeof(response), MSG_WAITALL) < 0) {
+        log_message(LOG_ERROR, "Failed to receive server response: %s", strerror(errno));
+        perror("Receive failed");
+        return;
+    }
+    
+    // Interpret the response in detail
+    interpret_response(&response, CMD_STATS, 0);
+    
+    if (response.status == 0) {
+        stats_t *st = &response.stats;
+        printf("\nCommit window:        %d us or %d bytes\n", st->commit_window_us, st->commit_bytes);
+        printf("Journal syncs:        %lld (%lld records, largest group %d)\n",
+               st->commits, st->records_synced, st->max_group);
+        printf("Last sync took:       %d us\n", st->last_sync_us);
+        printf("Replies held:         %lld (%lld us average)\n", st->waits,
+               st->waits > 0 ? st->wait_us_total / st->waits : 0);
+        printf("Journal size:         %lld bytes\n", st->journal_bytes);
+        printf("Checkpoints:          %lld (%lld in the background)\n", st->checkpoints, st->snapshots_forked);
+        printf("Last background one:  %d ms%s\n", st->last_snapshot_ms,
+               st->snapshot_running ? " (another is running)" : "");
+        if (st->archived_bytes > 0) {
+            printf("Journal archived:     %lld bytes as %lld (ratio %.2f, %lld MB/s)\n",
+                   st->archived_bytes, st->archive_packed,
+                   st->archive_packed > 0 ? (double)st->archived_bytes / st->archive_packed : 0.0,
+                   st->archived_bytes / (st->archive_us > 0 ? st->archive_us : 1));
+        }
+        printf("\n");
+    }
+}
@@ -5,9 +5,16 @@
 #include "bank_account.h"
 #include "bank_log.h"
 #include "bank_persistence.h"
+#include "bank_index.h"
+#include "bank_store.h"
+#include "bank_history.h"
+#include "bank_journal.h"
+#include "bank_shm.h"
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /* Generate a random 4-digit PIN */
 int gen_pin(void)
@@ -48,34 +55,185 @@ void remember(account_t *a, char typ, int amt)
     t->balance_after = a->balance;
 }
 
-/* Create a new bank account */
+/* Serializes request handling against background jobs such as accrual,
+   and in the concurrent server against the other processes */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    volatile int lost; /* a process died holding the mutex */
+} bank_lock_state_t;
+
+static bank_lock_state_t local_lock = {PTHREAD_MUTEX_INITIALIZER, 0};
+static bank_lock_state_t *bank_mutex = &local_lock;
+
+/* Note a dead holder before the mutex becomes unrecoverable; glibc's
+   trylock would keep an unrecoverable mutex locked */
+static void lock_lost(int rc)
+{
+    bank_mutex->lost = 1;
+    if (rc == EOWNERDEAD)
+    {
+        pthread_mutex_unlock(&bank_mutex->mutex); /* not made consistent */
+    }
+}
+
+/* Take the bank lock around any access to account data. A process that
+   died holding it may have left a change half made, so the bank in memory
+   is neither served nor checkpointed again: this process ends, and the
+   next start rebuilds the bank from the snapshot and the journal. */
+void bank_lock(void)
+{
+    int rc = bank_mutex->lost ? ENOTRECOVERABLE : pthread_mutex_lock(&bank_mutex->mutex);
+    if (rc == EOWNERDEAD || rc == ENOTRECOVERABLE)
+    {
+        log_message(LOG_ERROR, "A process died holding the bank lock; stopping without a checkpoint");
+        lock_lost(rc);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+/* Whether a process died holding the bank lock; never blocks */
+int bank_lock_lost(void)
+{
+    if (!bank_mutex->lost)
+    {
+        int rc = pthread_mutex_trylock(&bank_mutex->mutex);
+        if (rc == 0)
+        {
+            pthread_mutex_unlock(&bank_mutex->mutex);
+        }
+        else if (rc == EOWNERDEAD)
+        {
+            lock_lost(rc);
+        }
+    }
+    return bank_mutex->lost;
+}
+
+/* Release the bank lock */
+void bank_unlock(void)
+{
+    pthread_mutex_unlock(&bank_mutex->mutex);
+}
+
+/* Replace the bank lock with a robust one in shared memory */
+int bank_lock_share(void)
+{
+    bank_lock_state_t *shared = shm_share(bank_mutex, sizeof(bank_lock_state_t));
+    if (!shared || shm_mutex_init(&shared->mutex) != 0)
+    {
+        return -1;
+    }
+    bank_mutex = shared;
+    return 0;
+}
+
+/* Place a transaction in the recent cache and full history of a slot */
+void post_transaction(int slot, const transaction_t *t)
+{
+    int *ntran = acct_ntran(slot);
+    acct_cold(slot)->last[*ntran % TRANS_KEEP] = *t;
+    (*ntran)++;
+    store_touch(slot);
+
+    /* the ring keeps the latest entries; the full history keeps them all */
+    if (history_append(slot, t) < 0)
+    {
+        log_message(LOG_WARNING, "History full: transaction on account %d kept only in recent cache",
+                    *acct_number(slot));
+    }
+}
+
+/* Record and journal a transaction on a stored account */
+void remember_slot(int slot, char typ, int amt)
+{
+    transaction_t t;
+    t.type = typ;
+    t.amount = amt;
+    t.when = time(NULL);
+    t.balance_after = *acct_balance(slot);
+
+    post_transaction(slot, &t);
+    journal_log_post(*acct_number(slot), &t);
+}
+
+/* Look up an account by number and verify its PIN; returns its slot or -1 */
+static int find_account(int acc_no, int pin)
+{
+    int slot = index_lookup(acc_no);
+    if (slot < 0 || *acct_pin(slot) != pin)
+    {
+        return -1;
+    }
+    return slot;
+}
+
+/* Check an account's PIN for requests that act on no account of their own */
+int authenticate(int acc_no, int pin)
+{
+    if (find_account(acc_no, pin) < 0)
+    {
+        log_message(LOG_WARNING, "Authentication failed: Account %d not found or wrong PIN", acc_no);
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
+}
+
+/* Create a new bank account; returns a copy of the new account record */
 account_t *open_account(const char *name, const char *nid, acct_type_t t)
 {
     log_message(LOG_INFO, "Attempting to open new account for %s (ID: %s, Type: %d)",
                 name, nid, t);
 
-    if (accounts_in_use >= MAX_ACCTS)
+    if (bank_totals->accounts_in_use >= MAX_ACCTS)
     {
         log_message(LOG_ERROR, "Cannot open account: maximum accounts limit reached");
         return NULL;
     }
 
-    account_t *a = &bank[accounts_in_use++];
+    /* reuse a closed slot, or grow the table by a segment when full */
+    int slot = store_alloc();
+    if (slot < 0)
+    {
+        log_message(LOG_ERROR, "Cannot open account: failed to grow account table");
+        return NULL;
+    }
+
+    static account_t opened;
+    account_t *a = &opened;
     memset(a, 0, sizeof(*a));
 
-    a->number = next_number++;
+    a->number = bank_totals->next_number++;
     a->pin = gen_pin();
     strncpy(a->name, name, sizeof(a->name) - 1);
     strncpy(a->nat_id, nid, sizeof(a->nat_id) - 1);
     a->type = t;
     a->balance = MIN_BALANCE; /* initial 1 k mandatory */
-    remember(a, 'D', MIN_BALANCE);
+
+    if (index_insert(a->number, slot) < 0)
+    {
+        log_message(LOG_ERROR, "Cannot open account: failed to index account %d", a->number);
+        store_release(slot);
+        return NULL;
+    }
+    store_put(slot, a);
+    if (customer_add(a->nat_id, slot) < 0)
+    {
+        log_message(LOG_ERROR, "Cannot open account: failed to index customer %s", a->nat_id);
+        index_remove(a->number);
+        store_release(slot);
+        return NULL;
+    }
+    journal_log_open(a);
+    remember_slot(slot, 'D', MIN_BALANCE);
+    store_get(slot, a);
+    bank_totals->accounts_in_use++;
 
     log_message(LOG_INFO, "Account created: Number=%d, PIN=%04d, Balance=%d",
                 a->number, a->pin, a->balance);
 
     // Save after modification
-    save_data();
+    commit_data();
     return a;
 }
 
@@ -84,18 +242,21 @@ int close_account(int acc_no, int pin)
 {
     log_message(LOG_INFO, "Attempting to close account %d", acc_no);
 
-    for (int i = 0; i < accounts_in_use; i++)
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
     {
-        if (bank[i].number == acc_no && bank[i].pin == pin)
-        {
-            log_message(LOG_INFO, "Closing account %d with balance %d",
-                        acc_no, bank[i].balance);
-
-            /* shift the tail of the array left */
-            bank[i] = bank[--accounts_in_use];
-            save_data();
-            return STATUS_OK;
-        }
+        log_message(LOG_INFO, "Closing account %d with balance %d",
+                    acc_no, *acct_balance(i));
+
+        /* leave a tombstone; no other account moves */
+        journal_log_close(acc_no);
+        index_remove(acc_no);
+        customer_remove(acct_cold(i)->nat_id, i);
+        history_release(i);
+        store_release(i);
+        bank_totals->accounts_in_use--;
+        commit_data();
+        return STATUS_OK;
     }
 
     log_message(LOG_WARNING, "Failed to close account %d: account not found or wrong PIN", acc_no);
@@ -114,19 +275,17 @@ int deposit(int acc_no, int pin, int amount)
         return STATUS_INVALID;
     }
 
-    for (int i = 0; i < accounts_in_use; i++)
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
     {
-        if (bank[i].number == acc_no && bank[i].pin == pin)
-        {
-            bank[i].balance += amount;
-            remember(&bank[i], 'D', amount);
+        *acct_balance(i) += amount;
+        remember_slot(i, 'D', amount);
 
-            log_message(LOG_INFO, "Deposit successful: Account %d, Amount %d, New Balance %d",
-                        acc_no, amount, bank[i].balance);
+        log_message(LOG_INFO, "Deposit successful: Account %d, Amount %d, New Balance %d",
+                    acc_no, amount, *acct_balance(i));
 
-            save_data();
-            return STATUS_OK;
-        }
+        commit_data();
+        return STATUS_OK;
     }
 
     log_message(LOG_WARNING, "Deposit failed: Account %d not found or wrong PIN", acc_no);
@@ -145,79 +304,228 @@ int withdraw(int acc_no, int pin, int amount)
         return STATUS_INVALID;
     }
 
-    for (int i = 0; i < accounts_in_use; i++)
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
     {
-        if (bank[i].number == acc_no && bank[i].pin == pin)
+        int *bal = acct_balance(i);
+        if (*bal - amount < MIN_BALANCE)
         {
-            if (bank[i].balance - amount < MIN_BALANCE)
-            {
-                log_message(LOG_WARNING, "Withdrawal rejected: Would break minimum balance (Current: %d, After: %d, Min: %d)",
-                            bank[i].balance, bank[i].balance - amount, MIN_BALANCE);
-                return STATUS_MIN_AMT;
-            }
+            log_message(LOG_WARNING, "Withdrawal rejected: Would break minimum balance (Current: %d, After: %d, Min: %d)",
+                        *bal, *bal - amount, MIN_BALANCE);
+            return STATUS_MIN_AMT;
+        }
 
-            bank[i].balance -= amount;
-            remember(&bank[i], 'W', amount);
+        *bal -= amount;
+        remember_slot(i, 'W', amount);
 
-            log_message(LOG_INFO, "Withdrawal successful: Account %d, Amount %d, New Balance %d",
-                        acc_no, amount, bank[i].balance);
+        log_message(LOG_INFO, "Withdrawal successful: Account %d, Amount %d, New Balance %d",
+                    acc_no, amount, *bal);
 
-            save_data();
-            return STATUS_OK;
-        }
+        commit_data();
+        return STATUS_OK;
     }
 
     log_message(LOG_WARNING, "Withdrawal failed: Account %d not found or wrong PIN", acc_no);
     return STATUS_ERROR;
 }
 
+/* Move money between two accounts as one posting */
+int transfer(int acc_no, int pin, int to_acc, int amount)
+{
+    log_message(LOG_INFO, "Transfer request: Account %d -> %d, Amount %d", acc_no, to_acc, amount);
+
+    if (amount < MIN_DEPOSIT || to_acc == acc_no)
+    {
+        log_message(LOG_WARNING, "Transfer rejected: Amount %d below minimum %d or same account",
+                    amount, MIN_DEPOSIT);
+        return STATUS_INVALID;
+    }
+
+    int i = find_account(acc_no, pin);
+    int j = index_lookup(to_acc);
+    if (i < 0 || j < 0)
+    {
+        log_message(LOG_WARNING, "Transfer failed: Account %d not found or wrong PIN, or account %d not found",
+                    acc_no, to_acc);
+        return STATUS_ERROR;
+    }
+
+    int *from = acct_balance(i);
+    if (*from - amount < MIN_BALANCE)
+    {
+        log_message(LOG_WARNING, "Transfer rejected: Would break minimum balance (Current: %d, After: %d, Min: %d)",
+                    *from, *from - amount, MIN_BALANCE);
+        return STATUS_MIN_AMT;
+    }
+
+    /* both legs land before the single save, so the file never holds half a transfer */
+    *from -= amount;
+    *acct_balance(j) += amount;
+    remember_slot(i, 'T', amount);
+    remember_slot(j, 'R', amount);
+
+    log_message(LOG_INFO, "Transfer successful: Account %d -> %d, Amount %d, New Balance %d",
+                acc_no, to_acc, amount, *from);
+
+    commit_data();
+    return STATUS_OK;
+}
+
 /* Get account balance */
 int balance(int acc_no, int pin, int *bal_out)
 {
     log_message(LOG_INFO, "Balance inquiry: Account %d", acc_no);
 
-    for (int i = 0; i < accounts_in_use; i++)
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
     {
-        if (bank[i].number == acc_no && bank[i].pin == pin)
-        {
-            *bal_out = bank[i].balance;
-            log_message(LOG_INFO, "Balance reported: Account %d, Balance %d", acc_no, *bal_out);
-            return STATUS_OK;
-        }
+        *bal_out = *acct_balance(i);
+        log_message(LOG_INFO, "Balance reported: Account %d, Balance %d", acc_no, *bal_out);
+        return STATUS_OK;
     }
 
     log_message(LOG_WARNING, "Balance inquiry failed: Account %d not found or wrong PIN", acc_no);
     return STATUS_ERROR;
 }
 
-/* Get account statement with transaction history */
+/* Get account statement with the most recent transactions (from the ring) */
 int statement(int acc_no, int pin, response_t *resp)
 {
     log_message(LOG_INFO, "Statement request: Account %d", acc_no);
 
-    for (int i = 0; i < accounts_in_use; i++)
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
     {
-        if (bank[i].number == acc_no && bank[i].pin == pin)
+        int ntran = *acct_ntran(i);
+        const acct_cold_t *c = acct_cold(i);
+        int start = (ntran > TRANS_KEEP) ? ntran - TRANS_KEEP : 0;
+        int count = 0;
+
+        log_message(LOG_INFO, "Generating statement for account %d with %d transactions",
+                    acc_no, ntran > TRANS_KEEP ? TRANS_KEEP : ntran);
+
+        for (int j = start; j < ntran; j++)
         {
-            account_t *a = &bank[i];
-            int start = (a->ntran > TRANS_KEEP) ? a->ntran - TRANS_KEEP : 0;
-            int count = 0;
+            const transaction_t *t = &c->last[j % TRANS_KEEP];
+            // Copy the transaction to the response
+            resp->transactions[count++] = *t;
+        }
+
+        resp->transaction_count = count;
+        resp->transaction_total = history_count(i);
+        return STATUS_OK;
+    }
+
+    log_message(LOG_WARNING, "Statement request failed: Account %d not found or wrong PIN", acc_no);
+    return STATUS_ERROR;
+}
+
+/* Get one page of an account's full transaction history */
+int statement_page(int acc_no, int pin, int offset, int limit, response_t *resp)
+{
+    log_message(LOG_INFO, "Statement page request: Account %d, Offset %d, Limit %d",
+                acc_no, offset, limit);
+
+    if (offset < 0 || limit <= 0)
+    {
+        log_message(LOG_WARNING, "Statement page rejected: invalid offset %d or limit %d",
+                    offset, limit);
+        return STATUS_INVALID;
+    }
+    if (limit > STMT_PAGE)
+    {
+        limit = STMT_PAGE;
+    }
+
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
+    {
+        resp->transaction_total = history_count(i);
+        resp->transaction_count = history_read(i, offset, limit, resp->transactions);
 
-            log_message(LOG_INFO, "Generating statement for account %d with %d transactions",
-                        acc_no, a->ntran > TRANS_KEEP ? TRANS_KEEP : a->ntran);
+        log_message(LOG_INFO, "Statement page for account %d: %d of %d transactions from offset %d",
+                    acc_no, resp->transaction_count, resp->transaction_total, offset);
+        return STATUS_OK;
+    }
+
+    log_message(LOG_WARNING, "Statement page request failed: Account %d not found or wrong PIN", acc_no);
+    return STATUS_ERROR;
+}
+
+/* List every account held by the owner of an account, with their total */
+int list_accounts(int acc_no, int pin, response_t *resp)
+{
+    log_message(LOG_INFO, "Account listing request: Account %d", acc_no);
+
+    int i = find_account(acc_no, pin);
+    if (i >= 0)
+    {
+        const int *slots;
+        int n = customer_slots(acct_cold(i)->nat_id, &slots);
+
+        resp->holding_count = 0;
+        resp->total_holdings = 0;
+
+        /* an account without a nat_id is its own customer */
+        if (n == 0)
+        {
+            slots = &i;
+            n = 1;
+        }
 
-            for (int j = start; j < a->ntran; j++)
+        /* the total covers every account even if the listing is truncated */
+        for (int k = 0; k < n; k++)
+        {
+            resp->total_holdings += *acct_balance(slots[k]);
+            if (k < HOLDINGS_LISTED)
             {
-                transaction_t *t = &a->last[j % TRANS_KEEP];
-                // Copy the transaction to the response
-                resp->transactions[count++] = *t;
+                holding_t *h = &resp->holdings[resp->holding_count++];
+                h->number = *acct_number(slots[k]);
+                h->type = acct_cold(slots[k])->type;
+                h->balance = *acct_balance(slots[k]);
             }
-
-            resp->transaction_count = count;
-            return STATUS_OK;
         }
+
+        log_message(LOG_INFO, "Account listing for customer %s: %d accounts, total %lld",
+                    acct_cold(i)->nat_id, n, resp->total_holdings);
+        return STATUS_OK;
     }
 
-    log_message(LOG_WARNING, "Statement request failed: Account %d not found or wrong PIN", acc_no);
+    log_message(LOG_WARNING, "Account listing failed: Account %d not found or wrong PIN", acc_no);
     return STATUS_ERROR;
-}
\ No newline at end of file
+}
+
+/* Apply a batch of postings in one pass with a single save at the end */
+int apply_batch(const batch_op_t *ops, int n, signed char *status_out)
+{
+    int applied = 0;
+
+    log_message(LOG_INFO, "Batch request: %d operations", n);
+
+    defer_saves();
+    for (int k = 0; k < n; k++)
+    {
+        int result;
+        switch (ops[k].command)
+        {
+        case DEPOSIT:
+            result = deposit(ops[k].account_number, ops[k].pin, ops[k].amount);
+            break;
+        case WITHDRAW:
+            result = withdraw(ops[k].account_number, ops[k].pin, ops[k].amount);
+            break;
+        default:
+            result = STATUS_INVALID;
+            break;
+        }
+        status_out[k] = (signed char)result;
+        if (result == STATUS_OK)
+        {
+            applied++;
+        }
+    }
+    flush_deferred();
+
+    log_message(LOG_INFO, "Batch complete: %d of %d operations applied", applied, n);
+    return applied;
+}
@@ -8,14 +8,25 @@
 #include "bank_common.h"
 
 /* Account operation prototypes */
+void bank_lock(void);
+void bank_unlock(void);
+int bank_lock_lost(void);
+int bank_lock_share(void);
 int gen_pin(void);
 transaction_t *slot_for(account_t *a);
 void remember(account_t *a, char typ, int amt);
+void post_transaction(int slot, const transaction_t *t);
+void remember_slot(int slot, char typ, int amt);
+int authenticate(int acc_no, int pin);
 account_t *open_account(const char *name, const char *nid, acct_type_t t);
 int close_account(int acc_no, int pin);
 int deposit(int acc_no, int pin, int amount);
 int withdraw(int acc_no, int pin, int amount);
+int transfer(int acc_no, int pin, int to_acc, int amount);
 int balance(int acc_no, int pin, int *bal_out);
 int statement(int acc_no, int pin, response_t *resp);
+int statement_page(int acc_no, int pin, int offset, int limit, response_t *resp);
+int list_accounts(int acc_no, int pin, response_t *resp);
+int apply_batch(const batch_op_t *ops, int n, signed char *status_out);
 
 #endif /* BANK_ACCOUNT_H */
\ No newline at end of file
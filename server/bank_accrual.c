@@ -0,0 +1,328 @@
+/*
+ * Banking System - End-of-day interest and fee accrual
+ *
+ * A run walks the account table in waves of ACCRUE_WAVE segments. Each wave
+ * is taken under the bank lock and split across a pool of worker threads,
+ * one segment at a time, so live requests wait for at most one wave rather
+ * than the whole run. Workers cannot share the journal queue, so each
+ * segment's postings are collected as it is accrued and journaled as one
+ * commit group once its wave is done, before the bank lock is let go.
+ * Periodic checkpoints wait for the end of the run, which leaves the
+ * checkpoint to the usual policy, in the background where that is on;
+ * after a crash the waves whose records reached the disk are replayed and
+ * the accounts of the rest wait for the next run.
+ *
+ * Runs start at local midnight or when the server receives SIGUSR1.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_accrual.h"
+#include "bank_account.h"
+#include "bank_persistence.h"
+#include "bank_journal.h"
+#include "bank_store.h"
+#include "bank_log.h"
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* An accrual posting waiting to be journaled */
+typedef struct
+{
+    int number;
+    transaction_t t;
+} accrue_rec_t;
+
+/* Postings made by one worker or by a whole run */
+typedef struct
+{
+    int interest_count;
+    long long interest_total;
+    int fee_count;
+    long long fee_total;
+} tally_t;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int wave_first = 0; /* first segment of the wave */
+static int wave_next = 0; /* next segment of the wave to hand out */
+static int wave_end = 0;  /* one past the last segment of the wave */
+static int wave_limit = 0; /* slots at or above this are not accrued */
+static int wave_busy = 0; /* workers still inside a segment */
+static tally_t wave_tally;
+static int pool_size = 0;
+static int accruing = 0;  /* a run is between its first and last wave */
+static accrue_rec_t wave_posts[ACCRUE_WAVE][SEG_SIZE]; /* postings of each segment of the wave */
+static int wave_posted[ACCRUE_WAVE];
+
+/* Post an accrual transaction and keep it for the journal */
+static void accrue_post(int slot, char typ, int amt, accrue_rec_t *out)
+{
+    out->number = *acct_number(slot);
+    out->t.type = typ;
+    out->t.amount = amt;
+    out->t.when = time(NULL);
+    out->t.balance_after = *acct_balance(slot);
+    post_transaction(slot, &out->t);
+}
+
+/* Post interest or a fee to every account of one segment, keeping the
+   postings in posts; returns how many were made */
+static int accrue_segment(int seg, int limit, tally_t *t, accrue_rec_t *posts)
+{
+    int posted = 0;
+    int base = seg << SEG_SHIFT;
+    int n = limit - base < SEG_SIZE ? limit - base : SEG_SIZE;
+    acct_hot_t *h = hot_segs[seg];
+
+    for (int i = 0; i < n; i++)
+    {
+        if (h->number[i] == SLOT_FREE)
+        {
+            continue;
+        }
+
+        int slot = base + i;
+        int bal = h->balance[i];
+        if (acct_cold(slot)->type == SAVINGS)
+        {
+            int interest = (int)((long long)bal * ACCRUE_RATE_BPS / (10000LL * 365));
+            if (interest > 0 && bal <= INT_MAX - interest)
+            {
+                h->balance[i] = bal + interest;
+                accrue_post(slot, 'I', interest, &posts[posted++]);
+                t->interest_count++;
+                t->interest_total += interest;
+            }
+        }
+        else if (bal < ACCRUE_FEE_WAIVER)
+        {
+            /* a fee never takes an account under the minimum balance */
+            int fee = bal - MIN_BALANCE < ACCRUE_FEE ? bal - MIN_BALANCE : ACCRUE_FEE;
+            if (fee > 0)
+            {
+                h->balance[i] = bal - fee;
+                accrue_post(slot, 'F', fee, &posts[posted++]);
+                t->fee_count++;
+                t->fee_total += fee;
+            }
+        }
+    }
+    return posted;
+}
+
+/* Worker: accrue segments of the current wave until none are left */
+static void *accrual_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool_mutex);
+    for (;;)
+    {
+        while (wave_next >= wave_end)
+        {
+            pthread_cond_wait(&work_cond, &pool_mutex);
+        }
+
+        int seg = wave_next++;
+        int k = seg - wave_first;
+        int limit = wave_limit;
+        wave_busy++;
+        pthread_mutex_unlock(&pool_mutex);
+
+        tally_t t = {0, 0, 0, 0};
+        int posted = accrue_segment(seg, limit, &t, wave_posts[k]);
+
+        pthread_mutex_lock(&pool_mutex);
+        wave_posted[k] = posted;
+        wave_tally.interest_count += t.interest_count;
+        wave_tally.interest_total += t.interest_total;
+        wave_tally.fee_count += t.fee_count;
+        wave_tally.fee_total += t.fee_total;
+        if (--wave_busy == 0 && wave_next >= wave_end)
+        {
+            pthread_cond_signal(&done_cond);
+        }
+    }
+    return NULL;
+}
+
+/* Hand segments [lo, hi) to the pool and wait for them; caller holds the bank lock */
+static void run_wave(int lo, int hi, int limit)
+{
+    pthread_mutex_lock(&pool_mutex);
+    wave_first = lo;
+    wave_next = lo;
+    wave_end = hi;
+    wave_limit = limit;
+    pthread_cond_broadcast(&work_cond);
+    while (wave_next < wave_end || wave_busy > 0)
+    {
+        pthread_cond_wait(&done_cond, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Journal the postings of a finished wave of segs segments as one commit
+   group; caller holds the bank lock. -1 when they could not be saved. */
+static int journal_wave(int segs)
+{
+    for (int k = 0; k < segs; k++)
+    {
+        for (int i = 0; i < wave_posted[k]; i++)
+        {
+            journal_log_post(wave_posts[k][i].number, &wave_posts[k][i].t);
+        }
+    }
+    return commit_data();
+}
+
+/* Accrue every account once; returns the postings made, or -1 when some
+   of them could not be saved */
+int run_accrual(void)
+{
+    struct timespec t0, t1;
+    int waves = 0;
+    int unsaved = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    bank_lock();
+    accruing = 1;
+    hold_checkpoints();
+    int segs = (bank_slots + SEG_SIZE - 1) >> SEG_SHIFT;
+    int limit = bank_slots; /* accounts opened after this wait for the next run */
+    int accounts = bank_totals->accounts_in_use;
+    bank_unlock();
+
+    memset(&wave_tally, 0, sizeof(wave_tally));
+    log_message(LOG_INFO, "Accrual started: %d accounts in %d segments, %d threads",
+                accounts, segs, pool_size);
+
+    for (int lo = 0; lo < segs; lo += ACCRUE_WAVE)
+    {
+        int hi = lo + ACCRUE_WAVE < segs ? lo + ACCRUE_WAVE : segs;
+
+        bank_lock();
+        run_wave(lo, hi, limit < bank_slots ? limit : bank_slots);
+        unsaved |= journal_wave(hi - lo) < 0;
+        bank_unlock();
+        waves++;
+    }
+
+    bank_lock();
+    release_checkpoints();
+    unsaved |= commit_data() < 0; /* a checkpoint now if one is due */
+    accruing = 0;
+    bank_unlock();
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+
+    log_message(LOG_INFO, "Accrual finished in %ld ms (%d waves): %d interest postings totalling %lld, "
+                          "%d fees totalling %lld",
+                ms, waves, wave_tally.interest_count, wave_tally.interest_total,
+                wave_tally.fee_count, wave_tally.fee_total);
+    printf("Accrual finished in %ld ms: %d interest postings, %d fees\n",
+           ms, wave_tally.interest_count, wave_tally.fee_count);
+
+    if (unsaved)
+    {
+        log_message(LOG_ERROR, "Accrual postings could be neither journaled nor checkpointed");
+        return -1;
+    }
+    return wave_tally.interest_count + wave_tally.fee_count;
+}
+
+/* Whether a run is in progress; compaction must not move accounts under it */
+int accrual_running(void)
+{
+    return accruing;
+}
+
+/* Seconds from now until the next local midnight */
+static time_t until_midnight(void)
+{
+    time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    tm_now.tm_sec = 0;
+    tm_now.tm_min = 0;
+    tm_now.tm_hour = 0;
+    tm_now.tm_mday++;
+    time_t next = mktime(&tm_now);
+    return next > now ? next - now : 1;
+}
+
+/* Scheduler: run at every midnight and whenever SIGUSR1 arrives */
+static void *accrual_scheduler(void *arg)
+{
+    sigset_t *set = arg;
+
+    for (;;)
+    {
+        struct timespec wait = {until_midnight(), 0};
+        int sig = sigtimedwait(set, NULL, &wait);
+        if (sig < 0 && errno != EAGAIN)
+        {
+            continue; /* interrupted */
+        }
+
+        log_message(LOG_INFO, "Accrual triggered by %s", sig == SIGUSR1 ? "SIGUSR1" : "end of day");
+        run_accrual();
+    }
+    return NULL;
+}
+
+/* Start the worker pool and the scheduler. Must be called before any other
+   thread exists, so every thread inherits SIGUSR1 blocked. */
+int accrual_start(void)
+{
+    static sigset_t set;
+    sigset_t quiet, saved;
+    pthread_t tid;
+    int rc = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    /* shutdown signals stay with the main thread */
+    sigemptyset(&quiet);
+    sigaddset(&quiet, SIGINT);
+    sigaddset(&quiet, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quiet, &saved);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_size = cpus < 1 ? 1 : cpus > ACCRUE_MAX_THREADS ? ACCRUE_MAX_THREADS : (int)cpus;
+
+    for (int i = 0; i < pool_size && rc == 0; i++)
+    {
+        if (pthread_create(&tid, NULL, accrual_worker, NULL) != 0)
+        {
+            log_message(LOG_ERROR, "Failed to start accrual worker %d", i);
+            rc = -1;
+        }
+        else
+        {
+            pthread_detach(tid);
+        }
+    }
+
+    if (rc == 0 && pthread_create(&tid, NULL, accrual_scheduler, &set) != 0)
+    {
+        log_message(LOG_ERROR, "Failed to start accrual scheduler");
+        rc = -1;
+    }
+    else if (rc == 0)
+    {
+        pthread_detach(tid);
+        log_message(LOG_INFO, "Accrual scheduled with %d worker threads (SIGUSR1 runs it now)", pool_size);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return rc;
+}
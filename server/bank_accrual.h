@@ -0,0 +1,21 @@
+/*
+ * Banking System - End-of-day interest and fee accrual
+ */
+
+#ifndef BANK_ACCRUAL_H
+#define BANK_ACCRUAL_H
+
+#include "bank_common.h"
+
+#define ACCRUE_RATE_BPS 400      /* SAVINGS interest, basis points a year */
+#define ACCRUE_FEE 5             /* CHECKING daily maintenance fee        */
+#define ACCRUE_FEE_WAIVER 10000  /* CHECKING balance that waives the fee  */
+#define ACCRUE_WAVE 16           /* segments accrued per hold of the bank lock */
+#define ACCRUE_MAX_THREADS 16    /* worker pool ceiling                   */
+
+/* Accrual function prototypes */
+int accrual_start(void);
+int run_accrual(void);
+int accrual_running(void);
+
+#endif /* BANK_ACCRUAL_H */
@@ -0,0 +1,125 @@
+/*
+ * Banking System - Page arena implementation
+ *
+ * A large range of address space is reserved once with PROT_NONE and
+ * chunks are mapped into it on demand. Chunks never move, so pointers into
+ * them stay valid for the life of the process, and only chunks actually
+ * handed out consume memory.
+ *
+ * Once the shared region is up, chunks come from it instead, so every
+ * process of the concurrent server sees the same segments.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "bank_arena.h"
+#include "bank_log.h"
+#include "bank_shm.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static char *base = NULL;     /* start of the reserved range     */
+static size_t reserved = 0;   /* size of the reserved range      */
+static size_t next_off = 0;   /* first unused offset in the range */
+static size_t committed = 0;  /* bytes currently mapped           */
+static int reserve_failed = 0;
+
+/* Round a size up to a whole number of pages */
+static size_t page_round(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Reserve the address range on first use */
+static void arena_reserve(void)
+{
+    void *p = mmap(NULL, ARENA_RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        log_message(LOG_WARNING, "Could not reserve %zu bytes for the arena (%s); using loose mappings",
+                    (size_t)ARENA_RESERVE, strerror(errno));
+        reserve_failed = 1;
+        return;
+    }
+
+    base = p;
+    reserved = ARENA_RESERVE;
+}
+
+/* Map a zeroed chunk of at least size bytes; returns NULL on failure */
+void *arena_alloc(size_t size)
+{
+    if (shm_active())
+    {
+        return shm_pages(size);
+    }
+    if (!base && !reserve_failed)
+    {
+        arena_reserve();
+    }
+
+    size = page_round(size);
+    void *p;
+
+    if (base && next_off + size <= reserved)
+    {
+        p = mmap(base + next_off, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            next_off += size;
+        }
+    }
+    else
+    {
+        /* reservation missing or exhausted: fall back to a standalone mapping */
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (p == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Arena allocation of %zu bytes failed: %s", size, strerror(errno));
+        return NULL;
+    }
+
+    committed += size;
+    return p;
+}
+
+/* Return a chunk's memory to the system; its addresses are not reused */
+void arena_free(void *p, size_t size)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    if (shm_owns(p))
+    {
+        shm_release_pages(p, size);
+        return;
+    }
+
+    size = page_round(size);
+    char *c = p;
+    if (base && c >= base && c < base + reserved)
+    {
+        /* keep the range reserved so nothing else can be mapped there */
+        mmap(c, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    }
+    else
+    {
+        munmap(c, size);
+    }
+    committed -= size;
+}
+
+/* Bytes currently mapped by the arena */
+size_t arena_committed(void)
+{
+    return shm_active() ? shm_committed() : committed;
+}
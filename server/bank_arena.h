@@ -0,0 +1,17 @@
+/*
+ * Banking System - Page arena for long-lived tables
+ */
+
+#ifndef BANK_ARENA_H
+#define BANK_ARENA_H
+
+#include "bank_common.h"
+
+#define ARENA_RESERVE ((size_t)1 << 36) /* virtual address space reserved up front (64 GB) */
+
+/* Arena function prototypes */
+void *arena_alloc(size_t size);
+void arena_free(void *p, size_t size);
+size_t arena_committed(void);
+
+#endif /* BANK_ARENA_H */
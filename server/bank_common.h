@@ -0,0 +1,197 @@
+/*
+ * Banking System - Common definitions shared by all server modules
+ */
+
+#ifndef BANK_COMMON_H
+#define BANK_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdarg.h>
+
+#define MAX_ACCTS (1 << 24)   /* ceiling of the account table    */
+#define MIN_BALANCE 1000      /* Ksh. minimum account balance    */
+#define MIN_DEPOSIT 500       /* Ksh. minimum single deposit     */
+#define MIN_WITHDRAW 500      /* Ksh. minimum withdrawal unit    */
+#define TRANS_KEEP 5          /* recent transactions cached      */
+#define STMT_PAGE 20          /* most transactions per statement */
+#define HOLDINGS_LISTED 10    /* most accounts in one listing    */
+#define BATCH_MAX 4096        /* most operations per BATCH frame */
+#define REPORT_BINS 16        /* buckets in the balance histogram */
+#define REPORT_TOP 10         /* most balances in a top-N report  */
+#define REPORT_BIN_BASE 1024  /* upper edge of the first bucket   */
+#define DATA_FILE "bank.json" /* JSON import/export file name    */
+#define PACKED_DATA_FILE "bank.json.lz" /* compressed JSON, read if DATA_FILE is missing */
+#define SNAP_FILE "bank.snap" /* binary snapshot file name       */
+#define RECORD_FILE "bank.dat" /* fixed-record data file name    */
+#define JOURNAL_FILE "bank.journal" /* write-ahead journal file name */
+#define LOCK_FILE "bank.lock" /* held by the one process that owns the data */
+#define CURRENT_VERSION 2     /* current data format version     */
+#define LOG_FILE "bank.log"   /* log file name                   */
+#define SHORT_WAIT 1          /* short wait in seconds           */
+#define MEDIUM_WAIT 2         /* medium wait in seconds          */
+#define DEFAULT_PORT 8888     /* default server port             */
+#define BUFFER_SIZE 1024      /* socket buffer size              */
+
+/* Log levels */
+typedef enum
+{
+    LOG_INFO = 0,
+    LOG_WARNING = 1,
+    LOG_ERROR = 2
+} log_level_t;
+
+/* Message commands between client and server */
+typedef enum
+{
+    OPEN = 1,      /* Open an account               */
+    CLOSE = 2,     /* Close an account              */
+    DEPOSIT = 3,   /* Deposit money                 */
+    WITHDRAW = 4,  /* Withdraw money                */
+    BALANCE = 5,   /* Check balance                 */
+    STATEMENT = 6, /* Get transaction statement     */
+    ACCOUNTS = 7,  /* List the customer's accounts  */
+    BATCH = 8,     /* Apply several postings at once */
+    TRANSFER = 9,  /* Move money between accounts   */
+    REPORT = 10,   /* Bank-wide balance report      */
+    STATS = 11,    /* Persistence counters          */
+    QUIT = 0       /* Quit                          */
+} command_t;
+
+/* Server response codes */
+typedef enum
+{
+    STATUS_OK = 0,       /* Operation successful          */
+    STATUS_ERROR = -1,   /* General error                 */
+    STATUS_MIN_AMT = -2, /* Below minimum amount          */
+    STATUS_INVALID = -3  /* Invalid parameters            */
+} status_t;
+
+typedef enum
+{
+    SAVINGS = 1,
+    CHECKING = 2
+} acct_type_t;
+
+typedef struct
+{
+    char type;         /* 'D' deposit, 'W' withdraw, 'T'/'R' transfer out/in, 'I' interest, 'F' fee */
+    int amount;        /* amount of the transaction           */
+    time_t when;       /* time of transaction                 */
+    int balance_after; /* balance after posting               */
+} transaction_t;
+
+typedef struct
+{
+    int number; /* automatically generated  */
+    int pin;    /* generated 4-digit pin     */
+    char name[40];
+    char nat_id[20];
+    acct_type_t type;
+    int balance; /* balance in Ksh.          */
+
+    transaction_t last[TRANS_KEEP]; /* ring buffer of last 5    */
+    int ntran;                      /* total number ever done   */
+} account_t;
+
+/* One account in a customer's listing */
+typedef struct
+{
+    int number;
+    acct_type_t type;
+    int balance;
+} holding_t;
+
+/* Bank-wide balance report; bucket k holds balances below REPORT_BIN_BASE << k
+   and at or above the previous bucket's edge, the last bucket is unbounded */
+typedef struct
+{
+    long long total;           /* sum of all balances                 */
+    int accounts;              /* live accounts scanned               */
+    int threshold;             /* MIN_BALANCE + the requested margin  */
+    int under;                 /* accounts below threshold            */
+    int hist[REPORT_BINS];     /* balance histogram                   */
+    int top_count;             /* entries used in top                 */
+    holding_t top[REPORT_TOP]; /* largest balances, descending        */
+    int elapsed_us;            /* time spent scanning                 */
+    char engine[8];            /* kernel that ran: avx2, sse2, scalar */
+} report_t;
+
+/* Group commit and checkpoint counters */
+typedef struct
+{
+    long long commits;        /* fdatasync calls made                */
+    long long records_synced; /* journal records they made durable   */
+    long long waits;          /* replies held for durability         */
+    long long wait_us_total;  /* time those replies were held        */
+    long long journal_bytes;  /* current journal size                */
+    long long checkpoints;    /* snapshots written since start       */
+    long long snapshots_forked; /* of those, written by a forked child */
+    int commit_window_us;     /* longest a write waits for its sync  */
+    int commit_bytes;         /* unsynced bytes that force a sync    */
+    int last_sync_us;         /* duration of the latest fdatasync    */
+    int max_group;            /* most records made durable by one sync */
+    int last_snapshot_ms;     /* duration of the latest background snapshot */
+    int snapshot_running;     /* a background snapshot is being written */
+    long long archived_bytes; /* journal bytes moved to the archive  */
+    long long archive_packed; /* what they took there, compressed    */
+    long long archive_us;     /* time spent packing them             */
+} stats_t;
+
+/* One posting inside a BATCH frame */
+typedef struct
+{
+    command_t command; /* DEPOSIT or WITHDRAW */
+    int account_number;
+    int pin;
+    int amount;
+} batch_op_t;
+
+/* A structure for client request messages */
+typedef struct
+{
+    command_t command;
+    int account_number;
+    int pin;
+    int amount; /* BATCH: records that follow; REPORT: margin over MIN_BALANCE */
+    acct_type_t account_type;
+    char name[40];
+    char nat_id[20];
+    int offset; /* STATEMENT: first entry of the page, 0 = oldest */
+    int limit;  /* STATEMENT: page size, 0 = latest TRANS_KEEP; REPORT: top N */
+    int to_account; /* TRANSFER: account credited                */
+} request_t;
+
+/* A structure for server response messages */
+typedef struct
+{
+    status_t status;
+    int account_number;
+    int pin;
+    int balance;
+    char message[256];
+    int transaction_count;
+    transaction_t transactions[STMT_PAGE];
+    int transaction_total; /* entries in the account's full history */
+    int holding_count;     /* ACCOUNTS: accounts held by the customer */
+    holding_t holdings[HOLDINGS_LISTED];
+    long long total_holdings; /* ACCOUNTS: sum of their balances     */
+    report_t report;          /* REPORT: bank-wide figures           */
+    stats_t stats;            /* STATS: persistence counters         */
+} response_t;
+
+/* Bank-wide counters, behind a pointer so the concurrent server can move
+   them into shared memory */
+typedef struct
+{
+    int accounts_in_use;
+    int next_number;
+} bank_totals_t;
+
+/* Global variables (defined in bank_persistence.c) */
+extern bank_totals_t *bank_totals;
+extern FILE *log_file;
+
+#endif /* BANK_COMMON_H */
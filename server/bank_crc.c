@@ -0,0 +1,127 @@
+/*
+ * Banking System - CRC32C checksums
+ *
+ * CRC32C (the Castagnoli polynomial) guards journal records, account
+ * records and packed blocks. On x86 with SSE4.2 the crc32 instruction does
+ * eight bytes per step; elsewhere a slicing-by-8 table does the same work
+ * eight bytes per lookup round. Both give the same value, so files move
+ * freely between machines. The kernel is picked once, on first use.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_crc.h"
+#include "bank_log.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78U /* Castagnoli polynomial, bit reversed */
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t n);
+
+static uint32_t crc_table[8][256];
+static crc_fn crc_kernel = NULL;
+static const char *crc_name = "table";
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8 kernel: eight table lookups fold in eight bytes */
+static uint32_t crc_sliced(uint32_t crc, const unsigned char *p, size_t n)
+{
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    for (; n > 0; n--)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+
+/* SSE4.2 kernel: the crc32 instruction, eight bytes at a time */
+__attribute__((target("sse4.2"))) static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; n > 0; n--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+
+#endif /* CRC_X86 */
+
+/* Build the tables and pick the fastest kernel this CPU runs */
+static void crc_init(void)
+{
+    for (unsigned i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (unsigned i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xff] ^ (crc_table[t - 1][i] >> 8);
+        }
+    }
+
+    crc_kernel = crc_sliced;
+#ifdef CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc_kernel = crc_sse42;
+        crc_name = "sse4.2";
+    }
+#endif
+    log_message(LOG_INFO, "Checksum engine: %s CRC32C", crc_name);
+}
+
+/* Extend the CRC32C of earlier bytes, crc, over n more; start from 0 */
+unsigned crc32c(unsigned crc, const void *p, size_t n)
+{
+    pthread_once(&crc_once, crc_init);
+    return ~crc_kernel(~(uint32_t)crc, p, n);
+}
+
+/* Name of the kernel checksums run on */
+const char *crc32c_engine(void)
+{
+    pthread_once(&crc_once, crc_init);
+    return crc_name;
+}
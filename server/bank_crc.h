@@ -0,0 +1,14 @@
+/*
+ * Banking System - CRC32C checksums
+ */
+
+#ifndef BANK_CRC_H
+#define BANK_CRC_H
+
+#include "bank_common.h"
+
+/* Checksum function prototypes */
+unsigned crc32c(unsigned crc, const void *p, size_t n);
+const char *crc32c_engine(void);
+
+#endif /* BANK_CRC_H */
@@ -0,0 +1,394 @@
+/*
+ * Banking System - Transaction history implementation
+ *
+ * Every posting is appended to a per-account chain of fixed-size chunks
+ * drawn from a shared pool. The pool grows a segment at a time from the
+ * arena and recycles chunks of closed accounts through a free list, so an
+ * account's history is bounded only by memory. The last[] ring in the
+ * account's cold data stays as a cache of the most recent entries.
+ *
+ * Chunk ids are 1-based so a zeroed account has no chain. Every chunk that
+ * changes is marked dirty so the record file writes only those.
+ */
+
+#include "bank_history.h"
+#include "bank_store.h"
+#include "bank_arena.h"
+#include "bank_log.h"
+#include "bank_shm.h"
+#include <pthread.h>
+
+typedef struct
+{
+    int next;  /* id of the following chunk, 0 at the end of a chain */
+    int count; /* entries used in this chunk                         */
+    transaction_t entries[HIST_CHUNK];
+} hist_chunk_t;
+
+/* Pool state, behind a pointer so history_share() can move it into shared memory */
+typedef struct
+{
+    hist_chunk_t *segs[HIST_MAX_SEGS];
+    int chunks;         /* chunks mapped so far            */
+    int next;           /* next never-used chunk id        */
+    int free_chunks;    /* head of the recycled chunk list */
+    size_t in_use;
+    unsigned char *chunk_dirty[HIST_MAX_SEGS]; /* one byte per chunk changed since the last flush */
+    unsigned char seg_dirty[HIST_MAX_SEGS];    /* pool segments with any chunk changed */
+
+    /* Guards the pool and free list; accounts' own chains are touched only by
+       whoever owns the account, so appends to different accounts run in parallel */
+    pthread_mutex_t mutex;
+} hist_pool_t;
+
+static hist_pool_t local_pool = {.next = 1, .mutex = PTHREAD_MUTEX_INITIALIZER};
+static hist_pool_t *pool = &local_pool;
+
+/* Address of a chunk by id */
+static hist_chunk_t *chunk_at(int id)
+{
+    int i = id - 1;
+    return &pool->segs[i / HIST_SEG_CHUNKS][i % HIST_SEG_CHUNKS];
+}
+
+/* Note that a chunk changed */
+static void chunk_touch(int id)
+{
+    int i = id - 1;
+    pool->chunk_dirty[i / HIST_SEG_CHUNKS][i % HIST_SEG_CHUNKS] = 1;
+    pool->seg_dirty[i / HIST_SEG_CHUNKS] = 1;
+}
+
+/* Take an empty chunk from the free list or the pool */
+static int chunk_alloc(void)
+{
+    int id;
+
+    shm_lock(&pool->mutex);
+    if (pool->free_chunks)
+    {
+        id = pool->free_chunks;
+        pool->free_chunks = chunk_at(id)->next;
+    }
+    else
+    {
+        if (pool->next > pool->chunks)
+        {
+            int seg = pool->chunks / HIST_SEG_CHUNKS;
+            if (seg >= HIST_MAX_SEGS)
+            {
+                pthread_mutex_unlock(&pool->mutex);
+                log_message(LOG_ERROR, "Transaction history pool exhausted");
+                return 0;
+            }
+
+            hist_chunk_t *chunks = arena_alloc(HIST_SEG_CHUNKS * sizeof(hist_chunk_t));
+            unsigned char *dirty = shm_calloc(HIST_SEG_CHUNKS, 1);
+            if (!chunks || !dirty)
+            {
+                pthread_mutex_unlock(&pool->mutex);
+                log_message(LOG_ERROR, "Failed to map history pool segment %d", seg);
+                arena_free(chunks, HIST_SEG_CHUNKS * sizeof(hist_chunk_t));
+                shm_free(dirty);
+                return 0;
+            }
+            pool->segs[seg] = chunks;
+            pool->chunk_dirty[seg] = dirty;
+            pool->chunks += HIST_SEG_CHUNKS;
+        }
+        id = pool->next++;
+    }
+    pool->in_use++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    hist_chunk_t *c = chunk_at(id);
+    c->next = 0;
+    c->count = 0;
+    chunk_touch(id);
+    return id;
+}
+
+/* Append a transaction to the end of an account's history */
+int history_append(int slot, const transaction_t *t)
+{
+    acct_cold_t *a = acct_cold(slot);
+    hist_chunk_t *tail = a->hist_tail ? chunk_at(a->hist_tail) : NULL;
+
+    if (!tail || tail->count == HIST_CHUNK)
+    {
+        int id = chunk_alloc();
+        if (!id)
+        {
+            return -1;
+        }
+
+        if (tail)
+        {
+            tail->next = id;
+            chunk_touch(a->hist_tail);
+        }
+        else
+        {
+            a->hist_head = id;
+        }
+        a->hist_tail = id;
+        tail = chunk_at(id);
+    }
+
+    tail->entries[tail->count++] = *t;
+    a->hist_count++;
+    chunk_touch(a->hist_tail);
+    return 0;
+}
+
+/* Copy up to limit entries starting at offset (0 = oldest) into out.
+   Returns the number of entries copied. */
+int history_read(int slot, int offset, int limit, transaction_t *out)
+{
+    const acct_cold_t *a = acct_cold(slot);
+    int copied = 0;
+
+    if (offset < 0 || offset >= a->hist_count || limit <= 0)
+    {
+        return 0;
+    }
+
+    /* whole chunks before the offset are skipped by following links only */
+    int id = a->hist_head;
+    while (id && offset >= HIST_CHUNK)
+    {
+        id = chunk_at(id)->next;
+        offset -= HIST_CHUNK;
+    }
+
+    while (id && copied < limit)
+    {
+        const hist_chunk_t *c = chunk_at(id);
+        int n = c->count - offset;
+        if (n > limit - copied)
+        {
+            n = limit - copied;
+        }
+
+        memcpy(&out[copied], &c->entries[offset], n * sizeof(transaction_t));
+        copied += n;
+        offset = 0;
+        id = c->next;
+    }
+
+    return copied;
+}
+
+/* Walk an account's chain and check it against the account's counters;
+   returns the chunks in it, or -1 when the chain is broken */
+int history_check(int slot)
+{
+    const acct_cold_t *a = acct_cold(slot);
+    int most = (a->hist_count + HIST_CHUNK - 1) / HIST_CHUNK;
+    int id = a->hist_head, last = 0, chunks = 0, entries = 0;
+
+    while (id)
+    {
+        if (id < 0 || id >= pool->next || chunks == most)
+        {
+            return -1; /* points outside the pool, or loops */
+        }
+        const hist_chunk_t *c = chunk_at(id);
+        if (c->count <= 0 || c->count > HIST_CHUNK)
+        {
+            return -1;
+        }
+        entries += c->count;
+        chunks++;
+        last = id;
+        id = c->next;
+    }
+    return entries == a->hist_count && last == a->hist_tail ? chunks : -1;
+}
+
+/* Number of entries held for an account */
+int history_count(int slot)
+{
+    return acct_cold(slot)->hist_count;
+}
+
+/* Give an account's whole chain back to the pool */
+void history_release(int slot)
+{
+    acct_cold_t *a = acct_cold(slot);
+    if (!a->hist_head)
+    {
+        return;
+    }
+
+    shm_lock(&pool->mutex);
+
+    /* every chunk of a chain holds at least one entry */
+    pool->in_use -= (a->hist_count + HIST_CHUNK - 1) / HIST_CHUNK;
+
+    /* splice the chain onto the free list in one step */
+    chunk_at(a->hist_tail)->next = pool->free_chunks;
+    pool->free_chunks = a->hist_head;
+    chunk_touch(a->hist_tail);
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    a->hist_head = 0;
+    a->hist_tail = 0;
+    a->hist_count = 0;
+}
+
+/* Number of chunks currently holding history */
+size_t history_chunks_in_use(void)
+{
+    return pool->in_use;
+}
+
+/* Bytes of one pool segment */
+size_t history_segment_bytes(void)
+{
+    return HIST_SEG_CHUNKS * sizeof(hist_chunk_t);
+}
+
+/* Bytes at the start of a pool segment that were ever handed out */
+size_t history_used_bytes(int seg)
+{
+    long long used = (long long)(pool->next - 1) - (long long)seg * HIST_SEG_CHUNKS;
+    used = used < 0 ? 0 : used > HIST_SEG_CHUNKS ? HIST_SEG_CHUNKS : used;
+    return (size_t)used * sizeof(hist_chunk_t);
+}
+
+/* Pool segments holding chunks that were ever handed out */
+int history_segments(void)
+{
+    return (pool->next - 1 + HIST_SEG_CHUNKS - 1) / HIST_SEG_CHUNKS;
+}
+
+/* Start of a pool segment */
+const void *history_segment(int seg)
+{
+    return pool->segs[seg];
+}
+
+/* Allocator state a snapshot must carry to adopt the pool later */
+void history_state(int *next, int *free_head, long long *in_use)
+{
+    *next = pool->next;
+    *free_head = pool->free_chunks;
+    *in_use = (long long)pool->in_use;
+}
+
+/* Adopt one already filled pool segment; call before any append */
+int history_attach_segment(int seg, char *chunks)
+{
+    /* a private file mapping is invisible to other processes: copy it */
+    if (shm_active())
+    {
+        hist_chunk_t *copy = arena_alloc(HIST_SEG_CHUNKS * sizeof(hist_chunk_t));
+        if (!copy)
+        {
+            log_message(LOG_ERROR, "Failed to map history pool segment %d", seg);
+            return -1;
+        }
+        memcpy(copy, chunks, HIST_SEG_CHUNKS * sizeof(hist_chunk_t));
+        chunks = (char *)copy;
+    }
+
+    pool->segs[seg] = (hist_chunk_t *)chunks;
+    pool->chunk_dirty[seg] = shm_calloc(HIST_SEG_CHUNKS, 1);
+    if (!pool->chunk_dirty[seg])
+    {
+        log_message(LOG_ERROR, "Failed to track history pool segment %d", seg);
+        return -1;
+    }
+    return 0;
+}
+
+/* Take over the allocator state that goes with segs attached segments */
+void history_adopt(int segs, int next, int free_head, long long in_use)
+{
+    pool->chunks = segs * HIST_SEG_CHUNKS;
+    pool->next = next;
+    pool->free_chunks = free_head;
+    pool->in_use = (size_t)in_use;
+}
+
+/* Adopt an already filled pool laid out stride bytes per segment */
+int history_attach(int segs, char *base, size_t stride, int next, int free_head, long long in_use)
+{
+    for (int seg = 0; seg < segs; seg++)
+    {
+        if (history_attach_segment(seg, base + (size_t)seg * stride) < 0)
+        {
+            return -1;
+        }
+    }
+    history_adopt(segs, next, free_head, in_use);
+    return 0;
+}
+
+/* Bytes of one chunk as stored */
+size_t history_chunk_bytes(void)
+{
+    return sizeof(hist_chunk_t);
+}
+
+/* A chunk's bytes by id */
+const void *history_chunk(int id)
+{
+    return chunk_at(id);
+}
+
+/* Take the first dirty chunk above after (0 to start), clearing its mark;
+   0 once none are left */
+int history_next_dirty(int after)
+{
+    int i = after; /* zero-based index of the chunk after "after" */
+
+    while (i < pool->next - 1)
+    {
+        int seg = i / HIST_SEG_CHUNKS;
+        if (!pool->seg_dirty[seg])
+        {
+            i = (seg + 1) * HIST_SEG_CHUNKS;
+            continue;
+        }
+
+        unsigned char *map = pool->chunk_dirty[seg];
+        unsigned char *hit = memchr(map + i % HIST_SEG_CHUNKS, 1, HIST_SEG_CHUNKS - i % HIST_SEG_CHUNKS);
+        if (hit)
+        {
+            *hit = 0;
+            return seg * HIST_SEG_CHUNKS + (int)(hit - map) + 1;
+        }
+
+        pool->seg_dirty[seg] = 0;
+        i = (seg + 1) * HIST_SEG_CHUNKS;
+    }
+    return 0;
+}
+
+/* Forget every dirty mark, after the whole pool was written out */
+void history_clear_dirty(void)
+{
+    for (int seg = 0; seg < pool->chunks / HIST_SEG_CHUNKS; seg++)
+    {
+        if (pool->seg_dirty[seg])
+        {
+            memset(pool->chunk_dirty[seg], 0, HIST_SEG_CHUNKS);
+            pool->seg_dirty[seg] = 0;
+        }
+    }
+}
+
+/* Move the pool state into shared memory; segments already live there */
+int history_share(void)
+{
+    hist_pool_t *shared = shm_share(pool, sizeof(hist_pool_t));
+    if (!shared || shm_mutex_init(&shared->mutex) != 0)
+    {
+        return -1;
+    }
+    pool = shared;
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Banking System - Unbounded per-account transaction history
+ */
+
+#ifndef BANK_HISTORY_H
+#define BANK_HISTORY_H
+
+#include "bank_common.h"
+
+#define HIST_CHUNK 32          /* transactions per history chunk  */
+#define HIST_SEG_CHUNKS 4096   /* chunks mapped at a time         */
+#define HIST_MAX_SEGS 16384    /* pool segment directory size     */
+
+/* History function prototypes */
+int history_append(int slot, const transaction_t *t);
+int history_read(int slot, int offset, int limit, transaction_t *out);
+int history_count(int slot);
+int history_check(int slot);
+void history_release(int slot);
+size_t history_chunks_in_use(void);
+
+/* Snapshot support: the pool is written and mapped back segment by segment */
+size_t history_segment_bytes(void);
+size_t history_used_bytes(int seg);
+int history_segments(void);
+const void *history_segment(int seg);
+void history_state(int *next, int *free_head, long long *in_use);
+int history_attach(int segs, char *base, size_t stride, int next, int free_head, long long in_use);
+int history_attach_segment(int seg, char *chunks);
+void history_adopt(int segs, int next, int free_head, long long in_use);
+
+/* Record file support: chunks that changed since the last flush */
+size_t history_chunk_bytes(void);
+const void *history_chunk(int id);
+int history_next_dirty(int after);
+void history_clear_dirty(void);
+int history_share(void);
+
+#endif /* BANK_HISTORY_H */
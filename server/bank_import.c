@@ -0,0 +1,584 @@
+/*
+ * Banking System - Bulk account import from CSV
+ *
+ * bank_server --import FILE opens one account per row of a CSV file with
+ * the columns name, nat_id, type and opening balance. It does not go
+ * through open_account(), which journals and commits every account on
+ * its own. The file is mapped and cut into chunks at line ends. Threads
+ * parse and check their chunks and draw PINs in parallel. The accepted
+ * rows are then entered on one thread in file order, taking account
+ * numbers from one contiguous range, and a single checkpoint writes the
+ * whole import, so a crash part way leaves the bank as it was.
+ *
+ * A type is 1, 2, savings or checking. Quoted fields may hold commas and
+ * doubled quotes, but not line breaks. A first row starting with "name"
+ * is a header and is skipped. The numbers and PINs issued go to
+ * FILE.accounts, a new file only its owner may read; rejected rows go to
+ * FILE.rejected with their reason. The caller holds the data directory
+ * lock, so no server runs meanwhile.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_import.h"
+#include "bank_account.h"
+#include "bank_persistence.h"
+#include "bank_history.h"
+#include "bank_index.h"
+#include "bank_store.h"
+#include "bank_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* One row that passed its checks */
+typedef struct
+{
+    int line;
+    int pin;
+    acct_type_t type;
+    int balance;
+    char name[40];
+    char nat_id[20];
+} import_row_t;
+
+/* One row left out, and why */
+typedef struct
+{
+    int line;
+    char reason[64];
+} import_reject_t;
+
+/* A chunk of the file and what its thread made of it */
+typedef struct
+{
+    const char *p;
+    const char *end;
+    int header;     /* the chunk starts the file */
+    unsigned seed;  /* PINs */
+    int lines;
+    import_row_t *rows;
+    int nrows;
+    int cap_rows;
+    import_reject_t *rejects;
+    int nrejects;
+    int cap_rejects;
+    int rc;
+} import_chunk_t;
+
+/* Grow an array of items of size bytes to hold one more; -1 when out of memory */
+static int grow(void **items, int count, int *cap, size_t size)
+{
+    if (count < *cap)
+    {
+        return 0;
+    }
+    int want = *cap ? *cap * 2 : 1024;
+    void *grown = realloc(*items, (size_t)want * size);
+    if (!grown)
+    {
+        return -1;
+    }
+    *items = grown;
+    *cap = want;
+    return 0;
+}
+
+/* Note a rejected row */
+static int reject(import_reject_t **list, int *count, int *cap, int line, const char *reason)
+{
+    if (grow((void **)list, *count, cap, sizeof(import_reject_t)) < 0)
+    {
+        return -1;
+    }
+    import_reject_t *r = &(*list)[(*count)++];
+    r->line = line;
+    snprintf(r->reason, sizeof(r->reason), "%s", reason);
+    return 0;
+}
+
+/* Copy one field into out, at most size - 1 bytes, and step past its comma.
+   Returns the field length, which may exceed what was copied, or -1 for a
+   quote that is never closed. */
+static int next_field(const char **pp, const char *end, char *out, size_t size)
+{
+    const char *p = *pp;
+    size_t len = 0;
+
+    while (p < end && *p == ' ')
+    {
+        p++;
+    }
+    if (p < end && *p == '"')
+    {
+        for (p++;; p++)
+        {
+            if (p == end)
+            {
+                return -1;
+            }
+            if (*p == '"' && (p + 1 == end || p[1] != '"'))
+            {
+                p++;
+                break;
+            }
+            if (*p == '"')
+            {
+                p++; /* a doubled quote stands for one */
+            }
+            if (len + 1 < size)
+            {
+                out[len] = *p;
+            }
+            len++;
+        }
+        while (p < end && *p == ' ')
+        {
+            p++;
+        }
+    }
+    else
+    {
+        const char *start = p;
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+        const char *stop = p;
+        while (stop > start && stop[-1] == ' ')
+        {
+            stop--;
+        }
+        len = (size_t)(stop - start);
+        memcpy(out, start, len < size ? len : size - 1);
+    }
+
+    out[len < size ? len : size - 1] = '\0';
+    *pp = p < end && *p == ',' ? p + 1 : p;
+    return (int)len;
+}
+
+/* Parse and check one line; fills reason when it is rejected */
+static int parse_row(const char *p, const char *end, import_row_t *row, char *reason, size_t size)
+{
+    char type[16], balance[16];
+    int len[4];
+    char *out[4] = {row->name, row->nat_id, type, balance};
+    size_t cap[4] = {sizeof(row->name), sizeof(row->nat_id), sizeof(type), sizeof(balance)};
+
+    if (end > p && end[-1] == '\r')
+    {
+        end--;
+    }
+    for (int f = 0; f < 4; f++)
+    {
+        if (f > 0 && (p == end || p[-1] != ','))
+        {
+            snprintf(reason, size, "expected 4 fields, found %d", f);
+            return -1;
+        }
+        if ((len[f] = next_field(&p, end, out[f], cap[f])) < 0)
+        {
+            snprintf(reason, size, "unterminated quote");
+            return -1;
+        }
+    }
+    if (p != end)
+    {
+        snprintf(reason, size, "more than 4 fields");
+        return -1;
+    }
+
+    if (len[0] == 0 || len[0] >= (int)sizeof(row->name))
+    {
+        snprintf(reason, size, "name must be 1 to %d characters", (int)sizeof(row->name) - 1);
+        return -1;
+    }
+    if (len[1] == 0 || len[1] >= (int)sizeof(row->nat_id))
+    {
+        snprintf(reason, size, "nat_id must be 1 to %d characters", (int)sizeof(row->nat_id) - 1);
+        return -1;
+    }
+
+    if (strcmp(type, "1") == 0 || strcasecmp(type, "savings") == 0)
+    {
+        row->type = SAVINGS;
+    }
+    else if (strcmp(type, "2") == 0 || strcasecmp(type, "checking") == 0)
+    {
+        row->type = CHECKING;
+    }
+    else
+    {
+        snprintf(reason, size, "unknown account type '%s'", type);
+        return -1;
+    }
+
+    char *stop;
+    errno = 0;
+    long amount = len[3] < (int)sizeof(balance) ? strtol(balance, &stop, 10) : -1;
+    if (len[3] == 0 || len[3] >= (int)sizeof(balance) || *stop != '\0' || errno != 0 ||
+        amount < MIN_BALANCE || amount > INT_MAX)
+    {
+        snprintf(reason, size, "opening balance must be a whole number from %d", MIN_BALANCE);
+        return -1;
+    }
+    row->balance = (int)amount;
+    return 0;
+}
+
+/* Whether a line holds nothing but blanks */
+static int blank_line(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\r' || *p == '\t'))
+    {
+        p++;
+    }
+    return p == end;
+}
+
+/* Parse one chunk; runs on its own thread */
+static void *parse_chunk(void *arg)
+{
+    import_chunk_t *c = arg;
+    const char *p = c->p;
+    char reason[64];
+
+    c->rc = 0;
+    while (p < c->end && c->rc == 0)
+    {
+        const char *eol = memchr(p, '\n', (size_t)(c->end - p));
+        const char *next = eol ? eol + 1 : c->end;
+        eol = eol ? eol : c->end;
+        c->lines++;
+
+        if (blank_line(p, eol) || (c->header && c->lines == 1 && eol - p >= 4 && strncasecmp(p, "name", 4) == 0))
+        {
+            p = next;
+            continue;
+        }
+
+        import_row_t row;
+        if (parse_row(p, eol, &row, reason, sizeof(reason)) == 0)
+        {
+            if (grow((void **)&c->rows, c->nrows, &c->cap_rows, sizeof(import_row_t)) < 0)
+            {
+                c->rc = -1;
+                break;
+            }
+            row.line = c->lines;
+            row.pin = 1000 + rand_r(&c->seed) % 9000; /* random 4-digit pin */
+            c->rows[c->nrows++] = row;
+        }
+        else if (reject(&c->rejects, &c->nrejects, &c->cap_rejects, c->lines, reason) < 0)
+        {
+            c->rc = -1;
+        }
+        p = next;
+    }
+    return NULL;
+}
+
+/* Chunks to cut the file into: one per core unless BANK_IMPORT_THREADS
+   says otherwise, and none smaller than IMPORT_MIN_CHUNK */
+static int chunk_count(size_t size)
+{
+    const char *env = getenv("BANK_IMPORT_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    long most = (long)(size / IMPORT_MIN_CHUNK) + 1;
+
+    n = n < 1 ? 1 : n > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : n;
+    return (int)(n < most ? n : most);
+}
+
+/* Write a CSV field, quoted when it needs to be */
+static void put_field(FILE *f, const char *s)
+{
+    if (!strpbrk(s, ",\""))
+    {
+        fputs(s, f);
+        return;
+    }
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"')
+        {
+            fputc('"', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* Open an account for an accepted row; 0 when opened, else the reason */
+static int enter_row(const import_row_t *row, time_t now, FILE *out, char *reason, size_t size)
+{
+    if (bank_totals->accounts_in_use >= MAX_ACCTS)
+    {
+        snprintf(reason, size, "account table full");
+        return -1;
+    }
+    int slot = store_alloc();
+    if (slot < 0)
+    {
+        snprintf(reason, size, "failed to grow account table");
+        return -1;
+    }
+
+    account_t a;
+    memset(&a, 0, sizeof(a));
+    a.number = bank_totals->next_number;
+    a.pin = row->pin;
+    a.type = row->type;
+    a.balance = row->balance;
+    memcpy(a.name, row->name, sizeof(a.name));
+    memcpy(a.nat_id, row->nat_id, sizeof(a.nat_id));
+
+    if (index_insert(a.number, slot) < 0)
+    {
+        store_release(slot);
+        snprintf(reason, size, "failed to index account");
+        return -1;
+    }
+    store_put(slot, &a);
+    if (customer_add(a.nat_id, slot) < 0)
+    {
+        index_remove(a.number);
+        store_release(slot);
+        snprintf(reason, size, "failed to index customer");
+        return -1;
+    }
+
+    /* the opening balance goes down as a deposit, as with open_account() */
+    transaction_t t;
+    t.type = 'D';
+    t.amount = row->balance;
+    t.when = now;
+    t.balance_after = row->balance;
+    post_transaction(slot, &t);
+
+    bank_totals->next_number++;
+    bank_totals->accounts_in_use++;
+
+    fprintf(out, "%d,%d,%04d,", row->line, a.number, a.pin);
+    put_field(out, a.name);
+    fputc(',', out);
+    put_field(out, a.nat_id);
+    fputc('\n', out);
+    return 0;
+}
+
+/* Order rejected rows by line */
+static int by_line(const void *a, const void *b)
+{
+    return ((const import_reject_t *)a)->line - ((const import_reject_t *)b)->line;
+}
+
+/* Import every row of a CSV file and save the bank once */
+int import_csv(const char *path)
+{
+    import_chunk_t chunks[IMPORT_MAX_THREADS];
+    pthread_t tids[IMPORT_MAX_THREADS];
+    int started[IMPORT_MAX_THREADS] = {0};
+    char out_path[300], bad_path[300], reason[64];
+    struct timespec t0, t1;
+    struct stat st;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to open import file %s: %s", path, strerror(errno));
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *text = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Failed to map import file %s: %s", path, strerror(errno));
+        perror(path);
+        return -1;
+    }
+
+    /* cut the file into chunks that start right after a line end */
+    int n = chunk_count(size);
+    const char *from = text;
+    for (int i = 0; i < n; i++)
+    {
+        const char *to = i == n - 1 ? text + size : text + size * (i + 1) / n;
+        if (to < from)
+        {
+            to = from;
+        }
+        const char *eol = to < text + size ? memchr(to, '\n', (size_t)(text + size - to)) : NULL;
+        to = i == n - 1 || !eol ? text + size : eol + 1;
+
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].p = from;
+        chunks[i].end = to;
+        chunks[i].header = i == 0;
+        chunks[i].seed = (unsigned)time(NULL) ^ (unsigned)getpid() * 2654435761u ^ (unsigned)i * 40503u;
+        from = to;
+    }
+
+    for (int i = 1; i < n; i++)
+    {
+        started[i] = pthread_create(&tids[i], NULL, parse_chunk, &chunks[i]) == 0;
+    }
+    parse_chunk(&chunks[0]);
+    for (int i = 1; i < n; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(tids[i], NULL);
+        }
+        else
+        {
+            parse_chunk(&chunks[i]); /* no thread to be had; do it here */
+        }
+    }
+
+    /* line numbers were counted per chunk; make them count from the file start */
+    int rc = 0, rows = 0, first_line = 0;
+    import_reject_t *rejects = NULL;
+    int nrejects = 0, cap_rejects = 0;
+    for (int i = 0; i < n; i++)
+    {
+        import_chunk_t *c = &chunks[i];
+        rc |= c->rc;
+        for (int k = 0; k < c->nrows; k++)
+        {
+            c->rows[k].line += first_line;
+        }
+        for (int k = 0; k < c->nrejects && rc == 0; k++)
+        {
+            rc = reject(&rejects, &nrejects, &cap_rejects, c->rejects[k].line + first_line, c->rejects[k].reason);
+        }
+        first_line += c->lines;
+        rows += c->nrows + c->nrejects;
+        free(c->rejects);
+    }
+    if (size > 0)
+    {
+        munmap((void *)text, size);
+    }
+
+    snprintf(out_path, sizeof(out_path), "%s.accounts", path);
+    snprintf(bad_path, sizeof(bad_path), "%s.rejected", path);
+
+    /* the PINs are for the account holders alone; never reuse a file */
+    int out_fd = rc == 0 ? open(out_path, O_WRONLY | O_CREAT | O_EXCL, 0600) : -1;
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    int err = errno;
+    if (!out)
+    {
+        log_message(LOG_ERROR, "Import of %s failed: %s: %s", path, out_path, rc == 0 ? strerror(err) : "out of memory");
+        fprintf(stderr, "Import of %s failed%s.\n", path,
+                rc == 0 && err == EEXIST ? ": an earlier import's accounts file is in the way" : "");
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+            unlink(out_path);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            free(chunks[i].rows);
+        }
+        free(rejects);
+        return -1;
+    }
+    fprintf(out, "line,number,pin,name,nat_id\n");
+
+    /* enter the accepted rows in file order; numbers follow on from the bank's */
+    int first_number = bank_totals->next_number;
+    int opened = 0;
+    time_t now = time(NULL);
+    store_reserve(bank_slots + rows < MAX_ACCTS ? bank_slots + rows : MAX_ACCTS);
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < chunks[i].nrows && rc == 0; k++)
+        {
+            if (enter_row(&chunks[i].rows[k], now, out, reason, sizeof(reason)) == 0)
+            {
+                opened++;
+            }
+            else
+            {
+                rc = reject(&rejects, &nrejects, &cap_rejects, chunks[i].rows[k].line, reason);
+            }
+        }
+        free(chunks[i].rows);
+    }
+    if (fclose(out) != 0)
+    {
+        rc = -1;
+    }
+
+    /* one checkpoint covers every account opened */
+    if (rc == 0 && opened > 0 && save_data() != 0)
+    {
+        rc = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+    long rate = (long)((long long)rows * 1000 / (ms > 0 ? ms : 1));
+
+    qsort(rejects, nrejects, sizeof(import_reject_t), by_line);
+    FILE *bad = nrejects > 0 ? fopen(bad_path, "w") : NULL;
+    if (bad)
+    {
+        fprintf(bad, "line,reason\n");
+    }
+    for (int k = 0; k < nrejects; k++)
+    {
+        if (bad)
+        {
+            fprintf(bad, "%d,", rejects[k].line);
+            put_field(bad, rejects[k].reason);
+            fputc('\n', bad);
+        }
+        if (k < IMPORT_SHOW_REJECTS)
+        {
+            printf("  line %d: %s\n", rejects[k].line, rejects[k].reason);
+        }
+    }
+    if (bad)
+    {
+        fclose(bad);
+    }
+    free(rejects);
+
+    if (rc != 0)
+    {
+        unlink(out_path);
+        log_message(LOG_ERROR, "Import of %s failed after %d accounts; nothing was saved", path, opened);
+        fprintf(stderr, "Import of %s failed; nothing was saved.\n", path);
+        return -1;
+    }
+
+    log_message(LOG_INFO, "Imported %d of %d rows from %s in %ld ms (%ld rows/s, %d threads): accounts %d to %d",
+                opened, rows, path, ms, rate, n, first_number, first_number + opened - 1);
+    printf("Imported %d of %d rows in %ld ms (%ld rows/s) on %d threads.\n", opened, rows, ms, rate, n);
+    if (opened > 0)
+    {
+        printf("Accounts %d to %d; numbers and PINs are in %s.\n", first_number, first_number + opened - 1, out_path);
+    }
+    if (nrejects > 0)
+    {
+        printf("%d rows rejected%s; all are listed in %s.\n", nrejects,
+               nrejects > IMPORT_SHOW_REJECTS ? " (first ones shown above)" : "", bad_path);
+    }
+    return 0;
+}
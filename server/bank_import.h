@@ -0,0 +1,17 @@
+/*
+ * Banking System - Bulk account import from CSV
+ */
+
+#ifndef BANK_IMPORT_H
+#define BANK_IMPORT_H
+
+#include "bank_common.h"
+
+#define IMPORT_MAX_THREADS 16       /* most chunks parsed at once                */
+#define IMPORT_MIN_CHUNK (64 << 10) /* bytes a chunk is worth a thread for        */
+#define IMPORT_SHOW_REJECTS 20      /* rejected rows echoed on the terminal       */
+
+/* Import function prototypes */
+int import_csv(const char *path);
+
+#endif /* BANK_IMPORT_H */
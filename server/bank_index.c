@@ -0,0 +1,523 @@
+/*
+ * Banking System - Account hash index implementation
+ *
+ * Open-addressing table with linear probing mapping an account number to
+ * its slot in the account table. Deletion uses backward shifting, so the
+ * table never accumulates tombstones and probe chains stay short.
+ *
+ * A second table of the same shape maps a customer's nat_id to the slots
+ * of every account that customer holds.
+ *
+ * A snapshot carries the account table image, which is adopted as mapped;
+ * the customer table then builds on its first use.
+ *
+ * In the concurrent server both tables live in shared memory.
+ */
+
+#include "bank_index.h"
+#include "bank_log.h"
+#include "bank_store.h"
+#include "bank_shm.h"
+#include <stdint.h>
+
+#define INDEX_MIN_CAP 1024 /* initial number of buckets (power of 2) */
+#define INDEX_EMPTY 0      /* account numbers start at 100001      */
+
+typedef struct
+{
+    int number; /* account number, INDEX_EMPTY if unused */
+    int slot;   /* position of the account in the table  */
+} index_entry_t;
+
+typedef struct
+{
+    char nat_id[20]; /* customer key, empty string if unused */
+    int count;       /* accounts held by the customer        */
+    int cap;         /* allocated length of slots            */
+    int *slots;      /* slots of the customer's accounts     */
+} customer_entry_t;
+
+/* Both tables, behind a pointer so index_share() can move them into
+   shared memory */
+typedef struct
+{
+    index_entry_t *table;
+    size_t capacity; /* always a power of 2 */
+    size_t used;
+    int table_mapped; /* table belongs to a snapshot mapping, not malloc */
+
+    customer_entry_t *customers;
+    size_t cust_capacity; /* always a power of 2 */
+    size_t cust_used;
+    int cust_stale; /* rebuild the customer table before next use */
+} index_state_t;
+
+static index_state_t local_index;
+static index_state_t *idx = &local_index;
+
+static int customer_rebuild(int skip);
+
+/* Fibonacci hashing spreads sequential account numbers over the table */
+static size_t bucket_for(int number)
+{
+    return (size_t)(((uint32_t)number * 2654435769u) & (idx->capacity - 1));
+}
+
+/* Place an entry without checking the load factor */
+static void place(int number, int slot)
+{
+    size_t i = bucket_for(number);
+    while (idx->table[i].number != INDEX_EMPTY && idx->table[i].number != number)
+    {
+        i = (i + 1) & (idx->capacity - 1);
+    }
+    if (idx->table[i].number == INDEX_EMPTY)
+    {
+        idx->used++;
+    }
+    idx->table[i].number = number;
+    idx->table[i].slot = slot;
+}
+
+/* Resize the table to new_cap buckets and re-insert every entry */
+static int resize(size_t new_cap)
+{
+    index_entry_t *old = idx->table;
+    size_t old_cap = idx->capacity;
+
+    index_entry_t *fresh = shm_calloc(new_cap, sizeof(*fresh));
+    if (!fresh)
+    {
+        log_message(LOG_ERROR, "Failed to grow account index to %zu buckets", new_cap);
+        return -1;
+    }
+
+    idx->table = fresh;
+    idx->capacity = new_cap;
+    idx->used = 0;
+
+    for (size_t i = 0; i < old_cap; i++)
+    {
+        if (old[i].number != INDEX_EMPTY)
+        {
+            place(old[i].number, old[i].slot);
+        }
+    }
+
+    if (!idx->table_mapped)
+    {
+        shm_free(old);
+    }
+    idx->table_mapped = 0;
+    return 0;
+}
+
+/* Drop every entry from the index */
+void index_clear(void)
+{
+    if (idx->table)
+    {
+        memset(idx->table, 0, idx->capacity * sizeof(*idx->table));
+    }
+    idx->used = 0;
+}
+
+/* Rebuild the index from the current contents of the account table */
+int index_rebuild(void)
+{
+    size_t want = INDEX_MIN_CAP;
+    while (want < (size_t)bank_totals->accounts_in_use * 2)
+    {
+        want <<= 1;
+    }
+
+    if (want != idx->capacity)
+    {
+        if (!idx->table_mapped)
+        {
+            shm_free(idx->table);
+        }
+        idx->table_mapped = 0;
+        idx->table = NULL;
+        idx->capacity = 0;
+        if (resize(want) < 0)
+        {
+            return -1;
+        }
+    }
+    index_clear();
+
+    for (int i = 0; i < bank_slots; i++)
+    {
+        if (!store_is_free(i))
+        {
+            place(*acct_number(i), i);
+        }
+    }
+
+    if (customer_rebuild(-1) < 0)
+    {
+        return -1;
+    }
+
+    log_message(LOG_INFO, "Account index rebuilt (%d accounts, %zu buckets)",
+                bank_totals->accounts_in_use, idx->capacity);
+    return 0;
+}
+
+/* Adopt an account table image written by index_image(); the customer
+   table is rebuilt from the accounts when it is first needed */
+int index_attach(void *entries, size_t cap, size_t count)
+{
+    if (cap < INDEX_MIN_CAP || (cap & (cap - 1)) != 0 || count * 2 > cap)
+    {
+        log_message(LOG_ERROR, "Rejected account index image of %zu buckets", cap);
+        return -1;
+    }
+
+    if (!idx->table_mapped)
+    {
+        shm_free(idx->table);
+    }
+    idx->table = entries;
+    idx->table_mapped = 1;
+
+    /* a private file mapping is invisible to other processes: copy it */
+    if (shm_active())
+    {
+        idx->table = shm_calloc(cap, sizeof(index_entry_t));
+        idx->table_mapped = 0;
+        if (!idx->table)
+        {
+            log_message(LOG_ERROR, "Failed to copy account index of %zu buckets", cap);
+            idx->capacity = 0;
+            idx->used = 0;
+            return -1;
+        }
+        memcpy(idx->table, entries, cap * sizeof(index_entry_t));
+    }
+    idx->capacity = cap;
+    idx->used = count;
+    idx->cust_stale = 1;
+    return 0;
+}
+
+/* The account table as it should be written to a snapshot */
+const void *index_image(size_t *cap, size_t *count, size_t *entry_bytes)
+{
+    *cap = idx->capacity;
+    *count = idx->used;
+    *entry_bytes = sizeof(index_entry_t);
+    return idx->table;
+}
+
+/* Add or update the slot of an account number */
+int index_insert(int number, int slot)
+{
+    /* keep the load factor at or below one half */
+    if (idx->capacity == 0 || (idx->used + 1) * 2 > idx->capacity)
+    {
+        if (resize(idx->capacity ? idx->capacity * 2 : INDEX_MIN_CAP) < 0)
+        {
+            return -1;
+        }
+    }
+
+    place(number, slot);
+    return 0;
+}
+
+/* Find the slot of an account number, or -1 if it is not indexed */
+int index_lookup(int number)
+{
+    if (idx->capacity == 0 || number == INDEX_EMPTY)
+    {
+        return -1;
+    }
+
+    size_t i = bucket_for(number);
+    while (idx->table[i].number != INDEX_EMPTY)
+    {
+        if (idx->table[i].number == number)
+        {
+            return idx->table[i].slot;
+        }
+        i = (i + 1) & (idx->capacity - 1);
+    }
+    return -1;
+}
+
+/* Remove an account number, shifting later entries of its probe chain back */
+void index_remove(int number)
+{
+    if (idx->capacity == 0 || number == INDEX_EMPTY)
+    {
+        return;
+    }
+
+    size_t i = bucket_for(number);
+    while (idx->table[i].number != number)
+    {
+        if (idx->table[i].number == INDEX_EMPTY)
+        {
+            return; /* not present */
+        }
+        i = (i + 1) & (idx->capacity - 1);
+    }
+
+    size_t hole = i;
+    for (;;)
+    {
+        i = (i + 1) & (idx->capacity - 1);
+        if (idx->table[i].number == INDEX_EMPTY)
+        {
+            break;
+        }
+
+        /* an entry may fill the hole only if its home bucket is not
+           cyclically between the hole and its current position */
+        size_t home = bucket_for(idx->table[i].number);
+        if (((i - home) & (idx->capacity - 1)) >= ((i - hole) & (idx->capacity - 1)))
+        {
+            idx->table[hole] = idx->table[i];
+            hole = i;
+        }
+    }
+
+    idx->table[hole].number = INDEX_EMPTY;
+    idx->table[hole].slot = 0;
+    idx->used--;
+}
+
+/* FNV-1a over the nat_id string */
+static size_t customer_bucket(const char *nat_id)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)nat_id; *p; p++)
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    return (size_t)(h & (idx->cust_capacity - 1));
+}
+
+/* Find the bucket holding nat_id, or the empty bucket where it belongs */
+static size_t customer_find(const char *nat_id)
+{
+    size_t i = customer_bucket(nat_id);
+    while (idx->customers[i].nat_id[0] && strcmp(idx->customers[i].nat_id, nat_id) != 0)
+    {
+        i = (i + 1) & (idx->cust_capacity - 1);
+    }
+    return i;
+}
+
+/* Resize the customer table, keeping every customer's slot list */
+static int customer_resize(size_t new_cap)
+{
+    customer_entry_t *old = idx->customers;
+    size_t old_cap = idx->cust_capacity;
+
+    customer_entry_t *fresh = shm_calloc(new_cap, sizeof(*fresh));
+    if (!fresh)
+    {
+        log_message(LOG_ERROR, "Failed to grow customer index to %zu buckets", new_cap);
+        return -1;
+    }
+
+    idx->customers = fresh;
+    idx->cust_capacity = new_cap;
+
+    for (size_t i = 0; i < old_cap; i++)
+    {
+        if (old[i].nat_id[0])
+        {
+            idx->customers[customer_find(old[i].nat_id)] = old[i];
+        }
+    }
+
+    shm_free(old);
+    return 0;
+}
+
+/* Drop every customer and index all live accounts again, but for the
+   slot skip, which the caller is about to add or move itself */
+static int customer_rebuild(int skip)
+{
+    for (size_t i = 0; i < idx->cust_capacity; i++)
+    {
+        shm_free(idx->customers[i].slots);
+    }
+    shm_free(idx->customers);
+    idx->customers = NULL;
+    idx->cust_capacity = 0;
+    idx->cust_used = 0;
+    idx->cust_stale = 0;
+
+    for (int i = 0; i < bank_slots; i++)
+    {
+        if (i != skip && !store_is_free(i) && customer_add(acct_cold(i)->nat_id, i) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Build the customer table if a snapshot left it pending. An account is
+   already in its slot when it is added, and still in its old slot as well
+   when it is moved; the caller passes that slot as skip, as indexing it
+   here too would list the account twice. */
+static int customer_ready(int skip)
+{
+    if (!idx->cust_stale)
+    {
+        return 0;
+    }
+
+    int rc = customer_rebuild(skip);
+    log_message(LOG_INFO, "Customer index built on first use (%zu idx->customers)", idx->cust_used);
+    return rc;
+}
+
+/* Record that the account in slot belongs to the customer nat_id */
+int customer_add(const char *nat_id, int slot)
+{
+    if (!nat_id[0])
+    {
+        return 0; /* accounts without an ID are not grouped */
+    }
+    if (customer_ready(slot) < 0)
+    {
+        return -1;
+    }
+
+    if (idx->cust_capacity == 0 || (idx->cust_used + 1) * 2 > idx->cust_capacity)
+    {
+        if (customer_resize(idx->cust_capacity ? idx->cust_capacity * 2 : INDEX_MIN_CAP) < 0)
+        {
+            return -1;
+        }
+    }
+
+    customer_entry_t *c = &idx->customers[customer_find(nat_id)];
+    if (!c->nat_id[0])
+    {
+        strncpy(c->nat_id, nat_id, sizeof(c->nat_id) - 1);
+        idx->cust_used++;
+    }
+
+    if (c->count == c->cap)
+    {
+        int new_cap = c->cap ? c->cap * 2 : 4;
+        int *grown = shm_realloc(c->slots, new_cap * sizeof(int));
+        if (!grown)
+        {
+            log_message(LOG_ERROR, "Failed to grow account list of customer %s", nat_id);
+            return -1;
+        }
+        c->slots = grown;
+        c->cap = new_cap;
+    }
+
+    c->slots[c->count++] = slot;
+    return 0;
+}
+
+/* Forget that the account in slot belongs to the customer nat_id */
+void customer_remove(const char *nat_id, int slot)
+{
+    customer_ready(-1);
+    if (idx->cust_capacity == 0 || !nat_id[0])
+    {
+        return;
+    }
+
+    size_t i = customer_find(nat_id);
+    customer_entry_t *c = &idx->customers[i];
+    if (!c->nat_id[0])
+    {
+        return; /* unknown customer */
+    }
+
+    for (int k = 0; k < c->count; k++)
+    {
+        if (c->slots[k] == slot)
+        {
+            c->slots[k] = c->slots[--c->count];
+            break;
+        }
+    }
+    if (c->count > 0)
+    {
+        return;
+    }
+
+    /* last account gone: delete the customer with backward shifting */
+    shm_free(c->slots);
+    size_t hole = i;
+    for (;;)
+    {
+        i = (i + 1) & (idx->cust_capacity - 1);
+        if (!idx->customers[i].nat_id[0])
+        {
+            break;
+        }
+
+        size_t home = customer_bucket(idx->customers[i].nat_id);
+        if (((i - home) & (idx->cust_capacity - 1)) >= ((i - hole) & (idx->cust_capacity - 1)))
+        {
+            idx->customers[hole] = idx->customers[i];
+            hole = i;
+        }
+    }
+
+    memset(&idx->customers[hole], 0, sizeof(idx->customers[hole]));
+    idx->cust_used--;
+}
+
+/* Update a customer's account list after an account moved slots */
+void customer_move(const char *nat_id, int from, int to)
+{
+    customer_ready(from);
+    if (idx->cust_capacity == 0 || !nat_id[0])
+    {
+        return;
+    }
+
+    customer_entry_t *c = &idx->customers[customer_find(nat_id)];
+    for (int k = 0; k < c->count; k++)
+    {
+        if (c->slots[k] == from)
+        {
+            c->slots[k] = to;
+            return;
+        }
+    }
+}
+
+/* Point slots_out at the slots of a customer's accounts; returns how many */
+int customer_slots(const char *nat_id, const int **slots_out)
+{
+    *slots_out = NULL;
+    customer_ready(-1);
+    if (idx->cust_capacity == 0 || !nat_id[0])
+    {
+        return 0;
+    }
+
+    customer_entry_t *c = &idx->customers[customer_find(nat_id)];
+    *slots_out = c->slots;
+    return c->count;
+}
+
+/* Move the index state into shared memory; the tables already live there */
+int index_share(void)
+{
+    index_state_t *shared = shm_share(idx, sizeof(index_state_t));
+    if (!shared)
+    {
+        return -1;
+    }
+    idx = shared;
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Banking System - Account hash indexes
+ */
+
+#ifndef BANK_INDEX_H
+#define BANK_INDEX_H
+
+#include "bank_common.h"
+
+/* Index function prototypes */
+void index_clear(void);
+int index_rebuild(void);
+int index_insert(int number, int slot);
+int index_lookup(int number);
+void index_remove(int number);
+int index_attach(void *entries, size_t cap, size_t count);
+const void *index_image(size_t *cap, size_t *count, size_t *entry_bytes);
+int index_share(void);
+
+/* Customer (nat_id) index prototypes */
+int customer_add(const char *nat_id, int slot);
+void customer_remove(const char *nat_id, int slot);
+void customer_move(const char *nat_id, int from, int to);
+int customer_slots(const char *nat_id, const int **slots_out);
+
+#endif /* BANK_INDEX_H */
@@ -0,0 +1,1561 @@
+/*
+ * Banking System - Write-ahead journal of account mutations
+ *
+ * Mutations are queued as fixed-size records and written with one pwrite
+ * per commit, so the cost of a change no longer depends on the size of the
+ * bank. The last record of every commit is flagged; replay applies only
+ * complete commit groups, so a transfer or a batch is never half replayed.
+ * Every record carries a CRC32C; replay stops at the first record that
+ * fails it. A torn write leaves nothing valid after that point, so valid
+ * records further on mean the file was damaged. Those are kept in
+ * JOURNAL_FILE.bad rather than dropped with the tail.
+ * A checkpoint writes a snapshot carrying the last LSN it covers and then
+ * truncates the journal; records at or below that LSN are skipped on
+ * replay, which covers a crash between the two steps. A background
+ * checkpoint instead rotates the journal: records up to the snapshot go
+ * to JOURNAL_FILE.old, which is dropped once the snapshot is durable, and
+ * replay reads the old file ahead of the current one.
+ *
+ * Long journals are replayed on several threads. Posts are split by a hash
+ * of the account number, so each account's posts keep their order. Opens
+ * are applied before the posts of their stretch, and every close starts a
+ * new stretch.
+ *
+ * With BANK_JOURNAL_ARCHIVE=1 the records a checkpoint retires are not
+ * thrown away but appended to JOURNAL_FILE.archive as LZ blocks, each
+ * headed by the first and last LSN it holds. The server never reads the
+ * archive back. A failed archive is cut back to where it started and the
+ * records stay in the journal for the next checkpoint; a crash between
+ * archiving and truncating archives them again, so an LSN can appear in
+ * the archive more than once.
+ *
+ * Once journal_start_writer() has run, request handlers no longer touch
+ * the file. journal_commit() pushes the group into a lock-free ring of
+ * JOURNAL_RING records and returns; a writer thread drains the ring,
+ * checksums what it took and appends it with one pwrite. The same thread
+ * is the group-commit stage: it makes every write so far durable with one
+ * fdatasync once the commit window has passed or enough bytes are
+ * pending. Request handlers hold their replies in journal_wait() until
+ * their last LSN is durable, or until the writer reports that it failed.
+ * A failed append or sync is never retried: a sync that failed may have
+ * dropped the pages it was flushing, so nothing more counts as durable
+ * until a checkpoint has covered it.
+ * With BANK_IO=uring the writer appends from a registered buffer through
+ * io_uring, and a batch that crosses the byte threshold goes down together
+ * with its fdatasync in one submission.
+ * Without the writer (the multi-process server, exports) every commit
+ * writes its own group.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_journal.h"
+#include "bank_account.h"
+#include "bank_index.h"
+#include "bank_store.h"
+#include "bank_history.h"
+#include "bank_log.h"
+#include "bank_lz.h"
+#include "bank_crc.h"
+#include "bank_shm.h"
+#include "bank_uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static int journal_fd = -1;
+static journal_rec_t *pending = NULL; /* records queued since the last commit */
+static int pending_count = 0;
+static int pending_cap = 0;
+static int archive_on = 0; /* retired records go to JOURNAL_FILE.archive */
+
+/* Where the file ends, the LSN allocator and the group commit state. In
+   the concurrent server every process appends to the one journal, so
+   journal_share() moves this into shared memory. */
+typedef struct
+{
+    long long journal_end; /* end of the header and whole records in the file */
+    long long next_lsn;
+    int old_pending; /* JOURNAL_FILE.old still holds records a snapshot must cover */
+
+    /* Group commit state, guarded by sync_mutex */
+    pthread_mutex_t sync_mutex;
+    pthread_cond_t written_cond; /* work for the writer            */
+    pthread_cond_t durable_cond; /* durable_lsn or taken_lsn moved */
+    int writer_running;
+    int write_failed;        /* an append or sync failed; sticky until a checkpoint covers it */
+    long long queued_lsn;    /* last LSN committed by a handler */
+    long long taken_lsn;     /* last LSN the writer took off the ring */
+    long long written_lsn;   /* last LSN handed to pwrite       */
+    long long durable_lsn;   /* last LSN known to be on disk    */
+    long long unsynced_bytes;
+    struct timespec first_unsynced; /* when the oldest unsynced write landed */
+    int window_us;
+    int window_bytes;
+    long long sync_count;
+    long long records_synced;
+    long long wait_count;
+    long long wait_us_total;
+    int last_sync_us;
+    int max_group;
+    long long archived_bytes;
+    long long archive_packed;
+    long long archive_us;
+} journal_state_t;
+
+static journal_state_t local_state = {
+    .next_lsn = 1,
+    .sync_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .written_cond = PTHREAD_COND_INITIALIZER,
+    .durable_cond = PTHREAD_COND_INITIALIZER,
+    .window_us = GROUP_COMMIT_WINDOW_US,
+    .window_bytes = GROUP_COMMIT_BYTES,
+};
+static journal_state_t *js = &local_state;
+
+/* Multi-producer ring between journal_commit() and the writer. A slot is
+   free for position p while ring_seq says p, and holds the record for p
+   once it says p + 1. Producers claim positions by advancing ring_head;
+   only the writer advances ring_tail. */
+static journal_rec_t *ring = NULL;
+static unsigned long long *ring_seq = NULL;
+static unsigned long long ring_head = 0;
+static unsigned long long ring_tail = 0;
+static int writer_idle = 0; /* the writer is asleep, or about to be */
+static long long ring_stalls = 0;
+static replay_stats_t last_replay; /* what journal_recover() found */
+static int legacy_format = 0; /* recovery read a version 1 file; only a checkpoint may follow */
+static int read_only = 0;     /* recovery reads the files and writes nothing */
+static uring_t *writer_ring = NULL; /* BANK_IO=uring: the writer's appends and syncs */
+
+#define JOURNAL_HEADER_BYTES ((long long)sizeof(journal_rec_t)) /* the header's room */
+
+/* Offset of the first record in a journal file of the given format */
+static long long journal_start(int version)
+{
+    return version == JOURNAL_VERSION ? JOURNAL_HEADER_BYTES : 0;
+}
+
+/* Write the header of an empty journal file and sync it */
+static int journal_write_header(int fd)
+{
+    journal_rec_t room;
+    journal_header_t h;
+
+    memset(&room, 0, sizeof(room));
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    h.version = JOURNAL_VERSION;
+    h.record_bytes = (int)sizeof(journal_rec_t);
+    h.crc = crc32c(0, &h, offsetof(journal_header_t, crc));
+    memcpy(&room, &h, sizeof(h));
+
+    if (pwrite(fd, &room, sizeof(room), 0) != (ssize_t)sizeof(room) || fdatasync(fd) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to write journal header: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Format of a journal file of size bytes: JOURNAL_VERSION, 1 for a file
+   from before the header, 0 for an empty file, or -1 if this build cannot
+   read it */
+static int journal_format(int fd, long long size)
+{
+    journal_header_t h;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (size < (long long)sizeof(h))
+    {
+        return 1; /* not even one whole record of the old format */
+    }
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+    {
+        log_message(LOG_ERROR, "Failed to read journal header: %s", strerror(errno));
+        return -1;
+    }
+    if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0)
+    {
+        return 1;
+    }
+    if (h.crc != crc32c(0, &h, offsetof(journal_header_t, crc)) || h.version != JOURNAL_VERSION ||
+        h.record_bytes != (int)sizeof(journal_rec_t))
+    {
+        log_message(LOG_ERROR, "Journal header is damaged or from another build (version %d, %d-byte records)",
+                    h.version, h.record_bytes);
+        return -1;
+    }
+    return JOURNAL_VERSION;
+}
+
+/* Microseconds from a to b */
+static long long elapsed_us(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000LL + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/* Count a sync that made everything up to target durable, from was durable
+   before it; caller holds sync_mutex */
+static void mark_durable(long long target, long long from, long long us)
+{
+    if (target > js->durable_lsn)
+    {
+        int group = (int)(target - from);
+        js->durable_lsn = target;
+        js->records_synced += group;
+        if (group > js->max_group)
+        {
+            js->max_group = group;
+        }
+    }
+    js->sync_count++;
+    js->last_sync_us = (int)us;
+    pthread_cond_broadcast(&js->durable_cond);
+}
+
+/* Give up on the journal until the next checkpoint; caller holds
+   sync_mutex. Waiters are woken and told to checkpoint instead. */
+static void journal_failed(void)
+{
+    __atomic_store_n(&js->write_failed, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&js->durable_cond);
+}
+
+/* Flush the journal to disk; caller holds sync_mutex, which is dropped
+   meanwhile. A failed sync may have thrown the dirty pages away with the
+   error, so a later sync proves nothing: durable_lsn stays where it is and
+   the journal counts as failed until a checkpoint covers it. */
+static void sync_locked(void)
+{
+    struct timespec t0, t1;
+    long long target = js->written_lsn;
+    long long from = js->durable_lsn;
+
+    js->unsynced_bytes = 0;
+    pthread_mutex_unlock(&js->sync_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = fdatasync(journal_fd);
+    int err = errno;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    shm_lock(&js->sync_mutex);
+    if (rc < 0)
+    {
+        log_message(LOG_ERROR, "Failed to sync journal up to LSN %lld: %s; holding changes for a checkpoint",
+                    target, strerror(err));
+        journal_failed();
+        return;
+    }
+    mark_durable(target, from, elapsed_us(&t0, &t1));
+}
+
+/* When the commit window of the oldest unsynced write closes */
+static struct timespec window_deadline(void)
+{
+    struct timespec deadline = js->first_unsynced;
+    deadline.tv_nsec += (long)js->window_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    return deadline;
+}
+
+/* Wake the writer if it went to sleep; the fence pairs with the one the
+   writer passes before it checks the ring a last time */
+static void writer_wake(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_idle, __ATOMIC_RELAXED))
+    {
+        shm_lock(&js->sync_mutex);
+        pthread_cond_signal(&js->written_cond);
+        pthread_mutex_unlock(&js->sync_mutex);
+    }
+}
+
+/* Put one record on the ring; waits while the writer is a whole ring behind */
+static void ring_push(const journal_rec_t *r)
+{
+    unsigned long long pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        unsigned long long seq = __atomic_load_n(&ring_seq[pos & (JOURNAL_RING - 1)], __ATOMIC_ACQUIRE);
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (seq < pos)
+        {
+            /* full: the slot still holds a record from the previous lap */
+            struct timespec pause = {0, 50000};
+            if (ring_stalls++ == 0)
+            {
+                log_message(LOG_WARNING, "Journal ring full; handlers wait for the writer");
+            }
+            writer_wake();
+            nanosleep(&pause, NULL);
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    ring[pos & (JOURNAL_RING - 1)] = *r;
+    __atomic_store_n(&ring_seq[pos & (JOURNAL_RING - 1)], pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Whether the next record for the writer has been published */
+static int ring_ready(void)
+{
+    return __atomic_load_n(&ring_seq[ring_tail & (JOURNAL_RING - 1)], __ATOMIC_ACQUIRE) == ring_tail + 1;
+}
+
+/* Move up to max published records off the ring */
+static int ring_take(journal_rec_t *out, int max)
+{
+    int n = 0;
+    while (n < max && ring_ready())
+    {
+        out[n++] = ring[ring_tail & (JOURNAL_RING - 1)];
+        __atomic_store_n(&ring_seq[ring_tail & (JOURNAL_RING - 1)], ring_tail + JOURNAL_RING, __ATOMIC_RELEASE);
+        ring_tail++;
+    }
+    return n;
+}
+
+/* Checksum and append a batch the writer took; after a failed append every
+   batch is dropped until journal_reset(), as the checkpoint that follows
+   covers them */
+static void write_batch(journal_rec_t *recs, int count)
+{
+    size_t bytes = (size_t)count * sizeof(journal_rec_t);
+    int ok = !__atomic_load_n(&js->write_failed, __ATOMIC_ACQUIRE);
+    int synced = 0;          /* the batch went down with its fdatasync */
+    long long from = 0, sync_us = 0;
+
+    for (int i = 0; ok && i < count; i++)
+    {
+        recs[i].crc = 0;
+        recs[i].crc = crc32c(0, &recs[i], sizeof(journal_rec_t));
+    }
+
+    const char *p = (const char *)recs;
+    size_t len = bytes;
+    long long off = js->journal_end;
+    if (ok && writer_ring)
+    {
+        /* a batch that crosses the byte threshold takes its sync along */
+        struct timespec t0, t1;
+        shm_lock(&js->sync_mutex);
+        int sync_now = js->unsynced_bytes + (long long)bytes >= js->window_bytes;
+        from = js->durable_lsn;
+        pthread_mutex_unlock(&js->sync_mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (uring_write(writer_ring, journal_fd, recs, bytes, off) < 0 ||
+            (sync_now && uring_sync(writer_ring, journal_fd) < 0) || uring_wait(writer_ring) < 0)
+        {
+            log_message(LOG_WARNING, "io_uring journal write failed: %s; back to pwrite", strerror(errno));
+            uring_close(writer_ring);
+            writer_ring = NULL;
+            if (sync_now)
+            {
+                /* the sync may be what failed, and it cannot be retried */
+                log_message(LOG_ERROR, "Journal sync not confirmed; holding changes for a checkpoint");
+                ok = 0;
+            }
+        }
+        else
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            synced = sync_now;
+            sync_us = elapsed_us(&t0, &t1);
+            off += (long long)bytes;
+            len = 0;
+        }
+    }
+    while (ok && len > 0)
+    {
+        ssize_t n = pwrite(journal_fd, p, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_message(LOG_ERROR, "Failed to write journal: %s; holding changes for a checkpoint",
+                        strerror(errno));
+            ok = 0;
+            break;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    shm_lock(&js->sync_mutex);
+    js->taken_lsn = recs[count - 1].lsn;
+    if (ok)
+    {
+        __atomic_store_n(&js->journal_end, off, __ATOMIC_RELAXED);
+        if (js->unsynced_bytes == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &js->first_unsynced);
+        }
+        js->unsynced_bytes += bytes;
+        js->written_lsn = recs[count - 1].lsn;
+    }
+    else
+    {
+        /* a partial write lies past journal_end; the checkpoint truncates it */
+        journal_failed();
+    }
+    pthread_cond_broadcast(&js->durable_cond);
+    if (ok && synced)
+    {
+        js->unsynced_bytes = 0;
+        mark_durable(js->written_lsn, from, sync_us);
+    }
+    else if (ok && js->unsynced_bytes >= js->window_bytes)
+    {
+        sync_locked();
+    }
+    pthread_mutex_unlock(&js->sync_mutex);
+}
+
+/* Writer: drains the ring in batches, and syncs once per window or byte
+   threshold, whichever comes first */
+static void *journal_writer(void *arg)
+{
+    journal_rec_t *batch = arg;
+    for (;;)
+    {
+        int n = ring_take(batch, JOURNAL_RING);
+        if (n > 0)
+        {
+            write_batch(batch, n);
+            continue;
+        }
+
+        shm_lock(&js->sync_mutex);
+        __atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!ring_ready())
+        {
+            if (js->written_lsn <= js->durable_lsn || js->write_failed)
+            {
+                shm_cond_wait(&js->written_cond, &js->sync_mutex);
+            }
+            else
+            {
+                struct timespec deadline = window_deadline();
+                if (shm_cond_timedwait(&js->written_cond, &js->sync_mutex, &deadline) == ETIMEDOUT)
+                {
+                    sync_locked();
+                }
+            }
+        }
+        __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&js->sync_mutex);
+    }
+    return NULL;
+}
+
+/* Wait until the writer has taken everything committed so far. Callers
+   hold the bank lock, so nothing new is committed meanwhile. */
+static void writer_drain(void)
+{
+    if (!js->writer_running)
+    {
+        return;
+    }
+    shm_lock(&js->sync_mutex);
+    while (js->taken_lsn < js->queued_lsn)
+    {
+        shm_cond_wait(&js->durable_cond, &js->sync_mutex);
+    }
+    pthread_mutex_unlock(&js->sync_mutex);
+}
+
+/* Queue a new record and return it for the caller to fill in */
+static journal_rec_t *journal_next(journal_kind_t kind, int number)
+{
+    if (pending_count == pending_cap)
+    {
+        int cap = pending_cap ? pending_cap * 2 : 64;
+        journal_rec_t *grown = realloc(pending, cap * sizeof(journal_rec_t));
+        if (!grown)
+        {
+            log_message(LOG_ERROR, "Journal queue full: change to account %d held until the next checkpoint",
+                        number);
+            return NULL;
+        }
+        pending = grown;
+        pending_cap = cap;
+    }
+
+    journal_rec_t *r = &pending[pending_count++];
+    memset(r, 0, sizeof(*r));
+    r->lsn = js->next_lsn++;
+    r->kind = kind;
+    r->number = number;
+    return r;
+}
+
+/* Journal the creation of an account */
+void journal_log_open(const account_t *a)
+{
+    journal_rec_t *r = journal_next(JOURNAL_OPEN, a->number);
+    if (r)
+    {
+        r->pin = a->pin;
+        r->type = a->type;
+        r->next_number = bank_totals->next_number;
+        memcpy(r->name, a->name, sizeof(r->name));
+        memcpy(r->nat_id, a->nat_id, sizeof(r->nat_id));
+    }
+}
+
+/* Journal the closing of an account */
+void journal_log_close(int number)
+{
+    journal_next(JOURNAL_CLOSE, number);
+}
+
+/* Journal a transaction posted to an account */
+void journal_log_post(int number, const transaction_t *t)
+{
+    journal_rec_t *r = journal_next(JOURNAL_POST, number);
+    if (r)
+    {
+        r->t = *t;
+    }
+}
+
+/* Write the queued records as one commit group */
+int journal_commit(void)
+{
+    if (__atomic_load_n(&js->write_failed, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+    if (pending_count == 0)
+    {
+        return 0;
+    }
+    if (journal_fd < 0)
+    {
+        log_message(LOG_ERROR, "Journal not open: %d records held until the next checkpoint", pending_count);
+        return -1;
+    }
+
+    pending[pending_count - 1].last = 1;
+    if (js->writer_running)
+    {
+        /* callers hold the bank lock, so the ring is filled in LSN order */
+        for (int i = 0; i < pending_count; i++)
+        {
+            ring_push(&pending[i]);
+        }
+        __atomic_store_n(&js->queued_lsn, pending[pending_count - 1].lsn, __ATOMIC_RELEASE);
+        writer_wake();
+        pending_count = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < pending_count; i++)
+    {
+        pending[i].crc = 0;
+        pending[i].crc = crc32c(0, &pending[i], sizeof(journal_rec_t));
+    }
+
+    /* a failed write leaves journal_end alone so the next commit overwrites it */
+    const char *p = (const char *)pending;
+    size_t len = pending_count * sizeof(journal_rec_t);
+    long long off = js->journal_end;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(journal_fd, p, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_message(LOG_ERROR, "Failed to write journal: %s", strerror(errno));
+            pending[pending_count - 1].last = 0;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    js->journal_end = off;
+
+    shm_lock(&js->sync_mutex);
+    if (js->unsynced_bytes == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &js->first_unsynced);
+    }
+    js->unsynced_bytes += pending_count * sizeof(journal_rec_t);
+    js->written_lsn = js->queued_lsn = pending[pending_count - 1].lsn;
+    pthread_cond_signal(&js->written_cond);
+    pthread_mutex_unlock(&js->sync_mutex);
+
+    pending_count = 0;
+    return 0;
+}
+
+/* Block until every record up to lsn is on disk; -1 when the writer
+   failed and the caller must checkpoint instead */
+int journal_wait(long long lsn)
+{
+    struct timespec t0, t1;
+    int rc = 0;
+
+    shm_lock(&js->sync_mutex);
+    if (lsn > js->durable_lsn && lsn <= js->queued_lsn)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (!js->writer_running && !js->write_failed)
+        {
+            sync_locked();
+        }
+        while (lsn > js->durable_lsn && lsn <= js->queued_lsn && !js->write_failed)
+        {
+            shm_cond_wait(&js->durable_cond, &js->sync_mutex);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        js->wait_count++;
+        js->wait_us_total += elapsed_us(&t0, &t1);
+        rc = lsn > js->durable_lsn && lsn <= js->queued_lsn ? -1 : 0;
+    }
+    pthread_mutex_unlock(&js->sync_mutex);
+    return rc;
+}
+
+/* Start the writer thread; the window and byte threshold can be set
+   through BANK_COMMIT_WINDOW_US and BANK_COMMIT_BYTES */
+int journal_start_writer(void)
+{
+    pthread_condattr_t attr;
+    sigset_t quiet, saved;
+    pthread_t tid;
+    const char *env;
+
+    if ((env = getenv("BANK_COMMIT_WINDOW_US")) && atoi(env) >= 0)
+    {
+        js->window_us = atoi(env);
+    }
+    if ((env = getenv("BANK_COMMIT_BYTES")) && atoi(env) > 0)
+    {
+        js->window_bytes = atoi(env);
+    }
+
+    journal_rec_t *batch = malloc(JOURNAL_RING * sizeof(journal_rec_t));
+    ring = malloc(JOURNAL_RING * sizeof(journal_rec_t));
+    ring_seq = malloc(JOURNAL_RING * sizeof(unsigned long long));
+    if (!batch || !ring || !ring_seq)
+    {
+        log_message(LOG_ERROR, "No memory for the journal ring; writing on every commit");
+        free(batch);
+        free(ring);
+        free(ring_seq);
+        ring = NULL;
+        ring_seq = NULL;
+        return -1;
+    }
+    for (unsigned long long i = 0; i < JOURNAL_RING; i++)
+    {
+        ring_seq[i] = i;
+    }
+    if (uring_wanted() && (writer_ring = uring_open(URING_DEPTH)) != NULL)
+    {
+        uring_register(writer_ring, batch, JOURNAL_RING * sizeof(journal_rec_t));
+    }
+
+    /* the window deadline is measured on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (shm_owns(js))
+    {
+        pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_cond_destroy(&js->written_cond);
+    pthread_cond_init(&js->written_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* everything recovered so far counts as taken */
+    js->queued_lsn = js->taken_lsn = js->written_lsn;
+
+    /* shutdown signals stay with the main thread */
+    sigemptyset(&quiet);
+    sigaddset(&quiet, SIGINT);
+    sigaddset(&quiet, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quiet, &saved);
+    js->writer_running = 1;
+    int rc = pthread_create(&tid, NULL, journal_writer, batch);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to start journal writer; writing on every commit");
+        js->writer_running = 0;
+        uring_close(writer_ring);
+        writer_ring = NULL;
+        free(batch);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    log_message(LOG_INFO, "Journal writer: ring of %d records, window %d us, threshold %d bytes, %s",
+                JOURNAL_RING, js->window_us, js->window_bytes, writer_ring ? "io_uring" : "pwrite");
+    return 0;
+}
+
+/* Copy the group commit counters into a stats reply */
+void journal_stats(stats_t *out)
+{
+    shm_lock(&js->sync_mutex);
+    out->commit_window_us = js->window_us;
+    out->commit_bytes = js->window_bytes;
+    out->commits = js->sync_count;
+    out->records_synced = js->records_synced;
+    out->waits = js->wait_count;
+    out->wait_us_total = js->wait_us_total;
+    out->last_sync_us = js->last_sync_us;
+    out->max_group = js->max_group;
+    out->archived_bytes = js->archived_bytes;
+    out->archive_packed = js->archive_packed;
+    out->archive_us = js->archive_us;
+    pthread_mutex_unlock(&js->sync_mutex);
+    out->journal_bytes = journal_size();
+}
+
+/* Append the records between two offsets of a journal file to
+   JOURNAL_FILE.archive as packed blocks of ARCHIVE_BLOCK_RECORDS records
+   and sync it; on failure the archive is cut back to its old end */
+static int journal_archive(int fd, long long from, long long to)
+{
+    size_t raw_cap = ARCHIVE_BLOCK_RECORDS * sizeof(journal_rec_t);
+    journal_rec_t *recs = malloc(raw_cap);
+    char *packed = malloc(LZ_BLOCK_BOUND(raw_cap));
+    struct timespec t0, t1;
+    long long raw = 0, out = 0;
+    int rc = 0;
+
+    int afd = open(JOURNAL_FILE ".archive", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (afd < 0 || !recs || !packed)
+    {
+        log_message(LOG_ERROR, "Failed to open %s.archive: %s", JOURNAL_FILE, strerror(errno));
+        if (afd >= 0)
+        {
+            close(afd);
+        }
+        free(recs);
+        free(packed);
+        return -1;
+    }
+    off_t old_end = lseek(afd, 0, SEEK_END);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long long total = (to - from) / (long long)sizeof(journal_rec_t);
+    for (long long at = 0; at < total && rc == 0;)
+    {
+        int count = total - at < ARCHIVE_BLOCK_RECORDS ? (int)(total - at) : ARCHIVE_BLOCK_RECORDS;
+        size_t want = (size_t)count * sizeof(journal_rec_t);
+        if (pread(fd, recs, want, from + at * (long long)sizeof(journal_rec_t)) != (ssize_t)want)
+        {
+            rc = -1;
+            break;
+        }
+
+        size_t len = lz_pack_block(packed, recs, want, recs[0].lsn, recs[count - 1].lsn);
+        for (size_t done = 0; done < len && rc == 0;)
+        {
+            ssize_t n = write(afd, packed + done, len - done);
+            if (n < 0 && errno != EINTR)
+            {
+                rc = -1;
+            }
+            done += n > 0 ? (size_t)n : 0;
+        }
+        raw += (long long)want;
+        out += (long long)len;
+        at += count;
+    }
+    if (rc == 0 && fdatasync(afd) < 0)
+    {
+        rc = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (rc < 0)
+    {
+        log_message(LOG_ERROR, "Failed to archive journal: %s", strerror(errno));
+        if (old_end < 0 || ftruncate(afd, old_end) < 0)
+        {
+            log_message(LOG_ERROR, "Failed to cut %s.archive back after a failed append", JOURNAL_FILE);
+        }
+    }
+    close(afd);
+    free(recs);
+    free(packed);
+
+    long long us = elapsed_us(&t0, &t1);
+    shm_lock(&js->sync_mutex);
+    js->archived_bytes += raw;
+    js->archive_packed += out;
+    js->archive_us += us;
+    pthread_mutex_unlock(&js->sync_mutex);
+    log_message(LOG_INFO, "Archived %lld journal bytes as %lld (ratio %.2f) in %lld us, %lld MB/s",
+                raw, out, out > 0 ? (double)raw / out : 0.0, us, raw / (us > 0 ? us : 1));
+    return rc;
+}
+
+/* Empty the journal once a checkpoint has captured everything in it */
+int journal_reset(void)
+{
+    pending_count = 0;
+    writer_drain();
+    if (ring_stalls > 0)
+    {
+        log_message(LOG_WARNING, "Journal ring was full %lld times since the last checkpoint", ring_stalls);
+        ring_stalls = 0;
+    }
+    if (journal_drop_old() < 0)
+    {
+        return -1; /* the older records go first; this file waits for them */
+    }
+    if (journal_fd < 0)
+    {
+        return 0;
+    }
+    long long start = journal_start(legacy_format ? 1 : JOURNAL_VERSION);
+    if (archive_on && js->journal_end > start && journal_archive(journal_fd, start, js->journal_end) < 0)
+    {
+        return -1; /* kept for the next checkpoint to archive */
+    }
+
+    /* the header stays; a version 1 file is replaced by an empty current one */
+    if (ftruncate(journal_fd, legacy_format ? 0 : JOURNAL_HEADER_BYTES) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to truncate journal: %s", strerror(errno));
+        return -1;
+    }
+    if (legacy_format && journal_write_header(journal_fd) < 0)
+    {
+        return -1;
+    }
+    legacy_format = 0;
+    __atomic_store_n(&js->journal_end, JOURNAL_HEADER_BYTES, __ATOMIC_RELAXED);
+
+    /* the snapshot made everything up to now durable, including whatever
+       a failed writer dropped */
+    shm_lock(&js->sync_mutex);
+    js->written_lsn = js->durable_lsn = journal_lsn();
+    js->queued_lsn = js->taken_lsn = journal_lsn();
+    js->unsynced_bytes = 0;
+    __atomic_store_n(&js->write_failed, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&js->durable_cond);
+    pthread_mutex_unlock(&js->sync_mutex);
+    return 0;
+}
+
+/* Move everything journaled so far to JOURNAL_FILE.old and continue in an
+   empty journal; the caller then snapshots the bank as of journal_lsn() */
+int journal_rotate(void)
+{
+    if (journal_fd < 0 || pending_count > 0 || js->old_pending || legacy_format)
+    {
+        return -1;
+    }
+    writer_drain();
+    if (__atomic_load_n(&js->write_failed, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+
+    /* the old file must be whole before it is set aside */
+    if (fdatasync(journal_fd) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to sync journal before rotating: %s", strerror(errno));
+        shm_lock(&js->sync_mutex);
+        journal_failed();
+        pthread_mutex_unlock(&js->sync_mutex);
+        return -1;
+    }
+    shm_lock(&js->sync_mutex);
+    js->durable_lsn = js->written_lsn;
+    js->unsynced_bytes = 0;
+    pthread_cond_broadcast(&js->durable_cond);
+    pthread_mutex_unlock(&js->sync_mutex);
+
+    if (rename(JOURNAL_FILE, JOURNAL_FILE ".old") < 0)
+    {
+        log_message(LOG_ERROR, "Failed to rotate journal: %s", strerror(errno));
+        return -1;
+    }
+    int fd = open(JOURNAL_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int dir = open(".", O_RDONLY);
+    if (fd < 0 || dir < 0 || journal_write_header(fd) < 0 || fsync(dir) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to start a new journal: %s", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (dir >= 0)
+        {
+            close(dir);
+        }
+        rename(JOURNAL_FILE ".old", JOURNAL_FILE);
+        return -1;
+    }
+    close(dir);
+
+    /* same descriptor number, so a sync already in flight needs no care */
+    dup2(fd, journal_fd);
+    close(fd);
+    __atomic_store_n(&js->journal_end, JOURNAL_HEADER_BYTES, __ATOMIC_RELAXED);
+    js->old_pending = 1;
+    return 0;
+}
+
+/* Forget JOURNAL_FILE.old once a snapshot covering it is durable; -1 when
+   it could not be archived or removed and is kept */
+int journal_drop_old(void)
+{
+    if (js->old_pending && archive_on)
+    {
+        struct stat st;
+        int version;
+        int fd = open(JOURNAL_FILE ".old", O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0 && (version = journal_format(fd, st.st_size)) >= 0 &&
+            st.st_size > journal_start(version) && journal_archive(fd, journal_start(version), st.st_size) < 0)
+        {
+            close(fd);
+            return -1; /* kept for the next checkpoint to archive */
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    if (js->old_pending && unlink(JOURNAL_FILE ".old") < 0 && errno != ENOENT)
+    {
+        log_message(LOG_ERROR, "Failed to remove %s.old: %s", JOURNAL_FILE, strerror(errno));
+        return -1;
+    }
+    js->old_pending = 0;
+    return 0;
+}
+
+/* Whether JOURNAL_FILE.old still waits for a snapshot */
+int journal_old_pending(void)
+{
+    return js->old_pending;
+}
+
+/* Last LSN handed out; a snapshot taken now covers it */
+long long journal_lsn(void)
+{
+    return js->next_lsn - 1;
+}
+
+/* Bytes of records written to the journal since the last checkpoint */
+long long journal_size(void)
+{
+    long long end = __atomic_load_n(&js->journal_end, __ATOMIC_RELAXED);
+    return end > JOURNAL_HEADER_BYTES ? end - JOURNAL_HEADER_BYTES : 0;
+}
+
+/* Signed effect of a transaction on its account's balance */
+static int txn_delta(const transaction_t *t)
+{
+    switch (t->type)
+    {
+    case 'W':
+    case 'T':
+    case 'F':
+        return -t->amount;
+    default:
+        return t->amount;
+    }
+}
+
+/* Apply one journal record to the in-memory bank; -1 when it cannot apply,
+   1 when a transaction leaves another balance than the one journaled with it */
+static int journal_apply(const journal_rec_t *r)
+{
+    int slot;
+
+    switch (r->kind)
+    {
+    case JOURNAL_OPEN:
+    {
+        account_t a;
+        memset(&a, 0, sizeof(a));
+        a.number = r->number;
+        a.pin = r->pin;
+        a.type = r->type;
+        memcpy(a.name, r->name, sizeof(a.name) - 1);
+        memcpy(a.nat_id, r->nat_id, sizeof(a.nat_id) - 1);
+
+        slot = store_alloc();
+        if (slot < 0 || index_insert(a.number, slot) < 0)
+        {
+            return -1;
+        }
+        store_put(slot, &a);
+        customer_add(a.nat_id, slot);
+        bank_totals->accounts_in_use++;
+        bank_totals->next_number = r->next_number;
+        return 0;
+    }
+
+    case JOURNAL_CLOSE:
+        slot = index_lookup(r->number);
+        if (slot < 0)
+        {
+            return -1;
+        }
+        index_remove(r->number);
+        customer_remove(acct_cold(slot)->nat_id, slot);
+        history_release(slot);
+        store_release(slot);
+        bank_totals->accounts_in_use--;
+        return 0;
+
+    case JOURNAL_POST:
+    {
+        slot = index_lookup(r->number);
+        if (slot < 0)
+        {
+            return -1;
+        }
+        /* replay holds debits to the rule the live bank applied to them */
+        transaction_t t = r->t;
+        int delta = txn_delta(&t);
+        if (delta < 0 && *acct_balance(slot) + delta < MIN_BALANCE)
+        {
+            return -1;
+        }
+        *acct_balance(slot) += delta;
+        t.balance_after = *acct_balance(slot);
+        post_transaction(slot, &t);
+        return t.balance_after != r->t.balance_after;
+    }
+    }
+    return -1;
+}
+
+/* Add the outcome of one record to a tally */
+static void replay_one(const journal_rec_t *r, replay_stats_t *tally)
+{
+    int rc = journal_apply(r);
+    if (rc < 0)
+    {
+        tally->failed++;
+        return;
+    }
+    tally->applied++;
+    tally->mismatched += rc;
+}
+
+/* Posts of one partition, replayed by one thread */
+typedef struct
+{
+    const journal_rec_t *recs;
+    int *order; /* indexes into recs, in LSN order */
+    int count;
+    replay_stats_t tally;
+} replay_part_t;
+
+static void *replay_partition(void *arg)
+{
+    replay_part_t *p = arg;
+    for (int i = 0; i < p->count; i++)
+    {
+        replay_one(&p->recs[p->order[i]], &p->tally);
+    }
+    return NULL;
+}
+
+/* Partition of an account; all of its posts land in the same one */
+static int replay_part_of(int number, int parts)
+{
+    return (int)(((unsigned)number * 2654435761u) % (unsigned)parts);
+}
+
+/* Threads for replaying count records: one per core unless
+   BANK_REPLAY_THREADS says otherwise, and one for short journals */
+static int replay_threads(int count)
+{
+    const char *env = getenv("BANK_REPLAY_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    n = n < 1 ? 1 : n > REPLAY_MAX_THREADS ? REPLAY_MAX_THREADS : n;
+    return count < REPLAY_PARALLEL_RECORDS ? 1 : (int)n;
+}
+
+/* Replay records with no CLOSE among them. Their opens go first, in order,
+   on this thread: nothing else depends on them, and they change the index.
+   The posts then split by account over parts threads, each partition in
+   LSN order, so every account sees its transactions as they were made. */
+static void replay_stretch(const journal_rec_t *recs, int n, int parts, int *order, replay_stats_t *tally)
+{
+    replay_part_t jobs[REPLAY_MAX_THREADS];
+    pthread_t tids[REPLAY_MAX_THREADS];
+    int started[REPLAY_MAX_THREADS] = {0};
+    int counts[REPLAY_MAX_THREADS] = {0};
+    int posts = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (recs[i].kind == JOURNAL_OPEN)
+        {
+            replay_one(&recs[i], tally);
+        }
+        else
+        {
+            counts[replay_part_of(recs[i].number, parts)]++;
+            posts++;
+        }
+    }
+    if (parts == 1 || posts < REPLAY_PARALLEL_RECORDS)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (recs[i].kind != JOURNAL_OPEN)
+            {
+                replay_one(&recs[i], tally);
+            }
+        }
+        return;
+    }
+
+    for (int p = 0, at = 0; p < parts; p++)
+    {
+        jobs[p] = (replay_part_t){recs, order + at, 0, {0}};
+        at += counts[p];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (recs[i].kind != JOURNAL_OPEN)
+        {
+            replay_part_t *job = &jobs[replay_part_of(recs[i].number, parts)];
+            job->order[job->count++] = i;
+        }
+    }
+
+    for (int p = 1; p < parts; p++)
+    {
+        started[p] = pthread_create(&tids[p], NULL, replay_partition, &jobs[p]) == 0;
+    }
+    replay_partition(&jobs[0]);
+    for (int p = 0; p < parts; p++)
+    {
+        if (p > 0 && started[p])
+        {
+            pthread_join(tids[p], NULL);
+        }
+        else if (p > 0)
+        {
+            replay_partition(&jobs[p]); /* no thread to be had; do it here */
+        }
+        tally->applied += jobs[p].tally.applied;
+        tally->failed += jobs[p].tally.failed;
+        tally->mismatched += jobs[p].tally.mismatched;
+    }
+}
+
+/* Apply the first count records, skipping those the snapshot already
+   holds. A CLOSE frees a slot a later OPEN may take, so the journal is
+   replayed in stretches between CLOSE records, each close on its own. */
+static void journal_replay(const journal_rec_t *recs, int count, long long after_lsn, replay_stats_t *tally)
+{
+    int from = 0;
+    while (from < count && recs[from].lsn <= after_lsn)
+    {
+        from++;
+    }
+    tally->skipped = from;
+
+    int parts = replay_threads(count - from);
+    int *order = parts > 1 ? malloc((size_t)(count - from) * sizeof(int)) : NULL;
+    if (!order)
+    {
+        parts = 1;
+    }
+    tally->threads = parts;
+
+    while (from < count)
+    {
+        int end = from;
+        while (end < count && recs[end].kind != JOURNAL_CLOSE)
+        {
+            end++;
+        }
+        replay_stretch(recs + from, end - from, parts, order, tally);
+        if (end < count)
+        {
+            replay_one(&recs[end], tally);
+        }
+        from = end + 1;
+    }
+    free(order);
+}
+
+/* Whether a record is intact */
+static int record_ok(const journal_rec_t *r)
+{
+    journal_rec_t copy = *r;
+
+    copy.crc = 0;
+    return r->kind >= JOURNAL_OPEN && r->kind <= JOURNAL_POST &&
+           crc32c(0, &copy, sizeof(copy)) == r->crc;
+}
+
+/* Keep the records from the first bad one on in JOURNAL_FILE.bad when any
+   valid record newer than prev follows it; returns how many were kept */
+static int journal_keep_damaged(const journal_rec_t *recs, int from, int total, long long prev)
+{
+    int k = from + 1;
+    while (k < total && !(recs[k].lsn > prev && record_ok(&recs[k])))
+    {
+        k++;
+    }
+    if (k >= total)
+    {
+        return 0; /* only a torn tail */
+    }
+    if (read_only)
+    {
+        return total - from;
+    }
+
+    int fd = open(JOURNAL_FILE ".bad", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t len = (size_t)(total - from) * sizeof(journal_rec_t);
+    if (fd < 0 || write(fd, recs + from, len) != (ssize_t)len || fsync(fd) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to keep damaged journal records in %s.bad: %s",
+                    JOURNAL_FILE, strerror(errno));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return total - from;
+}
+
+/* Append every whole record of a journal file in the given format to
+   *recs, growing it and *total; *size receives the file's length in bytes.
+   Version 1 records carry no CRC, so they are given one here: the checks
+   replay makes then come down to the old rules for them. */
+static int journal_read(int fd, int version, journal_rec_t **recs, int *total, long long *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to read journal: %s", strerror(errno));
+        return -1;
+    }
+
+    long long start = journal_start(version);
+    *size = st.st_size;
+    int count = st.st_size > start ? (int)((st.st_size - start) / sizeof(journal_rec_t)) : 0;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    journal_rec_t *grown = realloc(*recs, (size_t)(*total + count) * sizeof(journal_rec_t));
+    if (!grown)
+    {
+        log_message(LOG_ERROR, "Cannot replay journal: out of memory for %d records", *total + count);
+        return -1;
+    }
+    *recs = grown;
+
+    size_t want = (size_t)count * sizeof(journal_rec_t);
+    size_t got = 0;
+    while (got < want)
+    {
+        ssize_t n = pread(fd, (char *)(grown + *total) + got, want - got, start + (long long)got);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        got += n;
+    }
+    count = (int)(got / sizeof(journal_rec_t));
+    for (int i = 0; version < JOURNAL_VERSION && i < count; i++)
+    {
+        journal_rec_t *r = &grown[*total + i];
+        r->crc = 0;
+        r->crc = crc32c(0, r, sizeof(journal_rec_t));
+    }
+    *total += count;
+    return 0;
+}
+
+/* Replay complete commit groups newer than after_lsn, drop a torn tail and
+   leave the journal open for appending. A version 1 file is replayed but
+   never cut short; journal_legacy() then asks for a checkpoint, which
+   replaces it, before anything is appended. */
+int journal_recover(long long after_lsn)
+{
+    journal_rec_t *recs = NULL;
+    int old_total = 0, total = 0;
+    int old_version = 0, version;
+    long long size = 0;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    js->next_lsn = after_lsn + 1;
+    const char *env = getenv("BANK_JOURNAL_ARCHIVE");
+    archive_on = env && strcmp(env, "1") == 0;
+
+    /* records set aside by a background checkpoint come first */
+    int old_fd = open(JOURNAL_FILE ".old", read_only ? O_RDONLY : O_RDWR);
+    if (old_fd >= 0)
+    {
+        struct stat st;
+        js->old_pending = 1;
+        if (fstat(old_fd, &st) < 0 || (old_version = journal_format(old_fd, st.st_size)) < 0 ||
+            journal_read(old_fd, old_version, &recs, &old_total, &size) < 0)
+        {
+            log_message(LOG_ERROR, "Cannot use %s.old; left as it is", JOURNAL_FILE);
+            free(recs);
+            close(old_fd);
+            return -1;
+        }
+        if (size != journal_start(old_version) + (long long)old_total * (long long)sizeof(journal_rec_t))
+        {
+            log_message(LOG_WARNING, "%s.old ends in a partial record", JOURNAL_FILE);
+        }
+    }
+
+    journal_fd = open(JOURNAL_FILE, read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0 && read_only && errno == ENOENT)
+    {
+        journal_fd = open("/dev/null", O_RDONLY); /* read as an empty journal */
+    }
+    struct stat cur;
+    if (journal_fd < 0 || fstat(journal_fd, &cur) < 0 || (version = journal_format(journal_fd, cur.st_size)) < 0)
+    {
+        log_message(LOG_ERROR, "Cannot use journal %s: %s; left as it is", JOURNAL_FILE,
+                    journal_fd < 0 ? strerror(errno) : "unknown format");
+        if (journal_fd >= 0)
+        {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+        free(recs);
+        if (old_fd >= 0)
+        {
+            close(old_fd);
+        }
+        return -1;
+    }
+    if (version == 0)
+    {
+        /* a new journal, or one emptied before its header was written */
+        if (!read_only && journal_write_header(journal_fd) < 0)
+        {
+            free(recs);
+            if (old_fd >= 0)
+            {
+                close(old_fd);
+            }
+            return -1;
+        }
+        version = JOURNAL_VERSION;
+    }
+    legacy_format = version < JOURNAL_VERSION || (old_fd >= 0 && old_version < JOURNAL_VERSION);
+    if (legacy_format)
+    {
+        log_message(LOG_WARNING, "Journal written before records carried CRCs; replaying it as it is "
+                    "and checkpointing before anything is appended");
+    }
+
+    total = old_total;
+    if (journal_read(journal_fd, version, &recs, &total, &size) < 0)
+    {
+        free(recs);
+        if (old_fd >= 0)
+        {
+            close(old_fd);
+        }
+        return -1;
+    }
+
+    int group = 0;        /* one past the last whole commit group */
+    int stop = total;     /* first record that failed its checks */
+    long long prev = 0;   /* LSN of the previous record */
+    for (int i = 0; i < total; i++)
+    {
+        const journal_rec_t *r = &recs[i];
+        if (r->lsn <= prev || !record_ok(r))
+        {
+            stop = i; /* garbage after a torn write, or damage */
+            break;
+        }
+        prev = r->lsn;
+
+        if (r->last)
+        {
+            group = i + 1;
+            if (prev >= js->next_lsn)
+            {
+                js->next_lsn = prev + 1;
+            }
+        }
+    }
+
+    /* the journal must carry on from the loaded data; replaying it onto an
+       older base would skip everything in between */
+    int from = 0;
+    while (from < group && recs[from].lsn <= after_lsn)
+    {
+        from++;
+    }
+    if (from < group && recs[from].lsn != after_lsn + 1)
+    {
+        log_message(LOG_ERROR, "Journal resumes at LSN %lld but the loaded data ends at LSN %lld; "
+                    "not replayed, %s left as it is", recs[from].lsn, after_lsn, JOURNAL_FILE);
+        fprintf(stderr, "Journal does not follow on from the loaded data (LSN %lld after %lld).\n",
+                recs[from].lsn, after_lsn);
+        free(recs);
+        if (old_fd >= 0)
+        {
+            close(old_fd);
+        }
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+
+    /* only whole groups are replayed; a torn one never happened */
+    memset(&last_replay, 0, sizeof(last_replay));
+    last_replay.records = group;
+    journal_replay(recs, group, after_lsn, &last_replay);
+
+    int damaged = stop < total ? journal_keep_damaged(recs, stop, total, prev) : 0;
+    if (damaged > 0)
+    {
+        const char *kept = read_only ? "left in place" : "kept in " JOURNAL_FILE ".bad";
+        log_message(LOG_ERROR, "Journal damaged at record %d: %d records from there on %s", stop, damaged, kept);
+        fprintf(stderr, "Journal damaged; %d records %s.\n", damaged, kept);
+    }
+    free(recs);
+
+    /* an old-format file is only replaced by a checkpoint, and a read-only
+       recovery leaves every file as it found it */
+    int keep = legacy_format || read_only;
+    const char *left = keep ? " (file left as it is)" : "";
+
+    /* whole groups in each file; a damaged old file also voids everything
+       journaled after it */
+    int old_whole = group < old_total ? group : old_total;
+    int whole = group > old_total ? group - old_total : 0;
+    long long old_valid = journal_start(old_version) + (long long)old_whole * sizeof(journal_rec_t);
+    long long valid = journal_start(version) + (long long)whole * sizeof(journal_rec_t);
+    if (old_fd >= 0 && old_whole < old_total)
+    {
+        log_message(LOG_WARNING, "Discarding %d records of %s.old after its last whole group%s",
+                    old_total - old_whole, JOURNAL_FILE, left);
+        if (!keep && ftruncate(old_fd, old_valid) < 0)
+        {
+            log_message(LOG_ERROR, "Failed to truncate %s.old: %s", JOURNAL_FILE, strerror(errno));
+        }
+        valid = journal_start(version);
+    }
+    if (old_fd >= 0)
+    {
+        close(old_fd);
+    }
+
+    if (valid < size)
+    {
+        log_message(LOG_WARNING, "Discarding %lld bytes of incomplete journal tail%s", size - valid, left);
+        if (!keep && ftruncate(journal_fd, valid) < 0)
+        {
+            log_message(LOG_ERROR, "Failed to truncate journal tail: %s", strerror(errno));
+        }
+    }
+    js->journal_end = valid;
+
+    replay_stats_t *st = &last_replay;
+    if (st->failed > 0)
+    {
+        log_message(LOG_ERROR, "Journal replay: %lld records did not apply", st->failed);
+    }
+    if (st->mismatched > 0)
+    {
+        log_message(LOG_WARNING, "Journal replay: %lld transactions left another balance than journaled",
+                    st->mismatched);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    st->us = elapsed_us(&t0, &t1);
+    long long rate = st->records * 1000000LL / (st->us > 0 ? st->us : 1);
+    log_message(LOG_INFO, "Journal replay: %lld records applied, %lld already in snapshot, in %lld us "
+                "on %d threads, %lld records/s (%s CRC32C)",
+                st->applied, st->skipped, st->us, st->threads, rate, crc32c_engine());
+    if (st->records > 0)
+    {
+        printf("Replayed %lld journal records in %lld ms (%lld records/s).\n", st->records, st->us / 1000, rate);
+    }
+    return st->failed > 0 || damaged > 0 ? -1 : 0;
+}
+
+/* Make journal_recover() read only: nothing is created, trimmed or set
+   aside, and the journal is not to be appended to afterwards */
+void journal_read_only(void)
+{
+    read_only = 1;
+}
+
+/* Whether recovery read a journal from before records carried CRCs; such
+   a file is never appended to, so a checkpoint must come first */
+int journal_legacy(void)
+{
+    return legacy_format;
+}
+
+/* Copy the counters of the last journal replay */
+void journal_replay_stats(replay_stats_t *out)
+{
+    *out = last_replay;
+}
+
+/* Move the journal state into shared memory, so every process appends at
+   the same end of the file and waits on the same durable LSN */
+int journal_share(void)
+{
+    journal_state_t *shared = shm_share(js, sizeof(journal_state_t));
+    if (!shared || shm_mutex_init(&shared->sync_mutex) != 0 ||
+        shm_cond_init(&shared->written_cond, 1) != 0 || shm_cond_init(&shared->durable_cond, 0) != 0)
+    {
+        return -1;
+    }
+    js = shared;
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Banking System - Write-ahead journal of account mutations
+ */
+
+#ifndef BANK_JOURNAL_H
+#define BANK_JOURNAL_H
+
+#include "bank_common.h"
+
+#define JOURNAL_CHECKPOINT_BYTES (64L << 20) /* journal size that forces a checkpoint */
+#define CHECKPOINT_SECS 300                  /* longest gap between checkpoints      */
+#define GROUP_COMMIT_WINDOW_US 2000          /* longest a write waits for its fdatasync */
+#define GROUP_COMMIT_BYTES (256 << 10)       /* unsynced bytes that force an early sync */
+#define ARCHIVE_BLOCK_RECORDS 2048           /* journal records per packed archive block */
+#define JOURNAL_RING 8192                    /* records between handlers and the writer (power of 2) */
+#define REPLAY_MAX_THREADS 16                /* most partitions a replay splits into */
+#define REPLAY_PARALLEL_RECORDS 4096         /* fewer records are replayed on one thread */
+#define JOURNAL_MAGIC "BANKJRNL"             /* first eight bytes of a journal file  */
+#define JOURNAL_VERSION 2                    /* records carry a CRC32C; files without
+                                                the magic are version 1 and have none */
+
+/* Kinds of journal record */
+typedef enum
+{
+    JOURNAL_OPEN = 1,  /* account created with a zero balance */
+    JOURNAL_CLOSE = 2, /* account closed                       */
+    JOURNAL_POST = 3   /* transaction posted to an account     */
+} journal_kind_t;
+
+/* One fixed-size journal record */
+typedef struct
+{
+    long long lsn;       /* log sequence number, strictly increasing    */
+    journal_kind_t kind;
+    int last;            /* closes a commit group; replay applies whole groups */
+    int number;          /* account the record applies to              */
+    int pin;             /* OPEN                                        */
+    acct_type_t type;    /* OPEN                                        */
+    int next_number;     /* OPEN: number allocator after the open      */
+    char name[40];       /* OPEN                                        */
+    char nat_id[20];     /* OPEN                                        */
+    unsigned crc;        /* CRC32C of the record with this field zero   */
+    transaction_t t;     /* POST                                        */
+} journal_rec_t;
+
+/* Header at the start of a journal file; it takes up one record's room,
+   so the records after it stay aligned */
+typedef struct
+{
+    char magic[8];
+    int version;
+    int record_bytes; /* sizeof(journal_rec_t) of the writer */
+    unsigned crc;     /* CRC32C of the fields above          */
+} journal_header_t;
+
+/* Outcome of the last journal replay */
+typedef struct
+{
+    long long records;    /* records in whole commit groups          */
+    long long applied;
+    long long skipped;    /* already in the snapshot                 */
+    long long failed;     /* did not apply                           */
+    long long mismatched; /* left another balance than journaled     */
+    int threads;
+    long long us;         /* reading, checking and applying          */
+} replay_stats_t;
+
+/* Journal function prototypes */
+int journal_recover(long long after_lsn);
+void journal_log_open(const account_t *a);
+void journal_log_close(int number);
+void journal_log_post(int number, const transaction_t *t);
+int journal_commit(void);
+int journal_reset(void);
+int journal_rotate(void);
+int journal_drop_old(void);
+int journal_old_pending(void);
+long long journal_lsn(void);
+long long journal_size(void);
+int journal_start_writer(void);
+int journal_wait(long long lsn);
+void journal_stats(stats_t *out);
+void journal_replay_stats(replay_stats_t *out);
+int journal_share(void);
+void journal_read_only(void);
+int journal_legacy(void);
+
+#endif /* BANK_JOURNAL_H */
@@ -0,0 +1,575 @@
+/*
+ * Banking System - JSON tokenizer over an in-memory buffer
+ *
+ * The whole document is mapped or read into memory and walked with a
+ * cursor, so there is no per-character stdio call and no allocation.
+ * Callers read objects member by member, dispatching on the key, which
+ * lets them accept members in any order and skip ones they do not know.
+ *
+ * The writer formats into JSON_BLOCKS blocks. A token never straddles two
+ * blocks: when the next one does not fit in what is left, the block is
+ * closed short, so the hot path is one bounds check and a store. Once every block
+ * is full they go out together in one writev(). A packing writer turns
+ * each block into an LZ block keyed by its offset in the document first.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_json.h"
+#include "bank_lz.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Advance past spaces, tabs and line breaks */
+static void skip_ws(json_cursor_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\n' || *c->p == '\r' || *c->p == '\t'))
+    {
+        c->p++;
+    }
+}
+
+/* Start reading a document of len bytes */
+void json_init(json_cursor_t *c, const char *buf, size_t len)
+{
+    c->p = buf;
+    c->end = buf + len;
+    c->base = buf;
+}
+
+/* Next significant byte without consuming it, or -1 at the end */
+int json_peek(json_cursor_t *c)
+{
+    skip_ws(c);
+    return c->p < c->end ? (unsigned char)*c->p : -1;
+}
+
+/* Consume ch, which must be the next significant byte */
+int json_expect(json_cursor_t *c, char ch)
+{
+    if (json_peek(c) != (unsigned char)ch)
+    {
+        return -1;
+    }
+    c->p++;
+    return 0;
+}
+
+/* Open an object or array: 1 if it has members, 0 if it is empty */
+int json_begin(json_cursor_t *c, char open, char close)
+{
+    if (json_expect(c, open) < 0)
+    {
+        return -1;
+    }
+    if (json_peek(c) == (unsigned char)close)
+    {
+        c->p++;
+        return 0;
+    }
+    return 1;
+}
+
+/* After a member or element: 1 if a comma follows, 0 if close ends the
+   container, -1 otherwise */
+int json_next(json_cursor_t *c, char close)
+{
+    int ch = json_peek(c);
+    if (ch == ',')
+    {
+        c->p++;
+        return 1;
+    }
+    if (ch == (unsigned char)close)
+    {
+        c->p++;
+        return 0;
+    }
+    return -1;
+}
+
+/* Read a member name and its colon; the key points into the document */
+int json_key(json_cursor_t *c, const char **key, size_t *len)
+{
+    if (json_expect(c, '"') < 0)
+    {
+        return -1;
+    }
+
+    const char *start = c->p;
+    const char *q = memchr(start, '"', c->end - start);
+    if (!q)
+    {
+        return -1;
+    }
+
+    *key = start;
+    *len = q - start;
+    c->p = q + 1;
+    return json_expect(c, ':');
+}
+
+/* Whether a key read by json_key() is want */
+int json_key_is(const char *key, size_t len, const char *want)
+{
+    return strncmp(key, want, len) == 0 && want[len] == '\0';
+}
+
+/* Read a string value into out, truncating to size - 1 bytes; out may be
+   NULL to skip the string */
+int json_string(json_cursor_t *c, char *out, size_t size)
+{
+    size_t pos = 0;
+
+    if (json_expect(c, '"') < 0)
+    {
+        return -1;
+    }
+
+    while (c->p < c->end)
+    {
+        char ch = *c->p++;
+        if (ch == '"')
+        {
+            if (out)
+            {
+                out[pos] = '\0';
+            }
+            return 0;
+        }
+
+        if (ch == '\\')
+        {
+            if (c->p >= c->end)
+            {
+                return -1;
+            }
+            ch = *c->p++;
+            switch (ch)
+            {
+            case 'b':
+                ch = '\b';
+                break;
+            case 'f':
+                ch = '\f';
+                break;
+            case 'n':
+                ch = '\n';
+                break;
+            case 'r':
+                ch = '\r';
+                break;
+            case 't':
+                ch = '\t';
+                break;
+            case 'u':
+            {
+                /* only code points below 256 survive, as single bytes */
+                int val = 0;
+                if (c->end - c->p < 4)
+                {
+                    return -1;
+                }
+                for (int k = 0; k < 4; k++)
+                {
+                    char h = *c->p++;
+                    int d = h >= '0' && h <= '9' ? h - '0'
+                          : h >= 'a' && h <= 'f' ? h - 'a' + 10
+                          : h >= 'A' && h <= 'F' ? h - 'A' + 10 : -1;
+                    if (d < 0)
+                    {
+                        return -1;
+                    }
+                    val = val * 16 + d;
+                }
+                if (val >= 256)
+                {
+                    continue;
+                }
+                ch = (char)val;
+                break;
+            }
+            default:
+                break; /* \" \\ \/ and unknown escapes copy the character */
+            }
+        }
+
+        if (out && pos + 1 < size)
+        {
+            out[pos++] = ch;
+        }
+    }
+    return -1; /* unterminated */
+}
+
+/* Read an integer value */
+int json_int(json_cursor_t *c, long long *out)
+{
+    int neg = 0;
+    long long v = 0;
+
+    skip_ws(c);
+    if (c->p < c->end && *c->p == '-')
+    {
+        neg = 1;
+        c->p++;
+    }
+
+    const char *start = c->p;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+    {
+        int d = *c->p++ - '0';
+        if (v > (LLONG_MAX - d) / 10)
+        {
+            return -1;
+        }
+        v = v * 10 + d;
+    }
+    if (c->p == start)
+    {
+        return -1;
+    }
+
+    *out = neg ? -v : v;
+    return 0;
+}
+
+/* Skip one value of any type, nested containers included */
+int json_skip_value(json_cursor_t *c)
+{
+    int ch = json_peek(c);
+    if (ch < 0)
+    {
+        return -1;
+    }
+    if (ch == '"')
+    {
+        return json_string(c, NULL, 0);
+    }
+
+    if (ch == '{' || ch == '[')
+    {
+        int depth = 0;
+        while (c->p < c->end)
+        {
+            char x = *c->p;
+            if (x == '"')
+            {
+                if (json_string(c, NULL, 0) < 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            c->p++;
+            if (x == '{' || x == '[')
+            {
+                depth++;
+            }
+            else if ((x == '}' || x == ']') && --depth == 0)
+            {
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    /* number, true, false or null */
+    const char *start = c->p;
+    while (c->p < c->end && !strchr(",}] \t\r\n", *c->p))
+    {
+        c->p++;
+    }
+    return c->p > start ? 0 : -1;
+}
+
+/* Byte offset of the cursor, for error messages */
+long json_offset(const json_cursor_t *c)
+{
+    return (long)(c->p - c->base);
+}
+
+/* Two-digit pairs for json_put_int */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Start writing to fd, as packed blocks if pack is set */
+int json_writer_open(json_writer_t *w, int fd, int pack)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+
+    if (pack && !(w->packed = malloc(JSON_BLOCKS * LZ_BLOCK_BOUND(JSON_BLOCK))))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < JSON_BLOCKS; i++)
+    {
+        w->block[i] = malloc(JSON_BLOCK);
+        if (!w->block[i])
+        {
+            json_writer_close(w);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    w->p = w->block[0];
+    w->lim = w->p + JSON_BLOCK;
+    return 0;
+}
+
+/* Write out every filled block with as few writev() calls as it takes */
+int json_flush(json_writer_t *w)
+{
+    struct iovec iov[JSON_BLOCKS];
+    int n = 0;
+
+    w->used[w->cur] = (size_t)(w->p - w->block[w->cur]);
+    if (w->packed)
+    {
+        struct timespec t0, t1;
+        size_t len = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i <= w->cur; i++)
+        {
+            if (w->used[i] > 0)
+            {
+                len += lz_pack_block(w->packed + len, w->block[i], w->used[i],
+                                     w->raw_bytes, w->raw_bytes + (long long)w->used[i]);
+                w->raw_bytes += (long long)w->used[i];
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        w->pack_us += (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+        iov[0].iov_base = w->packed;
+        iov[0].iov_len = len;
+        n = len > 0;
+    }
+    else
+    {
+        for (int i = 0; i <= w->cur; i++)
+        {
+            if (w->used[i] > 0)
+            {
+                iov[n].iov_base = w->block[i];
+                iov[n].iov_len = w->used[i];
+                w->raw_bytes += (long long)w->used[i];
+                n++;
+            }
+        }
+    }
+
+    struct iovec *v = iov;
+    while (n > 0 && w->error == 0)
+    {
+        ssize_t r = writev(w->fd, v, n);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r <= 0)
+        {
+            /* a write that takes nothing would never finish the flush */
+            w->error = r < 0 ? errno : EIO;
+            break;
+        }
+
+        /* a short write: drop what went out and resume mid-block */
+        w->bytes += r;
+        while (n > 0 && (size_t)r >= v->iov_len)
+        {
+            r -= (ssize_t)v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0)
+        {
+            v->iov_base = (char *)v->iov_base + r;
+            v->iov_len -= (size_t)r;
+        }
+    }
+
+    w->cur = 0;
+    w->p = w->block[0];
+    w->lim = w->p + JSON_BLOCK;
+    if (w->error)
+    {
+        errno = w->error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the current block and move to the next, flushing when all are full */
+static void next_block(json_writer_t *w)
+{
+    if (w->cur == JSON_BLOCKS - 1)
+    {
+        json_flush(w);
+        return;
+    }
+    w->used[w->cur] = (size_t)(w->p - w->block[w->cur]);
+    w->cur++;
+    w->p = w->block[w->cur];
+    w->lim = w->p + JSON_BLOCK;
+}
+
+/* Make len contiguous bytes available; tokens are far shorter than a block */
+static inline void reserve(json_writer_t *w, size_t len)
+{
+    if ((size_t)(w->lim - w->p) < len)
+    {
+        next_block(w);
+    }
+}
+
+/* Flush what is left and release the blocks; -1 if any write failed */
+int json_writer_close(json_writer_t *w)
+{
+    int rc = 0;
+    if (w->p)
+    {
+        rc = json_flush(w);
+    }
+    for (int i = 0; i < JSON_BLOCKS; i++)
+    {
+        free(w->block[i]);
+        w->block[i] = NULL;
+    }
+    free(w->packed);
+    w->packed = NULL;
+    w->p = w->lim = NULL;
+    if (w->error)
+    {
+        errno = w->error;
+        rc = -1;
+    }
+    return rc;
+}
+
+/* Append bytes as they are, across blocks if need be */
+void json_raw(json_writer_t *w, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        if (w->p == w->lim)
+        {
+            next_block(w);
+        }
+        size_t n = (size_t)(w->lim - w->p) < len ? (size_t)(w->lim - w->p) : len;
+        memcpy(w->p, s, n);
+        w->p += n;
+        s += n;
+        len -= n;
+    }
+}
+
+/* Append a literal such as punctuation or a quoted key */
+void json_lit(json_writer_t *w, const char *s)
+{
+    json_raw(w, s, strlen(s));
+}
+
+/* Append one byte */
+void json_char(json_writer_t *w, char ch)
+{
+    reserve(w, 1);
+    *w->p++ = ch;
+}
+
+/* Append an integer, two digits at a time */
+void json_put_int(json_writer_t *w, long long v)
+{
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *q = end;
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+
+    while (u >= 100)
+    {
+        const char *d = digit_pairs + (u % 100) * 2;
+        u /= 100;
+        *--q = d[1];
+        *--q = d[0];
+    }
+    if (u >= 10)
+    {
+        *--q = digit_pairs[u * 2 + 1];
+        *--q = digit_pairs[u * 2];
+    }
+    else
+    {
+        *--q = (char)('0' + u);
+    }
+    if (v < 0)
+    {
+        *--q = '-';
+    }
+
+    reserve(w, sizeof(tmp));
+    memcpy(w->p, q, (size_t)(end - q));
+    w->p += end - q;
+}
+
+/* Append a quoted string; runs that need no escaping are copied whole */
+void json_put_string(json_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    json_char(w, '"');
+    for (;;)
+    {
+        const char *run = s;
+        while ((unsigned char)*s >= 0x20 && *s != '"' && *s != '\\')
+        {
+            s++;
+        }
+        json_raw(w, run, (size_t)(s - run));
+        if (*s == '\0')
+        {
+            break;
+        }
+
+        unsigned char ch = (unsigned char)*s++;
+        reserve(w, 6);
+        *w->p++ = '\\';
+        switch (ch)
+        {
+        case '"':
+        case '\\':
+            *w->p++ = (char)ch;
+            break;
+        case '\b':
+            *w->p++ = 'b';
+            break;
+        case '\f':
+            *w->p++ = 'f';
+            break;
+        case '\n':
+            *w->p++ = 'n';
+            break;
+        case '\r':
+            *w->p++ = 'r';
+            break;
+        case '\t':
+            *w->p++ = 't';
+            break;
+        default:
+            memcpy(w->p, "u00", 3);
+            w->p[3] = hex[ch >> 4];
+            w->p[4] = hex[ch & 15];
+            w->p += 5;
+        }
+    }
+    json_char(w, '"');
+}
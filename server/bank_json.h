@@ -0,0 +1,62 @@
+/*
+ * Banking System - JSON tokenizer over an in-memory buffer and a
+ * block-buffered JSON writer
+ */
+
+#ifndef BANK_JSON_H
+#define BANK_JSON_H
+
+#include "bank_common.h"
+
+/* Read position in a JSON document; the document need not be terminated */
+typedef struct
+{
+    const char *p;    /* next unread byte          */
+    const char *end;  /* one past the last byte    */
+    const char *base; /* start, for error offsets  */
+} json_cursor_t;
+
+#define JSON_BLOCK (256 << 10) /* bytes per output block             */
+#define JSON_BLOCKS 4          /* blocks handed to one writev()       */
+
+/* Output state: tokens are formatted straight into a block, and full
+   blocks are gathered and written together, packed first if asked */
+typedef struct
+{
+    int fd;
+    int error;                    /* errno of the first failed write, 0 if none */
+    char *p;                      /* next free byte of the current block        */
+    char *lim;                    /* end of the current block                   */
+    int cur;                      /* block being filled                         */
+    char *block[JSON_BLOCKS];
+    size_t used[JSON_BLOCKS];     /* bytes filled in each completed block       */
+    long long bytes;              /* bytes handed to the kernel so far          */
+    long long raw_bytes;          /* JSON produced so far                       */
+    char *packed;                 /* packing buffer, NULL for plain output      */
+    long long pack_us;            /* time spent compressing                     */
+} json_writer_t;
+
+/* JSON reader prototypes */
+void json_init(json_cursor_t *c, const char *buf, size_t len);
+int json_peek(json_cursor_t *c);
+int json_expect(json_cursor_t *c, char ch);
+int json_begin(json_cursor_t *c, char open, char close);
+int json_next(json_cursor_t *c, char close);
+int json_key(json_cursor_t *c, const char **key, size_t *len);
+int json_key_is(const char *key, size_t len, const char *want);
+int json_string(json_cursor_t *c, char *out, size_t size);
+int json_int(json_cursor_t *c, long long *out);
+int json_skip_value(json_cursor_t *c);
+long json_offset(const json_cursor_t *c);
+
+/* JSON writer prototypes */
+int json_writer_open(json_writer_t *w, int fd, int pack);
+int json_writer_close(json_writer_t *w);
+int json_flush(json_writer_t *w);
+void json_raw(json_writer_t *w, const char *s, size_t len);
+void json_lit(json_writer_t *w, const char *s);
+void json_char(json_writer_t *w, char ch);
+void json_put_int(json_writer_t *w, long long v);
+void json_put_string(json_writer_t *w, const char *s);
+
+#endif /* BANK_JSON_H */
@@ -2,7 +2,21 @@
  * Banking System - Logging implementation
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "bank_log.h"
+#include <pthread.h>
+
+/* Keep a fork from copying the log stream while another thread holds it */
+static void log_prepare_fork(void)
+{
+    flockfile(log_file);
+}
+
+static void log_after_fork(void)
+{
+    funlockfile(log_file);
+}
 
 /* Log file initialization */
 void log_init(void)
@@ -13,6 +27,7 @@ void log_init(void)
         perror("Failed to open log file");
         log_file = stderr; /* Fallback to stderr if file cannot be opened */
     }
+    pthread_atfork(log_prepare_fork, log_after_fork, log_after_fork);
 
     time_t now = time(NULL);
     char timestamp[64];
@@ -31,8 +46,9 @@ void log_message(log_level_t level, const char *format, ...)
     }
 
     time_t now = time(NULL);
+    struct tm tm_now;
     char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_now));
 
     const char *level_str;
     switch (level)
@@ -51,6 +67,8 @@ void log_message(log_level_t level, const char *format, ...)
         break;
     }
 
+    // Keep each line whole when worker threads log too
+    flockfile(log_file);
     fprintf(log_file, "[%s] [%s] ", timestamp, level_str);
 
     va_list args;
@@ -60,4 +78,5 @@ void log_message(log_level_t level, const char *format, ...)
 
     fprintf(log_file, "\n");
     fflush(log_file);
+    funlockfile(log_file);
 }
\ No newline at end of file
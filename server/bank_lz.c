@@ -0,0 +1,429 @@
+/*
+ * Banking System - LZ block compression
+ *
+ * A byte-oriented LZ77 codec in the LZ4 mould: a block is a run of
+ * sequences, each a token byte holding a literal count and a match length,
+ * the literals, and a two-byte back offset. Matches are found through a
+ * small hash table of four-byte prefixes, so compression is one pass with
+ * no entropy stage and decompression is little more than memcpy. The last
+ * sequence carries literals only.
+ *
+ * JSON exports and the journal archive are written as packed blocks, each
+ * with a header giving its sizes, the key range it covers and a CRC32C.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_lz.h"
+#include "bank_crc.h"
+#include "bank_log.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define LZ_MIN_MATCH 4      /* shortest match worth a sequence           */
+#define LZ_LAST_LITERALS 5  /* a block always ends in this many literals */
+#define LZ_MATCH_LIMIT 12   /* no match may start closer to the end      */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+/* Unaligned four-byte load */
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* Hash table slot of a four-byte prefix */
+static inline unsigned lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a length beyond what fits in its token nibble */
+static inline unsigned char *put_length(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Emit one sequence; returns NULL if it does not fit before oend */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+                                   size_t lit_len, size_t offset, size_t match_len)
+{
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if ((size_t)(oend - op) < need)
+    {
+        return NULL;
+    }
+
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    unsigned char *token = op++;
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15)
+    {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len)
+    {
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (ml >= 15)
+        {
+            op = put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+/* Compress n bytes into dst; returns the compressed size, or 0 if it
+   would not fit in cap bytes */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const unsigned char *base = src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    const unsigned char *match_end = n > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : base;
+    unsigned char *op = dst, *oend = op + cap;
+
+    memset(table, 0, sizeof(table));
+    while (ip < match_end)
+    {
+        uint32_t seq = read32(ip);
+        unsigned h = lz_hash(seq);
+        const unsigned char *ref = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq)
+        {
+            /* step faster through data that keeps failing to match */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        while (ip > anchor && ref > base && ip[-1] == ref[-1])
+        {
+            ip--;
+            ref--;
+        }
+        const unsigned char *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+        const unsigned char *limit = end - LZ_LAST_LITERALS;
+        while (m < limit && *m == *r)
+        {
+            m++;
+            r++;
+        }
+
+        op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip));
+        if (!op)
+        {
+            return 0;
+        }
+        ip = anchor = m;
+        if (ip < match_end)
+        {
+            table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+/* Read a length continued past its token nibble */
+static inline int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned b;
+    do
+    {
+        if (*ip >= iend)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decompress n bytes of src into dst; returns the bytes produced, or -1
+   if the input is malformed or would overrun cap */
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+    const unsigned char *ip = src, *iend = ip + n;
+    unsigned char *op = dst, *oend = op + cap;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) < 0)
+        {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == iend)
+        {
+            break; /* the closing literals */
+        }
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && get_length(&ip, iend, &len) < 0)
+        {
+            return -1;
+        }
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) || (size_t)(oend - op) < len)
+        {
+            return -1;
+        }
+
+        const unsigned char *ref = op - offset;
+        if (offset >= len)
+        {
+            memcpy(op, ref, len);
+            op += len;
+        }
+        else
+        {
+            /* overlapping copy repeats the last offset bytes */
+            while (len-- > 0)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return (long)(op - (unsigned char *)dst);
+}
+
+/* CRC32C of a block header and its payload */
+static unsigned block_crc(const lz_block_t *h, const void *payload)
+{
+    return crc32c(crc32c(0, h, offsetof(lz_block_t, crc)), payload, (size_t)h->packed_bytes);
+}
+
+/* Pack n bytes into out, which has LZ_BLOCK_BOUND(n) bytes of room, as a
+   block covering keys first to last; returns the block's size. Data that
+   does not shrink is stored as it is. */
+size_t lz_pack_block(void *out, const void *src, size_t n, long long first, long long last)
+{
+    lz_block_t h;
+    char *payload = (char *)out + sizeof(h);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LZ_MAGIC, sizeof(h.magic));
+    h.raw_bytes = (int)n;
+    h.first = first;
+    h.last = last;
+
+    size_t packed = lz_compress(src, n, payload, n);
+    if (packed == 0 || packed >= n)
+    {
+        memcpy(payload, src, n);
+        packed = n;
+        h.flags = LZ_STORED;
+    }
+    h.packed_bytes = (int)packed;
+    h.crc = block_crc(&h, payload);
+    memcpy(out, &h, sizeof(h));
+    return sizeof(h) + packed;
+}
+
+/* Check the header of the block at the start of avail bytes; returns the
+   block's full size, or -1 if it is not a whole block */
+long lz_check_block(const void *block, size_t avail)
+{
+    lz_block_t h;
+
+    if (avail < sizeof(h))
+    {
+        return -1;
+    }
+    memcpy(&h, block, sizeof(h));
+    if (memcmp(h.magic, LZ_MAGIC, sizeof(h.magic)) != 0 ||
+        h.raw_bytes < 0 || h.raw_bytes > LZ_MAX_BLOCK || h.packed_bytes < 0 ||
+        (h.flags == LZ_STORED ? h.packed_bytes != h.raw_bytes : h.flags != 0) ||
+        (size_t)h.packed_bytes > avail - sizeof(h))
+    {
+        return -1;
+    }
+    return (long)(sizeof(h) + h.packed_bytes);
+}
+
+/* Verify a checked block and unpack it into dst; returns the raw size, or
+   -1 if the block is damaged */
+long lz_unpack_block(const void *block, void *dst, size_t cap)
+{
+    lz_block_t h;
+    const char *payload = (const char *)block + sizeof(h);
+
+    memcpy(&h, block, sizeof(h));
+    if (h.crc != block_crc(&h, payload) || (size_t)h.raw_bytes > cap)
+    {
+        return -1;
+    }
+    if (h.flags == LZ_STORED)
+    {
+        memcpy(dst, payload, (size_t)h.raw_bytes);
+        return h.raw_bytes;
+    }
+    long n = lz_decompress(payload, (size_t)h.packed_bytes, dst, (size_t)h.raw_bytes);
+    return n == h.raw_bytes ? n : -1;
+}
+
+/* Work for one unpacking thread: every stride-th block from first */
+typedef struct
+{
+    const char **blocks;
+    char *out;
+    const lz_block_t *heads;
+    int count;
+    int first;
+    int stride;
+    int rc;
+} unpack_job_t;
+
+/* Unpack a share of a stream's blocks; runs on its own thread */
+static void *unpack_share(void *arg)
+{
+    unpack_job_t *job = arg;
+
+    job->rc = 0;
+    for (int i = job->first; i < job->count && job->rc == 0; i += job->stride)
+    {
+        const lz_block_t *h = &job->heads[i];
+        if (lz_unpack_block(job->blocks[i], job->out + h->first, (size_t)h->raw_bytes) != h->raw_bytes)
+        {
+            log_message(LOG_ERROR, "Packed block %d at stream offset %lld is damaged", i, h->first);
+            job->rc = -1;
+        }
+    }
+    return NULL;
+}
+
+/* Unpack a stream of blocks keyed by their raw offsets into one new buffer,
+   several blocks at a time; returns NULL with errno set on failure */
+char *lz_unpack_stream(const void *buf, size_t len, size_t *raw_out)
+{
+    const char *p = buf, *end = p + len;
+    const char **blocks = NULL;
+    lz_block_t *heads = NULL;
+    int count = 0, cap = 0;
+    long long raw = 0;
+
+    /* hop through the headers first; each says where its bytes go */
+    while (p < end)
+    {
+        long size = lz_check_block(p, (size_t)(end - p));
+        if (size < 0 || count == INT_MAX)
+        {
+            log_message(LOG_ERROR, "Packed stream is damaged at byte %ld", (long)(p - (const char *)buf));
+            free(blocks);
+            free(heads);
+            errno = EINVAL;
+            return NULL;
+        }
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            const char **b = realloc(blocks, cap * sizeof(*b));
+            lz_block_t *h = b ? realloc(heads, cap * sizeof(*h)) : NULL;
+            blocks = b ? b : blocks;
+            heads = h ? h : heads;
+            if (!b || !h)
+            {
+                free(blocks);
+                free(heads);
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+        blocks[count] = p;
+        memcpy(&heads[count], p, sizeof(lz_block_t));
+        if (heads[count].first != raw || heads[count].last != raw + heads[count].raw_bytes)
+        {
+            log_message(LOG_ERROR, "Packed block %d does not continue the stream", count);
+            free(blocks);
+            free(heads);
+            errno = EINVAL;
+            return NULL;
+        }
+        raw += heads[count].raw_bytes;
+        count++;
+        p += size;
+    }
+
+    char *out = malloc(raw > 0 ? (size_t)raw : 1);
+    if (!out)
+    {
+        free(blocks);
+        free(heads);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > LZ_MAX_THREADS ? LZ_MAX_THREADS : (int)cores;
+    threads = threads > count ? (count > 0 ? count : 1) : threads;
+
+    unpack_job_t jobs[LZ_MAX_THREADS];
+    pthread_t tids[LZ_MAX_THREADS];
+    int started[LZ_MAX_THREADS] = {0};
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t] = (unpack_job_t){blocks, out, heads, count, t, threads, 0};
+    }
+    for (int t = 1; t < threads; t++)
+    {
+        started[t] = pthread_create(&tids[t], NULL, unpack_share, &jobs[t]) == 0;
+    }
+    unpack_share(&jobs[0]);
+
+    int rc = jobs[0].rc;
+    for (int t = 1; t < threads; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+        else
+        {
+            unpack_share(&jobs[t]);
+        }
+        rc |= jobs[t].rc;
+    }
+    free(blocks);
+    free(heads);
+
+    if (rc != 0)
+    {
+        free(out);
+        errno = EINVAL;
+        return NULL;
+    }
+    *raw_out = (size_t)raw;
+    return out;
+}
@@ -0,0 +1,43 @@
+/*
+ * Banking System - LZ block compression
+ */
+
+#ifndef BANK_LZ_H
+#define BANK_LZ_H
+
+#include "bank_common.h"
+
+#define LZ_MAGIC "BLZ1"      /* first four bytes of every packed block      */
+#define LZ_STORED 1          /* payload is the raw bytes; they did not shrink */
+#define LZ_MAX_BLOCK (16 << 20) /* largest raw block a reader accepts       */
+#define LZ_MAX_THREADS 8     /* most threads one stream is unpacked with    */
+
+/* Room a compressed copy of n bytes may need */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+/* Room a packed block of n raw bytes may need, header included */
+#define LZ_BLOCK_BOUND(n) (sizeof(lz_block_t) + LZ_BOUND(n))
+
+/* Header in front of every packed block. Blocks are self-contained, so a
+   reader can hop from header to header, skip the blocks whose key range it
+   does not need and unpack the rest in any order. */
+typedef struct
+{
+    char magic[4];
+    int flags;         /* LZ_STORED                                   */
+    int raw_bytes;     /* bytes the block unpacks to                  */
+    int packed_bytes;  /* payload bytes that follow the header        */
+    long long first;   /* caller's key range: stream offsets for a    */
+    long long last;    /* file, LSNs for the journal archive          */
+    unsigned crc;      /* CRC32C of the header above and the payload  */
+    int pad;
+} lz_block_t;
+
+/* Compression function prototypes */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+size_t lz_pack_block(void *out, const void *src, size_t n, long long first, long long last);
+long lz_check_block(const void *block, size_t avail);
+long lz_unpack_block(const void *block, void *dst, size_t cap);
+char *lz_unpack_stream(const void *buf, size_t len, size_t *raw_out);
+
+#endif /* BANK_LZ_H */
@@ -1,721 +1,1064 @@
 /*
  * Banking System - Data persistence implementation
+ *
+ * Mutations are made durable by the journal; checkpoints write a binary
+ * snapshot that startup maps in place before replaying the journal
+ * records newer than the snapshot's journal_lsn. The JSON file is kept as
+ * an import path, read when there is no snapshot yet, and as an export.
+ *
+ * With BANK_STORAGE=records the snapshot is replaced by the fixed-record
+ * file, and checkpoints become small, frequent flushes of the accounts and
+ * history chunks that changed.
+ *
+ * The concurrent server maps a shared region before loading and calls
+ * share_bank() before it forks, so every process serves the same bank.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "bank_persistence.h"
 #include "bank_log.h"
+#include "bank_index.h"
+#include "bank_store.h"
+#include "bank_history.h"
+#include "bank_journal.h"
+#include "bank_snapshot.h"
+#include "bank_records.h"
+#include "bank_json.h"
+#include "bank_lz.h"
+#include "bank_arena.h"
+#include "bank_account.h"
+#include "bank_shm.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* State every process of the concurrent server must agree on, behind a
+   pointer so share_bank() can move it into shared memory */
+typedef struct
+{
+    bank_totals_t totals;
+    time_t last_checkpoint;
+    long long checkpoint_count;
+} persist_state_t;
+
+static persist_state_t local_state = {.totals = {.next_number = 100001}}; /* first account number */
+static persist_state_t *ps = &local_state;
 
 /* Global variables defined here */
-account_t bank[MAX_ACCTS];
-int accounts_in_use = 0;
-int next_number = 100001; /* first account number */
+bank_totals_t *bank_totals = &local_state.totals;
 FILE *log_file = NULL;    /* Log file handle */
 
-/* JSON serialization helpers */
+static int defer_depth = 0;   /* open defer_saves() scopes        */
+static int deferred_dirty = 0; /* a save was skipped while deferred */
+static int checkpoint_holds = 0;  /* background jobs that must not be half captured */
+static long long snapshot_lsn = 0; /* journal LSN the loaded snapshot covers */
+static int background_mode = 0;    /* periodic checkpoints fork a snapshot writer */
+static pid_t snapshot_pid = 0;     /* running snapshot writer, 0 if none */
+static struct timespec snapshot_start;
+static long long background_count = 0;
+static int last_snapshot_ms = 0;
+static int record_mode = 0;        /* checkpoints flush dirty records to RECORD_FILE */
+static int read_only = 0;          /* load_data() leaves every file as it found it */
 
-/* Write a string with proper JSON escaping */
-void write_json_string(FILE *f, const char *str)
-{
-    fputc('"', f);
-    for (const char *p = str; *p; p++)
-    {
-        switch (*p)
-        {
-        case '\\':
-            fputs("\\\\", f);
-            break;
-        case '"':
-            fputs("\\\"", f);
-            break;
-        case '\b':
-            fputs("\\b", f);
-            break;
-        case '\f':
-            fputs("\\f", f);
-            break;
-        case '\n':
-            fputs("\\n", f);
-            break;
-        case '\r':
-            fputs("\\r", f);
-            break;
-        case '\t':
-            fputs("\\t", f);
-            break;
-        default:
-            if (*p < 32)
-            {
-                fprintf(f, "\\u%04x", *p);
-            }
-            else
-            {
-                fputc(*p, f);
-            }
-        }
-    }
-    fputc('"', f);
-}
+/* JSON serialization helpers */
 
 /* Writes a transaction as JSON */
-void write_transaction_json(FILE *f, const transaction_t *t)
+void write_transaction_json(json_writer_t *w, const transaction_t *t)
 {
-    fprintf(f, "{"
-               "\"type\":\"%c\","
-               "\"amount\":%d,"
-               "\"when\":%ld,"
-               "\"balance_after\":%d"
-               "}",
-            t->type, t->amount, (long)t->when, t->balance_after);
+    json_lit(w, "{\"type\":\"");
+    json_char(w, t->type);
+    json_lit(w, "\",\"amount\":");
+    json_put_int(w, t->amount);
+    json_lit(w, ",\"when\":");
+    json_put_int(w, (long long)t->when);
+    json_lit(w, ",\"balance_after\":");
+    json_put_int(w, t->balance_after);
+    json_char(w, '}');
 }
 
-/* Writes an account as JSON */
-void write_account_json(FILE *f, const account_t *a)
+/* Writes every member of an account object except the closing brace */
+static void write_account_members(json_writer_t *w, const account_t *a)
 {
-    fprintf(f, "{"
-               "\"number\":%d,"
-               "\"pin\":%d,",
-            a->number, a->pin);
-
-    fputs("\"name\":", f);
-    write_json_string(f, a->name);
-    fputs(",\"nat_id\":", f);
-    write_json_string(f, a->nat_id);
-
-    fprintf(f, ","
-               "\"type\":%d,"
-               "\"balance\":%d,"
-               "\"ntran\":%d,"
-               "\"last\":[",
-            a->type, a->balance, a->ntran);
+    json_lit(w, "{\"number\":");
+    json_put_int(w, a->number);
+    json_lit(w, ",\"pin\":");
+    json_put_int(w, a->pin);
+    json_lit(w, ",\"name\":");
+    json_put_string(w, a->name);
+    json_lit(w, ",\"nat_id\":");
+    json_put_string(w, a->nat_id);
+    json_lit(w, ",\"type\":");
+    json_put_int(w, a->type);
+    json_lit(w, ",\"balance\":");
+    json_put_int(w, a->balance);
+    json_lit(w, ",\"ntran\":");
+    json_put_int(w, a->ntran);
+    json_lit(w, ",\"last\":[");
 
     /* Write transactions */
     int start_index = a->ntran > TRANS_KEEP ? a->ntran - TRANS_KEEP : 0;
-    int written = 0;
 
     for (int i = start_index; i < a->ntran; i++)
     {
-        if (written > 0)
+        if (i > start_index)
         {
-            fputc(',', f);
+            json_char(w, ',');
         }
-        write_transaction_json(f, &a->last[i % TRANS_KEEP]);
-        written++;
+        write_transaction_json(w, &a->last[i % TRANS_KEEP]);
     }
 
-    fputs("]}", f);
+    json_char(w, ']');
 }
 
-/* Skip whitespace in a JSON file */
-void skip_whitespace(FILE *f)
+/* Writes an account as JSON */
+void write_account_json(json_writer_t *w, const account_t *a)
 {
-    int c;
-    while ((c = fgetc(f)) != EOF)
-    {
-        if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
-        {
-            ungetc(c, f);
-            break;
-        }
-    }
+    write_account_members(w, a);
+    json_char(w, '}');
 }
 
-/* Read a string with proper JSON */
-int read_json_string(FILE *f, char *buffer, size_t bufsize)
+/* Writes a stored account as JSON, with history older than the recent
+   cache under "history" */
+static void write_stored_account_json(json_writer_t *w, int slot)
 {
-    int c;
-    size_t pos = 0;
+    account_t a;
+    store_get(slot, &a);
+    write_account_members(w, &a);
 
-    /* Skip opening quote */
-    c = fgetc(f);
-    if (c != '"')
+    int cached = a.ntran > TRANS_KEEP ? TRANS_KEEP : a.ntran;
+    int older = history_count(slot) - cached;
+    if (older > 0)
     {
-        ungetc(c, f);
-        return -1;
-    }
+        transaction_t page[STMT_PAGE];
 
-    while ((c = fgetc(f)) != EOF)
-    {
-        if (c == '"')
-        {
-            /* End of string */
-            buffer[pos] = '\0';
-            return 0;
-        }
-        else if (c == '\\')
+        json_lit(w, ",\"history\":[");
+        for (int off = 0; off < older; off += STMT_PAGE)
         {
-            /* Escape sequence */
-            c = fgetc(f);
-            switch (c)
+            int want = older - off < STMT_PAGE ? older - off : STMT_PAGE;
+            int got = history_read(slot, off, want, page);
+            for (int k = 0; k < got; k++)
             {
-            case '\\':
-            case '"':
-            case '/':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = c;
-                break;
-            case 'b':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = '\b';
-                break;
-            case 'f':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = '\f';
-                break;
-            case 'n':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = '\n';
-                break;
-            case 'r':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = '\r';
-                break;
-            case 't':
-                if (pos < bufsize - 1)
-                    buffer[pos++] = '\t';
-                break;
-            case 'u':
-            {
-                /* Unicode escape - handle simple cases only */
-                char hex[5];
-                if (fread(hex, 1, 4, f) != 4)
-                    return -1;
-                hex[4] = '\0';
-                int val;
-                if (sscanf(hex, "%x", &val) != 1)
-                    return -1;
-                if (val < 256 && pos < bufsize - 1)
+                if (off + k > 0)
                 {
-                    buffer[pos++] = (char)val;
+                    json_char(w, ',');
                 }
-                break;
-            }
-            default:
-                /* Invalid escape - copy the character */
-                if (pos < bufsize - 1)
-                    buffer[pos++] = c;
+                write_transaction_json(w, &page[k]);
             }
         }
-        else
-        {
-            /* Regular character */
-            if (pos < bufsize - 1)
-                buffer[pos++] = c;
-        }
+        json_char(w, ']');
     }
 
-    return -1; /* Unexpected EOF */
+    json_char(w, '}');
 }
 
-/* Skip to a specific character in a JSON file */
-int skip_to_char(FILE *f, char target)
+/* Write every account to a JSON file, compressed if the name ends in .lz */
+int export_data(const char *path)
 {
-    int c;
-    while ((c = fgetc(f)) != EOF)
+    char tmp[256];
+    struct timespec t0, t1;
+    json_writer_t w;
+    size_t len = strlen(path);
+    int pack = len > 3 && strcmp(path + len - 3, ".lz") == 0;
+
+    log_message(LOG_INFO, "Exporting data to %s", path);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* the old file stays in place until the new one is complete */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || json_writer_open(&w, fd, pack) < 0)
     {
-        if (c == target)
+        log_message(LOG_ERROR, "Failed to open data file for writing: %s", strerror(errno));
+        perror("Failed to open data file for writing");
+        if (fd >= 0)
         {
-            return 0;
+            close(fd);
         }
+        return -1;
     }
-    return -1; /* EOF reached */
-}
 
-/* Read a JSON key name and match it */
-int match_json_key(FILE *f, const char *key)
-{
-    skip_whitespace(f);
+    /* Start the main JSON object */
+    json_lit(&w, "{\n  \"version\": ");
+    json_put_int(&w, CURRENT_VERSION);
+    json_lit(&w, ",\n  \"accounts_in_use\": ");
+    json_put_int(&w, bank_totals->accounts_in_use);
+    json_lit(&w, ",\n  \"next_number\": ");
+    json_put_int(&w, bank_totals->next_number);
+    json_lit(&w, ",\n  \"journal_lsn\": ");
+    json_put_int(&w, journal_lsn());
+    json_lit(&w, ",\n  \"accounts\": [\n");
+
+    /* Write all accounts, skipping closed slots */
+    int written = 0;
+    for (int i = 0; i < bank_slots; i++)
+    {
+        if (store_is_free(i))
+        {
+            continue;
+        }
 
-    char buffer[64];
-    if (read_json_string(f, buffer, sizeof(buffer)) < 0)
+        json_lit(&w, written ? ",\n    " : "    ");
+        write_stored_account_json(&w, i);
+        written++;
+    }
+    if (written > 0)
     {
-        return -1;
+        json_char(&w, '\n');
     }
 
-    if (strcmp(buffer, key) != 0)
+    /* Close the JSON structure */
+    json_lit(&w, "  ]\n}\n");
+
+    if (json_writer_close(&w) != 0 || fsync(fd) != 0)
     {
+        log_message(LOG_ERROR, "Failed to write data file: %s", strerror(errno));
+        close(fd);
+        unlink(tmp);
         return -1;
     }
-
-    skip_whitespace(f);
-    if (fgetc(f) != ':')
+    long long bytes = w.bytes;
+    long long raw = w.raw_bytes;
+    close(fd);
+    if (rename(tmp, path) != 0)
     {
+        log_message(LOG_ERROR, "Failed to replace data file: %s", strerror(errno));
         return -1;
     }
 
-    skip_whitespace(f);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+    log_message(LOG_INFO, "Exported %d accounts to %s in %ld ms (%lld bytes, %lld MB/s)", written, path,
+                ms, bytes, raw / 1000 / (ms > 0 ? ms : 1));
+    if (pack)
+    {
+        log_message(LOG_INFO, "Packed %lld bytes of JSON to %lld (ratio %.2f) at %lld MB/s", raw, bytes,
+                    bytes > 0 ? (double)raw / bytes : 0.0, raw / (w.pack_us > 0 ? w.pack_us : 1));
+    }
     return 0;
 }
 
-/* Read a transaction from JSON */
-int read_transaction_json(FILE *f, transaction_t *t)
+/* Check the loaded bank against itself: every open account indexed at its
+   slot and below the number allocator, every history chain whole, and the
+   counters matching what is stored. Returns the problems found, each logged. */
+int verify_data(void)
 {
-    skip_whitespace(f);
-    if (fgetc(f) != '{')
+    int problems = 0, live = 0, broken = 0;
+    size_t chunks = 0;
+
+    for (int i = 0; i < bank_slots; i++)
     {
-        return -1;
+        if (store_is_free(i))
+        {
+            continue;
+        }
+        live++;
+
+        int number = *acct_number(i);
+        if (index_lookup(number) != i)
+        {
+            log_message(LOG_ERROR, "Verify: account %d in slot %d is not indexed there", number, i);
+            problems++;
+        }
+        if (number >= bank_totals->next_number)
+        {
+            log_message(LOG_ERROR, "Verify: account %d is not below the next number %d",
+                        number, bank_totals->next_number);
+            problems++;
+        }
+
+        int n = history_check(i);
+        if (n < 0)
+        {
+            log_message(LOG_ERROR, "Verify: history of account %d is broken", number);
+            broken++;
+        }
+        else
+        {
+            chunks += n;
+        }
     }
 
-    /* Read type */
-    if (match_json_key(f, "type") < 0)
+    if (live != bank_totals->accounts_in_use)
     {
-        return -1;
+        log_message(LOG_ERROR, "Verify: %d open accounts stored, %d counted", live, bank_totals->accounts_in_use);
+        problems++;
     }
-    if (fgetc(f) != '"')
+    if (broken == 0 && chunks != history_chunks_in_use())
     {
-        return -1;
+        log_message(LOG_ERROR, "Verify: %zu history chunks in chains, %zu counted in use",
+                    chunks, history_chunks_in_use());
+        problems++;
     }
-    t->type = fgetc(f);
-    if (fgetc(f) != '"')
+    return problems + broken;
+}
+
+/* Make the rename of a new snapshot durable */
+static int sync_data_dir(void)
+{
+    int dir = open(".", O_RDONLY);
+    if (dir < 0 || fsync(dir) != 0)
     {
+        log_message(LOG_ERROR, "Failed to sync data directory: %s", strerror(errno));
+        if (dir >= 0)
+        {
+            close(dir);
+        }
         return -1;
     }
+    close(dir);
+    return 0;
+}
+
+/* Collect a finished snapshot writer; with wait set, block until it ends */
+static void reap_snapshot(int wait)
+{
+    struct timespec now;
+    int status;
+    pid_t r;
 
-    /* Read amount */
-    if (skip_to_char(f, ',') < 0)
+    if (snapshot_pid <= 0)
     {
-        return -1;
+        return;
     }
-    if (match_json_key(f, "amount") < 0)
+    do
     {
-        return -1;
-    }
-    if (fscanf(f, "%d", &t->amount) != 1)
+        r = waitpid(snapshot_pid, &status, wait ? 0 : WNOHANG);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0)
     {
-        return -1;
+        return; /* still writing */
     }
 
-    /* Read when */
-    if (skip_to_char(f, ',') < 0)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    last_snapshot_ms = (int)((now.tv_sec - snapshot_start.tv_sec) * 1000L +
+                             (now.tv_nsec - snapshot_start.tv_nsec) / 1000000L);
+    snapshot_pid = 0;
+
+    if (r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && journal_drop_old() < 0)
     {
-        return -1;
+        /* the snapshot holds; the journal set aside at the fork waits for the next one */
+        log_message(LOG_ERROR, "Background snapshot finished in %d ms but %s.old could not be retired",
+                    last_snapshot_ms, JOURNAL_FILE);
     }
-    if (match_json_key(f, "when") < 0)
+    else if (r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
     {
-        return -1;
+        /* the journal set aside at the fork is covered now */
+        background_count++;
+        ps->checkpoint_count++;
+        log_message(LOG_INFO, "Background snapshot finished in %d ms", last_snapshot_ms);
     }
-    long when;
-    if (fscanf(f, "%ld", &when) != 1)
+    else
     {
-        return -1;
+        log_message(LOG_ERROR, "Background snapshot failed after %d ms; the next checkpoint runs in the foreground",
+                    last_snapshot_ms);
     }
-    t->when = (time_t)when;
+}
 
-    /* Read balance_after */
-    if (skip_to_char(f, ',') < 0)
+/* Checkpoint in a forked child, which writes the copy-on-write image of the
+   bank as of the fork while this process keeps serving */
+static int save_data_background(void)
+{
+    reap_snapshot(0);
+    if (snapshot_pid > 0)
     {
-        return -1;
+        return 0; /* one writer at a time; the journal keeps everything meanwhile */
     }
-    if (match_json_key(f, "balance_after") < 0)
+
+    /* records from here on go to a fresh journal the snapshot will not cover */
+    if (journal_rotate() < 0)
     {
-        return -1;
+        return save_data();
     }
-    if (fscanf(f, "%d", &t->balance_after) != 1)
+
+    clock_gettime(CLOCK_MONOTONIC, &snapshot_start);
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        return -1;
+        _exit(snapshot_write(SNAP_FILE) == 0 && sync_data_dir() == 0 ? 0 : 1);
     }
-
-    /* Find closing brace */
-    if (skip_to_char(f, '}') < 0)
+    if (pid < 0)
     {
-        return -1;
+        log_message(LOG_ERROR, "Failed to fork snapshot writer: %s", strerror(errno));
+        return save_data();
     }
 
+    snapshot_pid = pid;
+    ps->last_checkpoint = time(NULL);
+    log_message(LOG_INFO, "Background snapshot started (pid %d, journal LSN %lld)",
+                (int)pid, journal_lsn());
     return 0;
 }
 
-/* Save data to file */
-int save_data(void)
+/* Let periodic checkpoints run in the background */
+void background_checkpoints(int on)
 {
-    log_message(LOG_INFO, "Saving data to %s", DATA_FILE);
-
-    printf("System waiting while saving data...\n");
-    sleep(SHORT_WAIT);
+    background_mode = on;
+}
 
-    FILE *f = fopen(DATA_FILE, "w");
-    if (!f)
+/* Empty the journal once a checkpoint holds everything in it. A journal
+   that cannot be emptied fails the checkpoint: its records are safe in
+   the checkpoint, but the next one has to archive and cut them again. */
+static int checkpoint_done(void)
+{
+    ps->last_checkpoint = time(NULL);
+    if (journal_reset() < 0)
     {
-        log_message(LOG_ERROR, "Failed to open data file for writing: %s", strerror(errno));
-        perror("Failed to open data file for writing");
+        log_message(LOG_ERROR, "Checkpoint written but the journal could not be emptied");
         return -1;
     }
-
-    /* Start the main JSON object */
-    fprintf(f, "{\n"
-               "  \"version\": %d,\n"
-               "  \"accounts_in_use\": %d,\n"
-               "  \"next_number\": %d,\n"
-               "  \"accounts\": [\n",
-            CURRENT_VERSION, accounts_in_use, next_number);
-
-    /* Write all accounts */
-    for (int i = 0; i < accounts_in_use; i++)
-    {
-        fprintf(f, "    ");
-        write_account_json(f, &bank[i]);
-        if (i < accounts_in_use - 1)
-        {
-            fprintf(f, ",\n");
-        }
-        else
-        {
-            fprintf(f, "\n");
-        }
-    }
-
-    /* Close the JSON structure */
-    fprintf(f, "  ]\n}\n");
-
-    fclose(f);
-    log_message(LOG_INFO, "Data saved successfully (%d accounts)", accounts_in_use);
-
-    printf("Data saved.\n");
+    ps->checkpoint_count++;
     return 0;
 }
 
-/* Load data from file */
-int load_data(void)
+/* Checkpoint: write a snapshot of every account, or flush the records that
+   changed, then empty the journal */
+int save_data(void)
 {
-    log_message(LOG_INFO, "Loading data from %s", DATA_FILE);
-
-    printf("System waiting while loading data...\n");
-    sleep(MEDIUM_WAIT);
-
-    FILE *f = fopen(DATA_FILE, "r");
-    if (!f)
+    if (record_mode)
     {
-        // File doesn't exist yet - first run
-        if (errno == ENOENT)
+        if (records_flush(RECORD_FILE) < 0)
         {
-            log_message(LOG_INFO, "No existing data file found. Starting with empty file.");
-            printf("No existing data.\n");
-            return 0;
+            return -1;
         }
-        log_message(LOG_ERROR, "Failed to open data file: %s", strerror(errno));
-        perror("Failed to open data file");
-        return -1;
+        return checkpoint_done();
     }
 
-    // Basic JSON parsing
-    skip_whitespace(f);
+    log_message(LOG_INFO, "Saving data to %s", SNAP_FILE);
+
+    /* a background writer must not race this one for the temp file */
+    reap_snapshot(1);
 
-    /* Check for opening brace */
-    if (fgetc(f) != '{')
+    if (snapshot_write(SNAP_FILE) < 0)
     {
-        fclose(f);
         return -1;
     }
 
-    /* Read version */
-    if (match_json_key(f, "version") < 0)
+    /* the rename itself must be durable before the journal is emptied */
+    if (sync_data_dir() < 0)
     {
-        fclose(f);
         return -1;
     }
 
-    int version;
-    if (fscanf(f, "%d", &version) != 1)
+    /* everything journaled so far is in the snapshot */
+    if (checkpoint_done() < 0)
     {
-        fclose(f);
         return -1;
     }
+    log_message(LOG_INFO, "Data saved successfully (%d accounts)", bank_totals->accounts_in_use);
+    return 0;
+}
 
-    /* Check version compatibility */
-    if (version > CURRENT_VERSION)
+/* Make a mutation durable now, or once the enclosing deferred scope ends */
+int commit_data(void)
+{
+    if (defer_depth > 0)
     {
-        log_message(LOG_WARNING, "Data file version %d is newer than supported version %d",
-                    version, CURRENT_VERSION);
-        fprintf(stderr, "Warning: Data file version %d is newer than supported version %d.\n",
-                version, CURRENT_VERSION);
+        deferred_dirty = 1;
+        return 0;
     }
 
-    /* Read accounts_in_use */
-    if (skip_to_char(f, ',') < 0)
+    /* a snapshot also covers changes the journal failed to take */
+    if (journal_commit() < 0)
     {
-        log_message(LOG_ERROR, "Failed to find accounts_in_use in the file");
-        fclose(f);
-        return -1;
-    }
-    if (match_json_key(f, "accounts_in_use") < 0)
-    {
-        fclose(f);
-        return -1;
-    }
-    if (fscanf(f, "%d", &accounts_in_use) != 1)
-    {
-        fclose(f);
-        return -1;
+        return save_data();
     }
 
-    /* Read next_number */
-    if (skip_to_char(f, ',') < 0)
+    reap_snapshot(0);
+    if (checkpoint_holds > 0 || journal_size() == 0)
     {
-        fclose(f);
-        return -1;
+        return 0;
     }
-    if (match_json_key(f, "next_number") < 0)
+
+    /* record flushes are cheap, so they run far more often than snapshots */
+    if (record_mode)
     {
-        fclose(f);
-        return -1;
+        if (journal_size() >= RECORD_FLUSH_BYTES || time(NULL) - ps->last_checkpoint >= RECORD_FLUSH_SECS)
+        {
+            return save_data();
+        }
+        return 0;
     }
-    if (fscanf(f, "%d", &next_number) != 1)
+    if (journal_size() >= JOURNAL_CHECKPOINT_BYTES || time(NULL) - ps->last_checkpoint >= CHECKPOINT_SECS)
     {
-        fclose(f);
-        return -1;
+        return background_mode ? save_data_background() : save_data();
     }
+    return 0;
+}
 
-    /* Find accounts array */
-    if (skip_to_char(f, ',') < 0)
-    {
-        fclose(f);
-        return -1;
-    }
-    if (match_json_key(f, "accounts") < 0)
+/* Hold back commits until the matching flush_deferred() */
+void defer_saves(void)
+{
+    defer_depth++;
+}
+
+/* Close a deferred scope, committing once if anything changed inside it */
+int flush_deferred(void)
+{
+    if (defer_depth > 0 && --defer_depth == 0 && deferred_dirty)
     {
-        fclose(f);
-        return -1;
+        deferred_dirty = 0;
+        return commit_data();
     }
+    return 0;
+}
 
-    skip_whitespace(f);
-    if (fgetc(f) != '[')
+/* Keep periodic checkpoints from capturing a half-finished background job */
+void hold_checkpoints(void)
+{
+    checkpoint_holds++;
+}
+
+/* Allow periodic checkpoints again */
+void release_checkpoints(void)
+{
+    checkpoint_holds--;
+}
+
+/* Fill a STATS reply with the group commit and checkpoint counters */
+void persistence_stats(stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    journal_stats(out);
+    reap_snapshot(0);
+    out->checkpoints = ps->checkpoint_count;
+    out->snapshots_forked = background_count;
+    out->last_snapshot_ms = last_snapshot_ms;
+    out->snapshot_running = snapshot_pid > 0;
+}
+
+/* Read a JSON number that must fit an int */
+static int read_int(json_cursor_t *c, int *out)
+{
+    long long v;
+    if (json_int(c, &v) < 0 || v < INT_MIN || v > INT_MAX)
     {
-        fclose(f);
         return -1;
     }
+    *out = (int)v;
+    return 0;
+}
 
-    /* Read each account */
-    for (int i = 0; i < accounts_in_use; i++)
+/* Read a transaction object; members may come in any order */
+static int read_transaction(json_cursor_t *c, transaction_t *t)
+{
+    memset(t, 0, sizeof(*t));
+
+    int more = json_begin(c, '{', '}');
+    while (more > 0)
     {
-        skip_whitespace(f);
+        const char *key;
+        size_t len;
+        long long when;
+        char typ[2];
 
-        if (fgetc(f) != '{')
+        if (json_key(c, &key, &len) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
 
-        account_t *a = &bank[i];
-
-        /* Read account number */
-        if (match_json_key(f, "number") < 0)
+        if (json_key_is(key, len, "type"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            if (json_string(c, typ, sizeof(typ)) < 0)
+            {
+                return -1;
+            }
+            t->type = typ[0];
         }
-        if (fscanf(f, "%d", &a->number) != 1)
+        else if (json_key_is(key, len, "amount"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            if (read_int(c, &t->amount) < 0)
+            {
+                return -1;
+            }
         }
-
-        /* Read PIN */
-        if (skip_to_char(f, ',') < 0)
+        else if (json_key_is(key, len, "when"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            if (json_int(c, &when) < 0)
+            {
+                return -1;
+            }
+            t->when = (time_t)when;
         }
-        if (match_json_key(f, "pin") < 0)
+        else if (json_key_is(key, len, "balance_after"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            if (read_int(c, &t->balance_after) < 0)
+            {
+                return -1;
+            }
         }
-        if (fscanf(f, "%d", &a->pin) != 1)
+        else if (json_skip_value(c) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
 
-        /* Read name */
-        if (skip_to_char(f, ',') < 0)
+        more = json_next(c, '}');
+    }
+    return more;
+}
+
+/* Read the "last" array, keeping its newest TRANS_KEEP entries in order */
+static int read_recent(json_cursor_t *c, transaction_t *recent, int *count)
+{
+    int seen = 0;
+
+    int more = json_begin(c, '[', ']');
+    while (more > 0)
+    {
+        transaction_t t;
+        if (read_transaction(c, &t) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
-        if (match_json_key(f, "name") < 0)
+        if (seen >= TRANS_KEEP)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            memmove(recent, recent + 1, (TRANS_KEEP - 1) * sizeof(*recent));
         }
-        if (read_json_string(f, a->name, sizeof(a->name)) < 0)
+        recent[seen < TRANS_KEEP ? seen : TRANS_KEEP - 1] = t;
+        seen++;
+
+        more = json_next(c, ']');
+    }
+    *count = seen < TRANS_KEEP ? seen : TRANS_KEEP;
+    return more;
+}
+
+/* Read the "history" array straight into the slot's history */
+static int read_history(json_cursor_t *c, int slot)
+{
+    int more = json_begin(c, '[', ']');
+    while (more > 0)
+    {
+        transaction_t t;
+        if (read_transaction(c, &t) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
+        history_append(slot, &t);
+
+        more = json_next(c, ']');
+    }
+    return more;
+}
 
-        /* Read national ID */
-        if (skip_to_char(f, ',') < 0)
+/* Read one account object into a slot */
+static int read_account(json_cursor_t *c, int slot)
+{
+    account_t rec;
+    account_t *a = &rec;
+    transaction_t recent[TRANS_KEEP];
+    int trans_read = 0;
+
+    memset(a, 0, sizeof(*a));
+
+    int more = json_begin(c, '{', '}');
+    while (more > 0)
+    {
+        const char *key;
+        size_t len;
+        int rc;
+
+        if (json_key(c, &key, &len) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
-        if (match_json_key(f, "nat_id") < 0)
+
+        if (json_key_is(key, len, "number"))
+            rc = read_int(c, &a->number);
+        else if (json_key_is(key, len, "pin"))
+            rc = read_int(c, &a->pin);
+        else if (json_key_is(key, len, "name"))
+            rc = json_string(c, a->name, sizeof(a->name));
+        else if (json_key_is(key, len, "nat_id"))
+            rc = json_string(c, a->nat_id, sizeof(a->nat_id));
+        else if (json_key_is(key, len, "type"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            int type;
+            rc = read_int(c, &type);
+            a->type = (acct_type_t)type;
         }
-        if (read_json_string(f, a->nat_id, sizeof(a->nat_id)) < 0)
+        else if (json_key_is(key, len, "balance"))
+            rc = read_int(c, &a->balance);
+        else if (json_key_is(key, len, "ntran"))
+            rc = read_int(c, &a->ntran);
+        else if (json_key_is(key, len, "last"))
+            rc = read_recent(c, recent, &trans_read);
+        else if (json_key_is(key, len, "history"))
+            rc = read_history(c, slot); /* older than everything under "last" */
+        else
+            rc = json_skip_value(c);
+
+        if (rc < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
+        more = json_next(c, '}');
+    }
+    if (more < 0)
+    {
+        return -1;
+    }
+
+    /* Put the cached entries back at their ring positions */
+    if (a->ntran < trans_read)
+    {
+        a->ntran = trans_read;
+    }
+    for (int k = 0; k < trans_read; k++)
+    {
+        a->last[(a->ntran - trans_read + k) % TRANS_KEEP] = recent[k];
+    }
+
+    store_put(slot, a);
+
+    for (int k = 0; k < trans_read; k++)
+    {
+        history_append(slot, &recent[k]);
+    }
+    return 0;
+}
+
+/* Read the "accounts" array into consecutive slots, counting them as it goes */
+static int read_accounts(json_cursor_t *c, int *count)
+{
+    int more = json_begin(c, '[', ']');
+    while (more > 0)
+    {
+        int slot = *count;
 
-        /* Read account type */
-        if (skip_to_char(f, ',') < 0)
+        /* map segments as the array grows rather than trusting the header */
+        if (slot >= MAX_ACCTS || store_reserve(slot + 1) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
             return -1;
         }
-        if (match_json_key(f, "type") < 0)
+        if (read_account(c, slot) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
+            history_release(slot); /* drop a partly read account */
             return -1;
         }
-        int type;
-        if (fscanf(f, "%d", &type) != 1)
+        (*count)++;
+
+        more = json_next(c, ']');
+    }
+    return more;
+}
+
+/* Parse a JSON export into the account table. Top-level members may come
+   in any order and unknown ones are skipped. */
+static int read_data(json_cursor_t *c)
+{
+    int declared = -1;
+    int count = 0;
+    int rc = 0;
+
+    snapshot_lsn = 0; /* older files predate the journal */
+
+    int more = json_begin(c, '{', '}');
+    while (more > 0 && rc == 0)
+    {
+        const char *key;
+        size_t len;
+        int version;
+
+        if (json_key(c, &key, &len) < 0)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            rc = -1;
+            break;
         }
-        a->type = (acct_type_t)type;
 
-        /* Read balance */
-        if (skip_to_char(f, ',') < 0)
+        if (json_key_is(key, len, "version"))
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            rc = read_int(c, &version);
+            if (rc == 0 && version > CURRENT_VERSION)
+            {
+                log_message(LOG_WARNING, "Data file version %d is newer than supported version %d",
+                            version, CURRENT_VERSION);
+                fprintf(stderr, "Warning: Data file version %d is newer than supported version %d.\n",
+                        version, CURRENT_VERSION);
+            }
         }
-        if (match_json_key(f, "balance") < 0)
+        else if (json_key_is(key, len, "accounts_in_use"))
+            rc = read_int(c, &declared);
+        else if (json_key_is(key, len, "next_number"))
+            rc = read_int(c, &bank_totals->next_number);
+        else if (json_key_is(key, len, "journal_lsn"))
+            rc = json_int(c, &snapshot_lsn);
+        else if (json_key_is(key, len, "accounts"))
+            rc = read_accounts(c, &count);
+        else
+            rc = json_skip_value(c);
+
+        if (rc == 0)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            more = json_next(c, '}');
         }
-        if (fscanf(f, "%d", &a->balance) != 1)
+    }
+
+    /* keep whatever was read, even after an error */
+    bank_totals->accounts_in_use = count;
+    if (rc < 0 || more < 0)
+    {
+        return -1;
+    }
+
+    if (declared >= 0 && declared != count)
+    {
+        log_message(LOG_WARNING, "Data file declares %d accounts but holds %d", declared, count);
+    }
+    return 0;
+}
+
+/* Map a JSON export read-only and parse it, unpacking it first if it was
+   written compressed */
+static int import_data(const char *path)
+{
+    struct stat st;
+    const char *buf = NULL;
+    char *unpacked = NULL;
+    size_t len;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0)
+    {
+        buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED)
         {
-            accounts_in_use = i;
-            fclose(f);
+            close(fd);
             return -1;
         }
+        posix_madvise((void *)buf, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+    len = (size_t)st.st_size;
 
-        /* Read ntran */
-        if (skip_to_char(f, ',') < 0)
+    if (len >= sizeof(lz_block_t) && memcmp(buf, LZ_MAGIC, 4) == 0)
+    {
+        struct timespec t0, t1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        unpacked = lz_unpack_stream(buf, (size_t)st.st_size, &len);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (!unpacked)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            log_message(LOG_ERROR, "Failed to unpack %s", path);
+            fprintf(stderr, "Failed to unpack %s.\n", path);
+            munmap((void *)buf, (size_t)st.st_size);
+            return 1;
         }
-        if (match_json_key(f, "ntran") < 0)
+        long long us = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        log_message(LOG_INFO, "Unpacked %s: %lld bytes to %zu (ratio %.2f) in %lld ms, %lld MB/s",
+                    path, (long long)st.st_size, len, (double)len / st.st_size, us / 1000,
+                    (long long)len / (us > 0 ? us : 1));
+    }
+
+    json_cursor_t c;
+    json_init(&c, unpacked ? unpacked : buf, len);
+    int rc = read_data(&c);
+    if (rc < 0)
+    {
+        log_message(LOG_ERROR, "Malformed data in %s near byte %ld", path, json_offset(&c));
+        fprintf(stderr, "Malformed data in %s near byte %ld.\n", path, json_offset(&c));
+        rc = 1; /* opened, but not cleanly read */
+    }
+
+    if (buf)
+    {
+        munmap((void *)buf, (size_t)st.st_size);
+    }
+    free(unpacked);
+    return rc;
+}
+
+/* Claim the data directory for this process and its children, so a server
+   and an import never work on the same files; the lock lasts until they
+   all end */
+int lock_data_dir(void)
+{
+    int fd = open(LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        const char *why = errno == EWOULDBLOCK ? "a server or import is already using it" : strerror(errno);
+        log_message(LOG_ERROR, "Cannot lock the data directory (%s): %s", LOCK_FILE, why);
+        fprintf(stderr, "Cannot lock the data directory: %s.\n", why);
+        if (fd >= 0)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            close(fd);
         }
-        if (fscanf(f, "%d", &a->ntran) != 1)
+        return -1;
+    }
+    return 0;
+}
+
+/* Make load_data() read only, for checking a data directory in place:
+   nothing is created, trimmed, set aside or checkpointed. The bank it
+   loads must not be served. */
+void load_read_only(void)
+{
+    read_only = 1;
+    journal_read_only();
+    records_read_only();
+}
+
+/* Load the bank: read the record file in records mode, else map the
+   binary snapshot, or import the JSON file when there is neither, then
+   replay the journal */
+int load_data(void)
+{
+    struct timespec t0, t1;
+    const char *source = SNAP_FILE;
+    const char *storage = getenv("BANK_STORAGE");
+    int result = 0;
+    int loaded = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    record_mode = storage && strcmp(storage, "records") == 0;
+
+    if (record_mode)
+    {
+        log_message(LOG_INFO, "Loading data from %s", RECORD_FILE);
+        if (records_load(RECORD_FILE, &snapshot_lsn) == 0)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            source = RECORD_FILE;
+            loaded = 1;
         }
-
-        /* Read last transactions */
-        if (skip_to_char(f, ',') < 0)
+        else if (bank_capacity != 0)
         {
-            accounts_in_use = i;
-            fclose(f);
+            /* failed part way; there is nothing clean to fall back on */
+            fprintf(stderr, "Failed to load %s.\n", RECORD_FILE);
             return -1;
         }
-        if (match_json_key(f, "last") < 0)
+        else if (errno != ENOENT)
         {
-            accounts_in_use = i;
-            fclose(f);
+            /* never replace the bank with an older copy behind the operator's back */
+            log_message(LOG_ERROR, "Record file %s is damaged; nothing loaded", RECORD_FILE);
+            fprintf(stderr, "Record file %s is damaged; nothing loaded. Move it aside to rebuild the bank "
+                    "from %s or %s and the journal.\n", RECORD_FILE, SNAP_FILE, DATA_FILE);
             return -1;
         }
+    }
 
-        skip_whitespace(f);
-        if (fgetc(f) != '[')
+    if (!loaded)
+    {
+        log_message(LOG_INFO, "Loading data from %s", SNAP_FILE);
+    }
+    if (!loaded && snapshot_map(SNAP_FILE, &snapshot_lsn) < 0)
+    {
+        if (errno != ENOENT)
         {
-            accounts_in_use = i;
-            fclose(f);
+            /* the export is older than the journal assumes; leave the choice to the operator */
+            log_message(LOG_ERROR, "Snapshot %s is unusable; nothing loaded", SNAP_FILE);
+            fprintf(stderr, "Snapshot %s is unusable; nothing loaded. Move it aside to rebuild the bank "
+                    "from %s and the journal.\n", SNAP_FILE, DATA_FILE);
             return -1;
         }
 
-        /* Read up to TRANS_KEEP transactions */
-        int trans_read = 0;
-        int next_char;
-
-        skip_whitespace(f);
-        next_char = fgetc(f);
+        // No usable snapshot - fall back to importing the JSON file
+        source = DATA_FILE;
+        log_message(LOG_INFO, "No snapshot found. Importing %s", DATA_FILE);
 
-        while (next_char != ']' && trans_read < TRANS_KEEP)
+        int rc = import_data(DATA_FILE);
+        if (rc < 0 && errno == ENOENT && (rc = import_data(PACKED_DATA_FILE)) >= 0)
         {
-            ungetc(next_char, f);
-
-            if (read_transaction_json(f, &a->last[trans_read % TRANS_KEEP]) < 0)
-            {
-                accounts_in_use = i;
-                fclose(f);
-                return -1;
-            }
-
-            trans_read++;
-
-            skip_whitespace(f);
-            next_char = fgetc(f);
-
-            if (next_char == ',')
-            {
-                skip_whitespace(f);
-                next_char = fgetc(f);
-            }
+            source = PACKED_DATA_FILE;
         }
-
-        /* Skip to end of account object */
-        if (skip_to_char(f, '}') < 0)
+        if (rc > 0)
         {
-            accounts_in_use = i;
-            fclose(f);
-            return -1;
+            result = -1;
         }
-
-        skip_whitespace(f);
-        next_char = fgetc(f);
-
-        /* Check for comma or end of array */
-        if (next_char != ',' && next_char != ']')
+        else if (rc < 0 && errno == ENOENT)
         {
-            accounts_in_use = i + 1;
-            fclose(f);
+            // No data at all - first run
+            source = "empty bank";
+            log_message(LOG_INFO, "No existing data file found. Starting with empty file.");
+            printf("No existing data.\n");
+        }
+        else if (rc < 0)
+        {
+            log_message(LOG_ERROR, "Failed to open data file: %s", strerror(errno));
+            perror("Failed to open data file");
             return -1;
         }
+        store_loaded(bank_totals->accounts_in_use);
 
-        if (next_char == ']' && i < accounts_in_use - 1)
+        /* index whatever was read, even after a partial load */
+        if (index_rebuild() < 0)
         {
-            /* Fewer accounts than expected */
-            accounts_in_use = i + 1;
-            break;
+            result = -1;
         }
     }
 
-    fclose(f);
-    log_message(LOG_INFO, "Data loaded successfully (%d accounts)", accounts_in_use);
+    /* a partly read base is no base for the journal; leave both untouched */
+    if (result != 0)
+    {
+        log_message(LOG_ERROR, "No consistent data to replay the journal onto; %s left as it is", JOURNAL_FILE);
+        return -1;
+    }
+
+    /* bring the snapshot forward with everything journaled after it */
+    if (journal_recover(snapshot_lsn) < 0)
+    {
+        result = -1;
+    }
+    ps->last_checkpoint = time(NULL);
+
+    /* first start in records mode: lay the file out from what was loaded */
+    if (record_mode && !loaded && !read_only && records_create(RECORD_FILE) < 0)
+    {
+        result = -1;
+    }
+
+    /* a journal from before the header is replaced only once a checkpoint
+       holds everything in it */
+    if (result == 0 && journal_legacy() && !read_only && save_data() < 0)
+    {
+        log_message(LOG_ERROR, "Checkpoint after replaying an old-format journal failed; %s left as it is",
+                    JOURNAL_FILE);
+        result = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+    log_message(LOG_INFO, "Startup: %d accounts from %s in %ld ms", bank_totals->accounts_in_use, source, ms);
+    printf("Loaded %d accounts from %s in %ld ms.\n", bank_totals->accounts_in_use, source, ms);
 
-    printf("Data loaded. System online.\n");
+    if (result == 0)
+    {
+        log_message(LOG_INFO, "Data loaded successfully (%d accounts)", bank_totals->accounts_in_use);
+        printf("Data loaded. System online.\n");
+    }
+    return result;
+}
+
+/* Move the loaded bank's bookkeeping into the shared region mapped by
+   shm_init() before load_data(); the tables were allocated there already.
+   Processes forked afterwards then all work on the one bank. */
+int share_bank(void)
+{
+    persist_state_t *shared = shm_share(ps, sizeof(persist_state_t));
+    if (!shared || store_share() < 0 || history_share() < 0 || index_share() < 0 ||
+        journal_share() < 0 || bank_lock_share() < 0)
+    {
+        log_message(LOG_ERROR, "Failed to move the bank into shared memory");
+        return -1;
+    }
+    ps = shared;
+    bank_totals = &shared->totals;
+
+    log_message(LOG_INFO, "Bank shared between processes: %d accounts in %zu MB of shared memory",
+                bank_totals->accounts_in_use, arena_committed() >> 20);
     return 0;
-}
\ No newline at end of file
+}
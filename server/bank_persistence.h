@@ -6,19 +6,26 @@
 #define BANK_PERSISTENCE_H
 
 #include "bank_common.h"
+#include "bank_json.h"
 
-/* JSON serialization/deserialization prototypes */
-void write_json_string(FILE *f, const char *str);
-void write_transaction_json(FILE *f, const transaction_t *t);
-void write_account_json(FILE *f, const account_t *a);
-void skip_whitespace(FILE *f);
-int read_json_string(FILE *f, char *buffer, size_t bufsize);
-int skip_to_char(FILE *f, char target);
-int match_json_key(FILE *f, const char *key);
-int read_transaction_json(FILE *f, transaction_t *t);
+/* JSON serialization prototypes */
+void write_transaction_json(json_writer_t *w, const transaction_t *t);
+void write_account_json(json_writer_t *w, const account_t *a);
 
 /* Persistence function prototypes */
 int save_data(void);
 int load_data(void);
+int lock_data_dir(void);
+void load_read_only(void);
+int export_data(const char *path);
+int verify_data(void);
+int commit_data(void);
+void defer_saves(void);
+int flush_deferred(void);
+void hold_checkpoints(void);
+void release_checkpoints(void);
+void persistence_stats(stats_t *out);
+void background_checkpoints(int on);
+int share_bank(void);
 
 #endif /* BANK_PERSISTENCE_H */
\ No newline at end of file
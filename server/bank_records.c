@@ -0,0 +1,732 @@
+/*
+ * Banking System - Fixed-record data file implementation
+ *
+ * The record file keeps every account at an offset derived from its slot
+ * and every history chunk at one derived from its chunk id, so a
+ * checkpoint writes only what changed since the last one. The store and
+ * the history pool mark slots and chunks dirty as they change, and a flush
+ * drains those marks: a deposit costs one account record and one history
+ * chunk rather than a whole snapshot.
+ *
+ * Records are updated in place, so a flush goes through a write batch.
+ * The changed records and their offsets are written to <file>.batch and
+ * synced before any of them is copied into the record file. A crash while
+ * copying leaves a complete batch that the next load applies again, and a
+ * crash before the batch is synced leaves the record file untouched. A
+ * flush too large to be worth batching rewrites the file instead.
+ *
+ * Every account record carries its own CRC32C, so a record damaged on
+ * disk stops the load with its slot named instead of being taken in.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include "bank_records.h"
+#include "bank_store.h"
+#include "bank_history.h"
+#include "bank_index.h"
+#include "bank_journal.h"
+#include "bank_snapshot.h"
+#include "bank_crc.h"
+#include "bank_log.h"
+#include "bank_uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Refuses to build if an account record outgrows its slot in the file */
+typedef char record_fits_slot[sizeof(acct_record_t) <= RECORD_BYTES ? 1 : -1];
+
+/* One write inside a batch; len bytes of data follow */
+typedef struct
+{
+    long long off;
+    int len;
+    int pad;
+} batch_entry_t;
+
+/* Last bytes of a complete batch */
+typedef struct
+{
+    char magic[8];
+    int count;                /* entries in the batch           */
+    int pad;
+    long long bytes;          /* bytes of entries before this   */
+    unsigned long long sum;   /* checksum of those bytes        */
+} batch_trailer_t;
+
+static int rewrite_pending = 0; /* dirty marks were lost; the next flush rewrites the file */
+static int read_only = 0;       /* records_load() reads the files and writes nothing */
+
+/* Name of the write batch that goes with a record file */
+static void batch_path(char *out, size_t size, const char *path)
+{
+    snprintf(out, size, "%s.batch", path);
+}
+
+/* Write len bytes at off, retrying short writes */
+static int write_at(int fd, const void *p, size_t len, long long off)
+{
+    const char *c = p;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, c, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        c += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Read len bytes at off; a file that ends early is an error */
+static int read_at(int fd, void *p, size_t len, long long off)
+{
+    char *c = p;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, c, len, off);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                errno = EIO;
+            }
+            return -1;
+        }
+        c += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Make renames and new files in the data directory durable */
+static int sync_dir(void)
+{
+    int dir = open(".", O_RDONLY);
+    if (dir < 0)
+    {
+        return -1;
+    }
+    int rc = fsync(dir);
+    close(dir);
+    return rc;
+}
+
+/* Describe the current state in a header for a file with room for slot_cap slots */
+static void rec_header_fill(rec_header_t *h, int slot_cap)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, REC_MAGIC, sizeof(h->magic));
+    h->version = REC_VERSION;
+    h->header_bytes = sizeof(*h);
+    h->record_bytes = RECORD_BYTES;
+    h->record_used = sizeof(acct_record_t);
+    h->chunk_bytes = history_chunk_bytes();
+    h->hist_seg_chunks = HIST_SEG_CHUNKS;
+    h->slot_cap = slot_cap;
+    h->slots = bank_slots;
+    h->accounts = bank_totals->accounts_in_use;
+    h->next_number = bank_totals->next_number;
+    history_state(&h->hist_next, &h->hist_free, &h->hist_in_use);
+    h->hist_off = REC_PAGE + (long long)slot_cap * RECORD_BYTES;
+    h->journal_lsn = journal_lsn();
+    h->written = time(NULL);
+    h->header_sum = snapshot_sum(SNAP_SUM_SEED, h, offsetof(rec_header_t, header_sum));
+}
+
+/* Check a header against this build and the file it came from */
+static int rec_check(const rec_header_t *h, long long file_size)
+{
+    if (memcmp(h->magic, REC_MAGIC, sizeof(h->magic)) != 0)
+    {
+        log_message(LOG_ERROR, "Record file has a bad magic number");
+        return -1;
+    }
+    if (h->header_sum != snapshot_sum(SNAP_SUM_SEED, h, offsetof(rec_header_t, header_sum)))
+    {
+        log_message(LOG_ERROR, "Record file header checksum mismatch");
+        return -1;
+    }
+    if (h->version != REC_VERSION || h->header_bytes != (int)sizeof(*h) ||
+        h->record_bytes != RECORD_BYTES || h->record_used != (int)sizeof(acct_record_t) ||
+        h->chunk_bytes != (int)history_chunk_bytes() || h->hist_seg_chunks != HIST_SEG_CHUNKS)
+    {
+        log_message(LOG_ERROR, "Record file version %d was written with a different layout", h->version);
+        return -1;
+    }
+    if (h->slot_cap <= 0 || h->slot_cap % SEG_SIZE != 0 || h->slot_cap > MAX_ACCTS ||
+        h->slots < 0 || h->slots > h->slot_cap || h->accounts < 0 || h->accounts > h->slots ||
+        h->hist_next < 1 || h->hist_next - 1 > (long long)HIST_MAX_SEGS * HIST_SEG_CHUNKS ||
+        h->hist_off != REC_PAGE + (long long)h->slot_cap * RECORD_BYTES)
+    {
+        log_message(LOG_ERROR, "Record file header holds impossible counts");
+        return -1;
+    }
+    if (file_size < h->hist_off + (long long)(h->hist_next - 1) * h->chunk_bytes)
+    {
+        log_message(LOG_ERROR, "Record file is %lld bytes, too short for its header", file_size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Pack the account in a slot into a RECORD_BYTES buffer */
+static void record_pack(int slot, char *out)
+{
+    const acct_cold_t *c = acct_cold(slot);
+    acct_record_t r;
+
+    memset(&r, 0, sizeof(r));
+    r.number = *acct_number(slot);
+    r.pin = *acct_pin(slot);
+    r.balance = *acct_balance(slot);
+    r.ntran = *acct_ntran(slot);
+    memcpy(r.name, c->name, sizeof(r.name));
+    memcpy(r.nat_id, c->nat_id, sizeof(r.nat_id));
+    r.type = c->type;
+    r.hist_head = c->hist_head;
+    r.hist_tail = c->hist_tail;
+    r.hist_count = c->hist_count;
+    memcpy(r.last, c->last, sizeof(r.last));
+    r.crc = crc32c(0, &r, sizeof(r));
+
+    memset(out, 0, RECORD_BYTES);
+    memcpy(out, &r, sizeof(r));
+}
+
+/* Whether a file record matches its CRC */
+static int record_ok(const char *in)
+{
+    acct_record_t r;
+
+    memcpy(&r, in, sizeof(r));
+    unsigned crc = r.crc;
+    r.crc = 0;
+    return crc32c(0, &r, sizeof(r)) == crc;
+}
+
+/* Put a file record back into a slot's columns */
+static void record_unpack(int slot, const char *in)
+{
+    acct_cold_t *c = acct_cold(slot);
+    acct_record_t r;
+
+    memcpy(&r, in, sizeof(r));
+    *acct_number(slot) = r.number;
+    *acct_pin(slot) = r.pin;
+    *acct_balance(slot) = r.balance;
+    *acct_ntran(slot) = r.ntran;
+    memcpy(c->name, r.name, sizeof(c->name));
+    memcpy(c->nat_id, r.nat_id, sizeof(c->nat_id));
+    c->type = r.type;
+    c->hist_head = r.hist_head;
+    c->hist_tail = r.hist_tail;
+    c->hist_count = r.hist_count;
+    memcpy(c->last, r.last, sizeof(c->last));
+}
+
+/* Write the whole bank as a new record file and rename it into place;
+   the caller holds the bank lock */
+int records_create(const char *path)
+{
+    char tmp[256], batch[256];
+    rec_header_t h;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    batch_path(batch, sizeof(batch), path);
+
+    /* leave room to grow before the history region has to move */
+    long long cap = ((long long)bank_slots * 2 + SEG_SIZE - 1) & ~(long long)(SEG_SIZE - 1);
+    cap = cap < SEG_SIZE ? SEG_SIZE : cap > MAX_ACCTS ? MAX_ACCTS : cap;
+    rec_header_fill(&h, (int)cap);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *buf = malloc((size_t)SEG_SIZE * RECORD_BYTES);
+    if (fd < 0 || !buf)
+    {
+        log_message(LOG_ERROR, "Failed to open %s for writing: %s", tmp, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(buf);
+        rewrite_pending = 1;
+        return -1;
+    }
+
+    int rc = 0;
+    for (int base = 0; base < bank_slots && rc == 0; base += SEG_SIZE)
+    {
+        int n = bank_slots - base < SEG_SIZE ? bank_slots - base : SEG_SIZE;
+        for (int k = 0; k < n; k++)
+        {
+            record_pack(base + k, buf + (size_t)k * RECORD_BYTES);
+        }
+        rc = write_at(fd, buf, (size_t)n * RECORD_BYTES, REC_PAGE + (long long)base * RECORD_BYTES);
+    }
+    free(buf);
+
+    for (int seg = 0; seg < history_segments() && rc == 0; seg++)
+    {
+        rc = write_at(fd, history_segment(seg), history_used_bytes(seg),
+                      h.hist_off + (long long)seg * history_segment_bytes());
+    }
+    if (rc == 0)
+    {
+        rc = write_at(fd, &h, sizeof(h), 0);
+    }
+
+    /* whole pool segments, so a load can map the last one in full */
+    long long size = h.hist_off + (long long)history_segments() * history_segment_bytes();
+    if (rc == 0 && (ftruncate(fd, size) != 0 || fsync(fd) != 0))
+    {
+        rc = -1;
+    }
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to write record file %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        rewrite_pending = 1;
+        return -1;
+    }
+    close(fd);
+
+    /* a batch left over for the old file must never be applied to this one */
+    if ((unlink(batch) != 0 && errno != ENOENT) || sync_dir() != 0 ||
+        rename(tmp, path) != 0 || sync_dir() != 0)
+    {
+        log_message(LOG_ERROR, "Failed to replace %s: %s", path, strerror(errno));
+        rewrite_pending = 1;
+        return -1;
+    }
+
+    store_clear_dirty();
+    history_clear_dirty();
+    rewrite_pending = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_message(LOG_INFO, "Record file %s written: %d accounts, %lld bytes in %ld ms",
+                path, h.accounts, size,
+                (long)((t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L));
+    return 0;
+}
+
+/* Append one write to a batch being built */
+static char *batch_add(char *p, long long off, const void *data, int len)
+{
+    batch_entry_t e;
+    memset(&e, 0, sizeof(e));
+    e.off = off;
+    e.len = len;
+    memcpy(p, &e, sizeof(e));
+    memcpy(p + sizeof(e), data, len);
+    return p + sizeof(e) + len;
+}
+
+/* Copy every write of a verified batch into the record file. With
+   BANK_IO=uring the scattered writes and the sync behind them are queued
+   together and go down in a handful of calls. */
+static int batch_apply(int fd, const char *batch, long long bytes)
+{
+    static uring_t *ring = NULL;
+    static pid_t ring_pid = 0;
+    const char *p = batch;
+    const char *end = batch + bytes;
+    int rc = 0;
+
+    /* a ring cannot be shared with forked processes; each opens its own */
+    if (ring_pid != getpid() && uring_wanted())
+    {
+        uring_close(ring);
+        ring = uring_open(URING_DEPTH);
+        ring_pid = getpid();
+    }
+
+    while (p < end && rc == 0)
+    {
+        batch_entry_t e;
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+        if (e.len < 0 || e.off < 0 || e.len > end - p)
+        {
+            rc = -1;
+        }
+        else
+        {
+            rc = ring ? uring_write(ring, fd, p, e.len, e.off) : write_at(fd, p, e.len, e.off);
+        }
+        p += e.len;
+    }
+    if (!ring)
+    {
+        return rc == 0 ? fdatasync(fd) : -1;
+    }
+    if (rc == 0)
+    {
+        rc = uring_sync(ring, fd);
+    }
+    return uring_wait(ring) == 0 ? rc : -1;
+}
+
+/* Write the slots and chunks that changed since the last flush; the
+   caller holds the bank lock */
+int records_flush(const char *path)
+{
+    char bpath[256];
+    rec_header_t h;
+    struct timespec t0, t1;
+    int *slots = NULL, *chunks = NULL;
+    int nslots = 0, nchunks = 0, cap_slots = 0, cap_chunks = 0;
+
+    if (rewrite_pending)
+    {
+        return records_create(path);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return records_create(path);
+    }
+    if (read_at(fd, &h, sizeof(h), 0) < 0 || rec_check(&h, LLONG_MAX) < 0 || bank_slots > h.slot_cap)
+    {
+        /* no room for the slots in use, so the history region has to move */
+        close(fd);
+        return records_create(path);
+    }
+
+    /* drain the dirty marks */
+    int lost = 0;
+    for (int s = store_next_dirty(-1); s >= 0; s = store_next_dirty(s))
+    {
+        if (s >= h.slot_cap)
+        {
+            continue; /* trimmed off the top; never read back */
+        }
+        if (nslots == cap_slots)
+        {
+            int *grown = realloc(slots, (cap_slots = cap_slots ? cap_slots * 2 : 1024) * sizeof(int));
+            if (!grown)
+            {
+                lost = 1;
+                break;
+            }
+            slots = grown;
+        }
+        slots[nslots++] = s;
+    }
+    for (int c = history_next_dirty(0); c > 0 && !lost; c = history_next_dirty(c))
+    {
+        if (nchunks == cap_chunks)
+        {
+            int *grown = realloc(chunks, (cap_chunks = cap_chunks ? cap_chunks * 2 : 1024) * sizeof(int));
+            if (!grown)
+            {
+                lost = 1;
+                break;
+            }
+            chunks = grown;
+        }
+        chunks[nchunks++] = c;
+    }
+
+    int chunk_bytes = (int)history_chunk_bytes();
+    long long bytes = (long long)nslots * (sizeof(batch_entry_t) + RECORD_BYTES) +
+                      (long long)nchunks * (sizeof(batch_entry_t) + chunk_bytes) +
+                      sizeof(batch_entry_t) + sizeof(rec_header_t);
+    char *batch = lost || bytes > REC_REWRITE_BYTES ? NULL : malloc(bytes + sizeof(batch_trailer_t));
+    if (!batch)
+    {
+        /* too much changed, or the marks could not be collected */
+        free(slots);
+        free(chunks);
+        close(fd);
+        return records_create(path);
+    }
+
+    char rec[RECORD_BYTES];
+    char *p = batch;
+    for (int i = 0; i < nslots; i++)
+    {
+        record_pack(slots[i], rec);
+        p = batch_add(p, REC_PAGE + (long long)slots[i] * RECORD_BYTES, rec, RECORD_BYTES);
+    }
+    for (int i = 0; i < nchunks; i++)
+    {
+        p = batch_add(p, h.hist_off + (long long)(chunks[i] - 1) * chunk_bytes,
+                      history_chunk(chunks[i]), chunk_bytes);
+    }
+    rec_header_fill(&h, h.slot_cap);
+    p = batch_add(p, 0, &h, sizeof(h));
+    free(slots);
+    free(chunks);
+
+    batch_trailer_t t;
+    memset(&t, 0, sizeof(t));
+    memcpy(t.magic, REC_BATCH_MAGIC, sizeof(t.magic));
+    t.count = nslots + nchunks + 1;
+    t.bytes = p - batch;
+    t.sum = snapshot_sum(SNAP_SUM_SEED, batch, t.bytes);
+    memcpy(p, &t, sizeof(t));
+
+    /* the batch is durable before the record file is touched */
+    batch_path(bpath, sizeof(bpath), path);
+    int created = 0;
+    int bfd = open(bpath, O_WRONLY | O_TRUNC);
+    if (bfd < 0 && errno == ENOENT)
+    {
+        bfd = open(bpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        created = 1;
+    }
+    int rc = bfd < 0 ? -1 : 0;
+    if (rc == 0)
+    {
+        rc = write_at(bfd, batch, t.bytes + sizeof(t), 0);
+    }
+    if (rc == 0 && (fdatasync(bfd) != 0 || (created && sync_dir() != 0)))
+    {
+        rc = -1;
+    }
+    if (rc == 0)
+    {
+        rc = batch_apply(fd, batch, t.bytes);
+    }
+    if (rc == 0 && ftruncate(bfd, 0) != 0)
+    {
+        rc = -1;
+    }
+    free(batch);
+    if (bfd >= 0)
+    {
+        close(bfd);
+    }
+    close(fd);
+
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to flush records to %s: %s", path, strerror(errno));
+        rewrite_pending = 1;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_message(LOG_INFO, "Flushed %d accounts and %d history chunks to %s (%lld bytes) in %ld us",
+                nslots, nchunks, path, t.bytes,
+                (long)((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000L));
+    return 0;
+}
+
+/* Finish a flush that was interrupted after its batch was synced */
+static int batch_recover(int fd, const char *path)
+{
+    char bpath[256];
+    struct stat st;
+    batch_trailer_t t;
+
+    batch_path(bpath, sizeof(bpath), path);
+    int bfd = open(bpath, read_only ? O_RDONLY : O_RDWR);
+    if (bfd < 0)
+    {
+        return 0;
+    }
+    if (fstat(bfd, &st) != 0 || st.st_size < (long long)sizeof(t))
+    {
+        close(bfd);
+        return 0; /* nothing pending */
+    }
+
+    char *batch = malloc(st.st_size);
+    int rc = 0;
+    if (!batch || read_at(bfd, batch, st.st_size, 0) < 0)
+    {
+        log_message(LOG_ERROR, "Failed to read write batch %s", bpath);
+        rc = -1;
+    }
+    else
+    {
+        memcpy(&t, batch + st.st_size - sizeof(t), sizeof(t));
+        if (memcmp(t.magic, REC_BATCH_MAGIC, sizeof(t.magic)) != 0 ||
+            t.bytes != st.st_size - (long long)sizeof(t) ||
+            t.sum != snapshot_sum(SNAP_SUM_SEED, batch, t.bytes))
+        {
+            /* torn before it was synced, so the record file was never touched */
+            log_message(LOG_WARNING, "Ignoring incomplete write batch %s", bpath);
+        }
+        else if (read_only)
+        {
+            /* the record file is only whole once the batch is applied */
+            log_message(LOG_ERROR, "Write batch %s is pending and is not applied read only", bpath);
+            rc = -1;
+        }
+        else if (batch_apply(fd, batch, t.bytes) < 0)
+        {
+            log_message(LOG_ERROR, "Failed to apply write batch %s: %s", bpath, strerror(errno));
+            rc = -1;
+        }
+        else
+        {
+            log_message(LOG_INFO, "Applied %d pending record writes from %s", t.count, bpath);
+        }
+    }
+
+    if (rc == 0 && !read_only && ftruncate(bfd, 0) != 0)
+    {
+        rc = -1;
+    }
+    free(batch);
+    close(bfd);
+    return rc;
+}
+
+/* Check the CRC of every account record; buf holds SEG_SIZE records */
+static int records_verify(int fd, const rec_header_t *h, char *buf)
+{
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int base = 0; base < h->slots; base += SEG_SIZE)
+    {
+        int n = h->slots - base < SEG_SIZE ? h->slots - base : SEG_SIZE;
+        if (read_at(fd, buf, (size_t)n * RECORD_BYTES, REC_PAGE + (long long)base * RECORD_BYTES) < 0)
+        {
+            return -1;
+        }
+        for (int k = 0; k < n; k++)
+        {
+            if (!record_ok(buf + (size_t)k * RECORD_BYTES))
+            {
+                log_message(LOG_ERROR, "Account record in slot %d fails its CRC", base + k);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_message(LOG_INFO, "Checked %d account records in %ld us (%s CRC32C)", h->slots,
+                (long)((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000),
+                crc32c_engine());
+    return 0;
+}
+
+/* Make records_load() read only: a pending write batch is refused rather
+   than applied, and the file is neither grown nor rewritten */
+void records_read_only(void)
+{
+    read_only = 1;
+}
+
+/* Load the bank from a record file. Returns -1 with errno ENOENT if there
+   is no record file, or EINVAL if it is unusable and nothing was loaded. */
+int records_load(const char *path, long long *lsn_out)
+{
+    rec_header_t h;
+    struct stat st;
+
+    int fd = open(path, read_only ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (batch_recover(fd, path) < 0 || fstat(fd, &st) != 0 ||
+        read_at(fd, &h, sizeof(h), 0) < 0 || rec_check(&h, st.st_size) < 0 || bank_capacity != 0)
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* every record is checked before any is taken in, so a damaged file
+       leaves the bank empty and the caller free to fall back */
+    char *buf = malloc((size_t)SEG_SIZE * RECORD_BYTES);
+    if (!buf || records_verify(fd, &h, buf) < 0)
+    {
+        free(buf);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* account records are unpacked into the column store */
+    int rc = store_reserve(h.slots) == 0 ? 0 : -1;
+    for (int base = 0; base < h.slots && rc == 0; base += SEG_SIZE)
+    {
+        int n = h.slots - base < SEG_SIZE ? h.slots - base : SEG_SIZE;
+        rc = read_at(fd, buf, (size_t)n * RECORD_BYTES, REC_PAGE + (long long)base * RECORD_BYTES);
+        for (int k = 0; k < n && rc == 0; k++)
+        {
+            record_unpack(base + k, buf + (size_t)k * RECORD_BYTES);
+        }
+    }
+    free(buf);
+
+    /* the history region is mapped in place, whole segments at a time */
+    int segs = (h.hist_next - 1 + HIST_SEG_CHUNKS - 1) / HIST_SEG_CHUNKS;
+    size_t seg_bytes = history_segment_bytes();
+    long long need = h.hist_off + (long long)segs * seg_bytes;
+    char *map = NULL;
+    if (rc == 0 && segs > 0)
+    {
+        if (st.st_size < need && read_only)
+        {
+            /* the file may not be grown to whole segments, so read it instead */
+            map = mmap(NULL, (size_t)segs * seg_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            rc = map == MAP_FAILED ? -1 : read_at(fd, map, (size_t)(st.st_size - h.hist_off), h.hist_off);
+        }
+        else if (st.st_size < need && ftruncate(fd, need) != 0)
+        {
+            rc = -1;
+        }
+        else
+        {
+            map = mmap(NULL, (size_t)segs * seg_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, h.hist_off);
+            rc = map == MAP_FAILED ? -1 : 0;
+        }
+    }
+    close(fd);
+    if (rc == 0 && segs > 0)
+    {
+        rc = history_attach(segs, map, seg_bytes, h.hist_next, h.hist_free, h.hist_in_use);
+    }
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to load record file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    bank_totals->accounts_in_use = h.accounts;
+    bank_totals->next_number = h.next_number;
+    store_loaded(h.slots);
+    if (index_rebuild() < 0)
+    {
+        return -1;
+    }
+
+    *lsn_out = h.journal_lsn;
+    log_message(LOG_INFO, "Record file %s loaded: %d accounts, journal LSN %lld",
+                path, h.accounts, h.journal_lsn);
+    return 0;
+}
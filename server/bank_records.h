@@ -0,0 +1,66 @@
+/*
+ * Banking System - Fixed-record data file
+ */
+
+#ifndef BANK_RECORDS_H
+#define BANK_RECORDS_H
+
+#include "bank_common.h"
+
+#define REC_MAGIC "BANKRECS"   /* first eight bytes of the record file      */
+#define REC_BATCH_MAGIC "RECBATCH" /* trailer of a complete write batch     */
+#define REC_VERSION 2          /* current record layout                     */
+#define REC_PAGE 4096          /* header page; both regions start aligned   */
+#define RECORD_BYTES 256       /* file bytes per account slot, 16 per page  */
+#define REC_REWRITE_BYTES (64L << 20) /* larger flushes rewrite the whole file */
+#define RECORD_FLUSH_BYTES (1L << 20) /* journal size that triggers a flush  */
+#define RECORD_FLUSH_SECS 5    /* longest gap between flushes               */
+
+/* One account as stored at REC_PAGE + slot * RECORD_BYTES */
+typedef struct
+{
+    int number; /* SLOT_FREE for a closed slot */
+    int pin;
+    int balance;
+    int ntran;
+    char name[40];
+    char nat_id[20];
+    acct_type_t type;
+    int hist_head; /* the account's chain in the history region */
+    int hist_tail;
+    int hist_count;
+    unsigned crc; /* CRC32C of the record with this field zero */
+    transaction_t last[TRANS_KEEP];
+} acct_record_t;
+
+/* Header page. History chunk id c lives at hist_off + (c - 1) * chunk_bytes,
+   so every pool segment starts page aligned and the region maps in place. */
+typedef struct
+{
+    char magic[8];
+    int version;
+    int header_bytes;    /* sizeof(rec_header_t) of the writer   */
+    int record_bytes;    /* file stride of an account            */
+    int record_used;     /* sizeof(acct_record_t) of the writer  */
+    int chunk_bytes;     /* file stride of a history chunk       */
+    int hist_seg_chunks; /* chunks per pool segment              */
+    int slot_cap;        /* slots the account region has room for */
+    int slots;           /* slots in use, tombstones included    */
+    int accounts;        /* live accounts                        */
+    int next_number;
+    int hist_next;       /* next never-used chunk id             */
+    int hist_free;       /* head of the recycled chunk list      */
+    long long hist_in_use;
+    long long hist_off;    /* start of the history region        */
+    long long journal_lsn; /* last journal record the file covers */
+    long long written;
+    unsigned long long header_sum; /* everything above */
+} rec_header_t;
+
+/* Record file function prototypes */
+int records_create(const char *path);
+int records_flush(const char *path);
+void records_read_only(void);
+int records_load(const char *path, long long *lsn_out);
+
+#endif /* BANK_RECORDS_H */
@@ -0,0 +1,355 @@
+/*
+ * Banking System - Bank-wide balance reports
+ *
+ * Reports scan the balance column one segment at a time. Each kernel keeps
+ * the total, the count under the threshold and one "at or above edge"
+ * counter per histogram edge in vector registers, so the loop has no
+ * branches except the rare top-N candidate. The widest kernel the CPU
+ * supports is picked once at first use.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_report.h"
+#include "bank_log.h"
+#include "bank_store.h"
+#include <limits.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REPORT_X86 1
+#endif
+
+#define EDGES (REPORT_BINS - 1) /* histogram edges between buckets */
+
+/* Running totals of one report */
+typedef struct
+{
+    long long total;
+    int threshold;
+    int under;
+    int above[EDGES]; /* balances at or above REPORT_BIN_BASE << k */
+    int top_n;
+    int top_len;
+    int top_min;              /* smallest balance that can still enter the top */
+    int top_slot[REPORT_TOP]; /* min-heap on balance */
+    int top_bal[REPORT_TOP];
+} scan_t;
+
+typedef void (*scan_fn)(const int *bal, int base, int n, scan_t *s);
+
+/* Swap two heap entries */
+static void top_swap(scan_t *s, int a, int b)
+{
+    int slot = s->top_slot[a], bal = s->top_bal[a];
+    s->top_slot[a] = s->top_slot[b];
+    s->top_bal[a] = s->top_bal[b];
+    s->top_slot[b] = slot;
+    s->top_bal[b] = bal;
+}
+
+/* Restore the heap after its root was replaced */
+static void top_sift_down(scan_t *s)
+{
+    int k = 0;
+    for (;;)
+    {
+        int c = 2 * k + 1;
+        if (c >= s->top_len)
+        {
+            break;
+        }
+        if (c + 1 < s->top_len && s->top_bal[c + 1] < s->top_bal[c])
+        {
+            c++;
+        }
+        if (s->top_bal[c] >= s->top_bal[k])
+        {
+            break;
+        }
+        top_swap(s, k, c);
+        k = c;
+    }
+}
+
+/* Offer an account to the top-N heap */
+static void top_offer(scan_t *s, int slot, int bal)
+{
+    if (s->top_n == 0 || store_is_free(slot))
+    {
+        return;
+    }
+
+    if (s->top_len < s->top_n)
+    {
+        int k = s->top_len++;
+        s->top_slot[k] = slot;
+        s->top_bal[k] = bal;
+        while (k > 0 && s->top_bal[(k - 1) / 2] > s->top_bal[k])
+        {
+            top_swap(s, k, (k - 1) / 2);
+            k = (k - 1) / 2;
+        }
+    }
+    else if (bal > s->top_bal[0])
+    {
+        s->top_slot[0] = slot;
+        s->top_bal[0] = bal;
+        top_sift_down(s);
+    }
+
+    if (s->top_len == s->top_n)
+    {
+        s->top_min = s->top_bal[0];
+    }
+}
+
+/* Portable kernel; also finishes the tail the vector kernels leave */
+static void scan_scalar(const int *bal, int base, int n, scan_t *s)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int b = bal[i];
+        s->total += b;
+        s->under += b < s->threshold;
+        for (int k = 0; k < EDGES; k++)
+        {
+            s->above[k] += b >= (REPORT_BIN_BASE << k);
+        }
+        if (b > s->top_min)
+        {
+            top_offer(s, base + i, b);
+        }
+    }
+}
+
+#ifdef REPORT_X86
+
+/* SSE2 kernel: four balances per step */
+__attribute__((target("sse2"))) static void scan_sse2(const int *bal, int base, int n, scan_t *s)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i thr = _mm_set1_epi32(s->threshold);
+    __m128i edge[EDGES], above[EDGES];
+    __m128i sum = zero, under = zero;
+    __m128i top = _mm_set1_epi32(s->top_min);
+    int i;
+
+    for (int k = 0; k < EDGES; k++)
+    {
+        edge[k] = _mm_set1_epi32((REPORT_BIN_BASE << k) - 1);
+        above[k] = zero;
+    }
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bal + i));
+
+        /* balances are never negative, so zero extension widens them */
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, zero));
+        under = _mm_sub_epi32(under, _mm_cmplt_epi32(v, thr));
+        for (int k = 0; k < EDGES; k++)
+        {
+            above[k] = _mm_sub_epi32(above[k], _mm_cmpgt_epi32(v, edge[k]));
+        }
+
+        int hit = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, top)));
+        if (hit)
+        {
+            for (int l = 0; l < 4; l++)
+            {
+                if (hit & (1 << l))
+                {
+                    top_offer(s, base + i + l, bal[i + l]);
+                }
+            }
+            top = _mm_set1_epi32(s->top_min);
+        }
+    }
+
+    long long lanes64[2];
+    int lanes[4];
+    _mm_storeu_si128((__m128i *)lanes64, sum);
+    s->total += lanes64[0] + lanes64[1];
+    _mm_storeu_si128((__m128i *)lanes, under);
+    s->under += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (int k = 0; k < EDGES; k++)
+    {
+        _mm_storeu_si128((__m128i *)lanes, above[k]);
+        s->above[k] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    scan_scalar(bal + i, base + i, n - i, s);
+}
+
+/* AVX2 kernel: eight balances per step */
+__attribute__((target("avx2"))) static void scan_avx2(const int *bal, int base, int n, scan_t *s)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i thr = _mm256_set1_epi32(s->threshold);
+    __m256i edge[EDGES], above[EDGES];
+    __m256i sum = zero, under = zero;
+    __m256i top = _mm256_set1_epi32(s->top_min);
+    int i;
+
+    for (int k = 0; k < EDGES; k++)
+    {
+        edge[k] = _mm256_set1_epi32((REPORT_BIN_BASE << k) - 1);
+        above[k] = zero;
+    }
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bal + i));
+
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+        under = _mm256_sub_epi32(under, _mm256_cmpgt_epi32(thr, v));
+        for (int k = 0; k < EDGES; k++)
+        {
+            above[k] = _mm256_sub_epi32(above[k], _mm256_cmpgt_epi32(v, edge[k]));
+        }
+
+        int hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, top)));
+        if (hit)
+        {
+            for (int l = 0; l < 8; l++)
+            {
+                if (hit & (1 << l))
+                {
+                    top_offer(s, base + i + l, bal[i + l]);
+                }
+            }
+            top = _mm256_set1_epi32(s->top_min);
+        }
+    }
+
+    long long lanes64[4];
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes64, sum);
+    s->total += lanes64[0] + lanes64[1] + lanes64[2] + lanes64[3];
+    _mm256_storeu_si256((__m256i *)lanes, under);
+    for (int l = 0; l < 8; l++)
+    {
+        s->under += lanes[l];
+    }
+    for (int k = 0; k < EDGES; k++)
+    {
+        _mm256_storeu_si256((__m256i *)lanes, above[k]);
+        for (int l = 0; l < 8; l++)
+        {
+            s->above[k] += lanes[l];
+        }
+    }
+
+    scan_scalar(bal + i, base + i, n - i, s);
+}
+
+#endif /* REPORT_X86 */
+
+static scan_fn scan_kernel = NULL;
+static const char *scan_name = "scalar";
+
+/* Pick the widest kernel this CPU runs */
+static void pick_kernel(void)
+{
+    scan_kernel = scan_scalar;
+#ifdef REPORT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan_kernel = scan_avx2;
+        scan_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan_kernel = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+    log_message(LOG_INFO, "Report engine: %s kernel", scan_name);
+}
+
+/* Name of the kernel reports run on */
+const char *report_engine(void)
+{
+    if (!scan_kernel)
+    {
+        pick_kernel();
+    }
+    return scan_name;
+}
+
+/* Scan every balance into a report; margin is added to MIN_BALANCE */
+int run_report(int margin, int top_n, report_t *out)
+{
+    struct timespec t0, t1;
+    scan_t s;
+
+    if (top_n < 0 || top_n > REPORT_TOP)
+    {
+        return STATUS_INVALID;
+    }
+    if (!scan_kernel)
+    {
+        pick_kernel();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    memset(&s, 0, sizeof(s));
+    s.threshold = MIN_BALANCE + margin;
+    s.top_n = top_n;
+    s.top_min = top_n > 0 ? -1 : INT_MAX;
+
+    for (int base = 0; base < bank_slots; base += SEG_SIZE)
+    {
+        int n = bank_slots - base < SEG_SIZE ? bank_slots - base : SEG_SIZE;
+        scan_kernel(hot_segs[base >> SEG_SHIFT]->balance, base, n, &s);
+    }
+
+    /* tombstones hold a zero balance: they landed in the first bucket and,
+       for a positive threshold, in the under count */
+    int dead = bank_slots - bank_totals->accounts_in_use;
+    if (s.threshold > 0)
+    {
+        s.under -= dead;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->total = s.total;
+    out->accounts = bank_totals->accounts_in_use;
+    out->threshold = s.threshold;
+    out->under = s.under;
+    out->hist[0] = bank_slots - s.above[0] - dead;
+    for (int k = 1; k < EDGES; k++)
+    {
+        out->hist[k] = s.above[k - 1] - s.above[k];
+    }
+    out->hist[REPORT_BINS - 1] = s.above[EDGES - 1];
+
+    /* drain the min-heap from the back so the list comes out descending */
+    out->top_count = s.top_len;
+    for (int k = s.top_len - 1; k >= 0; k--)
+    {
+        holding_t *h = &out->top[k];
+        h->number = *acct_number(s.top_slot[0]);
+        h->type = acct_cold(s.top_slot[0])->type;
+        h->balance = s.top_bal[0];
+
+        s.top_len--;
+        s.top_slot[0] = s.top_slot[s.top_len];
+        s.top_bal[0] = s.top_bal[s.top_len];
+        top_sift_down(&s);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    out->elapsed_us = (int)((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000);
+    snprintf(out->engine, sizeof(out->engine), "%s", scan_name);
+
+    log_message(LOG_INFO, "Report: %d accounts, total %lld, %d under %d, %d us (%s)",
+                out->accounts, out->total, out->under, out->threshold, out->elapsed_us, scan_name);
+    return STATUS_OK;
+}
@@ -0,0 +1,14 @@
+/*
+ * Banking System - Bank-wide balance reports
+ */
+
+#ifndef BANK_REPORT_H
+#define BANK_REPORT_H
+
+#include "bank_common.h"
+
+/* Report function prototypes */
+const char *report_engine(void);
+int run_report(int margin, int top_n, report_t *out);
+
+#endif /* BANK_REPORT_H */
@@ -5,7 +5,11 @@
 #include "bank_server.h"
 #include "bank_log.h"
 #include "bank_account.h"
+#include "bank_report.h"
+#include "bank_accrual.h"
 #include "bank_persistence.h"
+#include "bank_journal.h"
+#include "bank_store.h"
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
@@ -37,11 +41,56 @@ void shutdown_server(int signal)
     exit(0);
 }
 
+/* Operations and statuses of the BATCH frame being served */
+static batch_op_t batch_ops[BATCH_MAX];
+static signed char batch_status[BATCH_MAX];
+
+/* Receive exactly len bytes; returns len, 0 on disconnect or -1 on error */
+static ssize_t recv_all(int sock, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n;
+        }
+        got += n;
+    }
+    return (ssize_t)got;
+}
+
+/* Send exactly len bytes; returns len or -1 on error */
+static ssize_t send_all(int sock, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sock, (const char *)buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return (ssize_t)sent;
+}
+
 /* Handle a client connection */
 void handle_client(int client_socket)
 {
     request_t request;
     response_t response;
+    int batch_count;
     char client_ip[INET_ADDRSTRLEN];
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
@@ -68,12 +117,13 @@ void handle_client(int client_socket)
     {
         // Reset response structure
         memset(&response, 0, sizeof(response));
+        batch_count = 0;
 
         log_message(LOG_INFO, "Waiting to receive request from client %s", client_ip);
         printf("Waiting to receive request from client %s...\n", client_ip);
 
         // Receive client request
-        ssize_t bytes_received = recv(client_socket, &request, sizeof(request), 0);
+        ssize_t bytes_received = recv_all(client_socket, &request, sizeof(request));
         if (bytes_received <= 0)
         {
             if (bytes_received == 0)
@@ -97,7 +147,32 @@ void handle_client(int client_socket)
                request.command, client_ip, bytes_received);
         sleep(SHORT_WAIT);
 
-        // Process request based on command
+        // A batch's operations follow its frame; read them before taking the lock
+        if (request.command == BATCH)
+        {
+            if (request.amount < 1 || request.amount > BATCH_MAX)
+            {
+                // The frame length cannot be trusted, so drop the connection
+                response.status = STATUS_INVALID;
+                snprintf(response.message, sizeof(response.message),
+                         "Batch rejected: Must carry 1 to %d operations", BATCH_MAX);
+                log_message(LOG_WARNING, "Batch rejected: %d operations from client %s",
+                            request.amount, client_ip);
+                send_all(client_socket, &response, sizeof(response));
+                close(client_socket);
+                return;
+            }
+
+            if (recv_all(client_socket, batch_ops, request.amount * sizeof(batch_op_t)) <= 0)
+            {
+                log_message(LOG_ERROR, "Client %s disconnected in the middle of a batch", client_ip);
+                close(client_socket);
+                return;
+            }
+        }
+
+        // Process request based on command; background jobs wait meanwhile
+        bank_lock();
         switch (request.command)
         {
         case OPEN:
@@ -278,17 +353,29 @@ void handle_client(int client_socket)
         case STATEMENT:
         {
             log_message(LOG_INFO, "Processing STATEMENT command for client %s", client_ip);
-            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d",
-                        request.account_number, request.pin);
-
-            int result = statement(request.account_number, request.pin, &response);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d, Offset=%d, Limit=%d",
+                        request.account_number, request.pin, request.offset, request.limit);
+
+            // A zero limit asks for the latest entries from the recent cache
+            int result = request.limit > 0
+                             ? statement_page(request.account_number, request.pin,
+                                              request.offset, request.limit, &response)
+                             : statement(request.account_number, request.pin, &response);
             response.status = result;
             if (result == STATUS_OK)
             {
-                strcpy(response.message, "Statement retrieved successfully");
+                snprintf(response.message, sizeof(response.message),
+                         "Statement retrieved successfully (%d of %d transactions)",
+                         response.transaction_count, response.transaction_total);
                 log_message(LOG_INFO, "Statement request successful: Account=%d, Transactions=%d",
                             request.account_number, response.transaction_count);
             }
+            else if (result == STATUS_INVALID)
+            {
+                strcpy(response.message, "Statement request rejected: Invalid offset or limit");
+                log_message(LOG_WARNING, "Statement request rejected: Offset=%d, Limit=%d",
+                            request.offset, request.limit);
+            }
             else
             {
                 strcpy(response.message, "Statement request failed: Account not found or wrong PIN");
@@ -298,14 +385,150 @@ void handle_client(int client_socket)
             break;
         }
 
+        case ACCOUNTS:
+        {
+            log_message(LOG_INFO, "Processing ACCOUNTS command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d",
+                        request.account_number, request.pin);
+
+            int result = list_accounts(request.account_number, request.pin, &response);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Customer holds %d account(s), total balance %lld",
+                         response.holding_count, response.total_holdings);
+                log_message(LOG_INFO, "Account listing successful: Account=%d, Accounts=%d, Total=%lld",
+                            request.account_number, response.holding_count, response.total_holdings);
+            }
+            else
+            {
+                strcpy(response.message, "Account listing failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Account listing failed: Account %d not found or wrong PIN",
+                            request.account_number);
+            }
+            break;
+        }
+
+        case TRANSFER:
+        {
+            log_message(LOG_INFO, "Processing TRANSFER command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, PIN=%d, To=%d, Amount=%d",
+                        request.account_number, request.pin, request.to_account, request.amount);
+
+            int result = transfer(request.account_number, request.pin,
+                                  request.to_account, request.amount);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                int bal;
+                balance(request.account_number, request.pin, &bal);
+                response.balance = bal;
+                snprintf(response.message, sizeof(response.message),
+                         "Transfer to %d successful. New balance: %d", request.to_account, bal);
+                log_message(LOG_INFO, "Transfer successful: Account=%d, To=%d, Amount=%d, New Balance=%d",
+                            request.account_number, request.to_account, request.amount, bal);
+            }
+            else if (result == STATUS_MIN_AMT)
+            {
+                strcpy(response.message, "Transfer rejected: Would break minimum balance");
+                log_message(LOG_WARNING, "Transfer rejected: Would break minimum balance for account %d",
+                            request.account_number);
+            }
+            else if (result == STATUS_INVALID)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Transfer rejected: Must be >= %d to a different account", MIN_DEPOSIT);
+                log_message(LOG_WARNING, "Transfer rejected: Amount %d to account %d not valid",
+                            request.amount, request.to_account);
+            }
+            else
+            {
+                strcpy(response.message, "Transfer failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Transfer failed: Account %d or %d not found, or wrong PIN",
+                            request.account_number, request.to_account);
+            }
+            break;
+        }
+
+        case REPORT:
+        {
+            log_message(LOG_INFO, "Processing REPORT command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Account=%d, Margin=%d, Top=%d",
+                        request.account_number, request.amount, request.limit);
+
+            // Bank-wide figures are only for a signed-in account holder
+            int result = authenticate(request.account_number, request.pin);
+            if (result != STATUS_OK)
+            {
+                response.status = result;
+                strcpy(response.message, "Report failed: Account not found or wrong PIN");
+                log_message(LOG_WARNING, "Report refused: Account %d not found or wrong PIN",
+                            request.account_number);
+                break;
+            }
+
+            result = run_report(request.amount, request.limit, &response.report);
+            response.status = result;
+            if (result == STATUS_OK)
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Report over %d accounts: total %lld, %d under %d (%d us, %s)",
+                         response.report.accounts, response.report.total,
+                         response.report.under, response.report.threshold,
+                         response.report.elapsed_us, response.report.engine);
+                log_message(LOG_INFO, "Report successful: Accounts=%d, Total=%lld",
+                            response.report.accounts, response.report.total);
+            }
+            else
+            {
+                snprintf(response.message, sizeof(response.message),
+                         "Report rejected: Top list holds 0 to %d accounts", REPORT_TOP);
+                log_message(LOG_WARNING, "Report rejected: Top=%d", request.limit);
+            }
+            break;
+        }
+
+        case BATCH:
+        {
+            log_message(LOG_INFO, "Processing BATCH command for client %s", client_ip);
+            log_message(LOG_INFO, "Request details: Operations=%d", request.amount);
+
+            batch_count = request.amount;
+            int applied = apply_batch(batch_ops, batch_count, batch_status);
+            response.status = STATUS_OK;
+            response.transaction_total = batch_count;
+            response.transaction_count = applied;
+            snprintf(response.message, sizeof(response.message),
+                     "Batch applied: %d of %d operations succeeded", applied, batch_count);
+            log_message(LOG_INFO, "Batch from client %s: %d of %d applied",
+                        client_ip, applied, batch_count);
+            break;
+        }
+
+        case STATS:
+        {
+            log_message(LOG_INFO, "Processing STATS command for client %s", client_ip);
+
+            persistence_stats(&response.stats);
+            response.status = STATUS_OK;
+            snprintf(response.message, sizeof(response.message),
+                     "%lld syncs covering %lld records, %lld checkpoints (%lld in the background%s)",
+                     response.stats.commits, response.stats.records_synced,
+                     response.stats.checkpoints, response.stats.snapshots_forked,
+                     response.stats.snapshot_running ? ", one running" : "");
+            break;
+        }
+
         case QUIT:
         {
+            bank_unlock();
             log_message(LOG_INFO, "Client %s requested to quit", client_ip);
             // Send termination response
             response.status = STATUS_OK;
             strcpy(response.message, "Shutting Down...");
             log_message(LOG_INFO, "Sending termination message to client %s", client_ip);
-            send(client_socket, &response, sizeof(response), 0);
+            send_all(client_socket, &response, sizeof(response));
             log_message(LOG_INFO, "Closing connection with client %s", client_ip);
             close(client_socket);
             return;
@@ -320,6 +543,25 @@ void handle_client(int client_socket)
             break;
         }
         }
+        long long ticket = journal_lsn();
+        bank_unlock();
+
+        // Hold the reply until the changes it reports are on disk
+        if (journal_wait(ticket) < 0)
+        {
+            // The journal failed; a checkpoint makes them durable instead
+            bank_lock();
+            int saved = commit_data();
+            bank_unlock();
+            if (saved != 0)
+            {
+                response.status = STATUS_ERROR;
+                batch_count = 0;
+                strcpy(response.message, "Request failed: Changes could not be saved");
+                log_message(LOG_ERROR, "Changes for client %s are neither journaled nor checkpointed",
+                            client_ip);
+            }
+        }
 
         log_message(LOG_INFO, "Preparing to send response to client %s (status: %d)",
                     client_ip, response.status);
@@ -327,7 +569,12 @@ void handle_client(int client_socket)
         sleep(SHORT_WAIT);
 
         // Send response back to client
-        ssize_t bytes_sent = send(client_socket, &response, sizeof(response), 0);
+        ssize_t bytes_sent = send_all(client_socket, &response, sizeof(response));
+        if (bytes_sent >= 0 && batch_count > 0)
+        {
+            // A batch reply carries one status byte per operation
+            bytes_sent = send_all(client_socket, batch_status, batch_count);
+        }
         if (bytes_sent < 0)
         {
             log_message(LOG_ERROR, "Error sending response to client %s: %s",
@@ -473,6 +720,14 @@ void run_server(void)
         log_message(LOG_INFO, "Finished handling client %s:%d, returning to accept loop",
                     client_ip, client_port);
         printf("Finished handling client %s:%d\n", client_ip, client_port);
+
+        // Reclaim closed-account holes between client sessions
+        bank_lock();
+        if (!accrual_running() && store_free_count() * COMPACT_RATIO > bank_slots)
+        {
+            store_compact(COMPACT_BUDGET);
+        }
+        bank_unlock();
         sleep(SHORT_WAIT);
     }
 
@@ -0,0 +1,339 @@
+/*
+ * Banking System - Shared memory for the multi-process server
+ *
+ * The concurrent server forks one process per client, so the bank has to
+ * live in memory every process sees. shm_init() maps one large shared
+ * anonymous region before the bank is loaded; every fork inherits it at
+ * the same address, so pointers stored inside it are valid everywhere.
+ * Nothing is committed until touched.
+ *
+ * The region is carved with a bump pointer under a process-shared lock.
+ * Arena segments take whole pages. Smaller tables such as the index come
+ * with a 16-byte header. Blocks up to 2 KB go back on per-size free lists.
+ * Larger ones hand their pages back to the system, but their addresses
+ * are not reused, as in the arena.
+ *
+ * Locks placed in the region are process-shared and robust. When a
+ * process dies holding one, the next shm_lock() caller is told, logs it
+ * and carries on with the data as the dead process left it. The bank lock
+ * does not go through shm_lock(); see bank_lock().
+ *
+ * Until shm_init() runs, the shm_* allocators fall through to the heap,
+ * so the single-process server pays nothing.
+ */
+
+#define _GNU_SOURCE
+
+#include "bank_shm.h"
+#include "bank_log.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Start of the region; the allocator state lives here */
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t next;                   /* first unused offset              */
+    size_t committed;              /* bytes handed out, not yet freed  */
+    void *free_lists[SHM_CLASSES]; /* recycled blocks of each size     */
+} shm_header_t;
+
+/* In front of every shm_calloc() block */
+typedef struct
+{
+    size_t bytes; /* usable bytes after the header   */
+    long cls;     /* size class, -1 for page blocks  */
+} shm_block_t;
+
+static char *base = NULL;
+static shm_header_t *hdr = NULL;
+
+/* Round a size up to a whole number of pages */
+static size_t page_round(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Map the shared region; must run before the bank is loaded and before any fork */
+int shm_init(void)
+{
+    void *p = mmap(NULL, SHM_RESERVE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Could not map %zu bytes of shared memory: %s",
+                    (size_t)SHM_RESERVE, strerror(errno));
+        return -1;
+    }
+
+    base = p;
+    hdr = p;
+    hdr->next = page_round(sizeof(shm_header_t));
+    if (shm_mutex_init(&hdr->lock) != 0)
+    {
+        munmap(p, SHM_RESERVE);
+        base = NULL;
+        hdr = NULL;
+        return -1;
+    }
+
+    log_message(LOG_INFO, "Shared bank region of %zu GB mapped at %p",
+                (size_t)(SHM_RESERVE >> 30), p);
+    return 0;
+}
+
+/* Whether the bank lives in the shared region */
+int shm_active(void)
+{
+    return base != NULL;
+}
+
+/* Whether p points into the shared region */
+int shm_owns(const void *p)
+{
+    return base && (const char *)p >= base && (const char *)p < base + SHM_RESERVE;
+}
+
+/* Take size bytes from the top of the region; caller holds the lock */
+static void *bump(size_t size, size_t align)
+{
+    size_t off = (hdr->next + align - 1) & ~(align - 1);
+    if (off + size > SHM_RESERVE)
+    {
+        log_message(LOG_ERROR, "Shared region exhausted: %zu bytes requested", size);
+        return NULL;
+    }
+    hdr->next = off + size;
+    hdr->committed += size;
+    return base + off;
+}
+
+/* Hand out zeroed, page-aligned pages for an arena segment */
+void *shm_pages(size_t size)
+{
+    size = page_round(size);
+    shm_lock(&hdr->lock);
+    void *p = bump(size, (size_t)sysconf(_SC_PAGESIZE));
+    pthread_mutex_unlock(&hdr->lock);
+    return p;
+}
+
+/* Give the memory of pages back; their addresses are not reused */
+void shm_release_pages(void *p, size_t size)
+{
+    size = page_round(size);
+    if (madvise(p, size, MADV_REMOVE) < 0)
+    {
+        log_message(LOG_WARNING, "Could not release %zu shared bytes: %s", size, strerror(errno));
+    }
+    shm_lock(&hdr->lock);
+    hdr->committed -= size;
+    pthread_mutex_unlock(&hdr->lock);
+}
+
+/* Bytes of the region currently in use */
+size_t shm_committed(void)
+{
+    shm_lock(&hdr->lock);
+    size_t n = hdr->committed;
+    pthread_mutex_unlock(&hdr->lock);
+    return n;
+}
+
+/* Allocate zeroed memory: from the region once shm_init() ran, else the heap */
+void *shm_calloc(size_t n, size_t size)
+{
+    if (!shm_active())
+    {
+        return calloc(n, size);
+    }
+    if (size != 0 && n > (SHM_RESERVE - sizeof(shm_block_t)) / size)
+    {
+        return NULL;
+    }
+
+    size_t want = n * size + sizeof(shm_block_t);
+    long cls = 0;
+    while (cls < SHM_CLASSES && ((size_t)SHM_MIN_BLOCK << cls) < want)
+    {
+        cls++;
+    }
+
+    shm_block_t *b;
+    shm_lock(&hdr->lock);
+    if (cls == SHM_CLASSES)
+    {
+        cls = -1;
+        want = page_round(want);
+        b = bump(want, (size_t)sysconf(_SC_PAGESIZE));
+    }
+    else if (hdr->free_lists[cls])
+    {
+        want = (size_t)SHM_MIN_BLOCK << cls;
+        b = hdr->free_lists[cls];
+        hdr->free_lists[cls] = *(void **)(b + 1);
+        hdr->committed += want;
+        memset(b, 0, want);
+    }
+    else
+    {
+        want = (size_t)SHM_MIN_BLOCK << cls;
+        b = bump(want, SHM_MIN_BLOCK);
+    }
+    pthread_mutex_unlock(&hdr->lock);
+
+    if (!b)
+    {
+        return NULL;
+    }
+    b->bytes = want - sizeof(shm_block_t);
+    b->cls = cls;
+    return b + 1;
+}
+
+/* Free memory from shm_calloc(); heap pointers go back to the heap */
+void shm_free(void *p)
+{
+    if (!shm_owns(p))
+    {
+        free(p);
+        return;
+    }
+
+    shm_block_t *b = (shm_block_t *)p - 1;
+    size_t bytes = b->bytes + sizeof(shm_block_t);
+    if (b->cls < 0)
+    {
+        shm_release_pages(b, bytes);
+        return;
+    }
+
+    shm_lock(&hdr->lock);
+    *(void **)p = hdr->free_lists[b->cls];
+    hdr->free_lists[b->cls] = b;
+    hdr->committed -= bytes;
+    pthread_mutex_unlock(&hdr->lock);
+}
+
+/* realloc() for memory from shm_calloc() */
+void *shm_realloc(void *p, size_t size)
+{
+    if (!shm_owns(p) && (p || !shm_active()))
+    {
+        return realloc(p, size);
+    }
+    if (!p)
+    {
+        return shm_calloc(1, size);
+    }
+
+    shm_block_t *b = (shm_block_t *)p - 1;
+    if (size <= b->bytes)
+    {
+        return p;
+    }
+    void *fresh = shm_calloc(1, size);
+    if (fresh)
+    {
+        memcpy(fresh, p, b->bytes);
+        shm_free(p);
+    }
+    return fresh;
+}
+
+/* Copy a module's state into the region and return the copy; the original
+   is returned unchanged when there is no region */
+void *shm_share(void *state, size_t size)
+{
+    if (!shm_active())
+    {
+        return state;
+    }
+    void *copy = shm_calloc(1, size);
+    if (copy)
+    {
+        memcpy(copy, state, size);
+    }
+    else
+    {
+        log_message(LOG_ERROR, "Failed to move %zu bytes of state into shared memory", size);
+    }
+    return copy;
+}
+
+/* Initialise a mutex usable by every process of the region */
+int shm_mutex_init(pthread_mutex_t *m)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to create a shared lock: %s", strerror(rc));
+    }
+    return rc;
+}
+
+/* Initialise a condition variable usable by every process of the region */
+int shm_cond_init(pthread_cond_t *c, int monotonic)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (monotonic)
+    {
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    }
+    int rc = pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to create a shared condition: %s", strerror(rc));
+    }
+    return rc;
+}
+
+/* Recover a robust lock whose previous holder died */
+static void recover(pthread_mutex_t *m)
+{
+    log_message(LOG_WARNING, "A process died holding a shared lock; continuing with the data it left");
+    pthread_mutex_consistent(m);
+}
+
+/* Lock a mutex, taking over from a holder that died */
+void shm_lock(pthread_mutex_t *m)
+{
+    if (pthread_mutex_lock(m) == EOWNERDEAD)
+    {
+        recover(m);
+    }
+}
+
+/* pthread_cond_wait() that takes over from a holder that died */
+int shm_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+    int rc = pthread_cond_wait(c, m);
+    if (rc == EOWNERDEAD)
+    {
+        recover(m);
+        rc = 0;
+    }
+    return rc;
+}
+
+/* pthread_cond_timedwait() that takes over from a holder that died */
+int shm_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *deadline)
+{
+    int rc = pthread_cond_timedwait(c, m, deadline);
+    if (rc == EOWNERDEAD)
+    {
+        recover(m);
+        rc = 0;
+    }
+    return rc;
+}
@@ -0,0 +1,32 @@
+/*
+ * Banking System - Shared memory for the multi-process server
+ */
+
+#ifndef BANK_SHM_H
+#define BANK_SHM_H
+
+#include "bank_common.h"
+#include <pthread.h>
+
+#define SHM_RESERVE ((size_t)1 << 36) /* address space of the shared region (64 GB) */
+#define SHM_MIN_BLOCK 32              /* smallest block, header included           */
+#define SHM_CLASSES 7                 /* recycled block sizes: 32 bytes to 2 KB    */
+
+/* Shared memory function prototypes */
+int shm_init(void);
+int shm_active(void);
+int shm_owns(const void *p);
+void *shm_pages(size_t size);
+void shm_release_pages(void *p, size_t size);
+size_t shm_committed(void);
+void *shm_calloc(size_t n, size_t size);
+void *shm_realloc(void *p, size_t size);
+void shm_free(void *p);
+void *shm_share(void *state, size_t size);
+int shm_mutex_init(pthread_mutex_t *m);
+int shm_cond_init(pthread_cond_t *c, int monotonic);
+void shm_lock(pthread_mutex_t *m);
+int shm_cond_wait(pthread_cond_t *c, pthread_mutex_t *m);
+int shm_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *deadline);
+
+#endif /* BANK_SHM_H */
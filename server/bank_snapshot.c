@@ -0,0 +1,884 @@
+/*
+ * Banking System - Memory-mappable binary snapshots
+ *
+ * A snapshot is the in-memory image of the bank written block by block:
+ * the hot and cold account segments, the history pool and the account
+ * index, each block aligned so it can be mapped in place. Loading maps the
+ * files privately and points the segment directories, the pool and the
+ * index straight at them, so there is nothing to parse and pages are read
+ * on first touch. Writes to a mapped page copy it, which leaves the files
+ * themselves untouched until the next snapshot replaces them.
+ *
+ * The segments are split into shards, each a file of its own written and
+ * verified by its own thread; a small manifest at the snapshot path holds
+ * the account index and names the shard files. Version 1 snapshots, one
+ * file holding every block, are still loaded.
+ *
+ * All integers are in host byte order; the headers record the sizes the
+ * layout was written with and a snapshot from a different build of the
+ * structures is refused.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bank_snapshot.h"
+#include "bank_store.h"
+#include "bank_history.h"
+#include "bank_index.h"
+#include "bank_journal.h"
+#include "bank_log.h"
+#include "bank_uring.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Round up to the next block boundary */
+static long long snap_align(long long n)
+{
+    return (n + SNAP_ALIGN - 1) & ~(long long)(SNAP_ALIGN - 1);
+}
+
+/* Running 64-bit checksum; eight bytes per step */
+unsigned long long snapshot_sum(unsigned long long h, const void *p, size_t n)
+{
+    const unsigned char *b = p;
+    uint64_t w;
+
+    for (; n >= 8; n -= 8, b += 8)
+    {
+        memcpy(&w, b, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; n > 0; n--)
+    {
+        h = (h ^ *b++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Fill in the block offsets implied by the counts in a header */
+static void snap_layout(snap_header_t *h)
+{
+    h->hot_off = snap_align(sizeof(snap_header_t));
+    h->cold_off = h->hot_off + (long long)h->segs * snap_align(h->hot_bytes);
+    h->hist_off = h->cold_off + (long long)h->segs * snap_align(h->cold_bytes);
+    h->index_off = h->hist_off + (long long)h->hist_segs * snap_align(history_segment_bytes());
+    h->file_bytes = snap_align(h->index_off + h->index_cap * h->index_entry_bytes);
+}
+
+/* Write len bytes at off and fold them into a checksum; with a ring the
+   write is only queued, and checksums the next block while it runs */
+static int write_block(uring_t *u, int fd, const void *p, size_t len, long long off, unsigned long long *sum)
+{
+    const char *c = p;
+
+    if (u)
+    {
+        int rc = uring_write(u, fd, p, len, off);
+        *sum = snapshot_sum(*sum, p, len);
+        return rc;
+    }
+
+    *sum = snapshot_sum(*sum, p, len);
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, c, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        c += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Shard files to write: one per core unless BANK_SNAP_SHARDS says
+   otherwise, and never more than there are account segments */
+static int shard_count(int segs)
+{
+    const char *env = getenv("BANK_SNAP_SHARDS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    n = n < 1 ? 1 : n > SNAP_MAX_SHARDS ? SNAP_MAX_SHARDS : n;
+    if (n > segs)
+    {
+        n = segs > 0 ? segs : 1;
+    }
+    return (int)n;
+}
+
+/* File name of one shard of a snapshot */
+static void shard_name(char *out, size_t size, const char *path, long long gen, int shard)
+{
+    snprintf(out, size, "%s.%lld.%d", path, gen, shard);
+}
+
+/* Fill in the block offsets of a shard from its ranges */
+static void shard_layout(snap_shard_header_t *h)
+{
+    h->hot_off = snap_align(sizeof(snap_shard_header_t));
+    h->cold_off = h->hot_off + (long long)(h->seg_hi - h->seg_lo) * snap_align(h->hot_bytes);
+    h->hist_off = h->cold_off + (long long)(h->seg_hi - h->seg_lo) * snap_align(h->cold_bytes);
+    h->file_bytes = snap_align(h->hist_off + (long long)(h->hist_hi - h->hist_lo) * snap_align(h->hist_seg_bytes));
+}
+
+/* Work for one shard thread */
+typedef struct
+{
+    const char *path;    /* manifest the shard belongs to     */
+    snap_manifest_t *m;
+    int shard;
+    int verify;          /* load: recompute block checksums   */
+    char *map;           /* load: the mapped shard file       */
+    snap_shard_header_t h;
+    int rc;
+} shard_job_t;
+
+/* Write one shard file and sync it; runs on its own thread */
+static void *shard_write(void *arg)
+{
+    shard_job_t *job = arg;
+    snap_shard_header_t *h = &job->h;
+    snap_shard_t *e = &job->m->shard[job->shard];
+    char name[300];
+
+    shard_name(name, sizeof(name), job->path, job->m->gen, job->shard);
+    job->rc = -1;
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        log_message(LOG_ERROR, "Failed to open %s for writing: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SHARD_MAGIC, sizeof(h->magic));
+    h->version = SNAP_VERSION;
+    h->shard = job->shard;
+    h->gen = job->m->gen;
+    h->seg_lo = e->seg_lo;
+    h->seg_hi = e->seg_hi;
+    h->hist_lo = e->hist_lo;
+    h->hist_hi = e->hist_hi;
+    h->hot_bytes = sizeof(acct_hot_t);
+    h->cold_bytes = SEG_SIZE * sizeof(acct_cold_t);
+    h->hist_seg_bytes = history_segment_bytes();
+    shard_layout(h);
+
+    /* with BANK_IO=uring every block of the shard is in flight at once */
+    uring_t *ring = uring_wanted() ? uring_open(URING_DEPTH) : NULL;
+    h->hot_sum = h->cold_sum = h->hist_sum = SNAP_SUM_SEED;
+    int rc = 0;
+    for (int seg = h->seg_lo; seg < h->seg_hi && rc == 0; seg++)
+    {
+        rc = write_block(ring, fd, hot_segs[seg], h->hot_bytes,
+                         h->hot_off + (long long)(seg - h->seg_lo) * snap_align(h->hot_bytes), &h->hot_sum);
+    }
+    for (int seg = h->seg_lo; seg < h->seg_hi && rc == 0; seg++)
+    {
+        rc = write_block(ring, fd, cold_segs[seg], h->cold_bytes,
+                         h->cold_off + (long long)(seg - h->seg_lo) * snap_align(h->cold_bytes), &h->cold_sum);
+    }
+    for (int seg = h->hist_lo; seg < h->hist_hi && rc == 0; seg++)
+    {
+        /* chunks never handed out stay a hole in the file */
+        rc = write_block(ring, fd, history_segment(seg), history_used_bytes(seg),
+                         h->hist_off + (long long)(seg - h->hist_lo) * snap_align(h->hist_seg_bytes), &h->hist_sum);
+    }
+
+    h->header_sum = snapshot_sum(SNAP_SUM_SEED, h, offsetof(snap_shard_header_t, header_sum));
+    if (rc == 0)
+    {
+        unsigned long long ignored = 0;
+        rc = write_block(ring, fd, h, sizeof(*h), 0, &ignored);
+    }
+    if (ring && uring_wait(ring) != 0)
+    {
+        rc = -1;
+    }
+    uring_close(ring);
+    if (rc == 0 && (ftruncate(fd, h->file_bytes) != 0 || fsync(fd) != 0))
+    {
+        rc = -1;
+    }
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to write snapshot shard %s: %s", name, strerror(errno));
+    }
+    close(fd);
+
+    e->file_bytes = h->file_bytes;
+    e->header_sum = h->header_sum;
+    job->rc = rc;
+    return NULL;
+}
+
+/* Run fn over every job, one thread per job after the first, which runs
+   on the calling thread */
+static void run_shards(shard_job_t *jobs, int n, void *(*fn)(void *))
+{
+    pthread_t tids[SNAP_MAX_SHARDS];
+    int started[SNAP_MAX_SHARDS] = {0};
+
+    for (int i = 1; i < n; i++)
+    {
+        started[i] = pthread_create(&tids[i], NULL, fn, &jobs[i]) == 0;
+    }
+    fn(&jobs[0]);
+    for (int i = 1; i < n; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(tids[i], NULL);
+        }
+        else
+        {
+            fn(&jobs[i]); /* no thread to be had; do it here */
+        }
+    }
+}
+
+/* Make the manifest rename and the new shard names durable */
+static int sync_dir(void)
+{
+    int dir = open(".", O_RDONLY);
+    if (dir < 0)
+    {
+        return -1;
+    }
+    int rc = fsync(dir);
+    close(dir);
+    return rc;
+}
+
+/* Remove shard files that do not belong to generation keep */
+static void prune_shards(const char *path, long long keep)
+{
+    size_t len = strlen(path);
+    DIR *dir = opendir(".");
+    struct dirent *d;
+
+    if (!dir)
+    {
+        return;
+    }
+    while ((d = readdir(dir)) != NULL)
+    {
+        long long gen;
+        int shard, end = 0;
+
+        if (strncmp(d->d_name, path, len) == 0 && d->d_name[len] == '.' &&
+            sscanf(d->d_name + len + 1, "%lld.%d%n", &gen, &shard, &end) == 2 &&
+            d->d_name[len + 1 + end] == '\0' && gen != keep)
+        {
+            unlink(d->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/* Write the whole bank as a manifest at path and shard files beside it,
+   the shards in parallel; the caller holds the bank lock */
+int snapshot_write(const char *path)
+{
+    static long long last_gen = 0;
+    char tmp[256];
+    snap_manifest_t m;
+    shard_job_t jobs[SNAP_MAX_SHARDS];
+    size_t index_cap, index_used, entry_bytes;
+    struct timespec t0, t1, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    /* a fresh generation, even from a forked writer whose parent never
+       sees last_gen move */
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long gen = (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+    gen = gen > last_gen ? gen : last_gen + 1;
+    last_gen = gen;
+
+    const void *index = index_image(&index_cap, &index_used, &entry_bytes);
+
+    memset(&m, 0, sizeof(m));
+    memcpy(m.magic, SNAP_MAGIC, sizeof(m.magic));
+    m.version = SNAP_VERSION;
+    m.header_bytes = sizeof(m);
+    m.seg_size = SEG_SIZE;
+    m.hot_bytes = sizeof(acct_hot_t);
+    m.cold_bytes = SEG_SIZE * sizeof(acct_cold_t);
+    m.hist_chunk_bytes = history_segment_bytes() / HIST_SEG_CHUNKS;
+    m.slots = bank_slots;
+    m.segs = (bank_slots + SEG_SIZE - 1) >> SEG_SHIFT;
+    m.accounts = bank_totals->accounts_in_use;
+    m.next_number = bank_totals->next_number;
+    m.journal_lsn = journal_lsn();
+    m.written = time(NULL);
+    m.gen = gen;
+    m.hist_segs = history_segments();
+    history_state(&m.hist_next, &m.hist_free, &m.hist_in_use);
+    m.index_entry_bytes = entry_bytes;
+    m.index_cap = index_cap;
+    m.index_used = index_used;
+    m.index_off = snap_align(sizeof(m));
+    m.file_bytes = snap_align(m.index_off + m.index_cap * m.index_entry_bytes);
+
+    /* even ranges of account segments and of pool segments per shard */
+    m.shards = shard_count(m.segs);
+    for (int i = 0; i < m.shards; i++)
+    {
+        m.shard[i].seg_lo = (int)((long long)m.segs * i / m.shards);
+        m.shard[i].seg_hi = (int)((long long)m.segs * (i + 1) / m.shards);
+        m.shard[i].hist_lo = (int)((long long)m.hist_segs * i / m.shards);
+        m.shard[i].hist_hi = (int)((long long)m.hist_segs * (i + 1) / m.shards);
+
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].path = path;
+        jobs[i].m = &m;
+        jobs[i].shard = i;
+    }
+
+    run_shards(jobs, m.shards, shard_write);
+
+    int rc = 0;
+    for (int i = 0; i < m.shards; i++)
+    {
+        rc |= jobs[i].rc;
+    }
+
+    int fd = rc == 0 ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0)
+    {
+        rc = -1;
+    }
+    m.index_sum = SNAP_SUM_SEED;
+    if (rc == 0 && index_cap > 0)
+    {
+        rc = write_block(NULL, fd, index, index_cap * entry_bytes, m.index_off, &m.index_sum);
+    }
+    m.header_sum = snapshot_sum(SNAP_SUM_SEED, &m, offsetof(snap_manifest_t, header_sum));
+    if (rc == 0)
+    {
+        unsigned long long ignored = 0;
+        rc = write_block(NULL, fd, &m, sizeof(m), 0, &ignored);
+    }
+    if (rc == 0 && (ftruncate(fd, m.file_bytes) != 0 || fsync(fd) != 0))
+    {
+        rc = -1;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    /* the manifest names a complete set, or the old one stays in place */
+    if (rc == 0 && (sync_dir() != 0 || rename(tmp, path) != 0))
+    {
+        rc = -1;
+    }
+    if (rc != 0)
+    {
+        log_message(LOG_ERROR, "Failed to write snapshot %s: %s", path, strerror(errno));
+        unlink(tmp);
+        for (int i = 0; i < m.shards; i++)
+        {
+            char name[300];
+            shard_name(name, sizeof(name), path, gen, i);
+            unlink(name);
+        }
+        return -1;
+    }
+    /* old shards go only once the new manifest is durable */
+    if (sync_dir() == 0)
+    {
+        prune_shards(path, gen);
+    }
+
+    long long bytes = m.file_bytes;
+    for (int i = 0; i < m.shards; i++)
+    {
+        bytes += m.shard[i].file_bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_message(LOG_INFO, "Snapshot written to %s: %d accounts in %d shards, %lld bytes in %ld ms",
+                path, m.accounts, m.shards, bytes,
+                (long)((t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L));
+    return 0;
+}
+
+/* Check a header against this build and the file it came from */
+static int snap_check(const snap_header_t *h, long long file_size)
+{
+    snap_header_t want = *h;
+    size_t index_cap, index_used, entry_bytes;
+
+    index_image(&index_cap, &index_used, &entry_bytes);
+
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0)
+    {
+        log_message(LOG_ERROR, "Snapshot has a bad magic number");
+        return -1;
+    }
+    if (h->header_sum != snapshot_sum(SNAP_SUM_SEED, h, offsetof(snap_header_t, header_sum)))
+    {
+        log_message(LOG_ERROR, "Snapshot header checksum mismatch");
+        return -1;
+    }
+    if (h->version != SNAP_VERSION_SINGLE || h->header_bytes != (int)sizeof(*h) ||
+        h->seg_size != SEG_SIZE || h->hot_bytes != (int)sizeof(acct_hot_t) ||
+        h->cold_bytes != (int)(SEG_SIZE * sizeof(acct_cold_t)) ||
+        h->hist_chunk_bytes != (int)(history_segment_bytes() / HIST_SEG_CHUNKS) ||
+        h->index_entry_bytes != (int)entry_bytes)
+    {
+        log_message(LOG_ERROR, "Snapshot version %d was written with a different layout", h->version);
+        return -1;
+    }
+    if (h->slots < 0 || h->segs != (h->slots + SEG_SIZE - 1) >> SEG_SHIFT || h->segs > MAX_SEGS ||
+        h->accounts < 0 || h->accounts > h->slots ||
+        h->hist_segs < 0 || h->hist_segs > HIST_MAX_SEGS ||
+        h->hist_next < 1 || h->hist_next - 1 > (long long)h->hist_segs * HIST_SEG_CHUNKS ||
+        h->index_cap < 0 || h->index_used > h->index_cap)
+    {
+        log_message(LOG_ERROR, "Snapshot header holds impossible counts");
+        return -1;
+    }
+
+    snap_layout(&want);
+    if (want.hot_off != h->hot_off || want.cold_off != h->cold_off || want.hist_off != h->hist_off ||
+        want.index_off != h->index_off || want.file_bytes != h->file_bytes || h->file_bytes != file_size)
+    {
+        log_message(LOG_ERROR, "Snapshot is %lld bytes but its header describes %lld",
+                    file_size, want.file_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+/* Recompute the block checksums of a mapped snapshot */
+static int snap_verify(const snap_header_t *h, const char *map)
+{
+    unsigned long long hot = SNAP_SUM_SEED, cold = SNAP_SUM_SEED, hist = SNAP_SUM_SEED, index = SNAP_SUM_SEED;
+    size_t hist_seg = history_segment_bytes();
+    long long hist_used = (long long)(h->hist_next - 1) * h->hist_chunk_bytes;
+
+    for (int seg = 0; seg < h->segs; seg++)
+    {
+        hot = snapshot_sum(hot, map + h->hot_off + (long long)seg * snap_align(h->hot_bytes), h->hot_bytes);
+    }
+    for (int seg = 0; seg < h->segs; seg++)
+    {
+        cold = snapshot_sum(cold, map + h->cold_off + (long long)seg * snap_align(h->cold_bytes), h->cold_bytes);
+    }
+    for (int seg = 0; seg < h->hist_segs; seg++)
+    {
+        long long n = hist_used - (long long)seg * hist_seg;
+        hist = snapshot_sum(hist, map + h->hist_off + (long long)seg * snap_align(hist_seg),
+                        n < (long long)hist_seg ? (size_t)n : hist_seg);
+    }
+    if (h->index_cap > 0)
+    {
+        index = snapshot_sum(index, map + h->index_off, h->index_cap * h->index_entry_bytes);
+    }
+
+    if (hot != h->hot_sum || cold != h->cold_sum || hist != h->hist_sum || index != h->index_sum)
+    {
+        log_message(LOG_ERROR, "Snapshot block checksum mismatch (hot %d, cold %d, history %d, index %d)",
+                    hot != h->hot_sum, cold != h->cold_sum, hist != h->hist_sum, index != h->index_sum);
+        return -1;
+    }
+    return 0;
+}
+
+/* Map a version 1 snapshot and adopt it as the account table */
+static int map_single(int fd, const struct stat *st, const char *path, long long *lsn_out)
+{
+    snap_header_t h;
+
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+    {
+        log_message(LOG_ERROR, "Failed to read snapshot header from %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    if (snap_check(&h, st->st_size) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *map = mmap(NULL, h.file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Failed to map snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const char *verify = getenv("BANK_SNAP_VERIFY");
+    if ((!verify || strcmp(verify, "0") != 0) && snap_verify(&h, map) < 0)
+    {
+        munmap(map, h.file_bytes);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int seg = 0; seg < h.segs; seg++)
+    {
+        if (store_attach((acct_hot_t *)(map + h.hot_off + (long long)seg * snap_align(h.hot_bytes)),
+                         (acct_cold_t *)(map + h.cold_off + (long long)seg * snap_align(h.cold_bytes))) < 0)
+        {
+            return -1;
+        }
+    }
+    if (history_attach(h.hist_segs, map + h.hist_off, snap_align(history_segment_bytes()),
+                       h.hist_next, h.hist_free, h.hist_in_use) < 0)
+    {
+        return -1;
+    }
+
+    bank_totals->accounts_in_use = h.accounts;
+    bank_totals->next_number = h.next_number;
+    store_loaded(h.slots);
+
+    if (h.index_cap > 0 ? index_attach(map + h.index_off, h.index_cap, h.index_used) < 0
+                        : index_rebuild() < 0)
+    {
+        return -1;
+    }
+
+    *lsn_out = h.journal_lsn;
+    log_message(LOG_INFO, "Snapshot %s mapped: %d accounts, %lld bytes, journal LSN %lld",
+                path, h.accounts, h.file_bytes, h.journal_lsn);
+    return 0;
+}
+
+/* Check a manifest against this build and the file it came from */
+static int manifest_check(const snap_manifest_t *m, long long file_size)
+{
+    size_t index_cap, index_used, entry_bytes;
+
+    index_image(&index_cap, &index_used, &entry_bytes);
+
+    if (m->header_sum != snapshot_sum(SNAP_SUM_SEED, m, offsetof(snap_manifest_t, header_sum)))
+    {
+        log_message(LOG_ERROR, "Snapshot manifest checksum mismatch");
+        return -1;
+    }
+    if (m->header_bytes != (int)sizeof(*m) ||
+        m->seg_size != SEG_SIZE || m->hot_bytes != (int)sizeof(acct_hot_t) ||
+        m->cold_bytes != (int)(SEG_SIZE * sizeof(acct_cold_t)) ||
+        m->hist_chunk_bytes != (int)(history_segment_bytes() / HIST_SEG_CHUNKS) ||
+        m->index_entry_bytes != (int)entry_bytes)
+    {
+        log_message(LOG_ERROR, "Snapshot version %d was written with a different layout", m->version);
+        return -1;
+    }
+    if (m->slots < 0 || m->segs != (m->slots + SEG_SIZE - 1) >> SEG_SHIFT || m->segs > MAX_SEGS ||
+        m->accounts < 0 || m->accounts > m->slots ||
+        m->hist_segs < 0 || m->hist_segs > HIST_MAX_SEGS ||
+        m->hist_next < 1 || m->hist_next - 1 > (long long)m->hist_segs * HIST_SEG_CHUNKS ||
+        m->index_cap < 0 || m->index_used > m->index_cap ||
+        m->shards < 1 || m->shards > SNAP_MAX_SHARDS)
+    {
+        log_message(LOG_ERROR, "Snapshot manifest holds impossible counts");
+        return -1;
+    }
+
+    /* the shards must cover every segment once, in order */
+    int seg = 0, hist = 0;
+    for (int i = 0; i < m->shards; i++)
+    {
+        const snap_shard_t *e = &m->shard[i];
+        if (e->seg_lo != seg || e->seg_hi < e->seg_lo || e->hist_lo != hist || e->hist_hi < e->hist_lo)
+        {
+            log_message(LOG_ERROR, "Snapshot manifest has a gap at shard %d", i);
+            return -1;
+        }
+        seg = e->seg_hi;
+        hist = e->hist_hi;
+    }
+    if (seg != m->segs || hist != m->hist_segs)
+    {
+        log_message(LOG_ERROR, "Snapshot manifest shards cover %d of %d segments", seg, m->segs);
+        return -1;
+    }
+
+    long long index_off = snap_align(sizeof(*m));
+    long long file_bytes = snap_align(index_off + m->index_cap * m->index_entry_bytes);
+    if (m->index_off != index_off || m->file_bytes != file_bytes || file_bytes != file_size)
+    {
+        log_message(LOG_ERROR, "Snapshot manifest is %lld bytes but describes %lld",
+                    file_size, file_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+/* Open, check, map and verify one shard file; runs on its own thread */
+static void *shard_map(void *arg)
+{
+    shard_job_t *job = arg;
+    snap_shard_header_t *h = &job->h;
+    const snap_manifest_t *m = job->m;
+    const snap_shard_t *e = &m->shard[job->shard];
+    snap_shard_header_t want;
+    struct stat st;
+    char name[300];
+
+    shard_name(name, sizeof(name), job->path, m->gen, job->shard);
+    job->rc = -1;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        log_message(LOG_ERROR, "Snapshot shard %s is missing: %s", name, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h))
+    {
+        log_message(LOG_ERROR, "Failed to read snapshot shard header from %s", name);
+        close(fd);
+        return NULL;
+    }
+
+    want = *h;
+    shard_layout(&want);
+    if (memcmp(h->magic, SHARD_MAGIC, sizeof(h->magic)) != 0 ||
+        h->header_sum != snapshot_sum(SNAP_SUM_SEED, h, offsetof(snap_shard_header_t, header_sum)) ||
+        h->header_sum != e->header_sum || h->version != SNAP_VERSION ||
+        h->gen != m->gen || h->shard != job->shard ||
+        h->seg_lo != e->seg_lo || h->seg_hi != e->seg_hi ||
+        h->hist_lo != e->hist_lo || h->hist_hi != e->hist_hi ||
+        h->hot_bytes != m->hot_bytes || h->cold_bytes != m->cold_bytes ||
+        h->hist_seg_bytes != (long long)history_segment_bytes() ||
+        want.hot_off != h->hot_off || want.cold_off != h->cold_off || want.hist_off != h->hist_off ||
+        want.file_bytes != h->file_bytes || h->file_bytes != e->file_bytes || h->file_bytes != st.st_size)
+    {
+        log_message(LOG_ERROR, "Snapshot shard %s does not match its manifest", name);
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, h->file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Failed to map snapshot shard %s: %s", name, strerror(errno));
+        return NULL;
+    }
+    job->map = map;
+
+    if (job->verify)
+    {
+        unsigned long long hot = SNAP_SUM_SEED, cold = SNAP_SUM_SEED, hist = SNAP_SUM_SEED;
+        long long hist_seg = h->hist_seg_bytes;
+        long long hist_used = (long long)(m->hist_next - 1) * m->hist_chunk_bytes;
+
+        for (int seg = h->seg_lo; seg < h->seg_hi; seg++)
+        {
+            hot = snapshot_sum(hot, map + h->hot_off + (long long)(seg - h->seg_lo) * snap_align(h->hot_bytes),
+                               h->hot_bytes);
+        }
+        for (int seg = h->seg_lo; seg < h->seg_hi; seg++)
+        {
+            cold = snapshot_sum(cold, map + h->cold_off + (long long)(seg - h->seg_lo) * snap_align(h->cold_bytes),
+                                h->cold_bytes);
+        }
+        for (int seg = h->hist_lo; seg < h->hist_hi; seg++)
+        {
+            long long n = hist_used - (long long)seg * hist_seg;
+            n = n < 0 ? 0 : n < hist_seg ? n : hist_seg;
+            hist = snapshot_sum(hist, map + h->hist_off + (long long)(seg - h->hist_lo) * snap_align(hist_seg),
+                                (size_t)n);
+        }
+        if (hot != h->hot_sum || cold != h->cold_sum || hist != h->hist_sum)
+        {
+            log_message(LOG_ERROR, "Snapshot shard %s checksum mismatch (hot %d, cold %d, history %d)",
+                        name, hot != h->hot_sum, cold != h->cold_sum, hist != h->hist_sum);
+            return NULL;
+        }
+    }
+    job->rc = 0;
+    return NULL;
+}
+
+/* Map a version 2 snapshot: the manifest here, the shards in parallel,
+   then adopt the segments in order */
+static int map_sharded(int fd, const struct stat *st, const char *path, long long *lsn_out)
+{
+    snap_manifest_t m;
+    shard_job_t jobs[SNAP_MAX_SHARDS];
+
+    if (pread(fd, &m, sizeof(m), 0) != (ssize_t)sizeof(m))
+    {
+        log_message(LOG_ERROR, "Failed to read snapshot manifest from %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    if (manifest_check(&m, st->st_size) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *map = mmap(NULL, m.file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        log_message(LOG_ERROR, "Failed to map snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const char *verify = getenv("BANK_SNAP_VERIFY");
+    int check = !verify || strcmp(verify, "0") != 0;
+    if (check && m.index_cap > 0 &&
+        snapshot_sum(SNAP_SUM_SEED, map + m.index_off, m.index_cap * m.index_entry_bytes) != m.index_sum)
+    {
+        log_message(LOG_ERROR, "Snapshot index checksum mismatch");
+        munmap(map, m.file_bytes);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < m.shards; i++)
+    {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].path = path;
+        jobs[i].m = &m;
+        jobs[i].shard = i;
+        jobs[i].verify = check;
+    }
+    run_shards(jobs, m.shards, shard_map);
+
+    int rc = 0;
+    for (int i = 0; i < m.shards; i++)
+    {
+        rc |= jobs[i].rc;
+    }
+    if (rc != 0)
+    {
+        for (int i = 0; i < m.shards; i++)
+        {
+            if (jobs[i].map)
+            {
+                munmap(jobs[i].map, jobs[i].h.file_bytes);
+            }
+        }
+        munmap(map, m.file_bytes);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < m.shards; i++)
+    {
+        const snap_shard_header_t *h = &jobs[i].h;
+        char *shard = jobs[i].map;
+
+        for (int seg = h->seg_lo; seg < h->seg_hi; seg++)
+        {
+            long long k = seg - h->seg_lo;
+            if (store_attach((acct_hot_t *)(shard + h->hot_off + k * snap_align(h->hot_bytes)),
+                             (acct_cold_t *)(shard + h->cold_off + k * snap_align(h->cold_bytes))) < 0)
+            {
+                return -1;
+            }
+        }
+        for (int seg = h->hist_lo; seg < h->hist_hi; seg++)
+        {
+            long long k = seg - h->hist_lo;
+            if (history_attach_segment(seg, shard + h->hist_off + k * snap_align(h->hist_seg_bytes)) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    history_adopt(m.hist_segs, m.hist_next, m.hist_free, m.hist_in_use);
+
+    bank_totals->accounts_in_use = m.accounts;
+    bank_totals->next_number = m.next_number;
+    store_loaded(m.slots);
+
+    if (m.index_cap > 0 ? index_attach(map + m.index_off, m.index_cap, m.index_used) < 0
+                        : index_rebuild() < 0)
+    {
+        return -1;
+    }
+
+    long long bytes = m.file_bytes;
+    for (int i = 0; i < m.shards; i++)
+    {
+        bytes += m.shard[i].file_bytes;
+    }
+    *lsn_out = m.journal_lsn;
+    log_message(LOG_INFO, "Snapshot %s mapped: %d accounts in %d shards, %lld bytes, journal LSN %lld",
+                path, m.accounts, m.shards, bytes, m.journal_lsn);
+    return 0;
+}
+
+/* Map a snapshot and adopt it as the account table. Returns -1 with errno
+   ENOENT if there is no snapshot. Set BANK_SNAP_VERIFY=0 to skip the block
+   checksums, which otherwise read every file once. */
+int snapshot_map(const char *path, long long *lsn_out)
+{
+    struct
+    {
+        char magic[8];
+        int version;
+    } lead;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || pread(fd, &lead, sizeof(lead), 0) != (ssize_t)sizeof(lead))
+    {
+        log_message(LOG_ERROR, "Failed to read snapshot header from %s", path);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int rc;
+    if (memcmp(lead.magic, SNAP_MAGIC, sizeof(lead.magic)) != 0)
+    {
+        log_message(LOG_ERROR, "Snapshot has a bad magic number");
+        errno = EINVAL;
+        rc = -1;
+    }
+    else if (bank_capacity != 0)
+    {
+        errno = EINVAL;
+        rc = -1;
+    }
+    else if (lead.version == SNAP_VERSION)
+    {
+        rc = map_sharded(fd, &st, path, lsn_out);
+    }
+    else if (lead.version == SNAP_VERSION_SINGLE)
+    {
+        rc = map_single(fd, &st, path, lsn_out);
+    }
+    else
+    {
+        log_message(LOG_ERROR, "Snapshot version %d is not supported", lead.version);
+        errno = EINVAL;
+        rc = -1;
+    }
+
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
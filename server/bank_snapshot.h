@@ -0,0 +1,136 @@
+/*
+ * Banking System - Memory-mappable binary snapshots
+ */
+
+#ifndef BANK_SNAPSHOT_H
+#define BANK_SNAPSHOT_H
+
+#include "bank_common.h"
+
+#define SNAP_MAGIC "BANKSNAP" /* first eight bytes of every snapshot */
+#define SHARD_MAGIC "BANKSHRD" /* first eight bytes of every shard file */
+#define SNAP_VERSION_SINGLE 1 /* one file holding every block; read only */
+#define SNAP_VERSION 2        /* manifest plus shard files           */
+#define SNAP_MAX_SHARDS 16    /* most shard files in one snapshot    */
+#define SNAP_ALIGN 4096       /* every block starts on this boundary */
+#define SNAP_SUM_SEED 0xcbf29ce484222325ULL /* starting value of a checksum */
+
+/* Header of a version 1 snapshot; block offsets are from the start of the file and
+   every checksum covers the bytes written, not the alignment padding */
+typedef struct
+{
+    char magic[8];
+    int version;
+    int header_bytes;     /* sizeof(snap_header_t) of the writer      */
+    int seg_size;         /* accounts per segment                     */
+    int hot_bytes;        /* bytes of one hot segment                 */
+    int cold_bytes;       /* bytes of one cold segment                */
+    int hist_chunk_bytes; /* layout guard for the history pool        */
+    int slots;            /* account slots in use, tombstones included */
+    int segs;             /* account segments written                 */
+    int accounts;         /* live accounts                            */
+    int next_number;
+    long long journal_lsn; /* last journal record the snapshot covers */
+    long long written;     /* time the snapshot was taken             */
+
+    int hist_segs;         /* history pool segments written           */
+    int hist_next;         /* next never-used chunk id                */
+    int hist_free;         /* head of the recycled chunk list         */
+    int index_entry_bytes;
+    long long hist_in_use; /* chunks holding history                  */
+    long long index_cap;   /* buckets in the account index            */
+    long long index_used;  /* accounts in the account index           */
+
+    long long hot_off;     /* hot segments, one after another         */
+    long long cold_off;    /* cold segments, SNAP_ALIGN apart         */
+    long long hist_off;    /* history pool segments, SNAP_ALIGN apart */
+    long long index_off;   /* account index buckets                   */
+    long long file_bytes;
+
+    unsigned long long hot_sum;
+    unsigned long long cold_sum;
+    unsigned long long hist_sum;
+    unsigned long long index_sum;
+    unsigned long long header_sum; /* everything above */
+} snap_header_t;
+
+/* A manifest's entry for one shard file, named <manifest>.<gen>.<shard> */
+typedef struct
+{
+    int seg_lo;        /* first account segment in the shard        */
+    int seg_hi;        /* one past the last                         */
+    int hist_lo;       /* first history pool segment in the shard   */
+    int hist_hi;       /* one past the last                         */
+    long long file_bytes;
+    unsigned long long header_sum; /* ties the shard file to this manifest */
+} snap_shard_t;
+
+/* Header of a shard file: its account and history segments, each block
+   SNAP_ALIGN aligned like a version 1 snapshot */
+typedef struct
+{
+    char magic[8];
+    int version;
+    int shard;
+    long long gen;         /* snapshot the shard was written for      */
+    int seg_lo;
+    int seg_hi;
+    int hist_lo;
+    int hist_hi;
+    int hot_bytes;         /* layout guards, as in the manifest       */
+    int cold_bytes;
+    long long hist_seg_bytes;
+    long long hot_off;
+    long long cold_off;
+    long long hist_off;
+    long long file_bytes;
+    unsigned long long hot_sum;
+    unsigned long long cold_sum;
+    unsigned long long hist_sum;
+    unsigned long long header_sum; /* everything above */
+} snap_shard_header_t;
+
+/* Header of a version 2 snapshot. The manifest holds the account index
+   and the shard table; it is renamed into place only after every shard
+   file is synced, so it always names a complete set. */
+typedef struct
+{
+    char magic[8];
+    int version;
+    int header_bytes;      /* sizeof(snap_manifest_t) of the writer   */
+    int seg_size;
+    int hot_bytes;
+    int cold_bytes;
+    int hist_chunk_bytes;
+    int slots;
+    int segs;
+    int accounts;
+    int next_number;
+    long long journal_lsn;
+    long long written;
+    long long gen;         /* names the shard files                   */
+
+    int hist_segs;
+    int hist_next;
+    int hist_free;
+    int index_entry_bytes;
+    long long hist_in_use;
+    long long index_cap;
+    long long index_used;
+
+    int shards;
+    int pad;
+    snap_shard_t shard[SNAP_MAX_SHARDS];
+
+    long long index_off;
+    long long file_bytes;
+    unsigned long long index_sum;
+    unsigned long long header_sum; /* everything above */
+} snap_manifest_t;
+
+/* Snapshot function prototypes */
+int snapshot_write(const char *path);
+int snapshot_map(const char *path, long long *lsn_out);
+unsigned long long snapshot_sum(unsigned long long h, const void *p, size_t n);
+
+#endif /* BANK_SNAPSHOT_H */
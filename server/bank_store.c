@@ -0,0 +1,334 @@
+/*
+ * Banking System - Column-oriented account store implementation
+ *
+ * Accounts live in fixed-size segments mapped from the arena. Each segment
+ * keeps the hot fields (number, pin, balance, ntran) as contiguous columns
+ * and the cold fields (name, nat_id, type, last[]) in a parallel side
+ * table, so scans over balances touch 4 bytes per account instead of a
+ * whole account_t. Growing the store maps more segments and never copies.
+ *
+ * Slots are stable: closing an account leaves a tombstone that goes on a
+ * free list for reuse, and every change of occupant bumps the slot's
+ * generation so cached handles can detect it. An incremental compaction
+ * pass, run between client sessions, moves accounts from the top of the
+ * table into holes so the table does not stay sparse after mass closures.
+ *
+ * Every change to a slot marks it in a per-segment dirty map, which the
+ * record file drains to write only the accounts that changed.
+ *
+ * In the concurrent server the directory and every segment live in shared
+ * memory, so all processes work on the one table.
+ */
+
+#include "bank_store.h"
+#include "bank_arena.h"
+#include "bank_log.h"
+#include "bank_index.h"
+#include "bank_shm.h"
+
+static store_dir_t local_dir = {.free_head = -1};
+store_dir_t *store_dir = &local_dir;
+
+/* Make sure at least the given number of slots is backed by memory */
+int store_reserve(int slots)
+{
+    if (slots < 0 || slots > MAX_ACCTS)
+    {
+        log_message(LOG_ERROR, "Cannot reserve %d account slots (limit %d)", slots, MAX_ACCTS);
+        return -1;
+    }
+
+    while (bank_capacity < slots)
+    {
+        int seg = bank_capacity >> SEG_SHIFT;
+        acct_hot_t *hot = arena_alloc(sizeof(acct_hot_t));
+        acct_cold_t *cold = arena_alloc((size_t)SEG_SIZE * sizeof(acct_cold_t));
+        unsigned char *dirty = shm_calloc(SEG_SIZE, 1);
+        if (!hot || !cold || !dirty)
+        {
+            log_message(LOG_ERROR, "Failed to map account segment %d", seg);
+            arena_free(hot, sizeof(acct_hot_t));
+            arena_free(cold, (size_t)SEG_SIZE * sizeof(acct_cold_t));
+            shm_free(dirty);
+            return -1;
+        }
+
+        hot_segs[seg] = hot;
+        cold_segs[seg] = cold;
+        dirty_maps[seg] = dirty;
+        bank_capacity += SEG_SIZE;
+        log_message(LOG_INFO, "Mapped account segment %d (capacity now %d accounts)",
+                    seg, bank_capacity);
+    }
+    return 0;
+}
+
+/* Assemble the full record of the account in a slot */
+void store_get(int slot, account_t *out)
+{
+    const acct_cold_t *c = acct_cold(slot);
+
+    memset(out, 0, sizeof(*out));
+    out->number = *acct_number(slot);
+    out->pin = *acct_pin(slot);
+    out->balance = *acct_balance(slot);
+    out->ntran = *acct_ntran(slot);
+    memcpy(out->name, c->name, sizeof(out->name));
+    memcpy(out->nat_id, c->nat_id, sizeof(out->nat_id));
+    out->type = c->type;
+    memcpy(out->last, c->last, sizeof(out->last));
+}
+
+/* Scatter a full account record into the columns of a slot */
+void store_put(int slot, const account_t *in)
+{
+    acct_cold_t *c = acct_cold(slot);
+
+    *acct_number(slot) = in->number;
+    *acct_pin(slot) = in->pin;
+    *acct_balance(slot) = in->balance;
+    *acct_ntran(slot) = in->ntran;
+    memcpy(c->name, in->name, sizeof(c->name));
+    memcpy(c->nat_id, in->nat_id, sizeof(c->nat_id));
+    c->type = in->type;
+    memcpy(c->last, in->last, sizeof(c->last));
+    store_touch(slot);
+}
+
+/* Copy the account in slot src over slot dst */
+void store_move(int dst, int src)
+{
+    *acct_number(dst) = *acct_number(src);
+    *acct_pin(dst) = *acct_pin(src);
+    *acct_balance(dst) = *acct_balance(src);
+    *acct_ntran(dst) = *acct_ntran(src);
+    *acct_cold(dst) = *acct_cold(src);
+    store_touch(dst);
+}
+
+/* Take a slot for a new account; reuses tombstones before growing */
+int store_alloc(void)
+{
+    while (store_dir->free_head >= 0)
+    {
+        int slot = store_dir->free_head;
+        store_dir->free_head = acct_cold(slot)->next_free;
+        store_dir->free_count--;
+
+        /* compaction may have trimmed the slot off the top of the table */
+        if (slot < bank_slots)
+        {
+            return slot;
+        }
+    }
+
+    if (bank_slots >= MAX_ACCTS || store_reserve(bank_slots + 1) < 0)
+    {
+        return -1;
+    }
+    return bank_slots++;
+}
+
+/* Clear a slot's columns and mark it as a tombstone */
+static void clear_slot(int slot)
+{
+    *acct_number(slot) = SLOT_FREE;
+    *acct_pin(slot) = 0;
+    *acct_balance(slot) = 0;
+    *acct_ntran(slot) = 0;
+    (*acct_gen(slot))++;
+    memset(acct_cold(slot), 0, sizeof(acct_cold_t));
+    store_touch(slot);
+}
+
+/* Turn a slot into a tombstone and put it on the free list */
+void store_release(int slot)
+{
+    clear_slot(slot);
+    acct_cold(slot)->next_free = store_dir->free_head;
+    store_dir->free_head = slot;
+    store_dir->free_count++;
+}
+
+/* Adopt an already filled segment, such as one mapped from a snapshot */
+int store_attach(acct_hot_t *hot, acct_cold_t *cold)
+{
+    int seg = bank_capacity >> SEG_SHIFT;
+
+    /* a private file mapping is invisible to other processes: copy it */
+    if (shm_active())
+    {
+        if (store_reserve(bank_capacity + SEG_SIZE) < 0)
+        {
+            return -1;
+        }
+        memcpy(hot_segs[seg], hot, sizeof(acct_hot_t));
+        memcpy(cold_segs[seg], cold, (size_t)SEG_SIZE * sizeof(acct_cold_t));
+        return 0;
+    }
+
+    unsigned char *dirty = shm_calloc(SEG_SIZE, 1);
+    if (!dirty)
+    {
+        log_message(LOG_ERROR, "Failed to track account segment %d", seg);
+        return -1;
+    }
+    hot_segs[seg] = hot;
+    cold_segs[seg] = cold;
+    dirty_maps[seg] = dirty;
+    bank_capacity += SEG_SIZE;
+    return 0;
+}
+
+/* Reset slot bookkeeping after slots [0, slots) were filled by a load,
+   putting any tombstones among them on the free list */
+void store_loaded(int slots)
+{
+    bank_slots = slots;
+    store_dir->free_head = -1;
+    store_dir->free_count = 0;
+
+    for (int slot = slots - 1; slot >= 0; slot--)
+    {
+        if (store_is_free(slot))
+        {
+            acct_cold(slot)->next_free = store_dir->free_head;
+            store_dir->free_head = slot;
+            store_dir->free_count++;
+        }
+    }
+}
+
+/* Number of tombstones waiting for reuse */
+int store_free_count(void)
+{
+    return store_dir->free_count;
+}
+
+/* Move up to budget accounts from the top of the table into holes.
+   Calls back into the index, so it must not run while a lookup is in flight. */
+int store_compact(int budget)
+{
+    int moved = 0;
+
+    while (moved < budget && store_dir->free_head >= 0)
+    {
+        /* drop tombstones from the top of the table */
+        while (bank_slots > 0 && store_is_free(bank_slots - 1))
+        {
+            bank_slots--;
+        }
+
+        int hole = store_dir->free_head;
+        store_dir->free_head = acct_cold(hole)->next_free;
+        store_dir->free_count--;
+
+        if (hole >= bank_slots)
+        {
+            continue; /* already trimmed */
+        }
+
+        int src = bank_slots - 1;
+        int number = *acct_number(src);
+
+        store_move(hole, src);
+        (*acct_gen(hole))++;
+        index_insert(number, hole);
+        customer_move(acct_cold(hole)->nat_id, src, hole);
+
+        /* the vacated top slot is trimmed rather than listed as free */
+        clear_slot(src);
+        bank_slots--;
+        moved++;
+    }
+
+    if (store_dir->free_head < 0)
+    {
+        while (bank_slots > 0 && store_is_free(bank_slots - 1))
+        {
+            bank_slots--;
+        }
+    }
+
+    if (moved > 0)
+    {
+        log_message(LOG_INFO, "Compaction moved %d accounts (%d slots in use, %d holes left)",
+                    moved, bank_slots, store_dir->free_count);
+    }
+    return moved;
+}
+
+/* Capture a handle to the account currently in a slot */
+acct_handle_t store_handle(int slot)
+{
+    acct_handle_t h;
+    h.slot = slot;
+    h.gen = *acct_gen(slot);
+    return h;
+}
+
+/* Return the slot a handle refers to, or -1 if its account has moved or closed */
+int store_resolve(acct_handle_t h)
+{
+    if (h.slot < 0 || h.slot >= bank_slots || *acct_gen(h.slot) != h.gen ||
+        store_is_free(h.slot))
+    {
+        return -1;
+    }
+    return h.slot;
+}
+
+/* Take the first dirty slot above after (-1 to start), clearing its mark;
+   -1 once none are left */
+int store_next_dirty(int after)
+{
+    int slot = after + 1;
+
+    while (slot < bank_capacity)
+    {
+        int seg = slot >> SEG_SHIFT;
+        if (!dirty_segs[seg])
+        {
+            slot = (seg + 1) << SEG_SHIFT;
+            continue;
+        }
+
+        unsigned char *map = dirty_maps[seg];
+        unsigned char *hit = memchr(map + (slot & (SEG_SIZE - 1)), 1, SEG_SIZE - (slot & (SEG_SIZE - 1)));
+        if (hit)
+        {
+            *hit = 0;
+            return (seg << SEG_SHIFT) + (int)(hit - map);
+        }
+
+        /* nothing left in this segment */
+        dirty_segs[seg] = 0;
+        slot = (seg + 1) << SEG_SHIFT;
+    }
+    return -1;
+}
+
+/* Forget every dirty mark, after the whole table was written out */
+void store_clear_dirty(void)
+{
+    for (int seg = 0; seg < (bank_capacity >> SEG_SHIFT); seg++)
+    {
+        if (dirty_segs[seg])
+        {
+            memset(dirty_maps[seg], 0, SEG_SIZE);
+            dirty_segs[seg] = 0;
+        }
+    }
+}
+
+/* Move the directory into shared memory; segments already live there */
+int store_share(void)
+{
+    store_dir_t *shared = shm_share(store_dir, sizeof(store_dir_t));
+    if (!shared)
+    {
+        return -1;
+    }
+    store_dir = shared;
+    return 0;
+}
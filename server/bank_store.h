@@ -0,0 +1,133 @@
+/*
+ * Banking System - Column-oriented account store
+ */
+
+#ifndef BANK_STORE_H
+#define BANK_STORE_H
+
+#include "bank_common.h"
+
+#define SEG_SHIFT 12                       /* log2 of accounts per segment */
+#define SEG_SIZE (1 << SEG_SHIFT)          /* accounts per segment         */
+#define MAX_SEGS (MAX_ACCTS / SEG_SIZE)    /* segment directory size       */
+#define SLOT_FREE 0                        /* number column of a tombstone */
+#define COMPACT_BUDGET 256                 /* accounts moved per compaction step */
+#define COMPACT_RATIO 8                    /* compact once 1/8 of slots are holes */
+
+/* Hot numeric columns of one segment; every column starts page aligned */
+typedef struct
+{
+    int number[SEG_SIZE];
+    int pin[SEG_SIZE];
+    int balance[SEG_SIZE];
+    int ntran[SEG_SIZE];
+    unsigned gen[SEG_SIZE]; /* bumped whenever a slot changes occupant */
+} acct_hot_t;
+
+/* Cold identity and history data, kept in a separate side table */
+typedef struct
+{
+    char name[40];
+    char nat_id[20];
+    acct_type_t type;
+    transaction_t last[TRANS_KEEP]; /* ring buffer of last 5    */
+    int hist_head;                  /* first chunk of the full history */
+    int hist_tail;                  /* chunk receiving new entries     */
+    int hist_count;                 /* entries in the full history     */
+    int next_free;                  /* free list link of a tombstone */
+} acct_cold_t;
+
+/* A cached reference to a slot, valid until the slot changes occupant */
+typedef struct
+{
+    int slot;
+    unsigned gen;
+} acct_handle_t;
+
+/* Segment directories and slot bookkeeping; segments are never moved once
+   mapped. Kept behind a pointer so store_share() can move it into the
+   region the concurrent server's processes share. */
+typedef struct
+{
+    acct_hot_t *hot[MAX_SEGS];
+    acct_cold_t *cold[MAX_SEGS];
+    unsigned char *dirty[MAX_SEGS];    /* one byte per slot changed since the last flush */
+    unsigned char dirty_any[MAX_SEGS]; /* segments with any slot changed */
+    int capacity;   /* slots backed by mapped segments */
+    int slots;      /* high-water mark of slots in use (live + tombstones) */
+    int free_head;  /* most recently released slot */
+    int free_count; /* tombstones on the free list  */
+} store_dir_t;
+
+extern store_dir_t *store_dir;
+
+#define hot_segs (store_dir->hot)
+#define cold_segs (store_dir->cold)
+#define dirty_maps (store_dir->dirty)
+#define dirty_segs (store_dir->dirty_any)
+#define bank_capacity (store_dir->capacity)
+#define bank_slots (store_dir->slots)
+
+/* Column accessors for the account stored in a slot */
+static inline int *acct_number(int slot)
+{
+    return &hot_segs[slot >> SEG_SHIFT]->number[slot & (SEG_SIZE - 1)];
+}
+
+static inline int *acct_pin(int slot)
+{
+    return &hot_segs[slot >> SEG_SHIFT]->pin[slot & (SEG_SIZE - 1)];
+}
+
+static inline int *acct_balance(int slot)
+{
+    return &hot_segs[slot >> SEG_SHIFT]->balance[slot & (SEG_SIZE - 1)];
+}
+
+static inline int *acct_ntran(int slot)
+{
+    return &hot_segs[slot >> SEG_SHIFT]->ntran[slot & (SEG_SIZE - 1)];
+}
+
+static inline acct_cold_t *acct_cold(int slot)
+{
+    return &cold_segs[slot >> SEG_SHIFT][slot & (SEG_SIZE - 1)];
+}
+
+static inline unsigned *acct_gen(int slot)
+{
+    return &hot_segs[slot >> SEG_SHIFT]->gen[slot & (SEG_SIZE - 1)];
+}
+
+/* Note that a slot changed so the record file picks it up. Plain byte
+   stores, so accrual workers on different slots may mark concurrently. */
+static inline void store_touch(int slot)
+{
+    dirty_maps[slot >> SEG_SHIFT][slot & (SEG_SIZE - 1)] = 1;
+    dirty_segs[slot >> SEG_SHIFT] = 1;
+}
+
+/* Whether a slot below bank_slots holds a closed account */
+static inline int store_is_free(int slot)
+{
+    return *acct_number(slot) == SLOT_FREE;
+}
+
+/* Store function prototypes */
+int store_reserve(int slots);
+void store_get(int slot, account_t *out);
+void store_put(int slot, const account_t *in);
+void store_move(int dst, int src);
+int store_alloc(void);
+void store_release(int slot);
+int store_attach(acct_hot_t *hot, acct_cold_t *cold);
+void store_loaded(int slots);
+int store_free_count(void);
+int store_compact(int budget);
+acct_handle_t store_handle(int slot);
+int store_resolve(acct_handle_t h);
+int store_next_dirty(int after);
+void store_clear_dirty(void);
+int store_share(void);
+
+#endif /* BANK_STORE_H */
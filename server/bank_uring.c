@@ -0,0 +1,412 @@
+/*
+ * Banking System - io_uring submission for persistence writes
+ *
+ * With BANK_IO=uring the journal writer, snapshot shards and record file
+ * flushes queue their writes on an io_uring instead of making one pwrite
+ * call per block. A thread fills the submission queue, enters the kernel
+ * once for the lot and keeps up to URING_DEPTH operations in flight. A
+ * sync queued with uring_sync() starts only when everything queued before
+ * it has finished, so writes and their fdatasync go down in one call.
+ *
+ * The ring is driven with the raw system calls; only the kernel's header
+ * is needed. One buffer per ring may be registered; writes from inside it
+ * use the fixed-buffer opcode and skip the page pinning of every call.
+ *
+ * uring_open() returns NULL when the kernel has no io_uring, or it is
+ * switched off, and callers keep their pwrite path. A short write is
+ * finished with pwrite and synced on the spot, since a sync queued behind
+ * it may already have run.
+ */
+
+#define _GNU_SOURCE
+
+#include "bank_uring.h"
+#include "bank_log.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* One queued operation, kept until its completion is reaped */
+typedef struct
+{
+    int fd;
+    int sync; /* fdatasync rather than a write */
+    const char *buf;
+    size_t len;
+    long long off;
+} uring_op_t;
+
+struct uring
+{
+    int fd;
+    unsigned entries;
+
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned tail; /* our copy of *sq_tail */
+
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_bytes;
+    size_t cq_ring_bytes;
+
+    uring_op_t *ops;    /* indexed by the user_data of each entry */
+    unsigned *free_ids; /* ops not in flight                      */
+    unsigned free_count;
+    int failed; /* errno of the first failure since uring_wait() */
+
+    const char *fixed; /* the registered buffer */
+    size_t fixed_len;
+};
+
+/* Whether BANK_IO asks for io_uring */
+int uring_wanted(void)
+{
+    const char *env = getenv("BANK_IO");
+    return env && strcmp(env, "uring") == 0;
+}
+
+/* Whether the kernel implements every opcode used here */
+static int uring_probe(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = 0;
+
+    if (probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        ok = probe->last_op >= IORING_OP_WRITE &&
+             (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+/* Set up a ring for entries operations in flight; NULL when io_uring is
+   not to be had */
+uring_t *uring_open(unsigned entries)
+{
+    static int warned = 0;
+    struct io_uring_params p;
+    uring_t *u = calloc(1, sizeof(uring_t));
+
+    memset(&p, 0, sizeof(p));
+    int fd = u ? (int)syscall(__NR_io_uring_setup, entries, &p) : -1;
+    if (fd < 0 || !uring_probe(fd))
+    {
+        if (!warned)
+        {
+            warned = 1;
+            log_message(LOG_WARNING, "io_uring unavailable (%s); persistence writes stay synchronous",
+                        fd < 0 ? strerror(errno) : "missing opcodes");
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(u);
+        return NULL;
+    }
+
+    u->fd = fd;
+    u->entries = p.sq_entries;
+    u->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && u->cq_ring_bytes > u->sq_ring_bytes)
+    {
+        u->sq_ring_bytes = u->cq_ring_bytes;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    u->cq_ring = single ? u->sq_ring
+                        : mmap(NULL, u->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    u->ops = calloc(u->entries, sizeof(uring_op_t));
+    u->free_ids = malloc(u->entries * sizeof(unsigned));
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED ||
+        !u->ops || !u->free_ids)
+    {
+        log_message(LOG_ERROR, "Failed to map io_uring queues: %s", strerror(errno));
+        uring_close(u);
+        return NULL;
+    }
+
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    for (unsigned i = 0; i < u->entries; i++)
+    {
+        u->free_ids[i] = i;
+    }
+    u->free_count = u->entries;
+    return u;
+}
+
+/* Tear a ring down; operations still in flight are cancelled by the kernel */
+void uring_close(uring_t *u)
+{
+    if (!u)
+    {
+        return;
+    }
+    if (u->sqes && u->sqes != MAP_FAILED)
+    {
+        munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+    }
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+    {
+        munmap(u->cq_ring, u->cq_ring_bytes);
+    }
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+    {
+        munmap(u->sq_ring, u->sq_ring_bytes);
+    }
+    close(u->fd);
+    free(u->ops);
+    free(u->free_ids);
+    free(u);
+}
+
+/* Register the one buffer whose writes use the fixed-buffer opcode */
+int uring_register(uring_t *u, void *buf, size_t len)
+{
+    struct iovec iov = {buf, len};
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    {
+        log_message(LOG_WARNING, "Could not register a %zu byte io_uring buffer: %s", len, strerror(errno));
+        return -1;
+    }
+    u->fixed = buf;
+    u->fixed_len = len;
+    return 0;
+}
+
+/* Note the first failure until the next uring_wait() reports it */
+static void uring_fail(uring_t *u, int err)
+{
+    if (!u->failed)
+    {
+        u->failed = err;
+    }
+}
+
+/* Finish a write the kernel cut short, and sync it, as a sync queued
+   behind it may already have run */
+static void finish_short(uring_t *u, const uring_op_t *op, size_t done)
+{
+    const char *p = op->buf + done;
+    size_t len = op->len - done;
+    long long off = op->off + (long long)done;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(op->fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            uring_fail(u, n < 0 ? errno : EIO);
+            return;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    if (fdatasync(op->fd) < 0)
+    {
+        uring_fail(u, errno);
+    }
+}
+
+/* Take every completion the kernel has posted */
+static void uring_reap(uring_t *u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        unsigned id = (unsigned)cqe->user_data;
+        const uring_op_t *op = &u->ops[id];
+
+        if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN)
+        {
+            uring_fail(u, -cqe->res);
+        }
+        else if (op->sync && cqe->res < 0)
+        {
+            if (fdatasync(op->fd) < 0)
+            {
+                uring_fail(u, errno);
+            }
+        }
+        else if (!op->sync && (cqe->res < 0 || (size_t)cqe->res < op->len))
+        {
+            finish_short(u, op, cqe->res < 0 ? 0 : (size_t)cqe->res);
+        }
+        u->free_ids[u->free_count++] = id;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Hand the queued entries to the kernel, and wait for a completion if
+   asked; -1 when the ring itself fails */
+static int uring_enter(uring_t *u, int wait)
+{
+    for (;;)
+    {
+        unsigned queued = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        long rc = syscall(__NR_io_uring_enter, u->fd, queued, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0)
+        {
+            return 0;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY)
+        {
+            uring_reap(u); /* completions back up; make room and retry */
+            continue;
+        }
+        log_message(LOG_ERROR, "io_uring submission failed: %s", strerror(errno));
+        return -1;
+    }
+}
+
+/* Claim an entry for an operation, waiting for one to finish when all are
+   in flight */
+static struct io_uring_sqe *uring_next(uring_t *u, unsigned *id)
+{
+    while (u->free_count == 0)
+    {
+        if (uring_enter(u, 1) < 0)
+        {
+            return NULL;
+        }
+        uring_reap(u);
+    }
+
+    *id = u->free_ids[--u->free_count];
+    unsigned at = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[at];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = *id;
+    u->sq_array[at] = at;
+    return sqe;
+}
+
+/* Make an entry filled by uring_next() visible to the kernel */
+static void uring_push(uring_t *u)
+{
+    u->tail++;
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+}
+
+/* Queue a write of len bytes at off; the buffer must stay untouched until
+   uring_wait() returns */
+int uring_write(uring_t *u, int fd, const void *buf, size_t len, long long off)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        size_t part = len > URING_MAX_WRITE ? URING_MAX_WRITE : len;
+        unsigned id;
+        struct io_uring_sqe *sqe = uring_next(u, &id);
+        if (!sqe)
+        {
+            return -1;
+        }
+
+        int fixed = u->fixed && p >= u->fixed && p + part <= u->fixed + u->fixed_len;
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)p;
+        sqe->len = (unsigned)part;
+        sqe->off = (unsigned long long)off;
+        sqe->buf_index = 0;
+        u->ops[id] = (uring_op_t){fd, 0, p, part, off};
+        uring_push(u);
+
+        p += part;
+        len -= part;
+        off += (long long)part;
+    }
+    return 0;
+}
+
+/* Queue an fdatasync that starts once everything queued before it is done */
+int uring_sync(uring_t *u, int fd)
+{
+    unsigned id;
+    struct io_uring_sqe *sqe = uring_next(u, &id);
+    if (!sqe)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    u->ops[id] = (uring_op_t){fd, 1, NULL, 0, 0};
+    uring_push(u);
+    return 0;
+}
+
+/* Submit what is queued and wait for all of it; -1 with errno set when
+   any operation failed */
+int uring_wait(uring_t *u)
+{
+    while (u->free_count < u->entries)
+    {
+        if (uring_enter(u, 1) < 0)
+        {
+            return -1;
+        }
+        uring_reap(u);
+    }
+
+    int err = u->failed;
+    u->failed = 0;
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Banking System - io_uring submission for persistence writes
+ */
+
+#ifndef BANK_URING_H
+#define BANK_URING_H
+
+#include "bank_common.h"
+
+#define URING_DEPTH 64             /* operations one ring keeps in flight */
+#define URING_MAX_WRITE (1L << 30) /* longer writes are split             */
+
+/* A submission ring; used by one thread at a time */
+typedef struct uring uring_t;
+
+/* io_uring function prototypes */
+int uring_wanted(void);
+uring_t *uring_open(unsigned entries);
+void uring_close(uring_t *u);
+int uring_register(uring_t *u, void *buf, size_t len);
+int uring_write(uring_t *u, int fd, const void *buf, size_t len, long long off);
+int uring_sync(uring_t *u, int fd);
+int uring_wait(uring_t *u);
+
+#endif /* BANK_URING_H */
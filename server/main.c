@@ -1,8 +1,13 @@
 /*
  * Banking System - Main program
  *
- * Compile: gcc -std=c99 -Wall -o bank_server main.c bank_server.c bank_account.c bank_persistence.c bank_log.c
+ * Compile: gcc -std=c99 -Wall -pthread -o bank_server main.c bank_server.c bank_account.c bank_report.c bank_accrual.c bank_index.c bank_store.c bank_history.c bank_arena.c bank_persistence.c bank_json.c bank_lz.c bank_crc.c bank_snapshot.c bank_records.c bank_journal.c bank_shm.c bank_uring.c bank_import.c bank_log.c
  * Run: ./bank_server [port]
+ *      ./bank_server --export [file]   write the bank as JSON and exit
+ *      ./bank_server --verify dir      recover the data in dir in memory and check it;
+ *                                      nothing in dir is written, the log included
+ *      ./bank_server --import file.csv open an account per row of name,nat_id,type,balance
+ *                                      and save once; refused while the server runs
  */
 
 #include "bank_common.h"
@@ -10,13 +15,75 @@
 #include "bank_persistence.h"
 #include "bank_account.h"
 #include "bank_server.h"
+#include "bank_accrual.h"
+#include "bank_journal.h"
+#include "bank_import.h"
 #include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 int main(int argc, char *argv[])
 {
     int port = DEFAULT_PORT;
 
+    // Export mode: load the bank, write it out as JSON and stop
+    if (argc > 1 && strcmp(argv[1], "--export") == 0)
+    {
+        const char *path = argc > 2 ? argv[2] : DATA_FILE;
+        log_init();
+        if (lock_data_dir() != 0 || load_data() != 0 || export_data(path) != 0)
+        {
+            fprintf(stderr, "Export to %s failed.\n", path);
+            return EXIT_FAILURE;
+        }
+        printf("Exported %d accounts to %s.\n", bank_totals->accounts_in_use, path);
+        return EXIT_SUCCESS;
+    }
+
+    // Verify mode: recover a data directory as a restart would, check the result and stop
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0)
+    {
+        if (argc != 3)
+        {
+            fprintf(stderr, "Usage: %s --verify DIR\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char *dir = argv[2];
+        replay_stats_t st;
+        if (chdir(dir) != 0)
+        {
+            perror(dir);
+            return EXIT_FAILURE;
+        }
+        // Leave the directory exactly as it was: log to stderr, load read only
+        log_file = stderr;
+        load_read_only();
+        int rc = load_data();
+        journal_replay_stats(&st);
+        int problems = verify_data();
+        printf("Journal: %lld records, %lld applied, %lld already in snapshot, %lld failed, "
+               "%lld with another balance; %d threads, %lld ms.\n",
+               st.records, st.applied, st.skipped, st.failed, st.mismatched, st.threads, st.us / 1000);
+        printf("Verified %d accounts in %s: %d problems.\n", bank_totals->accounts_in_use, dir, problems);
+        return rc == 0 && problems == 0 && st.failed == 0 && st.mismatched == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Import mode: open an account per row of a CSV file, save once and stop
+    if (argc > 2 && strcmp(argv[1], "--import") == 0)
+    {
+        log_init();
+        if (lock_data_dir() != 0)
+        {
+            return EXIT_FAILURE;
+        }
+        if (load_data() != 0)
+        {
+            fprintf(stderr, "Existing data did not load cleanly; nothing imported.\n");
+            return EXIT_FAILURE;
+        }
+        return import_csv(argv[2]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     // Set port from command line if provided
     if (argc > 1)
     {
@@ -38,13 +105,33 @@ int main(int argc, char *argv[])
     // Initialize logging
     log_init();
 
-    // Load existing data
+    // One process owns the data directory at a time
+    if (lock_data_dir() != 0)
+    {
+        log_message(LOG_ERROR, "Data directory is in use. Exiting.");
+        return EXIT_FAILURE;
+    }
+
+    // Load existing data; serving a partly loaded bank would hide damage, so stop instead
     if (load_data() != 0)
     {
-        log_message(LOG_WARNING, "Could not load existing data. Starting fresh.");
-        fprintf(stderr, "Warning: Could not load existing data. Starting fresh.\n");
+        log_message(LOG_ERROR, "Could not load existing data cleanly. Exiting.");
+        fprintf(stderr, "Could not load existing data cleanly; see %s. Exiting.\n", LOG_FILE);
+        return EXIT_FAILURE;
     }
 
+    // Start end-of-day accrual before any other thread exists
+    if (accrual_start() != 0)
+    {
+        log_message(LOG_WARNING, "Accrual scheduler not started; interest will not be posted.");
+    }
+
+    // Hand journal writes and syncs to a writer thread
+    journal_start_writer();
+
+    // Periodic checkpoints fork a snapshot writer instead of pausing clients
+    background_checkpoints(1);
+
     // Initialize and run the server
     if (init_server(port) != 0)
     {
@@ -0,0 +1,179 @@
+/*
+ * Banking System - Minimal unit test support
+ *
+ * Each tests/test_*.c is a program linked against the server modules.
+ * CHECK reports a failure and carries on. The modules keep the bank in
+ * process-wide state and work on fixed file names in the current
+ * directory, so test_main() runs every case in a forked child of its own,
+ * inside a fresh scratch directory, and exits non-zero if any case failed.
+ */
+
+#ifndef BANK_TEST_H
+#define BANK_TEST_H
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../bank_common.h"
+#include "../bank_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int test_failures = 0; /* checks failed in the running case */
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            test_failures++;                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                            \
+    } while (0)
+
+/* One test case */
+typedef struct
+{
+    const char *name;
+    void (*run)(void);
+} test_case_t;
+
+/* Write len bytes to a new file; 0 on success */
+static inline int test_write_file(const char *path, const void *buf, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        return -1;
+    }
+    size_t n = fwrite(buf, 1, len, f);
+    return fclose(f) == 0 && n == len ? 0 : -1;
+}
+
+/* Read a whole file into a new buffer; NULL if it cannot be read */
+static inline char *test_read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    long size;
+
+    if (f && fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0 &&
+        (buf = malloc((size_t)size + 1)) != NULL && fread(buf, 1, (size_t)size, f) == (size_t)size)
+    {
+        buf[size] = '\0';
+        *len = (size_t)size;
+    }
+    else
+    {
+        free(buf);
+        buf = NULL;
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+    return buf;
+}
+
+/* Flip one bit of a file in place; 0 on success */
+static inline int test_flip_bit(const char *path, long long off)
+{
+    FILE *f = fopen(path, "r+b");
+    int c;
+
+    if (!f || fseek(f, (long)off, SEEK_SET) != 0 || (c = fgetc(f)) == EOF ||
+        fseek(f, (long)off, SEEK_SET) != 0 || fputc(c ^ 0x10, f) == EOF)
+    {
+        if (f)
+        {
+            fclose(f);
+        }
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* Size of a file, or -1 if it is missing */
+static inline long long test_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+/* Run fn in a child process, on a fresh copy of the process-wide bank;
+   0 when none of its checks failed */
+static inline int test_fork(void (*fn)(void))
+{
+    int status = 0;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        test_failures = 0;
+        fn();
+        _exit(test_failures == 0 ? 0 : 1);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+    {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* Run every case in its own process and directory, and report */
+static int test_main(const char *suite, const test_case_t *cases, int count)
+{
+    char dir[] = "/tmp/bank_test_XXXXXX";
+    int failed = 0;
+
+    if (!mkdtemp(dir) || chdir(dir) != 0)
+    {
+        perror("scratch directory");
+        return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        int status = 0;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            char sub[16];
+            snprintf(sub, sizeof(sub), "%d", i);
+            if (mkdir(sub, 0700) != 0 || chdir(sub) != 0)
+            {
+                _exit(2);
+            }
+            log_init();
+            cases[i].run();
+            _exit(test_failures == 0 ? 0 : 1);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failed++;
+        }
+        printf("%-10s %-48s %s\n", suite, cases[i].name,
+               WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok" : "FAILED");
+    }
+    printf("%s: %d of %d cases failed\n", suite, failed, count);
+
+    if (failed == 0)
+    {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        if (chdir("/") != 0 || system(cmd) != 0)
+        {
+            fprintf(stderr, "Left %s behind\n", dir);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Scratch files kept in %s\n", dir);
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif /* BANK_TEST_H */
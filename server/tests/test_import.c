@@ -0,0 +1,128 @@
+/*
+ * Banking System - Tests for the CSV account import
+ */
+
+#include "test.h"
+#include "../bank_import.h"
+#include "../bank_persistence.h"
+
+static const char csv[] =
+    "name,nat_id,type,balance\n"
+    "Ann Lee,ID-1,savings,1000\n"
+    "\"Smith, Bob\",ID-2,2,1500\n"
+    "Too,Few,1\n"
+    "Bad Type,ID-3,gold,1000\n"
+    "\"Unclosed,ID-4,1,1000\n"
+    "Poor,ID-5,1,999\n"
+    "Extra,ID-6,1,1000,9\n"
+    ",ID-7,1,1000\n"
+    "Carl,ID-8,checking,abc\n";
+
+static void load_and_import(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(import_csv("new.csv") == 0);
+}
+
+static void load_and_refuse(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(import_csv("new.csv") == -1);
+}
+
+static int expected_accounts = 0;
+
+static void check_accounts(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(bank_totals->accounts_in_use == expected_accounts);
+}
+
+/* Whether a fresh load finds n accounts */
+static int bank_holds(int n)
+{
+    expected_accounts = n;
+    return test_fork(check_accounts) == 0;
+}
+
+/* Lines in a file */
+static int lines_in(const char *path)
+{
+    size_t len = 0;
+    int lines = 0;
+    char *buf = test_read_file(path, &len);
+
+    if (!buf)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        lines += buf[i] == '\n';
+    }
+    free(buf);
+    return lines;
+}
+
+/* Good rows are opened and every malformed one is listed with its reason */
+static void malformed_rows_rejected(void)
+{
+    struct stat st;
+    size_t len = 0;
+
+    CHECK(test_write_file("new.csv", csv, sizeof(csv) - 1) == 0);
+    CHECK(test_fork(load_and_import) == 0);
+
+    CHECK(bank_holds(2));
+    CHECK(lines_in("new.csv.accounts") == 3);
+    CHECK(stat("new.csv.accounts", &st) == 0 && (st.st_mode & 0777) == 0600);
+
+    CHECK(lines_in("new.csv.rejected") == 8);
+    char *bad = test_read_file("new.csv.rejected", &len);
+    CHECK(bad && strstr(bad, "4,\"expected 4 fields, found 3\"\n"));
+    CHECK(bad && strstr(bad, "5,unknown account type 'gold'\n"));
+    CHECK(bad && strstr(bad, "6,unterminated quote\n"));
+    CHECK(bad && strstr(bad, "7,opening balance must be"));
+    CHECK(bad && strstr(bad, "8,more than 4 fields\n"));
+    CHECK(bad && strstr(bad, "9,name must be"));
+    CHECK(bad && strstr(bad, "10,opening balance must be"));
+    free(bad);
+}
+
+/* An accounts file left by an earlier import is neither overwritten nor
+   joined, and nothing is imported */
+static void accounts_file_not_reused(void)
+{
+    size_t len = 0;
+
+    CHECK(test_write_file("new.csv", csv, sizeof(csv) - 1) == 0);
+    CHECK(test_write_file("new.csv.accounts", "earlier\n", 8) == 0);
+    CHECK(test_fork(load_and_refuse) == 0);
+
+    char *kept = test_read_file("new.csv.accounts", &len);
+    CHECK(kept && strcmp(kept, "earlier\n") == 0);
+    free(kept);
+    CHECK(bank_holds(0));
+}
+
+static void lock_refused(void)
+{
+    CHECK(lock_data_dir() == -1);
+}
+
+/* Only one process at a time owns a data directory */
+static void data_dir_locked(void)
+{
+    CHECK(lock_data_dir() == 0);
+    CHECK(test_fork(lock_refused) == 0);
+}
+
+int main(void)
+{
+    static const test_case_t cases[] = {
+        {"malformed rows are rejected", malformed_rows_rejected},
+        {"accounts file is never reused", accounts_file_not_reused},
+        {"data directory lock is exclusive", data_dir_locked},
+    };
+    return test_main("import", cases, sizeof(cases) / sizeof(cases[0]));
+}
@@ -0,0 +1,167 @@
+/*
+ * Banking System - Tests for the account and customer hash indexes
+ */
+
+#include "test.h"
+#include "../bank_index.h"
+#include "../bank_account.h"
+#include "../bank_persistence.h"
+#include "../bank_store.h"
+
+#define NUMBERS 20000 /* enough to grow the table several times */
+
+/* Random inserts and removals agree with a plain array at every step,
+   across resizes and backward-shift deletions */
+static void index_matches_reference(void)
+{
+    static int expect[NUMBERS]; /* slot of 100001 + i, or -1 */
+    unsigned x = 2024;
+
+    for (int i = 0; i < NUMBERS; i++)
+    {
+        expect[i] = -1;
+    }
+    for (int step = 0; step < 4 * NUMBERS; step++)
+    {
+        x = x * 1103515245u + 12345u;
+        int i = (int)((x >> 8) % NUMBERS);
+        if ((x >> 28) < 11)
+        {
+            CHECK(index_insert(100001 + i, step) == 0);
+            expect[i] = step;
+        }
+        else
+        {
+            index_remove(100001 + i);
+            expect[i] = -1;
+        }
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < NUMBERS; i++)
+    {
+        mismatches += index_lookup(100001 + i) != expect[i];
+    }
+    CHECK(mismatches == 0);
+    CHECK(index_lookup(100001 + NUMBERS) == -1);
+    CHECK(index_lookup(0) == -1);
+}
+
+/* A customer's account list follows adds, moves and removals */
+static void customer_list_kept(void)
+{
+    const int *slots;
+
+    for (int slot = 0; slot < 6; slot++)
+    {
+        CHECK(customer_add(slot % 2 ? "ID-ODD" : "ID-EVEN", slot) == 0);
+    }
+    CHECK(customer_add("", 99) == 0);
+    CHECK(customer_slots("", &slots) == 0);
+
+    CHECK(customer_slots("ID-EVEN", &slots) == 3);
+    customer_move("ID-EVEN", 2, 40);
+    customer_remove("ID-EVEN", 0);
+    CHECK(customer_slots("ID-EVEN", &slots) == 2);
+    CHECK(slots && ((slots[0] == 40 && slots[1] == 4) || (slots[0] == 4 && slots[1] == 40)));
+
+    customer_remove("ID-ODD", 1);
+    customer_remove("ID-ODD", 3);
+    customer_remove("ID-ODD", 5);
+    CHECK(customer_slots("ID-ODD", &slots) == 0);
+    CHECK(customer_slots("ID-EVEN", &slots) == 2);
+}
+
+/* One customer may hold more accounts than a listing shows; the total
+   still covers all of them */
+static void many_accounts_listed(void)
+{
+    static response_t resp;
+    account_t first = {0};
+
+    CHECK(load_data() == 0);
+    for (int i = 0; i < HOLDINGS_LISTED + 2; i++)
+    {
+        account_t *a = open_account("Test Holder", "ID-TEST", SAVINGS);
+        CHECK(a != NULL);
+        if (a && i == 0)
+        {
+            first = *a;
+        }
+    }
+
+    CHECK(list_accounts(first.number, first.pin, &resp) == STATUS_OK);
+    CHECK(resp.holding_count == HOLDINGS_LISTED);
+    CHECK(resp.total_holdings == (long long)(HOLDINGS_LISTED + 2) * MIN_BALANCE);
+    CHECK(list_accounts(first.number, first.pin + 1, &resp) == STATUS_ERROR);
+}
+
+/* Accounts a customer holds by the index */
+static int held(const char *nat_id)
+{
+    const int *slots;
+    return customer_slots(nat_id, &slots);
+}
+
+/* Three customers with an account each, the middle one closed, and a
+   snapshot; the customer table is left to build on first use after it */
+static void snapshot_with_hole(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(open_account("One", "CUST-1", SAVINGS) != NULL);
+    account_t *a = open_account("Two", "CUST-2", SAVINGS);
+    CHECK(a != NULL);
+    account_t two = a ? *a : (account_t){0};
+    CHECK(open_account("Three", "CUST-3", SAVINGS) != NULL);
+    CHECK(close_account(two.number, two.pin) == STATUS_OK);
+    CHECK(save_data() == 0);
+}
+
+/* The reused slot is counted once, and only for its new owner */
+static void open_after_load(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(open_account("One Again", "CUST-1", CHECKING) != NULL);
+    CHECK(held("CUST-1") == 2);
+    CHECK(held("CUST-2") == 0);
+}
+
+/* The journaled open is replayed onto the snapshot the same way */
+static void replay_after_load(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(held("CUST-1") == 2);
+    CHECK(held("CUST-3") == 1);
+}
+
+/* Compaction moves the last account into the hole and the index follows */
+static void compact_after_load(void)
+{
+    const int *slots;
+
+    CHECK(load_data() == 0);
+    CHECK(store_compact(16) == 1);
+    CHECK(customer_slots("CUST-3", &slots) == 1 && slots && slots[0] == 1);
+    CHECK(held("CUST-1") == 1);
+}
+
+/* Indexing an account must not count it twice when that is what builds
+   the customer table after a snapshot load */
+static void customer_table_built_late(void)
+{
+    CHECK(test_fork(snapshot_with_hole) == 0);
+    CHECK(test_fork(compact_after_load) == 0);
+    CHECK(test_fork(open_after_load) == 0);
+    CHECK(test_fork(replay_after_load) == 0);
+}
+
+int main(void)
+{
+    static const test_case_t cases[] = {
+        {"account index matches a reference", index_matches_reference},
+        {"customer list follows changes", customer_list_kept},
+        {"customer may hold many accounts", many_accounts_listed},
+        {"customer table built after a load", customer_table_built_late},
+    };
+    return test_main("index", cases, sizeof(cases) / sizeof(cases[0]));
+}
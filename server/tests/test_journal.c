@@ -0,0 +1,353 @@
+/*
+ * Banking System - Tests for the write-ahead journal
+ *
+ * Linked with -Wl,--wrap=fdatasync,--wrap=fsync, so a case can make the
+ * journal's syncs and a checkpoint's fail the way a disk error would.
+ */
+
+#include "test.h"
+#include "../bank_journal.h"
+#include "../bank_persistence.h"
+#include "../bank_account.h"
+#include "../bank_index.h"
+#include "../bank_store.h"
+#include "../bank_accrual.h"
+#include <errno.h>
+
+static int fail_syncs = 0;  /* fdatasync fails with EIO while set */
+static int fail_fsyncs = 0; /* fsync fails with EIO while set     */
+
+int __real_fdatasync(int fd);
+int __real_fsync(int fd);
+
+int __wrap_fdatasync(int fd)
+{
+    if (fail_syncs)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return __real_fdatasync(fd);
+}
+
+int __wrap_fsync(int fd)
+{
+    if (fail_fsyncs)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return __real_fsync(fd);
+}
+
+/* Journal a post to an account that need not exist */
+static long long log_post(int number, int amount)
+{
+    transaction_t t = {'D', amount, 0, amount};
+    journal_log_post(number, &t);
+    CHECK(journal_commit() == 0);
+    return journal_lsn();
+}
+
+/* A failed sync must not count as durable, and later syncs must not
+   vouch for it either */
+static void check_failed_sync_sticks(void)
+{
+    stats_t st;
+
+    fail_syncs = 1;
+    long long lsn = log_post(100001, 500);
+    CHECK(journal_wait(lsn) == -1);
+
+    fail_syncs = 0;
+    CHECK(journal_wait(lsn) == -1);
+    journal_log_close(100001);
+    CHECK(journal_commit() == -1); /* held for a checkpoint */
+    journal_stats(&st);
+    CHECK(st.records_synced == 0);
+
+    /* a checkpoint covers everything and the journal is usable again */
+    CHECK(journal_reset() == 0);
+    CHECK(journal_wait(lsn) == 0);
+    lsn = log_post(100002, 500);
+    CHECK(journal_wait(lsn) == 0);
+    journal_stats(&st);
+    CHECK(st.records_synced == 1);
+}
+
+static void sync_failure_inline(void)
+{
+    CHECK(journal_recover(0) == 0);
+    check_failed_sync_sticks();
+}
+
+static void sync_failure_writer(void)
+{
+    setenv("BANK_COMMIT_WINDOW_US", "100", 1);
+    CHECK(journal_recover(0) == 0);
+    CHECK(journal_start_writer() == 0);
+    check_failed_sync_sticks();
+}
+
+/* When the journal has failed and the checkpoint standing in for it fails
+   too, commit_data() must say so, as request handlers reply on it */
+static void failed_checkpoint_reported(void)
+{
+    CHECK(load_data() == 0);
+
+    fail_syncs = 1;
+    long long lsn = log_post(100001, 500);
+    CHECK(journal_wait(lsn) == -1);
+
+    fail_fsyncs = 1;
+    CHECK(commit_data() == -1);
+    CHECK(journal_wait(lsn) == -1);
+
+    fail_syncs = fail_fsyncs = 0;
+    CHECK(commit_data() == 0);
+    CHECK(journal_wait(lsn) == 0);
+    CHECK(journal_size() == 0);
+}
+
+#define REC ((long long)sizeof(journal_rec_t))
+
+/* Open three accounts, two records each, and stop without a checkpoint */
+static void journal_three_accounts(void)
+{
+    CHECK(load_data() == 0);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+    }
+}
+
+static int accounts_after_load = -1;
+static int load_result = 0;
+
+static void load_and_count(void)
+{
+    load_result = load_data();
+    accounts_after_load = bank_totals->accounts_in_use;
+}
+
+static void expect_three(void)
+{
+    load_and_count();
+    CHECK(load_result == 0);
+    CHECK(accounts_after_load == 3);
+}
+
+/* A record cut short by a crash is dropped with the tail, and nothing is
+   set aside as damage */
+static void torn_tail_dropped(void)
+{
+    char half[REC / 2];
+
+    CHECK(test_fork(journal_three_accounts) == 0);
+    CHECK(test_file_size(JOURNAL_FILE) == REC + 6 * REC);
+
+    size_t len;
+    char *hdr = test_read_file(JOURNAL_FILE, &len);
+    CHECK(hdr && memcmp(hdr, JOURNAL_MAGIC, 8) == 0);
+    free(hdr);
+
+    memset(half, 0x5a, sizeof(half));
+    FILE *f = fopen(JOURNAL_FILE, "ab");
+    CHECK(f && fwrite(half, 1, sizeof(half), f) == sizeof(half) && fclose(f) == 0);
+
+    CHECK(test_fork(expect_three) == 0);
+    CHECK(test_file_size(JOURNAL_FILE) == REC + 6 * REC);
+    CHECK(test_file_size(JOURNAL_FILE ".bad") == -1);
+}
+
+static void expect_damage(void)
+{
+    load_and_count();
+    CHECK(load_result == -1);
+    CHECK(accounts_after_load == 1);
+}
+
+/* A record that fails its CRC with good records after it is damage, not a
+   torn write: replay stops there and the rest is kept in .bad */
+static void bad_crc_kept(void)
+{
+    CHECK(test_fork(journal_three_accounts) == 0);
+    CHECK(test_flip_bit(JOURNAL_FILE, REC + 2 * REC + 30) == 0);
+
+    CHECK(test_fork(expect_damage) == 0);
+    CHECK(test_file_size(JOURNAL_FILE ".bad") == 4 * REC);
+    CHECK(test_file_size(JOURNAL_FILE) == REC + 2 * REC);
+}
+
+/* Rewrite the journal as a build without the header and CRCs wrote it,
+   with a torn record at the end */
+static void make_legacy_journal(void)
+{
+    size_t len;
+    char *buf = test_read_file(JOURNAL_FILE, &len);
+    CHECK(buf && len == (size_t)(7 * REC));
+    if (!buf)
+    {
+        return;
+    }
+    for (int i = 1; i < 7; i++)
+    {
+        journal_rec_t *r = (journal_rec_t *)(buf + i * REC);
+        r->crc = 0;
+    }
+    memset(buf + 7 * REC - REC / 2, 0x5a, REC / 2); /* stand-in for the torn tail */
+    CHECK(test_write_file(JOURNAL_FILE, buf + REC, (size_t)(6 * REC + REC / 2)) == 0);
+    free(buf);
+}
+
+/* Recovery alone must not cut an old-format file short */
+static void recover_only(void)
+{
+    store_loaded(0);
+    CHECK(index_rebuild() == 0);
+    CHECK(journal_recover(0) == 0);
+    CHECK(journal_legacy() == 1);
+    CHECK(bank_totals->accounts_in_use == 3);
+}
+
+/* A journal from before the header is replayed by the old rules and left
+   whole until a checkpoint holds what it says */
+static void legacy_journal_replayed(void)
+{
+    size_t before_len = 0, after_len = 0;
+
+    CHECK(test_fork(journal_three_accounts) == 0);
+    make_legacy_journal();
+    char *before = test_read_file(JOURNAL_FILE, &before_len);
+
+    CHECK(test_fork(recover_only) == 0);
+    char *after = test_read_file(JOURNAL_FILE, &after_len);
+    CHECK(before && after && before_len == after_len && memcmp(before, after, before_len) == 0);
+    free(before);
+    free(after);
+
+    /* a full start checkpoints and moves to the current format */
+    CHECK(test_fork(expect_three) == 0);
+    CHECK(test_file_size(JOURNAL_FILE) == REC);
+    CHECK(test_fork(expect_three) == 0);
+}
+
+/* A savings account with 1,000,000 and a checking account with 2,000, run
+   through accrual; the journal alone holds the postings afterwards */
+static void accrue_without_checkpoint(void)
+{
+    CHECK(load_data() == 0);
+    account_t *a = open_account("Saver", "ID-S", SAVINGS);
+    CHECK(a && deposit(a->number, a->pin, 999000) == STATUS_OK);
+    a = open_account("Spender", "ID-C", CHECKING);
+    CHECK(a && deposit(a->number, a->pin, 1000) == STATUS_OK);
+
+    CHECK(accrual_start() == 0);
+    CHECK(run_accrual() == 2);
+    CHECK(*acct_balance(0) == 1000109 && *acct_balance(1) == 1995);
+    CHECK(test_file_size(SNAP_FILE) == -1); /* no checkpoint under the lock */
+}
+
+static void expect_accrued(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(bank_totals->accounts_in_use == 2);
+    CHECK(acct_cold(0)->type == SAVINGS && *acct_balance(0) == 1000109);
+    CHECK(acct_cold(1)->type == CHECKING && *acct_balance(1) == 1995);
+}
+
+/* Accrual postings are journaled, so a run no checkpoint covered is
+   replayed rather than lost */
+static void accrual_replayed(void)
+{
+    CHECK(test_fork(accrue_without_checkpoint) == 0);
+    CHECK(test_file_size(JOURNAL_FILE) > REC);
+    CHECK(test_fork(expect_accrued) == 0);
+}
+
+/* Open one account and journal a withdrawal the live bank would refuse */
+static void journal_overdraft(void)
+{
+    CHECK(load_data() == 0);
+    account_t *a = open_account("Test Holder", "ID-TEST", CHECKING);
+    CHECK(a != NULL);
+    transaction_t t = {'W', 500, 0, 500};
+    journal_log_post(a->number, &t);
+    CHECK(journal_commit() == 0);
+}
+
+static void expect_refused(void)
+{
+    replay_stats_t st;
+
+    CHECK(load_data() == -1);
+    journal_replay_stats(&st);
+    CHECK(st.failed == 1);
+    CHECK(*acct_balance(0) == MIN_BALANCE);
+}
+
+/* Replay never takes an account under the minimum balance */
+static void replay_keeps_minimum(void)
+{
+    CHECK(test_fork(journal_overdraft) == 0);
+    CHECK(test_fork(expect_refused) == 0);
+}
+
+/* A checkpoint whose archive fails leaves the journal whole, so the
+   records are archived by a later one rather than lost */
+static void failed_archive_keeps_journal(void)
+{
+    setenv("BANK_JOURNAL_ARCHIVE", "1", 1);
+    journal_three_accounts();
+    CHECK(journal_size() == 6 * REC);
+
+    CHECK(mkdir(JOURNAL_FILE ".archive", 0700) == 0); /* cannot be opened for writing */
+    CHECK(journal_reset() == -1);
+    CHECK(journal_size() == 6 * REC);
+    CHECK(test_file_size(JOURNAL_FILE) == REC + 6 * REC);
+
+    CHECK(rmdir(JOURNAL_FILE ".archive") == 0);
+    CHECK(journal_reset() == 0);
+    CHECK(journal_size() == 0);
+    CHECK(test_file_size(JOURNAL_FILE ".archive") > 0);
+}
+
+/* A checkpoint that cannot empty the journal reports it and is not
+   counted */
+static void failed_archive_fails_checkpoint(void)
+{
+    stats_t before, after;
+
+    setenv("BANK_JOURNAL_ARCHIVE", "1", 1);
+    journal_three_accounts();
+    persistence_stats(&before);
+
+    CHECK(mkdir(JOURNAL_FILE ".archive", 0700) == 0);
+    CHECK(save_data() == -1);
+    persistence_stats(&after);
+    CHECK(after.checkpoints == before.checkpoints);
+    CHECK(journal_size() == 6 * REC);
+
+    CHECK(rmdir(JOURNAL_FILE ".archive") == 0);
+    CHECK(save_data() == 0);
+    persistence_stats(&after);
+    CHECK(after.checkpoints == before.checkpoints + 1);
+    CHECK(journal_size() == 0);
+}
+
+int main(void)
+{
+    static const test_case_t cases[] = {
+        {"failed sync is not durable (inline)", sync_failure_inline},
+        {"failed sync is not durable (writer)", sync_failure_writer},
+        {"failed checkpoint is reported", failed_checkpoint_reported},
+        {"torn tail is dropped", torn_tail_dropped},
+        {"bad CRC is kept as damage", bad_crc_kept},
+        {"old-format journal is replayed, not cut", legacy_journal_replayed},
+        {"accrual postings are replayed", accrual_replayed},
+        {"replay keeps the minimum balance", replay_keeps_minimum},
+        {"failed archive keeps the journal", failed_archive_keeps_journal},
+        {"failed archive fails the checkpoint", failed_archive_fails_checkpoint},
+    };
+    return test_main("journal", cases, sizeof(cases) / sizeof(cases[0]));
+}
@@ -0,0 +1,112 @@
+/*
+ * Banking System - Tests for the LZ block codec and CRC32C
+ */
+
+#include "test.h"
+#include "../bank_lz.h"
+#include "../bank_crc.h"
+
+/* Text that compresses, followed by bytes that do not */
+static char *sample(size_t n)
+{
+    char *buf = malloc(n);
+    unsigned x = 12345;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i < n / 2)
+        {
+            buf[i] = "{\"number\":100001,\"balance\":2500}"[i % 32];
+        }
+        else
+        {
+            x = x * 1103515245u + 12345u;
+            buf[i] = (char)(x >> 16);
+        }
+    }
+    return buf;
+}
+
+static void crc_known_value(void)
+{
+    /* the CRC32C check value from RFC 3720 */
+    CHECK(crc32c(0, "123456789", 9) == 0xE3069283u);
+    /* chained calls give the same answer as one */
+    CHECK(crc32c(crc32c(0, "12345", 5), "6789", 4) == 0xE3069283u);
+}
+
+static void block_round_trip(void)
+{
+    size_t sizes[] = {0, 1, 31, 4096, 100000};
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        size_t n = sizes[k];
+        char *raw = sample(n ? n : 1);
+        char *packed = malloc(LZ_BLOCK_BOUND(n));
+        char *back = malloc(n + 1);
+
+        size_t len = lz_pack_block(packed, raw, n, 7, 9);
+        CHECK(lz_check_block(packed, len) == (long)len);
+        CHECK(lz_unpack_block(packed, back, n) == (long)n);
+        CHECK(memcmp(raw, back, n) == 0);
+
+        lz_block_t h;
+        memcpy(&h, packed, sizeof(h));
+        CHECK(h.first == 7 && h.last == 9);
+
+        free(raw);
+        free(packed);
+        free(back);
+    }
+}
+
+static void damaged_block_rejected(void)
+{
+    size_t n = 8192;
+    char *raw = sample(n);
+    char *packed = malloc(LZ_BLOCK_BOUND(n));
+    char *back = malloc(n);
+
+    size_t len = lz_pack_block(packed, raw, n, 0, 0);
+    packed[len - 1] ^= 0x40;
+    CHECK(lz_check_block(packed, len) == (long)len); /* the header alone still looks whole */
+    CHECK(lz_unpack_block(packed, back, n) == -1);
+    CHECK(lz_check_block(packed, len - 1) == -1);    /* a truncated block is not */
+
+    free(raw);
+    free(packed);
+    free(back);
+}
+
+static void stream_round_trip(void)
+{
+    size_t n = 300000, block = 65536, out = 0;
+    char *raw = sample(n);
+    char *stream = malloc(LZ_BLOCK_BOUND(block) * (n / block + 1));
+
+    for (size_t at = 0; at < n; at += block)
+    {
+        size_t len = n - at < block ? n - at : block;
+        out += lz_pack_block(stream + out, raw + at, len, (long long)at, (long long)(at + len));
+    }
+
+    size_t got = 0;
+    char *back = lz_unpack_stream(stream, out, &got);
+    CHECK(back != NULL);
+    CHECK(got == n);
+    CHECK(back && memcmp(raw, back, n) == 0);
+
+    free(raw);
+    free(stream);
+    free(back);
+}
+
+int main(void)
+{
+    static const test_case_t cases[] = {
+        {"crc32c known value", crc_known_value},
+        {"block round trip", block_round_trip},
+        {"damaged block rejected", damaged_block_rejected},
+        {"stream round trip", stream_round_trip},
+    };
+    return test_main("lz", cases, sizeof(cases) / sizeof(cases[0]));
+}
@@ -0,0 +1,239 @@
+/*
+ * Banking System - Tests for loading and checkpointing the bank
+ */
+
+#include "test.h"
+#include "../bank_persistence.h"
+#include "../bank_account.h"
+#include "../bank_records.h"
+#include "../bank_journal.h"
+#include "../bank_shm.h"
+#include "../bank_crc.h"
+#include <dirent.h>
+
+/* Open three accounts and checkpoint them */
+static void make_bank(void)
+{
+    CHECK(load_data() == 0);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+    }
+    CHECK(save_data() == 0);
+}
+
+/* Open one more account, journaled but not checkpointed */
+static void load_and_open_one(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+}
+
+static void load_fails(void)
+{
+    CHECK(load_data() == -1);
+}
+
+/* A damaged record file stops the load and is left exactly as it was */
+static void damaged_record_file_kept(void)
+{
+    size_t len_before = 0, len_after = 0;
+
+    setenv("BANK_STORAGE", "records", 1);
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(test_flip_bit(RECORD_FILE, REC_PAGE + RECORD_BYTES + 4) == 0);
+    char *before = test_read_file(RECORD_FILE, &len_before);
+
+    CHECK(test_fork(load_fails) == 0);
+
+    char *after = test_read_file(RECORD_FILE, &len_after);
+    CHECK(before && after && len_before == len_after && memcmp(before, after, len_before) == 0);
+    CHECK(test_file_size(RECORD_FILE ".bad") == -1);
+    free(before);
+    free(after);
+}
+
+/* A damaged snapshot stops the load instead of falling back to the export */
+static void damaged_snapshot_kept(void)
+{
+    size_t len_before = 0, len_after = 0;
+
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(test_flip_bit(SNAP_FILE, test_file_size(SNAP_FILE) / 2) == 0);
+    char *before = test_read_file(SNAP_FILE, &len_before);
+
+    CHECK(test_fork(load_fails) == 0);
+
+    char *after = test_read_file(SNAP_FILE, &len_after);
+    CHECK(before && after && len_before == len_after && memcmp(before, after, len_before) == 0);
+    CHECK(test_file_size(SNAP_FILE ".bad") == -1);
+    free(before);
+    free(after);
+}
+
+/* Export the checkpointed bank, then carry on: one more account after a
+   second checkpoint, and one journaled on top */
+static void export_then_move_on(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(export_data(DATA_FILE) == 0);
+    CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+    CHECK(save_data() == 0);
+    CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+}
+
+/* Export the bank and journal one more account on top */
+static void export_then_journal(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(export_data(DATA_FILE) == 0);
+    CHECK(open_account("Test Holder", "ID-TEST", SAVINGS) != NULL);
+}
+
+static void expect_four(void)
+{
+    CHECK(load_data() == 0);
+    CHECK(bank_totals->accounts_in_use == 4);
+}
+
+/* A journal that starts after the export's LSN is not replayed onto it,
+   and is left for a better base */
+static void stale_export_refused(void)
+{
+    size_t len_before = 0, len_after = 0;
+
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(test_fork(export_then_move_on) == 0);
+    CHECK(unlink(SNAP_FILE) == 0);
+    char *before = test_read_file(JOURNAL_FILE, &len_before);
+
+    CHECK(test_fork(load_fails) == 0);
+
+    char *after = test_read_file(JOURNAL_FILE, &len_after);
+    CHECK(before && after && len_before == len_after && memcmp(before, after, len_before) == 0);
+    free(before);
+    free(after);
+}
+
+/* The export plus a journal that carries on from it is the whole bank */
+static void export_joined_by_journal(void)
+{
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(test_fork(export_then_journal) == 0);
+    CHECK(unlink(SNAP_FILE) == 0);
+    CHECK(test_fork(expect_four) == 0);
+}
+
+static void take_bank_lock(void)
+{
+    bank_lock();
+}
+
+/* A process that dies holding the shared bank lock leaves it lost for
+   good: whoever locks next stops instead of serving or checkpointing */
+static void lost_bank_lock_stops(void)
+{
+    CHECK(shm_init() == 0);
+    CHECK(bank_lock_share() == 0);
+    CHECK(bank_lock_lost() == 0);
+
+    CHECK(test_fork(take_bank_lock) == 0); /* ends holding it */
+    CHECK(bank_lock_lost() == 1);
+    CHECK(bank_lock_lost() == 1);
+    CHECK(test_fork(take_bank_lock) == -1);
+}
+
+/* Sum of every file in the directory, names and contents, but the log */
+static unsigned dir_sum(void)
+{
+    DIR *dir = opendir(".");
+    struct dirent *d;
+    unsigned sum = 0;
+
+    while (dir && (d = readdir(dir)) != NULL)
+    {
+        size_t len = 0;
+        char *buf;
+        if (d->d_name[0] == '.' || strcmp(d->d_name, LOG_FILE) == 0 || !(buf = test_read_file(d->d_name, &len)))
+        {
+            continue;
+        }
+        sum += crc32c(crc32c(0, d->d_name, strlen(d->d_name)), buf, len);
+        free(buf);
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    return sum;
+}
+
+static int verify_result = 0;
+
+/* Load read only and check what was loaded, as --verify does */
+static void verify_in_place(void)
+{
+    load_read_only();
+    verify_result = load_data();
+    CHECK(verify_data() == 0);
+    CHECK(bank_totals->accounts_in_use == 3);
+}
+
+static void verify_fails(void)
+{
+    verify_in_place();
+    CHECK(verify_result == -1);
+}
+
+static void verify_passes(void)
+{
+    verify_in_place();
+    CHECK(verify_result == 0);
+}
+
+/* A damaged journal is reported, not trimmed or set aside */
+static void verify_leaves_damage(void)
+{
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(test_fork(load_and_open_one) == 0);
+    CHECK(test_fork(load_and_open_one) == 0);
+    long long size = test_file_size(JOURNAL_FILE);
+    CHECK(test_flip_bit(JOURNAL_FILE, size - 3 * (long long)sizeof(journal_rec_t) - 20) == 0);
+    FILE *f = fopen(JOURNAL_FILE, "ab");
+    CHECK(f && fwrite("torn", 1, 4, f) == 4 && fclose(f) == 0);
+    unsigned before = dir_sum();
+
+    CHECK(test_fork(verify_fails) == 0);
+
+    CHECK(dir_sum() == before);
+    CHECK(test_file_size(JOURNAL_FILE ".bad") == -1);
+}
+
+/* A record file is read without being grown to whole history segments,
+   and a missing journal is not created */
+static void verify_records_in_place(void)
+{
+    setenv("BANK_STORAGE", "records", 1);
+    CHECK(test_fork(make_bank) == 0);
+    CHECK(unlink(JOURNAL_FILE) == 0);
+    unsigned before = dir_sum();
+
+    CHECK(test_fork(verify_passes) == 0);
+
+    CHECK(dir_sum() == before);
+    CHECK(test_file_size(JOURNAL_FILE) == -1);
+}
+
+int main(void)
+{
+    static const test_case_t cases[] = {
+        {"damaged record file stops the load", damaged_record_file_kept},
+        {"damaged snapshot stops the load", damaged_snapshot_kept},
+        {"stale export is not replayed onto", stale_export_refused},
+        {"export joined by the journal loads", export_joined_by_journal},
+        {"lost bank lock stops the next locker", lost_bank_lock_stops},
+        {"read-only load leaves damage in place", verify_leaves_damage},
+        {"read-only load of a record file", verify_records_in_place},
+    };
+    return test_main("persist", cases, sizeof(cases) / sizeof(cases[0]));
+}